@@ -197,6 +197,47 @@ pm_backto_wakeup(struct vmctx *ctx)
 	pm1_status |= PM1_WAK_STS;
 }
 
+/* PM1 registers kept in a VM snapshot */
+struct pm_state {
+	uint16_t pm1_enable;
+	uint16_t pm1_status;
+	uint16_t pm1_control;
+};
+
+ssize_t
+pm_save_state(void *buf, size_t len)
+{
+	struct pm_state *state = buf;
+
+	if (len < sizeof(*state))
+		return -1;
+
+	pthread_mutex_lock(&pm_lock);
+	state->pm1_enable = pm1_enable;
+	state->pm1_status = pm1_status;
+	state->pm1_control = pm1_control;
+	pthread_mutex_unlock(&pm_lock);
+
+	return sizeof(*state);
+}
+
+int
+pm_load_state(const void *buf, size_t len)
+{
+	const struct pm_state *state = buf;
+
+	if (len != sizeof(*state))
+		return -1;
+
+	pthread_mutex_lock(&pm_lock);
+	pm1_enable = state->pm1_enable;
+	pm1_status = state->pm1_status;
+	pm1_control = state->pm1_control;
+	pthread_mutex_unlock(&pm_lock);
+
+	return 0;
+}
+
 static int
 pm1_enable_handler(struct vmctx *ctx, int vcpu, int in, int port, int bytes,
 		   uint32_t *eax, void *arg)
@@ -52,6 +52,7 @@ static struct command *parse_command(char *cmd_msg, int fd)
 		cmd = find_command(execute->valuestring);
 		if (cmd != NULL) {
 			cmd->para.fd = fd;
+			cmd->para.option[0] = '\0';
 			arguments = cJSON_GetObjectItemCaseSensitive(cmd_json, "arguments");
 			if (cJSON_IsString(arguments) && (arguments->valuestring != NULL)) {
 				pr_info("Command arguments: \"%s\"\n", arguments->valuestring);
@@ -99,6 +100,13 @@ static void register_socket_message_handlers(struct vmctx *ctx)
 	arg.ctx_arg = ctx;
 	register_command_handler(user_vm_destroy_handler, &arg, DESTROY);
 	register_command_handler(user_vm_blkrescan_handler, &arg, BLKRESCAN);
+	register_command_handler(user_vm_balloon_handler, &arg, BALLOON);
+	register_command_handler(user_vm_hotplug_mem_handler, &arg, HOTPLUG_MEM);
+	register_command_handler(user_vm_mem_stats_handler, &arg, MEM_STATS);
+	register_command_handler(user_vm_exit_stats_handler, &arg, EXIT_STATS);
+	register_command_handler(user_vm_display_stats_handler, &arg, DISPLAY_STATS);
+	register_command_handler(user_vm_gpu_stats_handler, &arg, GPU_STATS);
+	register_command_handler(user_vm_console_stats_handler, &arg, CONSOLE_STATS);
 }
 
 int init_cmd_monitor(struct vmctx *ctx)
@@ -26,6 +26,13 @@
 #define CMD_OBJS \
 	GEN_CMD_OBJ(DESTROY), \
 	GEN_CMD_OBJ(BLKRESCAN), \
+	GEN_CMD_OBJ(BALLOON), \
+	GEN_CMD_OBJ(HOTPLUG_MEM), \
+	GEN_CMD_OBJ(MEM_STATS), \
+	GEN_CMD_OBJ(EXIT_STATS), \
+	GEN_CMD_OBJ(DISPLAY_STATS), \
+	GEN_CMD_OBJ(GPU_STATS), \
+	GEN_CMD_OBJ(CONSOLE_STATS), \
 
 struct command dm_command_list[CMDS_NUM] = {CMD_OBJS};
 
@@ -10,8 +10,15 @@
 
 #define DESTROY "destroy"
 #define BLKRESCAN "blkrescan"
+#define BALLOON "balloon"
+#define HOTPLUG_MEM "hotplug_mem"
+#define MEM_STATS "mem_stats"
+#define EXIT_STATS "exit_stats"
+#define DISPLAY_STATS "display_stats"
+#define GPU_STATS "gpu_stats"
+#define CONSOLE_STATS "console_stats"
 
-#define CMDS_NUM 2U
+#define CMDS_NUM 9U
 #define CMD_NAME_MAX 32U
 #define CMD_ARG_MAX 320U
 
@@ -20,39 +20,51 @@
 #include "vmmapi.h"
 #include "log.h"
 #include "monitor.h"
+#include "exit_stats.h"
+#include "vdisplay.h"
 
 #define SUCCEEDED 0
 #define FAILED -1
 
-static char *generate_ack_message(int ret_val)
+/* the ack message takes over data, if any, to return the command results */
+static char *generate_ack_message(int ret_val, cJSON *data)
 {
 	char *ack_msg;
 	cJSON *val;
 	cJSON *ret_obj = cJSON_CreateObject();
 
-	if (ret_obj == NULL)
+	if (ret_obj == NULL) {
+		cJSON_Delete(data);
 		return NULL;
+	}
 	val = cJSON_CreateNumber(ret_val);
-	if (val == NULL)
+	if (val == NULL) {
+		cJSON_Delete(data);
+		cJSON_Delete(ret_obj);
 		return NULL;
+	}
 	cJSON_AddItemToObject(ret_obj, "ack", val);
+	if (data != NULL)
+		cJSON_AddItemToObject(ret_obj, "data", data);
 	ack_msg = cJSON_Print(ret_obj);
 	if (ack_msg == NULL)
 		fprintf(stderr, "Failed to generate ACK message.\n");
 	cJSON_Delete(ret_obj);
 	return ack_msg;
 }
-static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
+static int send_socket_reply(struct socket_dev *sock, int fd, bool normal, cJSON *data)
 {
 	int ret = 0, val;
 	char *ack_message;
 	struct socket_client *client = NULL;
 
 	client = find_socket_client(sock, fd);
-	if (client == NULL)
+	if (client == NULL) {
+		cJSON_Delete(data);
 		return -1;
+	}
 	val = normal ? SUCCEEDED : FAILED;
-	ack_message = generate_ack_message(val);
+	ack_message = generate_ack_message(val, data);
 
 	if (ack_message != NULL) {
 		memset(client->buf, 0, CLIENT_BUF_LEN);
@@ -67,6 +79,11 @@ static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
 	return ret;
 }
 
+static int send_socket_ack(struct socket_dev *sock, int fd, bool normal)
+{
+	return send_socket_reply(sock, fd, normal, NULL);
+}
+
 int user_vm_destroy_handler(void *arg, void *command_para)
 {
 	int ret;
@@ -122,3 +139,260 @@ int user_vm_blkrescan_handler(void *arg, void *command_para)
 	}
 	return ret;
 }
+
+int user_vm_balloon_handler(void *arg, void *command_para)
+{
+	int ret = 0;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct socket_client *client = NULL;
+	bool cmd_completed = false;
+
+	client = find_socket_client(sock, cmd_para->fd);
+	if (client == NULL)
+		return -1;
+
+	ret = vm_monitor_balloon(hdl_arg->ctx_arg, cmd_para->option);
+	if (ret >= 0) {
+		cmd_completed = true;
+	} else {
+		pr_err("Failed to set the balloon target.\n");
+	}
+
+	ret = send_socket_ack(sock, cmd_para->fd, cmd_completed);
+	if (ret < 0) {
+		pr_err("Failed to send ACK by socket.\n");
+	}
+	return ret;
+}
+
+int user_vm_hotplug_mem_handler(void *arg, void *command_para)
+{
+	int ret = 0;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct socket_client *client = NULL;
+	bool cmd_completed = false;
+
+	client = find_socket_client(sock, cmd_para->fd);
+	if (client == NULL)
+		return -1;
+
+	ret = vm_monitor_hotplug_mem(hdl_arg->ctx_arg, cmd_para->option);
+	if (ret >= 0) {
+		cmd_completed = true;
+	} else {
+		pr_err("Failed to set the hotplug memory size.\n");
+	}
+
+	ret = send_socket_ack(sock, cmd_para->fd, cmd_completed);
+	if (ret < 0) {
+		pr_err("Failed to send ACK by socket.\n");
+	}
+	return ret;
+}
+
+int user_vm_mem_stats_handler(void *arg, void *command_para)
+{
+	int ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct vm_mem_stats stats;
+	cJSON *data = NULL;
+
+	ret = vm_get_mem_stats(hdl_arg->ctx_arg, &stats);
+	if (ret >= 0) {
+		data = cJSON_CreateObject();
+		if (data != NULL) {
+			cJSON_AddNumberToObject(data, "rss_kb", stats.rss_kb);
+			cJSON_AddNumberToObject(data, "thp_kb", stats.thp_kb);
+		}
+	} else {
+		pr_err("Failed to get the memory stats.\n");
+	}
+
+	ret = send_socket_reply(sock, cmd_para->fd, data != NULL, data);
+	if (ret < 0) {
+		pr_err("Failed to send the memory stats by socket.\n");
+	}
+	return ret;
+}
+
+static cJSON *exit_stats_to_json(struct exit_stats_entry *e)
+{
+	cJSON *obj, *hist, *regs, *reg;
+	int i;
+
+	obj = cJSON_CreateObject();
+	if (obj == NULL)
+		return NULL;
+
+	cJSON_AddStringToObject(obj, "name", e->name);
+	cJSON_AddStringToObject(obj, "type", exit_stats_type_str(e->type));
+	cJSON_AddNumberToObject(obj, "base", e->base);
+	cJSON_AddNumberToObject(obj, "reads", e->reads);
+	cJSON_AddNumberToObject(obj, "writes", e->writes);
+	cJSON_AddNumberToObject(obj, "read_ns", e->read_ns);
+	cJSON_AddNumberToObject(obj, "write_ns", e->write_ns);
+
+	hist = cJSON_AddArrayToObject(obj, "hist_log2_ns");
+	for (i = 0; (hist != NULL) && (i < EXIT_STATS_HIST_BUCKETS); i++)
+		cJSON_AddItemToArray(hist, cJSON_CreateNumber(e->hist[i]));
+
+	regs = cJSON_AddArrayToObject(obj, "hot_regs");
+	for (i = 0; (regs != NULL) && (i < e->nregs); i++) {
+		reg = cJSON_CreateObject();
+		if (reg == NULL)
+			break;
+		cJSON_AddNumberToObject(reg, "offset", e->regs[i].offset);
+		cJSON_AddNumberToObject(reg, "reads", e->regs[i].reads);
+		cJSON_AddNumberToObject(reg, "writes", e->regs[i].writes);
+		cJSON_AddItemToArray(regs, reg);
+	}
+	return obj;
+}
+
+/*
+ * "start" enables the accounting and clears the stats, "stop" disables it and
+ * "reset" clears the stats. The stats collected so far are returned in any case.
+ */
+int user_vm_exit_stats_handler(void *arg, void *command_para)
+{
+	int i, n, ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct exit_stats_entry *entries = NULL;
+	cJSON *data = NULL, *list;
+
+	if (!strcmp(cmd_para->option, "start"))
+		exit_stats_enable(true);
+	else if (!strcmp(cmd_para->option, "stop"))
+		exit_stats_enable(false);
+	else if (!strcmp(cmd_para->option, "reset"))
+		exit_stats_reset();
+
+	n = exit_stats_collect(&entries);
+	if (n >= 0) {
+		data = cJSON_CreateObject();
+		if (data != NULL) {
+			cJSON_AddBoolToObject(data, "enabled", exit_stats_enabled);
+			list = cJSON_AddArrayToObject(data, "regions");
+			for (i = 0; (list != NULL) && (i < n); i++)
+				cJSON_AddItemToArray(list, exit_stats_to_json(&entries[i]));
+		}
+		free(entries);
+	} else {
+		pr_err("Failed to collect the exit stats.\n");
+	}
+
+	ret = send_socket_reply(sock, cmd_para->fd, data != NULL, data);
+	if (ret < 0) {
+		pr_err("Failed to send the exit stats by socket.\n");
+	}
+	return ret;
+}
+
+int user_vm_display_stats_handler(void *arg, void *command_para)
+{
+	int ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct vdpy_stats stats;
+	cJSON *data = NULL;
+
+	if (vdpy_get_stats(&stats) == 0) {
+		data = cJSON_CreateObject();
+		if ((data != NULL) && stats.offscreen) {
+			cJSON_AddNumberToObject(data, "presented", stats.presented);
+			cJSON_AddNumberToObject(data, "fps", stats.fps_x100 / 100.0);
+			cJSON_AddNumberToObject(data, "bytes_per_frame", stats.bytes_per_frame);
+			cJSON_AddNumberToObject(data, "latency_avg_us", stats.avg_latency_us);
+			cJSON_AddNumberToObject(data, "latency_max_us", stats.max_latency_us);
+		} else if (data != NULL) {
+			cJSON_AddNumberToObject(data, "presented", stats.presented);
+			cJSON_AddNumberToObject(data, "coalesced", stats.coalesced);
+		}
+	} else {
+		pr_err("No display to get the stats of.\n");
+	}
+
+	ret = send_socket_reply(sock, cmd_para->fd, data != NULL, data);
+	if (ret < 0) {
+		pr_err("Failed to send the display stats by socket.\n");
+	}
+	return ret;
+}
+
+int user_vm_gpu_stats_handler(void *arg, void *command_para)
+{
+	int ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct gpu_dmabuf_stats stats;
+	cJSON *data = NULL;
+
+	ret = vm_monitor_gpu_stats(hdl_arg->ctx_arg, &stats);
+	if (ret >= 0) {
+		data = cJSON_CreateObject();
+		if (data != NULL) {
+			cJSON_AddNumberToObject(data, "dmabuf_cache_size", stats.cache_size);
+			cJSON_AddNumberToObject(data, "dmabuf_hits", stats.hits);
+			cJSON_AddNumberToObject(data, "dmabuf_misses", stats.misses);
+			cJSON_AddNumberToObject(data, "dmabuf_evictions", stats.evictions);
+			cJSON_AddNumberToObject(data, "dmabuf_discards", stats.discards);
+		}
+	} else {
+		pr_err("Failed to get the virtio-gpu stats.\n");
+	}
+
+	ret = send_socket_reply(sock, cmd_para->fd, data != NULL, data);
+	if (ret < 0) {
+		pr_err("Failed to send the virtio-gpu stats by socket.\n");
+	}
+	return ret;
+}
+
+/* the most console ports reported */
+#define CONSOLE_STATS_PORTS_MAX 32
+
+int user_vm_console_stats_handler(void *arg, void *command_para)
+{
+	int i, n, ret;
+	struct command_parameters *cmd_para = (struct command_parameters *)command_para;
+	struct handler_args *hdl_arg = (struct handler_args *)arg;
+	struct socket_dev *sock = (struct socket_dev *)hdl_arg->channel_arg;
+	struct console_port_stats stats[CONSOLE_STATS_PORTS_MAX];
+	cJSON *data = NULL, *list, *port;
+
+	n = vm_monitor_console_stats(hdl_arg->ctx_arg, stats, CONSOLE_STATS_PORTS_MAX);
+	data = cJSON_CreateObject();
+	if (data != NULL) {
+		list = cJSON_AddArrayToObject(data, "ports");
+		for (i = 0; (list != NULL) && (i < n); i++) {
+			port = cJSON_CreateObject();
+			if (port == NULL)
+				break;
+			cJSON_AddStringToObject(port, "name", stats[i].name);
+			cJSON_AddNumberToObject(port, "tx_bytes", stats[i].tx_bytes);
+			cJSON_AddNumberToObject(port, "tx_writes", stats[i].tx_writes);
+			cJSON_AddNumberToObject(port, "tx_stalls", stats[i].tx_stalls);
+			cJSON_AddNumberToObject(port, "tx_drops", stats[i].tx_drops);
+			cJSON_AddNumberToObject(port, "rx_bytes", stats[i].rx_bytes);
+			cJSON_AddNumberToObject(port, "rx_reads", stats[i].rx_reads);
+			cJSON_AddNumberToObject(port, "rx_drops", stats[i].rx_drops);
+			cJSON_AddItemToArray(list, port);
+		}
+	}
+
+	ret = send_socket_reply(sock, cmd_para->fd, data != NULL, data);
+	if (ret < 0) {
+		pr_err("Failed to send the virtio-console stats by socket.\n");
+	}
+	return ret;
+}
@@ -9,4 +9,11 @@ extern struct socket_dev *sock_server;
 
 int user_vm_destroy_handler(void *arg, void *command_para);
 int user_vm_blkrescan_handler(void *arg, void *command_para);
+int user_vm_balloon_handler(void *arg, void *command_para);
+int user_vm_hotplug_mem_handler(void *arg, void *command_para);
+int user_vm_mem_stats_handler(void *arg, void *command_para);
+int user_vm_exit_stats_handler(void *arg, void *command_para);
+int user_vm_display_stats_handler(void *arg, void *command_para);
+int user_vm_gpu_stats_handler(void *arg, void *command_para);
+int user_vm_console_stats_handler(void *arg, void *command_para);
 #endif
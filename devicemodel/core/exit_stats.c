@@ -0,0 +1,344 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Exit accounting
+ *
+ * Each MMIO, PIO and PCI config access emulated by the DM is counted against
+ * the region it hits, with the time spent in its handler and the offset of
+ * the register accessed, so the devices and registers costing the most exits
+ * can be found.
+ *
+ * Every thread dispatching accesses owns a table it updates without locks or
+ * atomic read-modify-writes. An entry, or a register of an entry, is published
+ * by a store after it's filled, and the tables are merged when the stats are
+ * read. A reset bumps a generation, and each table clears itself when it sees
+ * the new one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "atomic.h"
+#include "exit_stats.h"
+#include "log.h"
+
+#define EXIT_STATS_ENTRIES	128
+
+struct exit_stats_slot {
+	int used;
+	struct exit_stats_entry e;
+};
+
+struct exit_stats_table {
+	struct exit_stats_table *next;
+	bool owned;
+	unsigned int gen;
+	struct exit_stats_slot slots[EXIT_STATS_ENTRIES];
+};
+
+bool exit_stats_enabled;
+
+/* the tables are reused by new threads once their thread is gone, never freed */
+static struct exit_stats_table *exit_stats_tables;
+static pthread_mutex_t exit_stats_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t exit_stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_stats_key;
+static __thread struct exit_stats_table *exit_stats_mine;
+static unsigned int exit_stats_gen;
+
+static const char *exit_stats_types[EXIT_STATS_TYPES] = {
+	[EXIT_STATS_MMIO] = "mmio",
+	[EXIT_STATS_PIO] = "pio",
+	[EXIT_STATS_PCICFG] = "pcicfg",
+};
+
+const char *
+exit_stats_type_str(enum exit_stats_type type)
+{
+	return (type < EXIT_STATS_TYPES) ? exit_stats_types[type] : "unknown";
+}
+
+static void
+exit_stats_release(void *arg)
+{
+	struct exit_stats_table *table = arg;
+
+	pthread_mutex_lock(&exit_stats_mtx);
+	table->owned = false;
+	pthread_mutex_unlock(&exit_stats_mtx);
+}
+
+static void
+exit_stats_init_key(void)
+{
+	pthread_key_create(&exit_stats_key, exit_stats_release);
+}
+
+static struct exit_stats_table *
+exit_stats_table(void)
+{
+	struct exit_stats_table *table;
+
+	if (exit_stats_mine)
+		return exit_stats_mine;
+
+	pthread_once(&exit_stats_once, exit_stats_init_key);
+
+	pthread_mutex_lock(&exit_stats_mtx);
+	for (table = exit_stats_tables; table; table = table->next) {
+		if (!table->owned)
+			break;
+	}
+	if (table == NULL) {
+		table = calloc(1, sizeof(*table));
+		if (table == NULL) {
+			pthread_mutex_unlock(&exit_stats_mtx);
+			return NULL;
+		}
+		table->gen = atomic_load(&exit_stats_gen);
+		table->next = exit_stats_tables;
+		atomic_store(&exit_stats_tables, table);
+	}
+	table->owned = true;
+	pthread_mutex_unlock(&exit_stats_mtx);
+
+	pthread_setspecific(exit_stats_key, table);
+	exit_stats_mine = table;
+	return table;
+}
+
+static struct exit_stats_entry *
+exit_stats_lookup(struct exit_stats_table *table, enum exit_stats_type type,
+		const char *name, uint64_t base)
+{
+	struct exit_stats_slot *slot;
+	unsigned int i, idx;
+
+	idx = (unsigned int)((base >> 4) ^ (base >> 12) ^ type);
+	for (i = 0; i < EXIT_STATS_ENTRIES; i++) {
+		slot = &table->slots[(idx + i) % EXIT_STATS_ENTRIES];
+		if (!slot->used) {
+			slot->e.type = type;
+			slot->e.base = base;
+			strncpy(slot->e.name, name, EXIT_STATS_NAME_LEN - 1);
+			atomic_store(&slot->used, 1);
+			return &slot->e;
+		}
+		if ((slot->e.type == type) && (slot->e.base == base) &&
+			!strncmp(slot->e.name, name, EXIT_STATS_NAME_LEN - 1))
+			return &slot->e;
+	}
+
+	/* the table is full, the access is not counted */
+	return NULL;
+}
+
+void
+exit_stats_account(enum exit_stats_type type, const char *name,
+		uint64_t base, uint64_t offset, bool write, uint64_t start)
+{
+	struct exit_stats_table *table;
+	struct exit_stats_entry *e;
+	struct exit_stats_reg *reg = NULL, *min;
+	struct timespec now;
+	unsigned int gen;
+	uint64_t ns;
+	int i, bucket, nregs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = now.tv_sec * 1000000000UL + now.tv_nsec - start;
+
+	table = exit_stats_table();
+	if (table == NULL)
+		return;
+
+	gen = atomic_load(&exit_stats_gen);
+	if (table->gen != gen) {
+		memset(table->slots, 0, sizeof(table->slots));
+		table->gen = gen;
+	}
+
+	e = exit_stats_lookup(table, type, name ? name : "unknown", base);
+	if (e == NULL)
+		return;
+
+	bucket = (ns == 0) ? 0 : (64 - __builtin_clzl(ns));
+	if (bucket >= EXIT_STATS_HIST_BUCKETS)
+		bucket = EXIT_STATS_HIST_BUCKETS - 1;
+	e->hist[bucket]++;
+
+	nregs = e->nregs;
+	for (i = 0; i < nregs; i++) {
+		if (e->regs[i].offset == offset) {
+			reg = &e->regs[i];
+			break;
+		}
+	}
+	if ((reg == NULL) && (nregs < EXIT_STATS_REG_SLOTS)) {
+		reg = &e->regs[nregs];
+		reg->offset = offset;
+		atomic_store(&e->nregs, nregs + 1);
+	} else if (reg == NULL) {
+		/*
+		 * Replace the register with the fewest hits. The new one inherits
+		 * them, so that a hot register showing up late isn't replaced in
+		 * turn before it can take the lead.
+		 */
+		min = &e->regs[0];
+		for (i = 1; i < nregs; i++) {
+			if (e->regs[i].hits < min->hits)
+				min = &e->regs[i];
+		}
+		reg = min;
+		reg->offset = offset;
+		reg->reads = 0;
+		reg->writes = 0;
+	}
+	reg->hits++;
+
+	if (write) {
+		e->writes++;
+		e->write_ns += ns;
+		reg->writes++;
+	} else {
+		e->reads++;
+		e->read_ns += ns;
+		reg->reads++;
+	}
+}
+
+void
+exit_stats_reset(void)
+{
+	atomic_add_fetch(&exit_stats_gen, 1);
+}
+
+void
+exit_stats_enable(bool enable)
+{
+	if (enable && !exit_stats_enabled)
+		exit_stats_reset();
+	exit_stats_enabled = enable;
+}
+
+static void
+exit_stats_merge(struct exit_stats_entry *to, struct exit_stats_entry *from)
+{
+	int i, j, nregs;
+
+	to->reads += from->reads;
+	to->writes += from->writes;
+	to->read_ns += from->read_ns;
+	to->write_ns += from->write_ns;
+	for (i = 0; i < EXIT_STATS_HIST_BUCKETS; i++)
+		to->hist[i] += from->hist[i];
+
+	nregs = atomic_load(&from->nregs);
+	for (i = 0; i < nregs; i++) {
+		for (j = 0; j < to->nregs; j++) {
+			if (to->regs[j].offset == from->regs[i].offset)
+				break;
+		}
+		if (j == to->nregs) {
+			if (j == EXIT_STATS_REG_SLOTS)
+				continue;
+			to->regs[j].offset = from->regs[i].offset;
+			to->nregs++;
+		}
+		to->regs[j].reads += from->regs[i].reads;
+		to->regs[j].writes += from->regs[i].writes;
+	}
+}
+
+static int
+exit_stats_reg_cmp(const void *a, const void *b)
+{
+	const struct exit_stats_reg *ra = a, *rb = b;
+	uint64_t na = ra->reads + ra->writes, nb = rb->reads + rb->writes;
+
+	return (na < nb) - (na > nb);
+}
+
+static int
+exit_stats_entry_cmp(const void *a, const void *b)
+{
+	const struct exit_stats_entry *ea = a, *eb = b;
+	uint64_t na = ea->read_ns + ea->write_ns, nb = eb->read_ns + eb->write_ns;
+
+	return (na < nb) - (na > nb);
+}
+
+/*
+ * Merge the tables of all threads into an array, most costly region first,
+ * with the hottest EXIT_STATS_TOP_REGS registers of each region. The caller
+ * frees *entries. Return the number of entries, or -1 on error.
+ */
+int
+exit_stats_collect(struct exit_stats_entry **entries)
+{
+	struct exit_stats_table *table;
+	struct exit_stats_slot *slot;
+	struct exit_stats_entry *all = NULL, *e;
+	unsigned int gen;
+	int i, j, n = 0, ntables = 0;
+
+	pthread_mutex_lock(&exit_stats_mtx);
+	for (table = exit_stats_tables; table; table = table->next)
+		ntables++;
+
+	if (ntables > 0) {
+		all = calloc(ntables * EXIT_STATS_ENTRIES, sizeof(*all));
+		if (all == NULL) {
+			pthread_mutex_unlock(&exit_stats_mtx);
+			pr_err("%s: failed to allocate the entries\n", __func__);
+			return -1;
+		}
+	}
+
+	gen = atomic_load(&exit_stats_gen);
+	for (table = exit_stats_tables; table; table = table->next) {
+		/* not cleared since the last reset */
+		if (table->gen != gen)
+			continue;
+
+		for (i = 0; i < EXIT_STATS_ENTRIES; i++) {
+			slot = &table->slots[i];
+			if (!atomic_load(&slot->used))
+				continue;
+
+			for (j = 0; j < n; j++) {
+				e = &all[j];
+				if ((e->type == slot->e.type) && (e->base == slot->e.base) &&
+					!strncmp(e->name, slot->e.name, EXIT_STATS_NAME_LEN))
+					break;
+			}
+			if (j == n) {
+				e = &all[n++];
+				e->type = slot->e.type;
+				e->base = slot->e.base;
+				memcpy(e->name, slot->e.name, EXIT_STATS_NAME_LEN);
+				e->name[EXIT_STATS_NAME_LEN - 1] = '\0';
+			}
+			exit_stats_merge(&all[j], &slot->e);
+		}
+	}
+	pthread_mutex_unlock(&exit_stats_mtx);
+
+	for (i = 0; i < n; i++) {
+		qsort(all[i].regs, all[i].nregs, sizeof(struct exit_stats_reg),
+			exit_stats_reg_cmp);
+		if (all[i].nregs > EXIT_STATS_TOP_REGS)
+			all[i].nregs = EXIT_STATS_TOP_REGS;
+	}
+	qsort(all, n, sizeof(*all), exit_stats_entry_cmp);
+
+	*entries = all;
+	return n;
+}
@@ -35,10 +35,22 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <log.h>
 #include <linux/memfd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "vmmapi.h"
+#include "dm.h"
+#include "atomic.h"
+#include "hugepool.h"
+#include "numa.h"
+#include "timer.h"
+#include "workers.h"
 
 extern char *vmname;
 
@@ -133,6 +145,7 @@ struct vm_mmap_mem_region {
 	vm_paddr_t fd_offset;
 	char *hva_base;
 	int fd;
+	size_t pg_size;
 };
 
 static struct vm_mmap_mem_region mmap_mem_regions[16];
@@ -143,6 +156,27 @@ static size_t total_size;
 static int hugetlb_lv_max;
 static int lock_fd;
 
+/*
+ * 2M hugepages added to the system by hugetlb_reserve_more(), only these are
+ * dropped again by hugetlb_release_more(). Both run with the reservation
+ * lock held: reserve_more_mtx between the threads of the DM, and the acrn
+ * hugetlb file lock between the DMs.
+ */
+static int reserved_more_pages;
+static pthread_mutex_t reserve_more_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* connection to acrn_hugepool while the guest memory is leased from it */
+static int hugepool_sock = -1;
+
+/*
+ * --mem_backend memfd: the guest memory is a plain memfd with transparent
+ * hugepages instead of hugetlbfs. There is no KSM mode, KSM never merges the
+ * guest pages as HSM keeps them pinned.
+ */
+static bool memfd_backend;
+static int memfd_fd = -1;
+#define MEMFD_THP_SIZE		(2 * MB)
+
 static int lock_acrn_hugetlb(void)
 {
 	int ret;
@@ -228,6 +262,11 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	if (addr == MAP_FAILED)
 		return -ENOMEM;
 
+	if (numa_bind_memory(addr, offset, len, hugetlb_priv[level].pg_size) < 0) {
+		munmap(addr, len);
+		return -ENOMEM;
+	}
+
 	if (addr_out)
 		*addr_out = addr;
 
@@ -237,9 +276,17 @@ static int mmap_hugetlbfs_from_level(struct vmctx *ctx, int level, size_t len,
 	mmap_mem_regions[mem_idx].fd = fd;
 	mmap_mem_regions[mem_idx].fd_offset = skip;
 	mmap_mem_regions[mem_idx].hva_base = addr;
+	mmap_mem_regions[mem_idx].pg_size = hugetlb_priv[level].pg_size;
 	mem_idx++;
 	pr_info("mmap 0x%lx@%p\n", len, addr);
 
+	/*
+	 * the pages are touched by hugetlb_prefault_memory() in parallel, or
+	 * already faulted in and cleared by acrn_hugepool.
+	 */
+	if (mem_prefault_threads > 0 || hugepool_sock >= 0)
+		return 0;
+
 	/* pre-allocate hugepages by touch them */
 	pagesz = hugetlb_priv[level].pg_size;
 
@@ -381,6 +428,27 @@ static int read_sys_info(const char *sys_path)
 	return pages;
 }
 
+static int write_sys_info(const char *sys_path, int pages)
+{
+	char tmp_buf[12];
+	int fd, len, ret = 0;
+
+	fd = open(sys_path, O_WRONLY);
+	if (fd < 0) {
+		pr_err("can't open: %s, err: %s\n", sys_path, strerror(errno));
+		return -1;
+	}
+
+	len = snprintf(tmp_buf, sizeof(tmp_buf), "%d", pages);
+	if (write(fd, tmp_buf, len) != len) {
+		pr_err("write %d to %s, error: %s\n", pages, sys_path, strerror(errno));
+		ret = -1;
+	}
+
+	close(fd);
+	return ret;
+}
+
 /* check if enough free huge pages for the User VM */
 static bool hugetlb_check_memgap(void)
 {
@@ -434,6 +502,90 @@ static void reserve_more_pages(int level)
 	hugetlb_priv[level].pages_delta = total_pages - cur_pages;
 }
 
+/*
+ * Take the reservation lock for hugetlb_reserve_more() and
+ * hugetlb_release_more(). Keep it till the reserved hugepages are faulted in,
+ * so that no other DM drops them meanwhile.
+ */
+int hugetlb_lock_reserve(void)
+{
+	pthread_mutex_lock(&reserve_more_mtx);
+	if (lock_acrn_hugetlb() < 0) {
+		pthread_mutex_unlock(&reserve_more_mtx);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+void hugetlb_unlock_reserve(void)
+{
+	unlock_acrn_hugetlb();
+	pthread_mutex_unlock(&reserve_more_mtx);
+}
+
+/* whether hugetlb_reserve_more() can add hugepages for the guest memory */
+bool hugetlb_can_reserve_more(void)
+{
+	return !memfd_backend;
+}
+
+/* drop up to pages free 2M hugepages this DM added, with the lock held */
+static void drop_more_pages(int pages)
+{
+	struct hugetlb_info *htlb = &hugetlb_priv[HUGETLB_LV1];
+	int orig_pages;
+
+	/* only free hugepages are dropped, the kernel keeps the ones in use */
+	pages = MIN(pages, reserved_more_pages);
+	pages = MIN(pages, read_sys_info(htlb->free_pages_path));
+	if (pages <= 0)
+		return;
+
+	orig_pages = read_sys_info(htlb->nr_pages_path);
+	if (write_sys_info(htlb->nr_pages_path, orig_pages - pages) == 0)
+		reserved_more_pages -= MAX(orig_pages - read_sys_info(htlb->nr_pages_path), 0);
+}
+
+/*
+ * Make sure there are free 2M hugepages for len more guest memory, e.g. for
+ * memory plugged at runtime. Called with the reservation lock held, the
+ * hugepages added are dropped again if there aren't enough of them.
+ */
+int hugetlb_reserve_more(size_t len)
+{
+	struct hugetlb_info *htlb = &hugetlb_priv[HUGETLB_LV1];
+	int orig_pages, added;
+
+	if (memfd_backend)
+		return -ENOTSUP;
+
+	htlb->pages_delta = len / htlb->pg_size - read_sys_info(htlb->free_pages_path);
+	if (htlb->pages_delta <= 0)
+		return 0;
+
+	orig_pages = read_sys_info(htlb->nr_pages_path);
+	reserve_more_pages(HUGETLB_LV1);
+	added = MAX(read_sys_info(htlb->nr_pages_path) - orig_pages, 0);
+	reserved_more_pages += added;
+	if (htlb->pages_delta > 0) {
+		pr_err("%s: %d hugepages short\n", __func__, htlb->pages_delta);
+		drop_more_pages(added);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Give back the 2M hugepages hugetlb_reserve_more() added for len guest
+ * memory, once that memory is freed, e.g. unplugged. Called with the
+ * reservation lock held.
+ */
+void hugetlb_release_more(size_t len)
+{
+	drop_more_pages(len / hugetlb_priv[HUGETLB_LV1].pg_size);
+}
+
 /* try to release larger free page */
 static bool release_larger_freepage(int level_limit)
 {
@@ -539,6 +691,81 @@ static bool hugetlb_reserve_pages(void)
 	return true;
 }
 
+/*
+ * Reserve the hugepages of the guest NUMA nodes bound to host nodes on those
+ * host nodes. The pages reserved through the global nr_hugepages are spread
+ * over all host nodes, so they can't back the bound memory.
+ */
+static bool hugetlb_reserve_node_pages(struct vmctx *ctx)
+{
+	static int need[NUMA_MAX_HOST_NODES][HUGETLB_LV_MAX];
+	const struct numa_node *node;
+	char path[MAX_PATH_LEN];
+	vm_paddr_t gpa[2], start, end;
+	size_t len[2];
+	int i, r, m, level, host, pages;
+
+	if (numa_get_nr_nodes() == 0)
+		return true;
+
+	memset(need, 0, sizeof(need));
+	gpa[0] = 0;
+	gpa[1] = ctx->highmem_gpa_base;
+	/* the memory of larger pages is mapped first, see mmap_hugetlbfs() */
+	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
+		len[0] = hugetlb_priv[level].lowmem;
+		len[1] = hugetlb_priv[level].highmem;
+
+		for (i = 0; (node = numa_get_node(i)) != NULL; i++) {
+			if (node->host < 0)
+				continue;
+			for (m = 0; m < 2; m++) {
+				for (r = 0; r < 2; r++) {
+					start = MAX(gpa[m], node->gpa[r]);
+					end = MIN(gpa[m] + len[m], node->gpa[r] + node->len[r]);
+					if (start < end)
+						need[node->host][level] += howmany(end - start,
+								hugetlb_priv[level].pg_size);
+				}
+			}
+		}
+		gpa[0] += len[0];
+		gpa[1] += len[1];
+	}
+
+	for (host = 0; host < NUMA_MAX_HOST_NODES; host++) {
+		for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
+			if (need[host][level] == 0)
+				continue;
+
+			snprintf(path, MAX_PATH_LEN,
+				"/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/free_hugepages",
+				host, hugetlb_priv[level].pg_size / 1024);
+			pages = need[host][level] - read_sys_info(path);
+			if (pages <= 0)
+				continue;
+
+			snprintf(path, MAX_PATH_LEN,
+				"/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/nr_hugepages",
+				host, hugetlb_priv[level].pg_size / 1024);
+			if (write_sys_info(path, read_sys_info(path) + pages) < 0)
+				return false;
+			pr_info("to reserve %d pages on node %d\n", pages, host);
+
+			snprintf(path, MAX_PATH_LEN,
+				"/sys/devices/system/node/node%d/hugepages/hugepages-%dkB/free_hugepages",
+				host, hugetlb_priv[level].pg_size / 1024);
+			if (read_sys_info(path) < need[host][level]) {
+				pr_err("failed to reserve %d level %d pages on node %d\n",
+					need[host][level], level, host);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
 bool init_hugetlb(void)
 {
 	char path[MAX_PATH_LEN] = {0};
@@ -563,6 +790,10 @@ bool init_hugetlb(void)
 		}
 	}
 
+	/* the memfd backend doesn't need hugetlbfs */
+	if (memfd_backend)
+		return true;
+
 	for (level = HUGETLB_LV1; level < HUGETLB_LV_MAX; level++) {
 		hugetlb_priv[level].fd = -1;
 		fd = memfd_create("acrn_memfd", hugetlb_priv[level].flags);
@@ -597,7 +828,446 @@ void uninit_hugetlb(void)
 		hugetlb_priv[level].fd = -1;
 	}
 
-	close(lock_fd);
+	if (!memfd_backend)
+		close(lock_fd);
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+#define PREFAULT_MAX_NODES	64
+/* granularity of the work handed out to the prefault workers */
+#define PREFAULT_CHUNK_SIZE	(256 * MB)
+
+struct prefault_chunk {
+	char *hva;
+	size_t len;
+	size_t pg_size;
+	int node;	/* -1 if the memory has no node binding */
+};
+
+struct prefault_ctx {
+	struct prefault_chunk *chunks;
+	int nr_chunks;
+	int next;		/* next chunk to take, atomically updated */
+	cpu_set_t dm_cpus;	/* affinity of the DM, for unbound memory */
+	int errors;
+};
+
+/*
+ * The node which the pages of hva are to be allocated from, according to the
+ * memory policy of the mapping. Returns -1 if the policy doesn't bind it to a
+ * single node.
+ */
+static int
+hugetlb_mem_node(char *hva)
+{
+	unsigned long mask[PREFAULT_MAX_NODES / (8 * sizeof(unsigned long))];
+	int mode, node = -1, i;
+
+	memset(mask, 0, sizeof(mask));
+	if (syscall(SYS_get_mempolicy, &mode, mask, PREFAULT_MAX_NODES,
+			hva, MPOL_F_ADDR) != 0)
+		return -1;
+
+	if ((mode != MPOL_BIND) && (mode != MPOL_PREFERRED))
+		return -1;
+
+	for (i = 0; i < PREFAULT_MAX_NODES; i++) {
+		if (mask[i / (8 * sizeof(unsigned long))] &
+				(1UL << (i % (8 * sizeof(unsigned long))))) {
+			if (node >= 0)
+				return -1;
+			node = i;
+		}
+	}
+
+	return node;
+}
+
+static int
+prefault_chunk(struct prefault_chunk *chunk)
+{
+	size_t off;
+
+	/* Let the kernel fault in and clear the pages in one call if supported */
+	if (madvise(chunk->hva, chunk->len, MADV_POPULATE_WRITE) == 0)
+		return 0;
+	if (errno != EINVAL)
+		return -1;
+
+	for (off = 0; off < chunk->len; off += chunk->pg_size)
+		*(volatile char *)(chunk->hva + off) = *(chunk->hva + off);
+
+	return 0;
+}
+
+static void *
+prefault_worker(void *arg)
+{
+	struct prefault_ctx *pctx = arg;
+	struct prefault_chunk *chunk;
+	cpu_set_t cpus;
+	int node = -1, i;
+
+	while ((i = atomic_fetch_add(&pctx->next, 1)) < pctx->nr_chunks) {
+		chunk = &pctx->chunks[i];
+
+		/* Fault the pages in from the node they belong to */
+		if (chunk->node != node) {
+			node = chunk->node;
+			if ((node < 0) || (numa_node_cpus(node, &cpus) != 0))
+				cpus = pctx->dm_cpus;
+			pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		}
+
+		if (prefault_chunk(chunk) != 0)
+			atomic_add_fetch(&pctx->errors, 1);
+	}
+
+	/* in case it was run in place by the main thread */
+	if (node != -1)
+		pthread_setaffinity_np(pthread_self(), sizeof(pctx->dm_cpus), &pctx->dm_cpus);
+
+	return NULL;
+}
+
+static int
+chunk_cmp_node(const void *a, const void *b)
+{
+	return ((const struct prefault_chunk *)a)->node -
+		((const struct prefault_chunk *)b)->node;
+}
+
+/*
+ * Fault in and clear all the hugetlb pages of the guest memory with
+ * mem_prefault_threads workers, instead of touching them one by one at mmap
+ * time.
+ */
+static int
+hugetlb_prefault_memory(void)
+{
+	struct prefault_ctx pctx;
+	size_t len, off, csize;
+	int i, n, nr_threads, ret = 0;
+
+	memset(&pctx, 0, sizeof(pctx));
+	n = 0;
+	for (i = 0; i < mem_idx; i++) {
+		len = mmap_mem_regions[i].gpa_end - mmap_mem_regions[i].gpa_start;
+		csize = MAX(PREFAULT_CHUNK_SIZE, mmap_mem_regions[i].pg_size);
+		n += howmany(len, csize);
+	}
+
+	pctx.chunks = calloc(n, sizeof(struct prefault_chunk));
+	if (pctx.chunks == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < mem_idx; i++) {
+		len = mmap_mem_regions[i].gpa_end - mmap_mem_regions[i].gpa_start;
+		/* keep the chunks aligned to the hugepage size of the region */
+		csize = MAX(PREFAULT_CHUNK_SIZE, mmap_mem_regions[i].pg_size);
+		for (off = 0; off < len; off += csize) {
+			struct prefault_chunk *chunk = &pctx.chunks[pctx.nr_chunks++];
+
+			chunk->hva = mmap_mem_regions[i].hva_base + off;
+			chunk->len = MIN(len - off, csize);
+			chunk->pg_size = mmap_mem_regions[i].pg_size;
+			chunk->node = hugetlb_mem_node(chunk->hva);
+		}
+	}
+	/* so that the workers seldom need to move to another node */
+	qsort(pctx.chunks, pctx.nr_chunks, sizeof(struct prefault_chunk), chunk_cmp_node);
+
+	if (sched_getaffinity(0, sizeof(pctx.dm_cpus), &pctx.dm_cpus) != 0)
+		CPU_ZERO(&pctx.dm_cpus);
+
+	nr_threads = dm_run_workers(prefault_worker, &pctx,
+			MIN(mem_prefault_threads, pctx.nr_chunks), "mem_prefault");
+
+	if (pctx.errors > 0) {
+		pr_err("failed to prefault %d memory chunks\n", pctx.errors);
+		ret = -ENOMEM;
+	} else {
+		pr_info("prefaulted %d memory chunks with %d threads\n", pctx.nr_chunks, nr_threads);
+	}
+
+	free(pctx.chunks);
+	return ret;
+}
+
+/*
+ * Lease the guest memory from acrn_hugepool, which keeps it reserved and
+ * cleared across VM restarts. On success, the memfd of each level is replaced
+ * by the pool memfd, which is at least as large as the level needs and already
+ * sized and sealed. The lease is kept until hugetlb_release_pool(), which is
+ * called once the VM is destroyed.
+ */
+static bool
+hugetlb_lease_pool(void)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * HUGEPOOL_LV_MAX)];
+	struct hugepool_msg msg;
+	struct sockaddr_un addr;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	size_t need[HUGETLB_LV_MAX];
+	int fds[HUGEPOOL_LV_MAX];
+	int level, nr_fds = 0, i = 0;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return false;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HUGEPOOL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		pr_warn("hugetlb: can't connect to acrn_hugepool: %s\n", strerror(errno));
+		goto err;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = HUGEPOOL_MSG_MAGIC;
+	msg.type = HUGEPOOL_LEASE;
+	strncpy(msg.name, vmname, sizeof(msg.name) - 1);
+	for (level = HUGETLB_LV1; level < HUGETLB_LV_MAX; level++) {
+		need[level] = hugetlb_priv[level].lowmem +
+			      hugetlb_priv[level].highmem +
+			      hugetlb_priv[level].biosmem +
+			      hugetlb_priv[level].fbmem;
+		msg.size[level] = need[level];
+	}
+	if (send(sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+		goto err;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(msg))
+		goto err;
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nr_fds);
+	}
+
+	if (msg.magic != HUGEPOOL_MSG_MAGIC || msg.result != 0) {
+		pr_warn("hugetlb: acrn_hugepool refused the lease: %d\n", msg.result);
+		goto err_fds;
+	}
+
+	/*
+	 * The pool sends one memfd per level it grants memory of, in level
+	 * order. It may grant more than requested, including levels the VM
+	 * doesn't use, whose memfds are simply dropped.
+	 */
+	for (level = HUGETLB_LV1; level < HUGETLB_LV_MAX; level++) {
+		if (msg.size[level] > 0)
+			i++;
+		if (msg.size[level] < need[level])
+			goto err_fds;
+	}
+	if (i != nr_fds)
+		goto err_fds;
+
+	for (level = HUGETLB_LV1, i = 0; level < HUGETLB_LV_MAX; level++) {
+		if (msg.size[level] == 0)
+			continue;
+		if (need[level] > 0) {
+			close_hugetlbfs(level);
+			hugetlb_priv[level].fd = fds[i++];
+		} else
+			close(fds[i++]);
+	}
+
+	hugepool_sock = sock;
+	pr_notice("hugetlb: leased 0x%lx 2M and 0x%lx 1G memory from acrn_hugepool\n",
+		msg.size[HUGEPOOL_LV_2M], msg.size[HUGEPOOL_LV_1G]);
+	return true;
+
+err_fds:
+	for (i = 0; i < nr_fds; i++)
+		close(fds[i]);
+err:
+	close(sock);
+	return false;
+}
+
+/*
+ * Return the leased memory to acrn_hugepool, after the VM is destroyed. The
+ * pool clears the memory for next lease, so it must be neither mapped to the
+ * guest nor pinned by HSM any more.
+ */
+void
+hugetlb_release_pool(void)
+{
+	struct hugepool_msg msg;
+
+	if (hugepool_sock < 0)
+		return;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.magic = HUGEPOOL_MSG_MAGIC;
+	msg.type = HUGEPOOL_RELEASE;
+	strncpy(msg.name, vmname, sizeof(msg.name) - 1);
+	if (send(hugepool_sock, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ||
+	    recv(hugepool_sock, &msg, sizeof(msg), 0) != sizeof(msg) || msg.result != 0)
+		pr_warn("hugetlb: acrn_hugepool didn't confirm the release\n");
+
+	close(hugepool_sock);
+	hugepool_sock = -1;
+}
+
+int acrn_parse_mem_backend(char *arg)
+{
+	if (!strcmp(arg, "hugetlb"))
+		return 0;
+	if (strcmp(arg, "memfd"))
+		return -1;
+
+	memfd_backend = true;
+	return 0;
+}
+
+bool vm_is_memfd_backend(void)
+{
+	return memfd_backend;
+}
+
+static int memfd_mmap(struct vmctx *ctx, size_t offset, size_t len, size_t skip,
+		char **addr_out)
+{
+	char *addr;
+
+	if (len == 0)
+		return 0;
+	if (mem_idx >= ARRAY_SIZE(mmap_mem_regions)) {
+		pr_err("exceed supported regions.\n");
+		return -EFAULT;
+	}
+
+	addr = mmap(ctx->baseaddr + offset, len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED, memfd_fd, skip);
+	if (addr == MAP_FAILED)
+		return -ENOMEM;
+
+	/*
+	 * For shmem, THP also needs "advise" or better in
+	 * /sys/kernel/mm/transparent_hugepage/shmem_enabled.
+	 */
+	if (madvise(addr, len, MADV_HUGEPAGE) < 0)
+		pr_warn("no transparent hugepages for 0x%lx@0x%lx: %s\n",
+			len, offset, strerror(errno));
+
+	if (numa_bind_memory(addr, offset, len, MEMFD_THP_SIZE) < 0) {
+		munmap(addr, len);
+		return -ENOMEM;
+	}
+
+	if (addr_out)
+		*addr_out = addr;
+
+	mmap_mem_regions[mem_idx].gpa_start = offset;
+	mmap_mem_regions[mem_idx].gpa_end = offset + len;
+	mmap_mem_regions[mem_idx].fd = memfd_fd;
+	mmap_mem_regions[mem_idx].fd_offset = skip;
+	mmap_mem_regions[mem_idx].hva_base = addr;
+	mmap_mem_regions[mem_idx].pg_size = MEMFD_THP_SIZE;
+	mem_idx++;
+	pr_info("mmap 0x%lx@%p\n", len, addr);
+
+	return 0;
+}
+
+static int memfd_setup_memory(struct vmctx *ctx)
+{
+	size_t skip;
+
+	mem_idx = 0;
+	memset(&mmap_mem_regions, 0, sizeof(mmap_mem_regions));
+	if (ctx->lowmem == 0) {
+		pr_err("vm requests 0 memory");
+		return -ENOMEM;
+	}
+	if (ALIGN_CHECK(ctx->lowmem, MEMFD_THP_SIZE) ||
+		ALIGN_CHECK(ctx->highmem, MEMFD_THP_SIZE) ||
+		ALIGN_CHECK(ctx->biosmem, MEMFD_THP_SIZE) ||
+		ALIGN_CHECK(ctx->fbmem, MEMFD_THP_SIZE)) {
+		pr_err("Memory size is not aligned to 2M.\n");
+		return -ENOMEM;
+	}
+
+	memfd_fd = memfd_create("acrn_memfd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if ((memfd_fd < 0) || (ftruncate(memfd_fd, ctx->lowmem + ctx->highmem +
+			ctx->biosmem + ctx->fbmem) < 0) ||
+		(fcntl(memfd_fd, F_ADD_SEALS,
+			F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL) < 0)) {
+		pr_err("Fail to create the memfd: %s\n", strerror(errno));
+		goto err;
+	}
+
+	/* basic overview vma, aligned up to the THP size */
+	total_size = ctx->highmem_gpa_base + ctx->highmem + MEMFD_THP_SIZE;
+	ptr = mmap(NULL, total_size, PROT_NONE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ptr == MAP_FAILED) {
+		pr_err("anony mmap fail");
+		ptr = NULL;
+		goto err;
+	}
+	ctx->baseaddr = (void *)ALIGN_UP((size_t)ptr, MEMFD_THP_SIZE);
+
+	skip = 0;
+	if (memfd_mmap(ctx, 0, ctx->lowmem, skip, NULL) < 0)
+		goto err;
+	skip += ctx->lowmem;
+	if (memfd_mmap(ctx, ctx->highmem_gpa_base, ctx->highmem, skip, NULL) < 0)
+		goto err;
+	skip += ctx->highmem;
+	if (memfd_mmap(ctx, 4 * GB - ctx->biosmem, ctx->biosmem, skip, NULL) < 0)
+		goto err;
+	skip += ctx->biosmem;
+	if (memfd_mmap(ctx, 4 * GB - ctx->biosmem - ctx->fbmem, ctx->fbmem, skip,
+			(char **)&ctx->fb_base) < 0)
+		goto err;
+
+	if ((mem_prefault_threads > 0) && (hugetlb_prefault_memory() < 0))
+		goto err;
+
+	if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
+		(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
+		goto err;
+	if ((ctx->biosmem > 0) && (vm_map_memseg_vma(ctx, ctx->biosmem,
+		4 * GB - ctx->biosmem, (uint64_t)(ctx->baseaddr + 4 * GB - ctx->biosmem),
+		PROT_ALL) < 0))
+		goto err;
+	if ((ctx->highmem > 0) && (vm_map_memseg_vma(ctx, ctx->highmem,
+		ctx->highmem_gpa_base, (uint64_t)(ctx->baseaddr + ctx->highmem_gpa_base),
+		PROT_ALL) < 0))
+		goto err;
+
+	pr_notice("memfd: guest memory set up\n");
+	return 0;
+
+err:
+	if (ptr) {
+		munmap(ptr, total_size);
+		ptr = NULL;
+	}
+	total_size = 0;
+	if (memfd_fd >= 0) {
+		close(memfd_fd);
+		memfd_fd = -1;
+	}
+	return -ENOMEM;
 }
 
 int hugetlb_setup_memory(struct vmctx *ctx)
@@ -608,6 +1278,10 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	int fd;
 	unsigned int seal_flag = F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL;
 	size_t mem_size_level;
+	struct timespec start;
+
+	if (memfd_backend)
+		return memfd_setup_memory(ctx);
 
 	mem_idx = 0;
 	memset(&mmap_mem_regions, 0, sizeof(mmap_mem_regions));
@@ -687,14 +1361,23 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 		}
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (use_hugepool && !hugetlb_lease_pool())
+		pr_warn("hugetlb: fall back to reserving hugepages from system\n");
+
 	lock_acrn_hugetlb();
 
 	/* it will check each level memory need */
-	has_gap = hugetlb_check_memgap();
-	if (has_gap) {
-		if (!hugetlb_reserve_pages())
+	if (hugepool_sock < 0) {
+		if (!hugetlb_reserve_node_pages(ctx))
 			goto err_lock;
+		has_gap = hugetlb_check_memgap();
+		if (has_gap) {
+			if (!hugetlb_reserve_pages())
+				goto err_lock;
+		}
 	}
+	pr_notice("hugetlb: reserving pages took %lu ms\n", elapsed_ms(&start));
 
 	/* align up total size with huge page size for vma alignment */
 	for (level = hugetlb_lv_max - 1; level >= HUGETLB_LV1; level--) {
@@ -734,6 +1417,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 	}
 	pr_info("mmap ptr 0x%p -> baseaddr 0x%p\n", ptr, ctx->baseaddr);
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	/* mmap lowmem */
 	if (mmap_hugetlbfs(ctx, 0, get_lowmem_param, adj_lowmem_param, NULL) < 0) {
 		pr_err("lowmem mmap failed");
@@ -760,12 +1444,20 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 		pr_err("fbmem mmap failed");
 		goto err_lock;
 	}
+	pr_notice("hugetlb: mapping memory took %lu ms\n", elapsed_ms(&start));
+
+	if (mem_prefault_threads > 0 && hugepool_sock < 0) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (hugetlb_prefault_memory() < 0)
+			goto err_lock;
+		pr_notice("hugetlb: prefaulting memory took %lu ms\n", elapsed_ms(&start));
+	}
 
 	/* resize the memfd to meet with the size requirement and add the
-	 * F_SEAL_SEAL flag
+	 * F_SEAL_SEAL flag, the pool memfds are sealed by acrn_hugepool.
 	 */
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
-		if (hugetlb_priv[level].fd > 0) {
+		if (hugetlb_priv[level].fd > 0 && hugepool_sock < 0) {
 			mem_size_level = hugetlb_priv[level].lowmem +
 					 hugetlb_priv[level].highmem +
 					 hugetlb_priv[level].biosmem +
@@ -798,6 +1490,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 			hugetlb_priv[level].highmem);
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &start);
 	/* map ept for lowmem */
 	if (vm_map_memseg_vma(ctx, ctx->lowmem, 0,
 		(uint64_t)ctx->baseaddr, PROT_ALL) < 0)
@@ -823,6 +1516,7 @@ int hugetlb_setup_memory(struct vmctx *ctx)
 			PROT_ALL) < 0)
 			goto err;
 	}
+	pr_notice("hugetlb: mapping EPT took %lu ms\n", elapsed_ms(&start));
 
 	return 0;
 
@@ -853,6 +1547,11 @@ void hugetlb_unsetup_memory(struct vmctx *ctx)
 	for (level = HUGETLB_LV1; level < hugetlb_lv_max; level++) {
 		close_hugetlbfs(level);
 	}
+
+	if (memfd_fd >= 0) {
+		close(memfd_fd);
+		memfd_fd = -1;
+	}
 }
 
 bool
@@ -883,10 +1582,201 @@ vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 	return ret;
 }
 
+static struct vm_mmap_mem_region *
+find_mmap_region(vm_paddr_t gpa, size_t len)
+{
+	int i;
+
+	for (i = 0; i < mem_idx; i++) {
+		if ((gpa >= mmap_mem_regions[i].gpa_start) &&
+			(gpa + len <= mmap_mem_regions[i].gpa_end))
+			return &mmap_mem_regions[i];
+	}
+
+	return NULL;
+}
+
+#define DISCARD_NOTIFIERS_MAX	4
+
+/*
+ * The users keeping references of the guest pages apart from the mappings,
+ * e.g. the dmabufs of virtio-gpu, drop them when the pages are discarded, or
+ * the pages wouldn't be freed.
+ */
+static struct {
+	vm_discard_notifier_t fn;
+	void *arg;
+} discard_notifiers[DISCARD_NOTIFIERS_MAX];
+static pthread_mutex_t discard_notifier_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+int
+vm_add_discard_notifier(vm_discard_notifier_t fn, void *arg)
+{
+	int i, ret = -ENOSPC;
+
+	pthread_mutex_lock(&discard_notifier_mtx);
+	for (i = 0; i < DISCARD_NOTIFIERS_MAX; i++) {
+		if (discard_notifiers[i].fn == NULL) {
+			discard_notifiers[i].fn = fn;
+			discard_notifiers[i].arg = arg;
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&discard_notifier_mtx);
+
+	return ret;
+}
+
+void
+vm_remove_discard_notifier(vm_discard_notifier_t fn, void *arg)
+{
+	int i;
+
+	pthread_mutex_lock(&discard_notifier_mtx);
+	for (i = 0; i < DISCARD_NOTIFIERS_MAX; i++) {
+		if ((discard_notifiers[i].fn == fn) && (discard_notifiers[i].arg == arg)) {
+			discard_notifiers[i].fn = NULL;
+			discard_notifiers[i].arg = NULL;
+		}
+	}
+	pthread_mutex_unlock(&discard_notifier_mtx);
+}
+
+/* tell the users that the memfd range [offset, offset + len) of fd goes away */
+void
+vm_notify_discard(int fd, uint64_t offset, size_t len)
+{
+	int i;
+
+	pthread_mutex_lock(&discard_notifier_mtx);
+	for (i = 0; i < DISCARD_NOTIFIERS_MAX; i++) {
+		if (discard_notifiers[i].fn)
+			discard_notifiers[i].fn(discard_notifiers[i].arg, fd, offset, len);
+	}
+	pthread_mutex_unlock(&discard_notifier_mtx);
+}
+
+/*
+ * Give the guest memory [gpa, gpa + len) back to the host: remove it from
+ * the EPT, so the guest can't reach the pages any more, drop the HSM pins and
+ * punch it out of the hugetlbfs file. The range must be within one mapping
+ * and aligned to its hugepage size, -ENOTSUP is returned for a range which
+ * can't be discarded as a whole, e.g. a part of a 1G page.
+ *
+ * HSM keeps the guest memory pinned till the VM is destroyed, unless it
+ * supports ACRN_IOCTL_UNPIN_MEMSEG and --experimental_unpin is given, see
+ * vm_can_unpin_memory(). Without it, punching the pages would free
+ * nothing and mapping them again would pin new pages on top, so -ENOTSUP is
+ * returned and the memory stays with the guest.
+ *
+ * The discard notifiers are called before the pages are punched out.
+ */
+int
+vm_discard_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	struct vm_mmap_mem_region *region;
+	uint64_t offset;
+
+	if (!vm_can_unpin_memory(ctx))
+		return -ENOTSUP;
+
+	region = find_mmap_region(gpa, len);
+	if (region == NULL)
+		return -EINVAL;
+	if ((gpa | len) & (region->pg_size - 1))
+		return -ENOTSUP;
+
+	if (vm_unpin_memseg_vma(ctx, len, gpa, (uint64_t)(ctx->baseaddr + gpa), PROT_ALL) < 0) {
+		pr_err("ACRN_IOCTL_UNPIN_MEMSEG ioctl() returned an error: %s\n", errormsg(errno));
+		return -EFAULT;
+	}
+
+	offset = gpa - region->gpa_start + region->fd_offset;
+	vm_notify_discard(region->fd, offset, len);
+	if (fallocate(region->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			offset, len) < 0) {
+		/* the memory is still there, hand it back to the guest */
+		pr_err("%s: failed to punch 0x%lx@0x%lx: %s\n", __func__,
+			len, gpa, strerror(errno));
+		vm_map_memseg_vma(ctx, len, gpa, (uint64_t)(ctx->baseaddr + gpa), PROT_ALL);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Get back the memory discarded by vm_discard_memory() and map it to the
+ * guest again, which pins it again in HSM. The hugepages are faulted in
+ * first, so running out of them is an error rather than a SIGBUS.
+ */
+int
+vm_populate_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len)
+{
+	if (find_mmap_region(gpa, len) == NULL)
+		return -EINVAL;
+
+	if (madvise(ctx->baseaddr + gpa, len, MADV_POPULATE_WRITE) < 0) {
+		pr_err("%s: failed to populate 0x%lx@0x%lx: %s\n", __func__,
+			len, gpa, strerror(errno));
+		return -ENOMEM;
+	}
+
+	if (vm_map_memseg_vma(ctx, len, gpa, (uint64_t)(ctx->baseaddr + gpa), PROT_ALL) < 0)
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Sum up the smaps of the guest memory mappings, to see how much of it is
+ * faulted in and backed by THP. Only this DM maps the guest memory, so
+ * there is nothing shared to report.
+ */
+int
+vm_get_mem_stats(struct vmctx *ctx, struct vm_mem_stats *stats)
+{
+	char line[256];
+	unsigned long start, end, kb;
+	bool guest = false;
+	FILE *fp;
+
+	memset(stats, 0, sizeof(*stats));
+	if (ptr == NULL)
+		return -EINVAL;
+
+	fp = fopen("/proc/self/smaps", "r");
+	if (fp == NULL)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+			guest = (start >= (unsigned long)ptr) &&
+				(end <= (unsigned long)ptr + total_size);
+			continue;
+		}
+		if (!guest)
+			continue;
+
+		if (sscanf(line, "Rss: %lu kB", &kb) == 1)
+			stats->rss_kb += kb;
+		else if ((sscanf(line, "AnonHugePages: %lu kB", &kb) == 1) ||
+			(sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1))
+			stats->thp_kb += kb;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
 bool vm_allow_dmabuf(struct vmctx *ctx)
 {
 	uint32_t mem_flags;
 
+	if (memfd_backend)
+		return true;
+
 	mem_flags = 0;
 	if (ctx->highmem) {
 		/* Check the highmem is used by HUGETLB_LV1/HUGETLB_LV2 */
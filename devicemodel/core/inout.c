@@ -30,6 +30,7 @@
 #include <string.h>
 
 #include "inout.h"
+#include "exit_stats.h"
 #include "log.h"
 SET_DECLARE(inout_port_set, struct inout_port);
 
@@ -40,6 +41,7 @@ SET_DECLARE(inout_port_set, struct inout_port);
 
 static struct {
 	const char	*name;
+	int		base;
 	int		flags;
 	inout_func_t	handler;
 	void		*arg;
@@ -92,6 +94,7 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *pio_reques
 	int bytes, flags, in, port;
 	inout_func_t handler;
 	void *arg;
+	uint64_t start;
 	int retval;
 
 	bytes = pio_request->size;
@@ -113,8 +116,13 @@ emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *pio_reques
 		if (!(flags & IOPORT_F_OUT))
 			return -1;
 	}
+	start = exit_stats_begin();
 	retval = handler(ctx, *pvcpu, in, port, bytes,
 		(uint32_t *)&(pio_request->value), arg);
+	if (start)
+		exit_stats_account(EXIT_STATS_PIO, inout_handlers[port].name,
+			inout_handlers[port].base, port - inout_handlers[port].base,
+			!in, start);
 	return retval;
 }
 
@@ -169,6 +177,7 @@ register_inout(struct inout_port *iop)
 
 	for (i = iop->port; i < iop->port + iop->size; i++) {
 		inout_handlers[i].name = iop->name;
+		inout_handlers[i].base = iop->port;
 		inout_handlers[i].flags = iop->flags;
 		inout_handlers[i].handler = iop->handler;
 		inout_handlers[i].arg = iop->arg;
@@ -18,6 +18,7 @@
 #include "iothread.h"
 #include "log.h"
 #include "mevent.h"
+#include "numa.h"
 
 
 #define MEVENT_MAX 64
@@ -36,6 +37,8 @@ io_thread(void *arg)
 	struct iothread_mevent *aevp;
 	int i, n;
 
+	numa_bind_io_thread();
+
 	while(ioctx.started) {
 		n = epoll_wait(ioctx.epfd, eventlist, MEVENT_MAX, -1);
 		if (n < 0) {
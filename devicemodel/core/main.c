@@ -71,6 +71,10 @@
 #include "cmd_monitor.h"
 #include "vdisplay.h"
 #include "iothread.h"
+#include "posted_write.h"
+#include "numa.h"
+#include "snapshot.h"
+#include "timer.h"
 
 #define	VM_MAXCPU		16	/* maximum virtual cpus */
 
@@ -101,6 +105,10 @@ bool vtpm2;
 bool is_winvm;
 bool skip_pci_mem64bar_workaround = false;
 bool gfx_ui = false;
+uint32_t ioreq_poll_time;
+uint32_t mem_prefault_threads;
+bool use_hugepool;
+bool experimental_unpin;
 
 static int guest_ncpus;
 static int virtio_msix = 1;
@@ -139,6 +147,16 @@ struct mt_vmm_info {
 
 static struct vmctx *_ctx;
 
+/* start of the current DM start-up phase, to log its wall time */
+static struct timespec phase_start;
+
+static void
+phase_done(const char *phase)
+{
+	pr_notice("%s took %lu ms\n", phase, elapsed_ms(&phase_start));
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
+}
+
 static void
 usage(int code)
 {
@@ -153,7 +171,11 @@ usage(int code)
 		"       %*s [--vtpm2 sock_path] [--virtio_poll interval]\n"
 		"       %*s [--cpu_affinity lapic_id] [--lapic_pt] [--rtvm] [--windows]\n"
 		"       %*s [--debugexit] [--logger_setting param_setting]\n"
-		"       %*s [--ssram] <vm>\n"
+		"       %*s [--ssram] [--posted_write] [--ioreq_poll time]\n"
+		"       %*s [--mem_prefault threads] [--hugepool]\n"
+		"       %*s [--mem_backend hugetlb|memfd] [--experimental_unpin]\n"
+		"       %*s [--numa cpus=vcpu_list,mem=size[,host=node]]\n"
+		"       %*s [--restore snapshot_file] <vm>\n"
 		"       -B: bootargs for kernel\n"
 		"       -E: elf image path\n"
 		"       -h: help\n"
@@ -183,12 +205,33 @@ usage(int code)
 		"       --logger_setting: params like console,level=4;kmsg,level=3\n"
 		"       --windows: support Oracle virtio-blk, virtio-net and virtio-input devices\n"
 		"            for windows guest with secure boot\n"
-		"       --virtio_msi: force virtio to use single-vector MSI\n",
+		"       --virtio_msi: force virtio to use single-vector MSI\n"
+		"       --posted_write: emulate writes to the posted write ranges asynchronously,\n"
+		"            needs HSM support\n"
+		"       --ioreq_poll: busy poll the I/O requests for at most time (us) before\n"
+		"            waiting for the notification, needs HSM support, bypasses ioeventfd\n"
+		"            and is not supported with vhost devices\n"
+		"       --mem_prefault: fault in and clear the guest memory with threads workers\n"
+		"            before the VM starts, each worker runs on the node of its memory\n"
+		"       --hugepool: lease the guest memory from acrn_hugepool\n"
+		"       --mem_backend: back the guest memory with hugetlbfs (default), or with\n"
+		"            a memfd using transparent hugepages\n"
+		"       --experimental_unpin: let virtio-balloon and virtio-mem give the guest\n"
+		"            memory back with ACRN_IOCTL_UNPIN_MEMSEG, an HSM ioctl which isn't\n"
+		"            upstream yet, so its number may change; needs a patched HSM\n"
+		"       --numa: add a guest NUMA node with the vCPUs in vcpu_list (e.g. 0-3:6),\n"
+		"            size of memory, and the host node backing it; repeat it for each node,\n"
+		"            the nodes have to cover all the vCPUs and memory\n"
+		"       --restore: start the VM from a snapshot saved with acrnctl snapshot,\n"
+		"            the VM must be launched with the same devices and memory\n",
 		progname, (int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
+		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
 		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "",
-		(int)strnlen(progname, PATH_MAX), "", (int)strnlen(progname, PATH_MAX), "");
+		(int)strnlen(progname, PATH_MAX), "");
 
 	exit(code);
 }
@@ -397,19 +440,8 @@ static vmexit_handler_t handler[VM_EXITCODE_MAX] = {
 };
 
 static void
-handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
+vm_ioreq_done(struct vmctx *ctx, int vcpu)
 {
-	enum vm_exitcode exitcode;
-
-	exitcode = io_req->type;
-	if (exitcode >= VM_EXITCODE_MAX || handler[exitcode] == NULL) {
-		pr_err("handle vmexit: unexpected exitcode 0x%x\n",
-				exitcode);
-		exit(1);
-	}
-
-	(*handler[exitcode])(ctx, io_req, &vcpu);
-
 	/* We cannot notify the HSM/hypervisor on the request completion at this
 	 * point if the User VM is in suspend or system reset mode, as the VM is
 	 * still not paused and a notification can kick off the vcpu to run
@@ -424,6 +456,23 @@ handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
 	vm_notify_request_done(ctx, vcpu);
 }
 
+static void
+handle_vmexit(struct vmctx *ctx, struct acrn_io_request *io_req, int vcpu)
+{
+	enum vm_exitcode exitcode;
+
+	exitcode = io_req->type;
+	if (exitcode >= VM_EXITCODE_MAX || handler[exitcode] == NULL) {
+		pr_err("handle vmexit: unexpected exitcode 0x%x\n",
+				exitcode);
+		exit(1);
+	}
+
+	(*handler[exitcode])(ctx, io_req, &vcpu);
+
+	vm_ioreq_done(ctx, vcpu);
+}
+
 static int
 guest_pm_notify_init(struct vmctx *ctx)
 {
@@ -466,6 +515,7 @@ vm_init_vdevs(struct vmctx *ctx)
 {
 	int ret;
 
+	prepare_vtpm2();
 	init_mem();
 	init_inout();
 	pci_irq_init(ctx);
@@ -538,6 +588,7 @@ pm_notify_fail:
 	atkbdc_deinit(ctx);
 	pci_irq_deinit(ctx);
 	ioapic_deinit();
+	deinit_vtpm2(ctx);
 	return -1;
 }
 
@@ -631,7 +682,7 @@ vm_system_reset(struct vmctx *ctx)
 	 * If we get system reset request, we don't want to exit the
 	 * vcpu_loop/vm_loop/mevent_loop. So we do:
 	 *   1. pause VM
-	 *   2. flush and clear ioreqs
+	 *   2. flush posted writes, flush and clear ioreqs
 	 *   3. reset virtual devices
 	 *   4. load software for User VM
 	 *   5. hypercall reset vm
@@ -655,6 +706,7 @@ vm_system_reset(struct vmctx *ctx)
 	 * to clear all ioreq status in HSM after VM pause, then let VM
 	 * reset in hypervisor reset all ioreqs.
 	 */
+	posted_write_drain();
 	vm_clear_ioreq(ctx);
 
 	vm_reset_vdevs(ctx);
@@ -683,6 +735,7 @@ vm_suspend_resume(struct vmctx *ctx)
 	 */
 	vm_pause(ctx);
 
+	posted_write_drain();
 	vm_clear_ioreq(ctx);
 	vm_stop_watchdog(ctx);
 	wait_for_resume(ctx);
@@ -696,6 +749,120 @@ vm_suspend_resume(struct vmctx *ctx)
 	vm_run(ctx);
 }
 
+#define CONF1_ADDR_PORT	0x0cf8
+#define CONF1_DATA_PORT	0x0cfc
+
+/*
+ * HSM owns the PCI configuration address latch and converts the accesses to
+ * the data port into ACRN_IOREQ_TYPE_PCICFG requests. The hypervisor always
+ * injects the upcall for these requests, leave them to HSM in polling mode.
+ */
+static bool
+vm_ioreq_is_pci_cfg(struct acrn_io_request *io_req)
+{
+	struct acrn_pio_request *pio_req = &io_req->reqs.pio_request;
+
+	return (io_req->type == ACRN_IOREQ_TYPE_PORTIO) &&
+		((pio_req->address == CONF1_ADDR_PORT) ||
+		 ((pio_req->address >= CONF1_DATA_PORT) && (pio_req->address < CONF1_DATA_PORT + 4)));
+}
+
+/*
+ * Handle the ioreqs dispatched to the DM.
+ *
+ * With claim_pending, also take the pending requests which no upcall was
+ * injected for as the DM is polling. The PCI config port requests are left
+ * pending for HSM, which dispatches them as PROCESSING PCICFG requests.
+ *
+ * Return the number of requests handled.
+ */
+static int
+vm_handle_ioreqs(struct vmctx *ctx, bool claim_pending)
+{
+	struct acrn_io_request *io_req;
+	uint32_t state;
+	int vcpu_id, count = 0;
+
+	/* Posted writes are emulated before the blocking ioreqs */
+	posted_write_hold();
+	for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
+		io_req = &ioreq_buf[vcpu_id];
+		state = atomic_load(&io_req->processed);
+		if ((state == ACRN_IOREQ_STATE_PROCESSING) && !io_req->kernel_handled) {
+			posted_write_wake(io_req);
+			handle_vmexit(ctx, io_req, vcpu_id);
+			count++;
+		} else if (claim_pending && (state == ACRN_IOREQ_STATE_PENDING) &&
+			!vm_ioreq_is_pci_cfg(io_req) &&
+			atomic_cmpxchg(&io_req->processed, &state, ACRN_IOREQ_STATE_PROCESSING)) {
+			posted_write_wake(io_req);
+			handle_vmexit(ctx, io_req, vcpu_id);
+			count++;
+		}
+	}
+	posted_write_release();
+
+	return count;
+}
+
+/*
+ * Spin on the ioreq slots for at most ioreq_poll_time us.
+ *
+ * Return true if any request was handled.
+ */
+static bool
+vm_poll_ioreqs(struct vmctx *ctx)
+{
+	struct timespec start, now;
+	uint64_t elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		if (vm_handle_ioreqs(ctx, true) > 0)
+			return true;
+
+		__builtin_ia32_pause();
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000000000UL + now.tv_nsec - start.tv_nsec;
+	} while (elapsed < ioreq_poll_time * 1000UL);
+
+	return false;
+}
+
+/*
+ * Wait for the next ioreqs and handle them.
+ *
+ * In polling mode, spin on the ioreq slots for a while before blocking in
+ * HSM. The hypervisor doesn't inject the upcall for the new requests while the
+ * DM is polling, so the polling is stopped before blocking and the slots are
+ * scanned once more to catch the requests issued in between.
+ */
+static int
+vm_wait_ioreqs(struct vmctx *ctx)
+{
+	int error;
+
+	if (ioreq_poll_time > 0) {
+		if (vm_poll_ioreqs(ctx))
+			return 0;
+
+		vm_set_ioreq_client_polling(ctx, false);
+		if (vm_handle_ioreqs(ctx, true) > 0) {
+			vm_set_ioreq_client_polling(ctx, true);
+			return 0;
+		}
+	}
+
+	error = vm_attach_ioreq_client(ctx);
+	if (!error)
+		vm_handle_ioreqs(ctx, false);
+
+	if (ioreq_poll_time > 0)
+		vm_set_ioreq_client_polling(ctx, true);
+
+	return error;
+}
+
 static void
 vm_loop(struct vmctx *ctx)
 {
@@ -707,26 +874,21 @@ vm_loop(struct vmctx *ctx)
 		return;
 	}
 
+	if (ioreq_poll_time && vm_set_ioreq_client_polling(ctx, true)) {
+		pr_warn("%s, ioreq polling is disabled.\n", __func__);
+		ioreq_poll_time = 0;
+	}
+
 	if (vm_run(ctx) != 0) {
 		pr_err("%s, failed to run VM.\n", __func__);
 		return;
 	}
 
 	while (1) {
-		int vcpu_id;
-		struct acrn_io_request *io_req;
-
-		error = vm_attach_ioreq_client(ctx);
+		error = vm_wait_ioreqs(ctx);
 		if (error)
 			break;
 
-		for (vcpu_id = 0; vcpu_id < guest_ncpus; vcpu_id++) {
-			io_req = &ioreq_buf[vcpu_id];
-			if ((atomic_load(&io_req->processed) == ACRN_IOREQ_STATE_PROCESSING)
-				&& !io_req->kernel_handled)
-				handle_vmexit(ctx, io_req, vcpu_id);
-		}
-
 		if (VM_SUSPEND_FULL_RESET == vm_get_suspend_mode() ||
 		    VM_SUSPEND_POWEROFF == vm_get_suspend_mode()) {
 			break;
@@ -787,6 +949,14 @@ enum {
 	CMD_OPT_PM_BY_VUART,
 	CMD_OPT_WINDOWS,
 	CMD_OPT_FORCE_VIRTIO_MSI,
+	CMD_OPT_POSTED_WRITE,
+	CMD_OPT_IOREQ_POLL,
+	CMD_OPT_MEM_PREFAULT,
+	CMD_OPT_HUGEPOOL,
+	CMD_OPT_NUMA,
+	CMD_OPT_RESTORE,
+	CMD_OPT_MEM_BACKEND,
+	CMD_OPT_EXPERIMENTAL_UNPIN,
 };
 
 static struct option long_options[] = {
@@ -830,6 +1000,14 @@ static struct option long_options[] = {
 	{"pm_by_vuart",	required_argument,	0, CMD_OPT_PM_BY_VUART},
 	{"windows",		no_argument,		0, CMD_OPT_WINDOWS},
 	{"virtio_msi",		no_argument,		0, CMD_OPT_FORCE_VIRTIO_MSI},
+	{"posted_write",	no_argument,		0, CMD_OPT_POSTED_WRITE},
+	{"ioreq_poll",		required_argument,	0, CMD_OPT_IOREQ_POLL},
+	{"mem_prefault",	required_argument,	0, CMD_OPT_MEM_PREFAULT},
+	{"hugepool",		no_argument,		0, CMD_OPT_HUGEPOOL},
+	{"numa",		required_argument,	0, CMD_OPT_NUMA},
+	{"restore",		required_argument,	0, CMD_OPT_RESTORE},
+	{"mem_backend",		required_argument,	0, CMD_OPT_MEM_BACKEND},
+	{"experimental_unpin",	no_argument,		0, CMD_OPT_EXPERIMENTAL_UNPIN},
 	{0,			0,			0,  0  },
 };
 
@@ -860,6 +1038,7 @@ main(int argc, char *argv[])
 	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 		fprintf(stderr, "cannot register handler for SIGPIPE\n");
 
+	clock_gettime(CLOCK_MONOTONIC, &phase_start);
 	if (parse_madt()) {
 		pr_err("Failed to parse the MADT table\n");
 		exit(1);
@@ -1023,6 +1202,37 @@ main(int argc, char *argv[])
 		case CMD_OPT_FORCE_VIRTIO_MSI:
 			virtio_msix = 0;
 			break;
+		case CMD_OPT_POSTED_WRITE:
+			posted_write = true;
+			break;
+		case CMD_OPT_IOREQ_POLL:
+			if (dm_strtoui(optarg, NULL, 10, &ioreq_poll_time) != 0 ||
+				ioreq_poll_time > 1000000)
+				errx(EX_USAGE, "invalid ioreq poll time %s", optarg);
+			break;
+		case CMD_OPT_MEM_PREFAULT:
+			if (dm_strtoui(optarg, NULL, 10, &mem_prefault_threads) != 0 ||
+				mem_prefault_threads == 0 || mem_prefault_threads > 256)
+				errx(EX_USAGE, "invalid mem prefault threads %s", optarg);
+			break;
+		case CMD_OPT_HUGEPOOL:
+			use_hugepool = true;
+			break;
+		case CMD_OPT_NUMA:
+			if (acrn_parse_numa(optarg) != 0)
+				errx(EX_USAGE, "invalid numa param %s", optarg);
+			break;
+		case CMD_OPT_RESTORE:
+			if (acrn_parse_restore(optarg) != 0)
+				errx(EX_USAGE, "invalid restore file %s", optarg);
+			break;
+		case CMD_OPT_MEM_BACKEND:
+			if (acrn_parse_mem_backend(optarg) != 0)
+				errx(EX_USAGE, "invalid mem_backend %s", optarg);
+			break;
+		case CMD_OPT_EXPERIMENTAL_UNPIN:
+			experimental_unpin = true;
+			break;
 		case 'h':
 			usage(0);
 		default:
@@ -1054,12 +1264,28 @@ main(int argc, char *argv[])
 		lapic_pt = false;
 		pr_warn("Only a Realtime VM can use local APIC pass through, '--lapic_pt' is invalid here.\n");
 	}
+
+	/*
+	 * The memory leased from acrn_hugepool is already faulted in, on any
+	 * host node, so it can't be bound to the host nodes of the guest.
+	 */
+	if (use_hugepool && numa_is_bound()) {
+		pr_err("'--hugepool' can't be used with '--numa ...,host=<node>'.\n");
+		exit(1);
+	}
+
+	/* acrn_hugepool only lends hugetlbfs memory */
+	if (use_hugepool && vm_is_memfd_backend()) {
+		pr_err("'--hugepool' can't be used with '--mem_backend memfd'.\n");
+		exit(1);
+	}
 	vmname = argv[0];
 
 	if (strnlen(vmname, MAX_VM_NAME_LEN) >= MAX_VM_NAME_LEN) {
 		pr_err("The name of the VM exceeds the maximum length: %u\n", MAX_VM_NAME_LEN - 1);
 		exit(1);
 	}
+	phase_done("option parsing");
 
 	if (!init_hugetlb()) {
 		pr_err("init_hugetlb failed\n");
@@ -1074,6 +1300,7 @@ main(int argc, char *argv[])
 	}
 
 	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &phase_start);
 		pr_notice("vm_create: %s\n", vmname);
 		ctx = vm_create(vmname, (unsigned long)ioreq_buf, &guest_ncpus);
 		if (!ctx) {
@@ -1093,12 +1320,25 @@ main(int argc, char *argv[])
 			goto fail;
 		}
 
+		/*
+		 * Probe the HSM support of ioreq polling before the devices
+		 * are initialized, polling mode bypasses ioeventfd and vhost.
+		 */
+		if (ioreq_poll_time && vm_set_ioreq_client_polling(ctx, false)) {
+			pr_warn("HSM doesn't support ioreq polling, it is disabled\n");
+			ioreq_poll_time = 0;
+		}
+
+		if (numa_setup(ctx, memsize, guest_ncpus) < 0)
+			goto fail;
+
 		pr_notice("vm_setup_memory: size=0x%lx\n", memsize);
 		error = vm_setup_memory(ctx, memsize);
 		if (error) {
 			pr_err("Unable to setup memory (%d)\n", errno);
 			goto fail;
 		}
+		phase_done("memory setup");
 
 		error = mevent_init();
 		if (error) {
@@ -1112,11 +1352,15 @@ main(int argc, char *argv[])
 			goto iothread_fail;
 		}
 
+		if (posted_write && posted_write_init(ctx) < 0)
+			pr_warn("posted write is disabled\n");
+
 		pr_notice("vm_init_vdevs\n");
 		if (vm_init_vdevs(ctx) < 0) {
 			pr_err("Unable to init vdev (%d)\n", errno);
 			goto dev_fail;
 		}
+		phase_done("device init");
 
 		/*
 		 * build the guest tables, MP etc.
@@ -1133,6 +1377,7 @@ main(int argc, char *argv[])
 			pr_err("acpi_build failed, error=%d\n", error);
 			goto vm_fail;
 		}
+		phase_done("ACPI build");
 
 		pr_notice("acrn_sw_load\n");
 		error = acrn_sw_load(ctx);
@@ -1140,6 +1385,17 @@ main(int argc, char *argv[])
 			pr_err("acrn_sw_load failed, error=%d\n", error);
 			goto vm_fail;
 		}
+		phase_done("image load");
+
+		if (snapshot_restoring()) {
+			pr_notice("vm_restore\n");
+			error = vm_restore(ctx);
+			if (error) {
+				pr_err("vm_restore failed, error=%d\n", error);
+				goto vm_fail;
+			}
+			phase_done("restore");
+		}
 
 		/*
 		 * Change the proc title to include the VM name.
@@ -1166,6 +1422,7 @@ main(int argc, char *argv[])
 
 		vm_pause(ctx);
 		delete_cpu(ctx, BSP);
+		posted_write_deinit(ctx);
 
 		if (vm_get_suspend_mode() != VM_SUSPEND_FULL_RESET){
 			ret = 0;
@@ -1189,6 +1446,7 @@ vm_fail:
 		clean_vssram_configs();
 
 dev_fail:
+	posted_write_deinit(ctx);
 	iothread_deinit();
 iothread_fail:
 	mevent_deinit();
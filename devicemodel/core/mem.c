@@ -40,6 +40,7 @@
 
 #include "mem.h"
 #include "tree.h"
+#include "exit_stats.h"
 
 #define MEMNAMESZ (80)
 
@@ -155,6 +156,9 @@ emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 	uint64_t paddr = mmio_req->address;
 	int size = mmio_req->size;
 	struct mmio_rb_range *hint, *entry = NULL;
+	struct mem_range mr;
+	char name[EXIT_STATS_NAME_LEN];
+	uint64_t start;
 	int err;
 
 	pthread_rwlock_rdlock(&mmio_rwlock);
@@ -174,18 +178,29 @@ emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
 		return -ESRCH;
 	}
 
-	pthread_rwlock_unlock(&mmio_rwlock);
-
-	if (entry == NULL)
+	if (entry == NULL) {
+		pthread_rwlock_unlock(&mmio_rwlock);
 		return -EINVAL;
+	}
+
+	/* the entry may be unregistered and freed once the lock is dropped */
+	mr = entry->mr_param;
+	start = exit_stats_begin();
+	if (start)
+		snprintf(name, sizeof(name), "%s", mr.name ? mr.name : "unknown");
+	pthread_rwlock_unlock(&mmio_rwlock);
 
 	if (mmio_req->direction == ACRN_IOREQ_DIR_READ)
 		err = mem_read(ctx, 0, paddr, (uint64_t *)&mmio_req->value,
-				size, &entry->mr_param);
+				size, &mr);
 	else
 		err = mem_write(ctx, 0, paddr, mmio_req->value,
-				size, &entry->mr_param);
+				size, &mr);
 
+	if (start)
+		exit_stats_account(EXIT_STATS_MMIO, name, mr.base,
+			paddr - mr.base,
+			mmio_req->direction != ACRN_IOREQ_DIR_READ, start);
 	return err;
 }
 
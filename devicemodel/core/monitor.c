@@ -450,6 +450,28 @@ static void handle_blkrescan(struct mngr_msg *msg, int client_fd, void *param)
 	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
 }
 
+static void handle_snapshot(struct mngr_msg *msg, int client_fd, void *param)
+{
+	struct mngr_msg ack;
+	struct vm_ops *ops;
+	int ret = -1;
+
+	ack.magic = MNGR_MSG_MAGIC;
+	ack.msgid = msg->msgid;
+	ack.timestamp = msg->timestamp;
+
+	msg->data.devargs[PARAM_LEN - 1] = '\0';
+	LIST_FOREACH(ops, &vm_ops_head, list) {
+		if (ops->ops->snapshot) {
+			ret = ops->ops->snapshot(ops->arg, msg->data.devargs);
+			break;
+		}
+	}
+
+	ack.data.err = ret;
+	mngr_send_msg(client_fd, &ack, NULL, ACK_TIMEOUT);
+}
+
 static struct monitor_vm_ops pmc_ops = {
 	.stop       = NULL,
 	.resume     = vm_monitor_resume,
@@ -457,6 +479,7 @@ static struct monitor_vm_ops pmc_ops = {
 	.pause      = NULL,
 	.unpause    = NULL,
 	.query      = vm_monitor_query,
+	.snapshot   = vm_monitor_snapshot,
 };
 
 int monitor_init(struct vmctx *ctx)
@@ -490,6 +513,7 @@ int monitor_init(struct vmctx *ctx)
 	ret += mngr_add_handler(monitor_fd, DM_RESUME, handle_resume, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_QUERY, handle_query, NULL);
 	ret += mngr_add_handler(monitor_fd, DM_BLKRESCAN, handle_blkrescan, NULL);
+	ret += mngr_add_handler(monitor_fd, DM_SNAPSHOT, handle_snapshot, NULL);
 
 	if (ret) {
 		pr_err("%s %d\r\n", __func__, __LINE__);
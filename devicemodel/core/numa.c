@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Guest NUMA topology.
+ *
+ * Each --numa option describes one guest node: its vCPUs, its memory size
+ * and optionally the host node backing it. The guest memory is handed out to
+ * the nodes in order, from the start of lowmem up to the end of highmem. The
+ * topology is reported to the guest with the SRAT and SLIT, and the memory of
+ * a node with a host node is bound to it with mbind() before it's faulted in.
+ *
+ * The PCI host bridge, so all the emulated devices, belong to the first node.
+ * The DM threads doing the device I/O are moved to the host node of it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "dm_string.h"
+#include "numa.h"
+#include "log.h"
+
+#define NUMA_LOCAL_DISTANCE	10
+#define NUMA_REMOTE_DISTANCE	20
+
+static struct numa_node numa_nodes[NUMA_MAX_NODES];
+static int nr_numa_nodes;
+
+/* vCPU list of a node, e.g. "0-3:8-11" */
+static int
+numa_parse_vcpus(char *list, uint64_t *vcpus)
+{
+	char *range, *last;
+	int first, end;
+
+	while ((range = strsep(&list, ":")) != NULL) {
+		last = strchr(range, '-');
+		if (last)
+			*last++ = '\0';
+		if (dm_strtoi(range, NULL, 10, &first) || (first < 0))
+			return -1;
+		end = first;
+		if (last && dm_strtoi(last, NULL, 10, &end))
+			return -1;
+		if ((end < first) || (end >= ACRN_PLATFORM_LAPIC_IDS_MAX))
+			return -1;
+		for (; first <= end; first++)
+			*vcpus |= 1UL << first;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse one guest node: cpus=<vCPU list>,mem=<size>[,host=<host node>]
+ */
+int
+acrn_parse_numa(char *arg)
+{
+	struct numa_node *node;
+	char *cp, *cp_opt, *key, *val;
+	int ret = -1;
+
+	if (nr_numa_nodes >= NUMA_MAX_NODES) {
+		pr_err("at most %d NUMA nodes are supported\n", NUMA_MAX_NODES);
+		return -1;
+	}
+
+	node = &numa_nodes[nr_numa_nodes];
+	memset(node, 0, sizeof(*node));
+	node->host = -1;
+
+	cp_opt = cp = strdup(arg);
+	if (!cp) {
+		pr_err("%s: strdup returns NULL\n", __func__);
+		return -1;
+	}
+
+	while ((val = strsep(&cp, ",")) != NULL) {
+		key = strsep(&val, "=");
+		if (val == NULL)
+			goto done;
+
+		if (!strcmp(key, "cpus")) {
+			if (numa_parse_vcpus(val, &node->vcpus))
+				goto done;
+		} else if (!strcmp(key, "mem")) {
+			if (vm_parse_memsize(val, &node->mem))
+				goto done;
+		} else if (!strcmp(key, "host")) {
+			if (dm_strtoi(val, NULL, 10, &node->host) ||
+				(node->host < 0) || (node->host >= NUMA_MAX_HOST_NODES))
+				goto done;
+		} else
+			goto done;
+	}
+
+	if (node->vcpus && node->mem) {
+		nr_numa_nodes++;
+		ret = 0;
+	}
+
+done:
+	free(cp_opt);
+	return ret;
+}
+
+/* if any guest node is bound to a host node */
+bool
+numa_is_bound(void)
+{
+	int i;
+
+	for (i = 0; i < nr_numa_nodes; i++) {
+		if (numa_nodes[i].host >= 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Check the guest nodes against the vCPU number and memory size of the VM,
+ * and lay out the guest physical ranges of each node.
+ */
+int
+numa_setup(struct vmctx *ctx, size_t memsize, int ncpus)
+{
+	struct numa_node *node;
+	uint64_t all_vcpus = 0;
+	size_t total = 0, lowmem, start, end;
+	int i;
+
+	if (nr_numa_nodes == 0)
+		return 0;
+
+	for (i = 0; i < nr_numa_nodes; i++) {
+		node = &numa_nodes[i];
+		if (node->vcpus & all_vcpus) {
+			pr_err("vCPUs of NUMA node %d are on other nodes\n", i);
+			return -1;
+		}
+		if (node->mem & (2 * MB - 1)) {
+			pr_err("memory of NUMA node %d isn't 2M aligned\n", i);
+			return -1;
+		}
+		all_vcpus |= node->vcpus;
+		total += node->mem;
+	}
+
+	if (all_vcpus != ((ncpus >= 64) ? ~0UL : ((1UL << ncpus) - 1))) {
+		pr_err("every vCPU of %d must be on exactly one NUMA node\n", ncpus);
+		return -1;
+	}
+	if (total != memsize) {
+		pr_err("memory of NUMA nodes 0x%lx doesn't match the VM memory 0x%lx\n",
+			total, memsize);
+		return -1;
+	}
+
+	/* the same split as vm_setup_memory() */
+	lowmem = MIN(memsize, vm_get_lowmem_limit(ctx));
+	start = 0;
+	for (i = 0; i < nr_numa_nodes; i++) {
+		node = &numa_nodes[i];
+		end = start + node->mem;
+		node->gpa[0] = node->gpa[1] = 0;
+		node->len[0] = node->len[1] = 0;
+
+		if (start < lowmem) {
+			node->gpa[0] = start;
+			node->len[0] = MIN(end, lowmem) - start;
+		}
+		if (end > lowmem) {
+			node->gpa[1] = ctx->highmem_gpa_base + MAX(start, lowmem) - lowmem;
+			node->len[1] = end - MAX(start, lowmem);
+		}
+
+		pr_info("NUMA node %d: vcpus 0x%lx host %d mem 0x%lx@0x%lx 0x%lx@0x%lx\n",
+			i, node->vcpus, node->host, node->len[0], node->gpa[0],
+			node->len[1], node->gpa[1]);
+		start = end;
+	}
+
+	return 0;
+}
+
+int
+numa_get_nr_nodes(void)
+{
+	return nr_numa_nodes;
+}
+
+const struct numa_node *
+numa_get_node(int node)
+{
+	return (node < nr_numa_nodes) ? &numa_nodes[node] : NULL;
+}
+
+/*
+ * Distance between two guest nodes, taken from the host nodes backing them.
+ */
+int
+numa_distance(int from, int to)
+{
+	char path[64], buf[256];
+	char *p, *end;
+	int host_from = numa_nodes[from].host;
+	int host_to = numa_nodes[to].host;
+	int dist = (from == to) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+	long val;
+	FILE *fp;
+	int i;
+
+	if ((host_from < 0) || (host_to < 0))
+		return dist;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/distance", host_from);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return dist;
+	p = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+
+	/* the distances to all host nodes, in node order */
+	for (i = 0; p != NULL; i++) {
+		val = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (i == host_to) {
+			/* a guest node is local to itself even if it shares the host node */
+			if (from != to && val == NUMA_LOCAL_DISTANCE)
+				val = NUMA_REMOTE_DISTANCE;
+			return (int)val;
+		}
+		p = end;
+	}
+
+	return dist;
+}
+
+/* Get the CPUs of a host NUMA node from sysfs, e.g. "0-3,8-11" */
+int
+numa_node_cpus(int host_node, cpu_set_t *cpus)
+{
+	char path[64], buf[1024];
+	char *p, *end;
+	long first, last;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", host_node);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	if (fgets(buf, sizeof(buf), fp) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	CPU_ZERO(cpus);
+	p = buf;
+	while ((*p != '\0') && (*p != '\n')) {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p)
+				return -1;
+		}
+		for (; (first <= last) && (first < CPU_SETSIZE); first++)
+			CPU_SET(first, cpus);
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/*
+ * Bind the part of a guest memory region, mapped at hva for gpa, which
+ * belongs to each node to the host node of it. It must be done before the
+ * memory is faulted in. mbind() on hugetlb mappings must be aligned to the
+ * hugepage size, so a page across two nodes goes to the later node.
+ */
+int
+numa_bind_memory(char *hva, vm_paddr_t gpa, size_t len, size_t pg_size)
+{
+	unsigned long mask[NUMA_MAX_HOST_NODES / (8 * sizeof(unsigned long)) + 1];
+	struct numa_node *node;
+	vm_paddr_t start, end;
+	int i, r;
+
+	for (i = 0; i < nr_numa_nodes; i++) {
+		node = &numa_nodes[i];
+		if (node->host < 0)
+			continue;
+
+		for (r = 0; r < 2; r++) {
+			start = MAX(gpa, node->gpa[r]);
+			end = MIN(gpa + len, node->gpa[r] + node->len[r]);
+			if (start >= end)
+				continue;
+
+			start = gpa + ALIGN_DOWN(start - gpa, pg_size);
+			end = (end == gpa + len) ? end : gpa + ALIGN_DOWN(end - gpa, pg_size);
+			if (start >= end)
+				continue;
+
+			memset(mask, 0, sizeof(mask));
+			mask[node->host / (8 * sizeof(unsigned long))] |=
+				1UL << (node->host % (8 * sizeof(unsigned long)));
+			if (syscall(SYS_mbind, hva + (start - gpa), end - start, MPOL_BIND,
+					mask, NUMA_MAX_HOST_NODES + 1, MPOL_MF_STRICT) != 0) {
+				pr_err("failed to bind 0x%lx@0x%lx to host node %d: %s\n",
+					end - start, start, node->host, strerror(errno));
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Move the calling I/O thread to the host node of the first guest node, which
+ * the emulated PCI devices belong to.
+ */
+void
+numa_bind_io_thread(void)
+{
+	cpu_set_t cpus;
+
+	if ((nr_numa_nodes == 0) || (numa_nodes[0].host < 0))
+		return;
+
+	if (numa_node_cpus(numa_nodes[0].host, &cpus) == 0)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
@@ -8,6 +8,7 @@
 #include <pthread.h>
 #include "vmmapi.h"
 #include "log.h"
+#include "snapshot.h"
 
 static pthread_cond_t suspend_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t suspend_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -45,6 +46,26 @@ vm_monitor_resume(void *arg)
 	return 0;
 }
 
+/*
+ * Save the VM to path. It's only done when the VM is suspended to RAM, and
+ * the VM is kept suspended while it's saved.
+ */
+int
+vm_monitor_snapshot(void *arg, char *path)
+{
+	struct vmctx *ctx = (struct vmctx *)arg;
+	int ret = -1;
+
+	pthread_mutex_lock(&suspend_mutex);
+	if (vm_get_suspend_mode() == VM_SUSPEND_SUSPEND)
+		ret = vm_snapshot(ctx, path);
+	else
+		pr_err("%s: VM must be suspended to RAM to be saved\n", __func__);
+	pthread_mutex_unlock(&suspend_mutex);
+
+	return ret;
+}
+
 int
 vm_monitor_query(void *arg)
 {
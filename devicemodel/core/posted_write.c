@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Posted writes
+ *
+ * Guest writes to the ranges registered here are queued by the hypervisor in
+ * a ring shared with the DM and the vCPU is resumed without waiting for the
+ * emulation, similar to coalesced MMIO. The ring is drained in order by a
+ * dedicated thread, and by the vm_loop thread before any blocking I/O request
+ * is handled, so that a posted write is always emulated before the blocking
+ * requests issued after it.
+ *
+ * The thread doesn't poll an idle ring: after PW_IDLE_POLLS empty checks, it
+ * flags the ring idle and sleeps. The hypervisor then delivers the writes to
+ * the posted ranges as blocking requests, and the first one handled by the
+ * vm_loop thread wakes it up again.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "vmmapi.h"
+#include "inout.h"
+#include "mem.h"
+#include "atomic.h"
+#include "log.h"
+#include "posted_write.h"
+
+/* Interval to check the ring when no posted write is found */
+#define PW_POLL_INTERVAL_NS	(100 * 1000)
+/* Empty checks before the ring is flagged idle, about 10ms */
+#define PW_IDLE_POLLS		100
+
+bool posted_write;
+
+static struct acrn_posted_write_buffer pw_buf __aligned(4096);
+
+static struct vmctx *pw_ctx;
+static pthread_t pw_tid;
+static bool pw_started;
+static pthread_mutex_t pw_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when the ring is no longer idle, protected by pw_mtx */
+static pthread_cond_t pw_cond = PTHREAD_COND_INITIALIZER;
+static struct acrn_posted_write_range pw_ranges[ACRN_POSTED_WRITE_RANGE_MAX];
+
+static void
+posted_write_emulate(struct acrn_posted_write *pw)
+{
+	struct acrn_pio_request pio_req;
+	struct acrn_mmio_request mmio_req;
+	int vcpu = 0;
+	int err;
+
+	if (pw->type == ACRN_IOREQ_TYPE_PORTIO) {
+		memset(&pio_req, 0, sizeof(pio_req));
+		pio_req.direction = ACRN_IOREQ_DIR_WRITE;
+		pio_req.address = pw->address;
+		pio_req.size = pw->size;
+		pio_req.value = (uint32_t)pw->value;
+		err = emulate_inout(pw_ctx, &vcpu, &pio_req);
+	} else {
+		memset(&mmio_req, 0, sizeof(mmio_req));
+		mmio_req.direction = ACRN_IOREQ_DIR_WRITE;
+		mmio_req.address = pw->address;
+		mmio_req.size = pw->size;
+		mmio_req.value = pw->value;
+		err = emulate_mem(pw_ctx, &mmio_req);
+	}
+
+	if (err)
+		pr_err("%s: unhandled posted write, type %u addr 0x%lx size %u\n",
+			__func__, pw->type, pw->address, pw->size);
+}
+
+/* pw_mtx shall be held */
+static int
+posted_write_drain_locked(void)
+{
+	struct acrn_posted_write_ring *ring = &pw_buf.ring;
+	struct acrn_posted_write pw;
+	uint32_t head, tail;
+	int count = 0;
+
+	tail = ring->tail;
+	head = atomic_load(&ring->head) & ~ACRN_POSTED_WRITE_HEAD_IDLE;
+	while ((tail != head) && (tail < ACRN_POSTED_WRITE_SLOT_MAX)) {
+		pw = ring->slot[tail];
+		tail = (tail + 1) % ACRN_POSTED_WRITE_SLOT_MAX;
+		/* Give the slot back before emulating, the write is already copied */
+		atomic_store(&ring->tail, tail);
+
+		posted_write_emulate(&pw);
+		count++;
+
+		if (tail == head)
+			head = atomic_load(&ring->head) & ~ACRN_POSTED_WRITE_HEAD_IDLE;
+	}
+
+	return count;
+}
+
+/**
+ * @brief Emulate all the posted writes queued so far
+ *
+ * @return number of posted writes emulated.
+ */
+int
+posted_write_drain(void)
+{
+	int count;
+
+	if (!pw_started)
+		return 0;
+
+	pthread_mutex_lock(&pw_mtx);
+	count = posted_write_drain_locked();
+	pthread_mutex_unlock(&pw_mtx);
+
+	return count;
+}
+
+/**
+ * @brief Drain the ring and keep posted writes from being emulated until
+ *	  posted_write_release() is called
+ *
+ * Used by the vm_loop thread around blocking I/O requests, so that they are
+ * emulated after all the posted writes queued before them.
+ */
+void
+posted_write_hold(void)
+{
+	if (!pw_started)
+		return;
+
+	pthread_mutex_lock(&pw_mtx);
+	posted_write_drain_locked();
+}
+
+void
+posted_write_release(void)
+{
+	if (!pw_started)
+		return;
+
+	pthread_mutex_unlock(&pw_mtx);
+}
+
+/* pw_mtx shall be held */
+static bool
+posted_write_is_idle(void)
+{
+	return (atomic_load(&pw_buf.ring.head) & ACRN_POSTED_WRITE_HEAD_IDLE) != 0U;
+}
+
+/*
+ * Flag the ring idle if it's empty, the hypervisor then stops queuing writes.
+ * pw_mtx shall be held.
+ */
+static bool
+posted_write_set_idle(void)
+{
+	struct acrn_posted_write_ring *ring = &pw_buf.ring;
+	uint32_t tail = ring->tail;
+
+	return atomic_cmpxchg(&ring->head, &tail, tail | ACRN_POSTED_WRITE_HEAD_IDLE);
+}
+
+/**
+ * @brief Resume draining the ring if it's idle and io_req is a write to a
+ *	  posted range, which the hypervisor delivered as a blocking request
+ *
+ * Called by the vm_loop thread between posted_write_hold() and
+ * posted_write_release().
+ */
+void
+posted_write_wake(struct acrn_io_request *io_req)
+{
+	struct acrn_posted_write_range *range;
+	uint64_t address;
+	uint32_t dir;
+	int i;
+
+	if (!pw_started || !posted_write_is_idle())
+		return;
+
+	if (io_req->type == ACRN_IOREQ_TYPE_PORTIO) {
+		dir = io_req->reqs.pio_request.direction;
+		address = io_req->reqs.pio_request.address;
+	} else if (io_req->type == ACRN_IOREQ_TYPE_MMIO) {
+		dir = io_req->reqs.mmio_request.direction;
+		address = io_req->reqs.mmio_request.address;
+	} else {
+		return;
+	}
+	if (dir != ACRN_IOREQ_DIR_WRITE)
+		return;
+
+	for (i = 0; i < ACRN_POSTED_WRITE_RANGE_MAX; i++) {
+		range = &pw_ranges[i];
+		if ((range->len != 0UL) && (range->type == io_req->type) &&
+		    (address >= range->base) && (address < range->base + range->len)) {
+			/* The hypervisor doesn't move an idle head, clear the flag */
+			atomic_and_fetch(&pw_buf.ring.head, ~ACRN_POSTED_WRITE_HEAD_IDLE);
+			pthread_cond_signal(&pw_cond);
+			break;
+		}
+	}
+}
+
+static void *
+posted_write_thread(void *arg)
+{
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = PW_POLL_INTERVAL_NS,
+	};
+	int count, polls = 0;
+
+	while (pw_started) {
+		pthread_mutex_lock(&pw_mtx);
+		count = posted_write_drain_locked();
+		if (count > 0) {
+			polls = 0;
+		} else if ((++polls >= PW_IDLE_POLLS) && posted_write_set_idle()) {
+			/* till posted_write_wake() or posted_write_deinit() */
+			while (pw_started && posted_write_is_idle())
+				pthread_cond_wait(&pw_cond, &pw_mtx);
+			polls = 0;
+		}
+		pthread_mutex_unlock(&pw_mtx);
+
+		if (count == 0)
+			nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+static int
+posted_write_set_range(uint32_t type, uint64_t base, uint64_t len, uint32_t flags)
+{
+	struct acrn_posted_write_range range;
+	int i, error;
+
+	if (!pw_started)
+		return -1;
+
+	if ((type != ACRN_IOREQ_TYPE_PORTIO) && (type != ACRN_IOREQ_TYPE_MMIO))
+		return -EINVAL;
+
+	memset(&range, 0, sizeof(range));
+	range.type = type;
+	range.flags = flags;
+	range.base = base;
+	range.len = len;
+
+	error = vm_set_posted_write_range(pw_ctx, &range);
+	if (error)
+		return error;
+
+	/* the ranges posted_write_wake() checks the blocking requests against */
+	pthread_mutex_lock(&pw_mtx);
+	for (i = 0; i < ACRN_POSTED_WRITE_RANGE_MAX; i++) {
+		if (flags & ACRN_POSTED_WRITE_FLAG_DEASSIGN) {
+			if ((pw_ranges[i].type == type) && (pw_ranges[i].base == base) &&
+			    (pw_ranges[i].len == len)) {
+				memset(&pw_ranges[i], 0, sizeof(pw_ranges[i]));
+				break;
+			}
+		} else if (pw_ranges[i].len == 0UL) {
+			pw_ranges[i] = range;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pw_mtx);
+
+	return 0;
+}
+
+/**
+ * @brief Post the guest writes to [base, base + len) instead of blocking
+ *	  the vCPU till their emulation completes
+ *
+ * Only for ranges whose writes have no side effect the guest depends on
+ * before its next access to the same device. Reads from the range are still
+ * emulated as blocking requests.
+ *
+ * @param type ACRN_IOREQ_TYPE_PORTIO or ACRN_IOREQ_TYPE_MMIO.
+ * @param base Start port or guest physical address of the range.
+ * @param len Length of the range.
+ *
+ * @return 0 on success, non-zero if posted writes are not available, the
+ *	   writes are then emulated as blocking requests.
+ */
+int
+posted_write_add_range(uint32_t type, uint64_t base, uint64_t len)
+{
+	return posted_write_set_range(type, base, len, 0U);
+}
+
+int
+posted_write_del_range(uint32_t type, uint64_t base, uint64_t len)
+{
+	int error;
+
+	error = posted_write_set_range(type, base, len,
+			ACRN_POSTED_WRITE_FLAG_DEASSIGN);
+	/* no write to the range can be queued any more, flush the queued ones */
+	if (!error)
+		posted_write_drain();
+
+	return error;
+}
+
+int
+posted_write_init(struct vmctx *ctx)
+{
+	int error;
+
+	memset(&pw_buf, 0, sizeof(pw_buf));
+	memset(pw_ranges, 0, sizeof(pw_ranges));
+	error = vm_set_posted_write_buffer(ctx, (uint64_t)&pw_buf);
+	if (error) {
+		pr_err("%s: posted write is not supported\n", __func__);
+		return -1;
+	}
+
+	pw_ctx = ctx;
+	pw_started = true;
+	error = pthread_create(&pw_tid, NULL, posted_write_thread, NULL);
+	if (error) {
+		pr_err("%s: failed to create posted write thread\n", __func__);
+		pw_started = false;
+		pw_ctx = NULL;
+		return -1;
+	}
+	pthread_setname_np(pw_tid, "posted_write");
+
+	return 0;
+}
+
+void
+posted_write_deinit(struct vmctx *ctx)
+{
+	if (!pw_started)
+		return;
+
+	pthread_mutex_lock(&pw_mtx);
+	pw_started = false;
+	pthread_cond_signal(&pw_cond);
+	pthread_mutex_unlock(&pw_mtx);
+	pthread_join(pw_tid, NULL);
+
+	/* The VM is paused, emulate whatever is left in the ring */
+	pthread_mutex_lock(&pw_mtx);
+	posted_write_drain_locked();
+	pthread_mutex_unlock(&pw_mtx);
+	pw_ctx = NULL;
+}
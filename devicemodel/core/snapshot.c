@@ -0,0 +1,411 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * VM snapshot and restore
+ *
+ * A User VM suspended to RAM (S3) can be saved to a file and started again
+ * from it later, with --restore, instead of booting. In S3 the vCPUs are
+ * stopped and the guest keeps their state in its own memory, and the guest
+ * drivers have quiesced the devices, so the snapshot only holds the guest
+ * memory and the state the DM emulates: the ACPI PM registers, the RTC CMOS
+ * and whatever the PCI devices save with their vdev_save callback. A restored
+ * VM boots the firmware which sees the wake status and goes through the S3
+ * resume path of the guest.
+ *
+ * A VM with any PCI device lacking vdev_save, passthrough devices included,
+ * can't be saved, as the device would come back without its state. The guest
+ * memory is read back in full before the VM starts, so a restore takes about
+ * as long as reading the snapshot file.
+ *
+ * File layout:
+ *   struct snapshot_header
+ *   struct snapshot_section + state, for each section
+ *   guest memory at mem_offset: lowmem, highmem, then biosmem
+ *
+ * Memory that is all zero is left as holes in the file, and skipped at
+ * restore, as the guest memory is cleared when it's allocated.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "dm.h"
+#include "vmmapi.h"
+#include "pci_core.h"
+#include "acpi.h"
+#include "rtc.h"
+#include "log.h"
+#include "snapshot.h"
+#include "timer.h"
+
+#define SNAPSHOT_MAGIC		0x50414e534e524341UL	/* "ACRNSNAP" */
+#define SNAPSHOT_VERSION	1
+/* granularity of the zero page detection, and alignment of the memory */
+#define SNAPSHOT_CHUNK		(2 * MB)
+
+struct snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t nr_sections;
+	uint64_t lowmem;
+	uint64_t highmem;
+	uint64_t biosmem;
+	uint64_t mem_offset;
+};
+
+struct snapshot_section {
+	char name[16];
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/* header of the "pci" sections, followed by the vdev_save state */
+struct snapshot_pci {
+	uint8_t bus;
+	uint8_t slot;
+	uint8_t func;
+	uint8_t reserved;
+	uint16_t vendor;
+	uint16_t device;
+};
+
+struct snapshot_file {
+	struct vmctx *ctx;
+	int fd;
+	off_t off;
+	uint32_t nr_sections;
+	char *buf;
+};
+
+static char *restore_path;
+
+int
+acrn_parse_restore(char *arg)
+{
+	restore_path = strdup(arg);
+	return (restore_path == NULL) ? -1 : 0;
+}
+
+bool
+snapshot_restoring(void)
+{
+	return restore_path != NULL;
+}
+
+static int
+snapshot_write_section(struct snapshot_file *sf, const char *name,
+		const void *data, size_t len)
+{
+	struct snapshot_section sec;
+
+	memset(&sec, 0, sizeof(sec));
+	strncpy(sec.name, name, sizeof(sec.name) - 1);
+	sec.len = len;
+
+	if ((pwrite(sf->fd, &sec, sizeof(sec), sf->off) != sizeof(sec)) ||
+		(pwrite(sf->fd, data, len, sf->off + sizeof(sec)) != len)) {
+		pr_err("%s: failed to write %s: %s\n", __func__, name, strerror(errno));
+		return -1;
+	}
+
+	sf->off += sizeof(sec) + len;
+	sf->nr_sections++;
+	return 0;
+}
+
+static int
+snapshot_save_vdev(struct pci_vdev *dev, void *arg)
+{
+	struct snapshot_file *sf = arg;
+	struct snapshot_pci *pci = (struct snapshot_pci *)sf->buf;
+	ssize_t len = 0;
+
+	pci->bus = dev->bus;
+	pci->slot = dev->slot;
+	pci->func = dev->func;
+	pci->reserved = 0;
+	pci->vendor = pci_get_cfgdata16(dev, PCIR_VENDOR);
+	pci->device = pci_get_cfgdata16(dev, PCIR_DEVICE);
+
+	if (dev->dev_ops->vdev_save == NULL) {
+		pr_err("%s: %s at %x:%x.%x doesn't support snapshots\n", __func__,
+			dev->name, dev->bus, dev->slot, dev->func);
+		return -1;
+	}
+
+	len = dev->dev_ops->vdev_save(sf->ctx, dev, pci + 1,
+			SNAPSHOT_STATE_MAX - sizeof(*pci));
+	if (len < 0) {
+		pr_err("%s: failed to save %s at %x:%x.%x\n", __func__,
+			dev->name, dev->bus, dev->slot, dev->func);
+		return -1;
+	}
+
+	return snapshot_write_section(sf, "pci", pci, sizeof(*pci) + len);
+}
+
+static bool
+is_zero_chunk(const char *p, size_t len)
+{
+	return (*(const uint64_t *)p == 0) && (memcmp(p, p + 8, len - 8) == 0);
+}
+
+static int
+snapshot_save_memory(int fd, off_t off, const char *hva, size_t len)
+{
+	size_t pos, n;
+
+	for (pos = 0; pos < len; pos += n) {
+		n = MIN(SNAPSHOT_CHUNK, len - pos);
+		if (is_zero_chunk(hva + pos, n))
+			continue;
+		if (pwrite(fd, hva + pos, n, off + pos) != n)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int
+snapshot_load_memory(int fd, off_t off, char *hva, size_t len)
+{
+	off_t data, hole;
+	ssize_t n;
+
+	/* only read the parts of the image with data */
+	for (data = lseek(fd, off, SEEK_DATA); (data >= 0) && (data < off + len);
+			data = lseek(fd, hole, SEEK_DATA)) {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -1;
+		hole = MIN(hole, off + len);
+
+		while (data < hole) {
+			n = pread(fd, hva + (data - off), hole - data, data);
+			if (n <= 0)
+				return -1;
+			data += n;
+		}
+	}
+
+	/* no more data after off is fine, the rest is all zero */
+	return ((data < 0) && (errno != ENXIO)) ? -1 : 0;
+}
+
+/*
+ * Save the suspended VM to path. The caller has to make sure the VM is
+ * suspended to RAM, so the vCPUs are paused, and isn't resumed meanwhile.
+ */
+int
+vm_snapshot(struct vmctx *ctx, const char *path)
+{
+	struct snapshot_header hdr;
+	struct snapshot_file sf;
+	struct timespec start;
+	ssize_t len;
+	int ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	memset(&sf, 0, sizeof(sf));
+	sf.ctx = ctx;
+	sf.off = sizeof(hdr);
+	sf.buf = malloc(SNAPSHOT_STATE_MAX);
+	if (sf.buf == NULL)
+		return -1;
+
+	sf.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (sf.fd < 0) {
+		pr_err("%s: failed to open %s: %s\n", __func__, path, strerror(errno));
+		goto out;
+	}
+
+	len = pm_save_state(sf.buf, SNAPSHOT_STATE_MAX);
+	if ((len < 0) || (snapshot_write_section(&sf, "pm", sf.buf, len) < 0))
+		goto out;
+	len = vrtc_save_state(ctx, sf.buf, SNAPSHOT_STATE_MAX);
+	if ((len < 0) || (snapshot_write_section(&sf, "rtc", sf.buf, len) < 0))
+		goto out;
+	if (pci_walk_vdevs(snapshot_save_vdev, &sf) != 0)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SNAPSHOT_MAGIC;
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.nr_sections = sf.nr_sections;
+	hdr.lowmem = ctx->lowmem;
+	hdr.highmem = ctx->highmem;
+	hdr.biosmem = ctx->biosmem;
+	hdr.mem_offset = roundup(sf.off, SNAPSHOT_CHUNK);
+
+	if ((snapshot_save_memory(sf.fd, hdr.mem_offset,
+			ctx->baseaddr, ctx->lowmem) < 0) ||
+		(snapshot_save_memory(sf.fd, hdr.mem_offset + ctx->lowmem,
+			ctx->baseaddr + ctx->highmem_gpa_base, ctx->highmem) < 0) ||
+		(snapshot_save_memory(sf.fd, hdr.mem_offset + ctx->lowmem + ctx->highmem,
+			ctx->baseaddr + 4 * GB - ctx->biosmem, ctx->biosmem) < 0)) {
+		pr_err("%s: failed to save the memory: %s\n", __func__, strerror(errno));
+		goto out;
+	}
+
+	/* size the file to cover the trailing zero memory, then commit the header */
+	if ((ftruncate(sf.fd, hdr.mem_offset + ctx->lowmem + ctx->highmem + ctx->biosmem) < 0) ||
+		(fdatasync(sf.fd) < 0) ||
+		(pwrite(sf.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+		(fdatasync(sf.fd) < 0)) {
+		pr_err("%s: failed to write %s: %s\n", __func__, path, strerror(errno));
+		goto out;
+	}
+
+	pr_notice("snapshot: saved to %s in %lu ms\n", path, elapsed_ms(&start));
+	ret = 0;
+
+out:
+	if (sf.fd >= 0)
+		close(sf.fd);
+	if (ret < 0)
+		unlink(path);
+	free(sf.buf);
+	return ret;
+}
+
+struct restore_vdev {
+	struct vmctx *ctx;
+	struct snapshot_pci *pci;
+	size_t len;
+	int ret;
+};
+
+static int
+restore_find_vdev(struct pci_vdev *dev, void *arg)
+{
+	struct restore_vdev *rv = arg;
+	struct snapshot_pci *pci = rv->pci;
+	size_t len = rv->len - sizeof(*pci);
+
+	if ((dev->bus != pci->bus) || (dev->slot != pci->slot) || (dev->func != pci->func))
+		return 0;
+
+	if ((pci_get_cfgdata16(dev, PCIR_VENDOR) != pci->vendor) ||
+		(pci_get_cfgdata16(dev, PCIR_DEVICE) != pci->device)) {
+		pr_err("%s: %x:%x.%x is %s now, not %04x:%04x\n", __func__, pci->bus,
+			pci->slot, pci->func, dev->name, pci->vendor, pci->device);
+		rv->ret = -1;
+	} else {
+		if (dev->dev_ops->vdev_load == NULL)
+			rv->ret = -1;
+		else
+			rv->ret = dev->dev_ops->vdev_load(rv->ctx, dev, pci + 1, len);
+		if (rv->ret < 0)
+			pr_err("%s: failed to load %s\n", __func__, dev->name);
+	}
+
+	return 1;
+}
+
+/*
+ * Restore the VM from the snapshot given with --restore, after the devices
+ * are initialized and the firmware is loaded.
+ */
+int
+vm_restore(struct vmctx *ctx)
+{
+	struct snapshot_header hdr;
+	struct snapshot_section sec;
+	struct restore_vdev rv;
+	struct timespec start;
+	char *buf = NULL;
+	off_t off;
+	uint32_t i;
+	int fd, ret = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fd = open(restore_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pr_err("%s: failed to open %s: %s\n", __func__, restore_path, strerror(errno));
+		return -1;
+	}
+
+	if ((pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+		(hdr.magic != SNAPSHOT_MAGIC) || (hdr.version != SNAPSHOT_VERSION)) {
+		pr_err("%s: %s isn't a VM snapshot\n", __func__, restore_path);
+		goto out;
+	}
+	if ((hdr.lowmem != ctx->lowmem) || (hdr.highmem != ctx->highmem) ||
+		(hdr.biosmem != ctx->biosmem)) {
+		pr_err("%s: memory layout of the snapshot doesn't match the VM\n", __func__);
+		goto out;
+	}
+
+	buf = malloc(SNAPSHOT_STATE_MAX);
+	if (buf == NULL)
+		goto out;
+
+	off = sizeof(hdr);
+	for (i = 0; i < hdr.nr_sections; i++) {
+		if ((pread(fd, &sec, sizeof(sec), off) != sizeof(sec)) ||
+			(sec.len > SNAPSHOT_STATE_MAX) ||
+			(pread(fd, buf, sec.len, off + sizeof(sec)) != sec.len)) {
+			pr_err("%s: broken section %u\n", __func__, i);
+			goto out;
+		}
+		off += sizeof(sec) + sec.len;
+		sec.name[sizeof(sec.name) - 1] = '\0';
+
+		if (!strcmp(sec.name, "pm")) {
+			if (pm_load_state(buf, sec.len) < 0)
+				goto out;
+		} else if (!strcmp(sec.name, "rtc")) {
+			if (vrtc_load_state(ctx, buf, sec.len) < 0)
+				goto out;
+		} else if (!strcmp(sec.name, "pci") && (sec.len >= sizeof(struct snapshot_pci))) {
+			rv.ctx = ctx;
+			rv.pci = (struct snapshot_pci *)buf;
+			rv.len = sec.len;
+			rv.ret = -1;
+			if (pci_walk_vdevs(restore_find_vdev, &rv) == 0)
+				pr_err("%s: no device at %x:%x.%x\n", __func__,
+					rv.pci->bus, rv.pci->slot, rv.pci->func);
+			if (rv.ret < 0)
+				goto out;
+		} else {
+			pr_err("%s: unknown section %s\n", __func__, sec.name);
+			goto out;
+		}
+	}
+
+	if ((snapshot_load_memory(fd, hdr.mem_offset,
+			ctx->baseaddr, ctx->lowmem) < 0) ||
+		(snapshot_load_memory(fd, hdr.mem_offset + ctx->lowmem,
+			ctx->baseaddr + ctx->highmem_gpa_base, ctx->highmem) < 0) ||
+		(snapshot_load_memory(fd, hdr.mem_offset + ctx->lowmem + ctx->highmem,
+			ctx->baseaddr + 4 * GB - ctx->biosmem, ctx->biosmem) < 0)) {
+		pr_err("%s: failed to load the memory: %s\n", __func__, strerror(errno));
+		goto out;
+	}
+
+	/* let the firmware take the S3 resume path */
+	pm_backto_wakeup(ctx);
+
+	pr_notice("snapshot: restored from %s in %lu ms\n", restore_path, elapsed_ms(&start));
+	/* a reboot of the restored VM boots it from scratch */
+	free(restore_path);
+	restore_path = NULL;
+	ret = 0;
+
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
@@ -28,6 +28,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "dm.h"
 #include "vmmapi.h"
@@ -160,100 +163,100 @@ acrn_parse_ramdisk(char *arg)
 		return -1;
 }
 
+/* open an image for load_images() and make sure it's still size long */
 static int
-acrn_prepare_ramdisk(struct vmctx *ctx)
+acrn_open_image(const char *path, size_t size, const char *name)
 {
-	FILE *fp;
-	long len;
-	size_t read;
+	struct stat st;
+	int fd;
 
-	fp = fopen(ramdisk_path, "r");
-	if (fp == NULL) {
-		pr_err("SW_LOAD ERR: could not open ramdisk file %s\n",
-				ramdisk_path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_err("SW_LOAD ERR: could not open %s file %s\n", name, path);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-
-	if (len != ramdisk_size) {
-		fprintf(stderr,
-			"SW_LOAD ERR: ramdisk file changed\n");
-		fclose(fp);
+	if ((fstat(fd, &st) < 0) || (st.st_size != size)) {
+		pr_err("SW_LOAD ERR: %s file changed\n", name);
+		close(fd);
 		return -1;
 	}
 
+	return fd;
+}
+
+static int
+acrn_prepare_ramdisk(struct vmctx *ctx, struct image_load *image)
+{
 	/* make sure there is enough room for the theoretical maximum ramdisk
 	 * size (kernel size is not yet available)
 	 */
 	if (ctx->lowmem <= (RAMDISK_LOAD_SIZE + 2*KB + KERNEL_LOAD_OFF(ctx))) {
 		pr_err("SW_LOAD ERR: the size of ramdisk file is too big"
-			" file len=0x%lx\n", len);
-		fclose(fp);
+			" file len=0x%lx\n", ramdisk_size);
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + RAMDISK_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
-		pr_err("SW_LOAD ERR: could not read the whole ramdisk file,"
-				" file len=%ld, read %lu\n", len, read);
-		fclose(fp);
+	image->fd = acrn_open_image(ramdisk_path, ramdisk_size, "ramdisk");
+	if (image->fd < 0)
 		return -1;
-	}
-	fclose(fp);
-	pr_info("SW_LOAD: ramdisk %s size %lu copied to guest 0x%lx\n",
-			ramdisk_path, ramdisk_size, RAMDISK_LOAD_OFF(ctx));
+	image->offset = 0;
+	image->size = ramdisk_size;
+	image->dst = ctx->baseaddr + RAMDISK_LOAD_OFF(ctx);
 
 	return 0;
 }
 
 static int
-acrn_prepare_kernel(struct vmctx *ctx)
+acrn_prepare_kernel(struct vmctx *ctx, struct image_load *image)
 {
-	FILE *fp;
-	long len;
-	size_t read;
-
-	fp = fopen(kernel_path, "r");
-	if (fp == NULL) {
-		pr_err("SW_LOAD ERR: could not open kernel file %s\n",
-				kernel_path);
+	if ((kernel_size + KERNEL_LOAD_OFF(ctx)) > RAMDISK_LOAD_OFF(ctx)) {
+		pr_err("SW_LOAD ERR: need big system memory to fit image\n");
 		return -1;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-
-	if (len != kernel_size) {
-		fprintf(stderr,
-			"SW_LOAD ERR: kernel file changed\n");
-		fclose(fp);
+	image->fd = acrn_open_image(kernel_path, kernel_size, "kernel");
+	if (image->fd < 0)
 		return -1;
-	}
+	image->offset = 0;
+	image->size = kernel_size;
+	image->dst = ctx->baseaddr + KERNEL_LOAD_OFF(ctx);
 
-	if ((len + KERNEL_LOAD_OFF(ctx)) > RAMDISK_LOAD_OFF(ctx)) {
-		pr_err("SW_LOAD ERR: need big system memory to fit image\n");
-		fclose(fp);
-		return -1;
+	return 0;
+}
+
+/* load the kernel and the ramdisk together */
+static int
+acrn_load_kernel_ramdisk(struct vmctx *ctx)
+{
+	struct image_load images[2];
+	int i, n = 0, ret = -1;
+
+	if (with_ramdisk) {
+		if (acrn_prepare_ramdisk(ctx, &images[n]) != 0)
+			goto done;
+		n++;
+	}
+	if (with_kernel) {
+		if (acrn_prepare_kernel(ctx, &images[n]) != 0)
+			goto done;
+		n++;
 	}
 
-	fseek(fp, 0, SEEK_SET);
-	read = fread(ctx->baseaddr + KERNEL_LOAD_OFF(ctx),
-			sizeof(char), len, fp);
-	if (read < len) {
-		pr_err("SW_LOAD ERR: could not read the whole kernel file,"
-				" file len=%ld, read %lu\n", len, read);
-		fclose(fp);
-		return -1;
+	ret = load_images(images, n);
+	if (ret == 0) {
+		if (with_ramdisk)
+			pr_info("SW_LOAD: ramdisk %s size %lu copied to guest 0x%lx\n",
+				ramdisk_path, ramdisk_size, RAMDISK_LOAD_OFF(ctx));
+		if (with_kernel)
+			pr_info("SW_LOAD: kernel %s size %lu copied to guest 0x%lx\n",
+				kernel_path, kernel_size, KERNEL_LOAD_OFF(ctx));
 	}
-	fclose(fp);
-	pr_info("SW_LOAD: kernel %s size %lu copied to guest 0x%lx\n",
-			kernel_path, kernel_size, KERNEL_LOAD_OFF(ctx));
 
-	return 0;
+done:
+	for (i = 0; i < n; i++)
+		close(images[i].fd);
+	return ret;
 }
 
 static int
@@ -318,16 +321,11 @@ acrn_sw_load_bzimage(struct vmctx *ctx)
 				BOOTARGS_LOAD_OFF(ctx));
 	}
 
-	if (with_ramdisk) {
-		ret = acrn_prepare_ramdisk(ctx);
-		if (ret)
-			return ret;
-	}
+	ret = acrn_load_kernel_ramdisk(ctx);
+	if (ret)
+		return ret;
 
 	if (with_kernel) {
-		ret = acrn_prepare_kernel(ctx);
-		if (ret)
-			return ret;
 		setup_size = acrn_get_bzimage_setup_size(ctx);
 		if (setup_size <= 0)
 			return -1;
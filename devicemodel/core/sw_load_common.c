@@ -28,12 +28,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "vmmapi.h"
 #include "sw_load.h"
 #include "dm.h"
 #include "pci_core.h"
 #include "vssram.h"
+#include "atomic.h"
+#include "log.h"
+#include "workers.h"
 
 int with_bootargs;
 static char bootargs[BOOT_ARG_LEN];
@@ -159,6 +166,106 @@ check_image(char *path, size_t size_limit, size_t *size)
 	return 0;
 }
 
+#define IMAGE_CHUNK_SIZE	(16 * MB)
+#define IMAGE_LOAD_THREADS	4
+
+struct image_chunk {
+	int fd;
+	off_t offset;
+	size_t size;
+	char *dst;
+};
+
+struct image_load_ctx {
+	struct image_chunk *chunks;
+	int nr_chunks;
+	int next;
+	int errors;
+};
+
+static int
+load_image_chunk(struct image_chunk *chunk)
+{
+	size_t done = 0;
+	ssize_t len;
+
+	while (done < chunk->size) {
+		len = pread(chunk->fd, chunk->dst + done, chunk->size - done,
+				chunk->offset + done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return -1;
+		done += len;
+	}
+
+	return 0;
+}
+
+static void *
+load_image_worker(void *arg)
+{
+	struct image_load_ctx *lctx = arg;
+	int i;
+
+	while ((i = atomic_fetch_add(&lctx->next, 1)) < lctx->nr_chunks) {
+		if (load_image_chunk(&lctx->chunks[i]) != 0)
+			atomic_add_fetch(&lctx->errors, 1);
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the images straight into guest memory. They are split in chunks read
+ * by a few workers with large pread() calls, so that the images are loaded
+ * in parallel, and a big one with several requests in flight.
+ */
+int
+load_images(struct image_load *images, int n)
+{
+	struct image_load_ctx lctx;
+	size_t off, len;
+	int i;
+
+	memset(&lctx, 0, sizeof(lctx));
+	for (i = 0; i < n; i++)
+		lctx.nr_chunks += howmany(images[i].size, IMAGE_CHUNK_SIZE);
+	if (lctx.nr_chunks == 0)
+		return 0;
+
+	lctx.chunks = calloc(lctx.nr_chunks, sizeof(struct image_chunk));
+	if (lctx.chunks == NULL)
+		return -1;
+
+	lctx.nr_chunks = 0;
+	for (i = 0; i < n; i++) {
+		posix_fadvise(images[i].fd, images[i].offset, images[i].size,
+				POSIX_FADV_SEQUENTIAL);
+		for (off = 0; off < images[i].size; off += len) {
+			len = MIN(images[i].size - off, IMAGE_CHUNK_SIZE);
+			lctx.chunks[lctx.nr_chunks].fd = images[i].fd;
+			lctx.chunks[lctx.nr_chunks].offset = images[i].offset + off;
+			lctx.chunks[lctx.nr_chunks].size = len;
+			lctx.chunks[lctx.nr_chunks].dst = images[i].dst + off;
+			lctx.nr_chunks++;
+		}
+	}
+
+	/* a single chunk is read in place */
+	dm_run_workers(load_image_worker, &lctx,
+			(lctx.nr_chunks > 1) ? MIN(lctx.nr_chunks, IMAGE_LOAD_THREADS) : 0,
+			"image_load");
+
+	free(lctx.chunks);
+	if (lctx.errors > 0) {
+		pr_err("SW_LOAD ERR: failed to read %d image chunks\n", lctx.errors);
+		return -1;
+	}
+
+	return 0;
+}
+
 /* Assumption:
  * the range [start, start + size] belongs to one entry of e820 table
  */
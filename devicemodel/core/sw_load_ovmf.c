@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "dm.h"
 #include "vmmapi.h"
@@ -83,6 +84,20 @@ static size_t ovmf_vars_size;
 static char *mmap_vars;
 static bool writeback_nv_storage;
 
+/*
+ * With --ovmf cache, the code of the firmware is kept in memory after it's
+ * loaded, and copied from there when the VM reboots instead of read again,
+ * as long as the file isn't changed.
+ */
+static bool ovmf_code_cache_enabled;
+static struct {
+	char *buf;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+} ovmf_code_cache;
+
 extern int init_cmos_vrpmb(struct vmctx *ctx);
 
 size_t
@@ -110,6 +125,8 @@ acrn_parse_ovmf(char *arg)
 		while ((token = strsep(&cp, ",")) != NULL) {
 			if (!strcmp(token, "w")) {
 				writeback_nv_storage = true;
+			} else if (!strcmp(token, "cache")) {
+				ovmf_code_cache_enabled = true;
 			} else if (!strncmp(token, "code=", sizeof("code=") - 1)) {
 				token += sizeof("code=") - 1;
 				strncpy(ovmf_code_path, token, sizeof(ovmf_code_path));
@@ -146,14 +163,42 @@ acrn_parse_ovmf(char *arg)
 	return error;
 }
 
+static bool
+ovmf_code_cached(struct stat *st, size_t size)
+{
+	return ovmf_code_cache.buf && (ovmf_code_cache.size == size) &&
+		(ovmf_code_cache.dev == st->st_dev) &&
+		(ovmf_code_cache.ino == st->st_ino) &&
+		(ovmf_code_cache.mtime.tv_sec == st->st_mtim.tv_sec) &&
+		(ovmf_code_cache.mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static void
+ovmf_cache_code(struct stat *st, const char *code, size_t size)
+{
+	free(ovmf_code_cache.buf);
+	ovmf_code_cache.buf = malloc(size);
+	if (ovmf_code_cache.buf == NULL)
+		return;
+
+	memcpy(ovmf_code_cache.buf, code, size);
+	ovmf_code_cache.size = size;
+	ovmf_code_cache.dev = st->st_dev;
+	ovmf_code_cache.ino = st->st_ino;
+	ovmf_code_cache.mtime = st->st_mtim;
+}
+
 static int
 acrn_prepare_ovmf(struct vmctx *ctx)
 {
-	int i, flags, fd;
-	char *path, *addr;
-	size_t size, size_limit, cur_size, read;
+	int i, flags, fd, nfds = 0, n = 0, ret = -1;
+	int fds[2];
+	char *path, *addr, *code_addr = NULL;
+	size_t size, size_limit, cur_size, nv_size, code_size = 0;
+	struct image_load images[3];
+	struct stat code_st;
+	bool cached = false;
 	struct flock fl;
-	FILE *fp;
 
 	if (ovmf_file_name) {
 		path = ovmf_file_name;
@@ -174,8 +219,9 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 		if (fd == -1) {
 			pr_err("SW_LOAD ERR: could not open ovmf file: %s (%s)\n",
 				path, strerror(errno));
-			return -1;
+			goto done;
 		}
+		fds[nfds++] = fd;
 
 		/* acquire read lock over the entire file */
 		memset(&fl, 0, sizeof(fl));
@@ -188,19 +234,15 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 			pr_err("SW_LOAD ERR: could not fcntl(F_RDLCK) "
 				"ovmf file: %s (%s)\n",
 				path, strerror(errno));
-			close(fd);
-			return -1;
+			goto done;
 		}
 
-		if (check_image(path, size_limit, &cur_size) != 0) {
-			close(fd);
-			return -1;
-		}
+		if (check_image(path, size_limit, &cur_size) != 0)
+			goto done;
 
 		if (cur_size != size) {
 			pr_err("SW_LOAD ERR: ovmf file %s changed\n", path);
-			close(fd);
-			return -1;
+			goto done;
 		}
 
 		if (flags == O_RDWR) {
@@ -215,8 +257,7 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 				pr_err("SW_LOAD ERR: could not fcntl(F_WRLCK) "
 					"ovmf file: %s (%s)\n",
 					path, strerror(errno));
-				close(fd);
-				return -1;
+				goto done;
 			}
 
 			mmap_vars = mmap(NULL, OVMF_NVSTORAGE_SZ, PROT_WRITE,
@@ -226,35 +267,45 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 				pr_err("SW_LOAD ERR: could not mmap "
 					"ovmf file: %s (%s)\n",
 					path, strerror(errno));
-				close(fd);
-				return -1;
+				goto done;
 			}
 		}
 
-		fp = fdopen(fd, "r");
-
-		if (fp == NULL) {
-			pr_err("SW_LOAD ERR: could not fdopen "
-				"ovmf file: %s (%s)\n",
-				path, strerror(errno));
-			close(fd);
-			return -1;
+		/*
+		 * The code is all of the code image, or all but the NV storage
+		 * of a unified image, and can be copied from the cache.
+		 */
+		nv_size = 0;
+		if (path != ovmf_code_file_name)
+			nv_size = ovmf_file_name ? MIN(OVMF_NVSTORAGE_SZ, size) : size;
+		if (nv_size > 0) {
+			images[n].fd = fd;
+			images[n].offset = 0;
+			images[n].size = nv_size;
+			images[n].dst = addr;
+			n++;
 		}
-
-		fseek(fp, 0, SEEK_SET);
-		read = fread(addr, sizeof(char), size, fp);
-		fclose(fp);
-
-		if (read < size) {
-			pr_err("SW_LOAD ERR: could not read whole partition blob %s\n",
-				path);
-			return -1;
+		if (size > nv_size) {
+			code_addr = addr + nv_size;
+			code_size = size - nv_size;
+			if (fstat(fd, &code_st) != 0)
+				goto done;
+			cached = ovmf_code_cache_enabled && ovmf_code_cached(&code_st, code_size);
+			if (cached) {
+				memcpy(code_addr, ovmf_code_cache.buf, code_size);
+			} else {
+				images[n].fd = fd;
+				images[n].offset = nv_size;
+				images[n].size = code_size;
+				images[n].dst = code_addr;
+				n++;
+			}
 		}
 
-		pr_info("SW_LOAD: partition blob %s size 0x%lx copied to addr %p\n",
-			path, size, addr);
+		pr_info("SW_LOAD: partition blob %s size 0x%lx copied to addr %p%s\n",
+			path, size, addr, cached ? " from the cache" : "");
 
-		if (!ovmf_file_name) {
+		if (!ovmf_file_name && (i == 0)) {
 			addr += size;
 			path = ovmf_code_file_name;
 			size = ovmf_code_size;
@@ -264,7 +315,20 @@ acrn_prepare_ovmf(struct vmctx *ctx)
 			break;
 	}
 
-	return 0;
+	/* the vars and the code are read in parallel */
+	if (load_images(images, n) != 0) {
+		pr_err("SW_LOAD ERR: could not read whole ovmf image\n");
+		goto done;
+	}
+
+	if (ovmf_code_cache_enabled && code_addr && !cached)
+		ovmf_cache_code(&code_st, code_addr, code_size);
+	ret = 0;
+
+done:
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	return ret;
 }
 
 int
@@ -5,8 +5,10 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/timerfd.h>
 
 #include "vmmapi.h"
@@ -19,45 +21,359 @@
  * Compare with sigevent mechanism, timerfd has a advantage that it could
  * avoid race condition on resource accessing in the async sigev thread.
  *
+ * All the acrn_timers dispatched by a thread are multiplexed on one timerfd
+ * through a hierarchical timer wheel, so arming and cancelling a timer are
+ * O(1) list operations and don't need a syscall unless the timer becomes the
+ * earliest one of the wheel. The timers expiring in the same tick are handled
+ * in one wakeup. mevent is the only thread dispatching timers for now.
+ *
  * Please note timerfd and epoll are all Linux specific. If the code need to be
  * ported to other OS, we can modify the api with POSIX timers and sigevent
  * mechanism.
  */
 
+/* Resolution of the wheel, timers never expire earlier than requested */
+#define TW_TICK_NS	(50000UL)
+
+/* 256 slots of 1 tick in the root level, 64 slots in each upper level */
+#define TW_ROOT_BITS	8
+#define TW_ROOT_SIZE	(1U << TW_ROOT_BITS)
+#define TW_ROOT_MASK	(TW_ROOT_SIZE - 1)
+#define TW_LVL_BITS	6
+#define TW_LVL_SIZE	(1U << TW_LVL_BITS)
+#define TW_LVL_MASK	(TW_LVL_SIZE - 1)
+#define TW_LEVELS	3
+#define TW_LVL_SHIFT(n)	(TW_ROOT_BITS + (n) * TW_LVL_BITS)
+/* Timers further than that are parked in the last level and re-queued later */
+#define TW_MAX_DELTA	((1UL << TW_LVL_SHIFT(TW_LEVELS)) - 1)
+
+#define TW_TICK_NONE	(~0UL)
+
+LIST_HEAD(timer_list, acrn_timer);
+
+struct timer_wheel {
+	pthread_mutex_t mtx;
+	int fd;
+	struct mevent *mevp;
+	int users;
+
+	uint64_t base;		/* CLOCK_MONOTONIC ns of tick 0 */
+	uint64_t clk;		/* next tick to process */
+	uint64_t armed;		/* tick the timerfd is armed for */
+	bool dispatching;
+	pthread_t thread;	/* valid while dispatching */
+
+	struct timer_list root[TW_ROOT_SIZE];
+	uint64_t root_map[TW_ROOT_SIZE / 64];
+	struct timer_list lvl[TW_LEVELS][TW_LVL_SIZE];
+	uint64_t lvl_map[TW_LEVELS];
+	struct timer_list expired;
+};
+
+static struct timer_wheel mevent_wheel = {
+	.mtx = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static inline uint64_t
+ts_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * NS_PER_SEC + ts->tv_nsec;
+}
+
+static inline void
+ns_to_ts(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NS_PER_SEC;
+	ts->tv_nsec = ns % NS_PER_SEC;
+}
+
+static uint64_t
+clock_now_ns(clockid_t clockid)
+{
+	struct timespec ts;
+
+	clock_gettime(clockid, &ts);
+	return ts_to_ns(&ts);
+}
+
 static void
-timer_handler(int fd __attribute__((unused)),
-		  enum ev_type t __attribute__((unused)),
-		  void *arg)
+wheel_enqueue(struct timer_wheel *w, struct acrn_timer *timer)
 {
-	struct acrn_timer *timer = arg;
-	uint64_t nexp;
-	ssize_t size;
-	void (*cb)(void *, uint64_t);
+	uint64_t tick = timer->tick;
+	uint64_t delta;
+	uint32_t idx;
+	int n;
 
-	if (timer == NULL) {
-		return;
+	if (tick < w->clk)
+		tick = w->clk;
+	delta = tick - w->clk;
+
+	if (delta < TW_ROOT_SIZE) {
+		idx = tick & TW_ROOT_MASK;
+		LIST_INSERT_HEAD(&w->root[idx], timer, entry);
+		w->root_map[idx / 64] |= 1UL << (idx % 64);
+	} else {
+		if (delta > TW_MAX_DELTA)
+			tick = w->clk + TW_MAX_DELTA;
+		for (n = 0; n < TW_LEVELS - 1; n++) {
+			if (delta < (1UL << TW_LVL_SHIFT(n + 1)))
+				break;
+		}
+		idx = (tick >> TW_LVL_SHIFT(n)) & TW_LVL_MASK;
+		LIST_INSERT_HEAD(&w->lvl[n][idx], timer, entry);
+		w->lvl_map[n] |= 1UL << idx;
+	}
+	timer->queued = true;
+}
+
+static void
+wheel_dequeue(struct timer_wheel *w, struct acrn_timer *timer)
+{
+	if (timer->queued) {
+		LIST_REMOVE(timer, entry);
+		timer->queued = false;
+	}
+}
+
+/* Move the timers of a slot of level n to the lower levels */
+static void
+wheel_cascade(struct timer_wheel *w, int n, uint32_t idx)
+{
+	struct timer_list list;
+	struct acrn_timer *timer;
+
+	LIST_INIT(&list);
+	while ((timer = LIST_FIRST(&w->lvl[n][idx])) != NULL) {
+		LIST_REMOVE(timer, entry);
+		LIST_INSERT_HEAD(&list, timer, entry);
+	}
+	w->lvl_map[n] &= ~(1UL << idx);
+
+	while ((timer = LIST_FIRST(&list)) != NULL) {
+		LIST_REMOVE(timer, entry);
+		wheel_enqueue(w, timer);
+	}
+}
+
+static bool
+wheel_root_empty(struct timer_wheel *w)
+{
+	uint32_t i;
+
+	for (i = 0; i < TW_ROOT_SIZE / 64; i++) {
+		if (w->root_map[i] != 0)
+			return false;
 	}
+	return true;
+}
+
+/* Collect the timers expiring up to tick now into the expired list */
+static void
+wheel_advance(struct timer_wheel *w, uint64_t now)
+{
+	struct acrn_timer *timer;
+	uint32_t idx;
+	uint64_t next;
+	int n;
+
+	while (w->clk <= now) {
+		idx = w->clk & TW_ROOT_MASK;
+		if (idx == 0) {
+			for (n = 0; n < TW_LEVELS; n++) {
+				idx = (w->clk >> TW_LVL_SHIFT(n)) & TW_LVL_MASK;
+				wheel_cascade(w, n, idx);
+				if (idx != 0)
+					break;
+			}
+			idx = 0;
+		}
+
+		while ((timer = LIST_FIRST(&w->root[idx])) != NULL) {
+			LIST_REMOVE(timer, entry);
+			LIST_INSERT_HEAD(&w->expired, timer, entry);
+		}
+		w->root_map[idx / 64] &= ~(1UL << (idx % 64));
+		w->clk++;
+
+		/* Nothing in the root level, jump to the next cascade */
+		if (wheel_root_empty(w)) {
+			next = (w->clk + TW_ROOT_MASK) & ~(uint64_t)TW_ROOT_MASK;
+			w->clk = MIN(next, now + 1);
+		}
+	}
+}
+
+/* The first tick at or after clk that the wheel has work to do */
+static uint64_t
+wheel_next_tick(struct timer_wheel *w)
+{
+	uint64_t next = TW_TICK_NONE;
+	uint64_t boundary, cand;
+	uint32_t i, idx, start;
+	int n;
+
+	if (!LIST_EMPTY(&w->expired))
+		return w->clk;
+
+	start = w->clk & TW_ROOT_MASK;
+	for (i = 0; i < TW_ROOT_SIZE; i++) {
+		idx = (start + i) & TW_ROOT_MASK;
+		if (w->root_map[idx / 64] & (1UL << (idx % 64))) {
+			next = w->clk + i;
+			break;
+		}
+		/* skip the empty words */
+		if (((idx % 64) == 0) && (w->root_map[idx / 64] == 0))
+			i += 63;
+	}
+
+	/* Timers in the upper levels need a wakeup to be cascaded */
+	for (n = 0; n < TW_LEVELS; n++) {
+		if (w->lvl_map[n] == 0)
+			continue;
+		boundary = (w->clk + (1UL << TW_LVL_SHIFT(n)) - 1) &
+				~((1UL << TW_LVL_SHIFT(n)) - 1);
+		start = (boundary >> TW_LVL_SHIFT(n)) & TW_LVL_MASK;
+		for (i = 0; i < TW_LVL_SIZE; i++) {
+			idx = (start + i) & TW_LVL_MASK;
+			if (w->lvl_map[n] & (1UL << idx)) {
+				cand = boundary + ((uint64_t)i << TW_LVL_SHIFT(n));
+				next = MIN(next, cand);
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+/* Arm the timerfd for tick, called with w->mtx held */
+static void
+wheel_arm(struct timer_wheel *w, uint64_t tick)
+{
+	struct itimerspec its;
 
-	/* Consume I/O event for default EPOLLLT type.
-	 * Here is a temporary solution, the processing could be moved to
-	 * mevent.c once EVF_TIMER is supported.
-	 */
-	size = read(timer->fd, &nexp, sizeof(nexp));
+	memset(&its, 0, sizeof(its));
+	if (tick != TW_TICK_NONE)
+		ns_to_ts(w->base + tick * TW_TICK_NS, &its.it_value);
 
-	if (size < 0) {
-		if (errno != EAGAIN) {
+	if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+		pr_err("acrn_timer wheel timerfd_settime failed: %s\n", strerror(errno));
+	w->armed = tick;
+}
+
+static void
+wheel_handler(int fd __attribute__((unused)),
+		enum ev_type t __attribute__((unused)),
+		void *arg)
+{
+	struct timer_wheel *w = arg;
+	struct acrn_timer *timer;
+	void (*cb)(void *, uint64_t);
+	void *param;
+	uint64_t nexp, now;
+
+	/* Consume I/O event for default EPOLLLT type */
+	if (read(w->fd, &nexp, sizeof(nexp)) < 0) {
+		if (errno != EAGAIN)
 			pr_err("acrn_timer read timerfd error");
+	}
+
+	pthread_mutex_lock(&w->mtx);
+	w->dispatching = true;
+	w->thread = pthread_self();
+	w->armed = TW_TICK_NONE;
+
+	now = clock_now_ns(CLOCK_MONOTONIC);
+	wheel_advance(w, (now - w->base) / TW_TICK_NS);
+
+	while ((timer = LIST_FIRST(&w->expired)) != NULL) {
+		wheel_dequeue(w, timer);
+
+		nexp = 1;
+		if (timer->interval != 0) {
+			if (now > timer->expires)
+				nexp += (now - timer->expires) / timer->interval;
+			timer->expires += nexp * timer->interval;
+			timer->tick = howmany(timer->expires - w->base, TW_TICK_NS);
+			wheel_enqueue(w, timer);
+		} else {
+			timer->expires = 0;
 		}
-		return;
+
+		cb = timer->callback;
+		param = timer->callback_param;
+		if (cb == NULL)
+			continue;
+
+		/*
+		 * The callback may take the device lock, which is also held
+		 * by the vCPU threads when arming the timer.
+		 */
+		pthread_mutex_unlock(&w->mtx);
+		(*cb)(param, nexp);
+		pthread_mutex_lock(&w->mtx);
 	}
 
-	/* check the validity of timer expiration. */
-	if ((size == 0) || (nexp == 0))
-		return;
+	w->dispatching = false;
+	wheel_arm(w, wheel_next_tick(w));
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static struct timer_wheel *
+wheel_get(void)
+{
+	struct timer_wheel *w = &mevent_wheel;
+	int i, n;
+
+	pthread_mutex_lock(&w->mtx);
+	if (w->users == 0) {
+		w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (w->fd < 0) {
+			pr_err("acrn_timer create failed.\n");
+			goto fail;
+		}
+
+		w->mevp = mevent_add(w->fd, EVF_READ, wheel_handler, w, NULL, NULL);
+		if (w->mevp == NULL) {
+			close(w->fd);
+			w->fd = -1;
+			pr_err("acrn_timer mevent add failed.\n");
+			goto fail;
+		}
+
+		w->base = clock_now_ns(CLOCK_MONOTONIC);
+		w->clk = 0;
+		w->armed = TW_TICK_NONE;
+		for (i = 0; i < TW_ROOT_SIZE; i++)
+			LIST_INIT(&w->root[i]);
+		memset(w->root_map, 0, sizeof(w->root_map));
+		for (n = 0; n < TW_LEVELS; n++)
+			for (i = 0; i < TW_LVL_SIZE; i++)
+				LIST_INIT(&w->lvl[n][i]);
+		memset(w->lvl_map, 0, sizeof(w->lvl_map));
+		LIST_INIT(&w->expired);
+	}
+	w->users++;
+	pthread_mutex_unlock(&w->mtx);
+	return w;
+
+fail:
+	pthread_mutex_unlock(&w->mtx);
+	return NULL;
+}
 
-	if ((cb = timer->callback) != NULL) {
-		(*cb)(timer->callback_param, nexp);
+static void
+wheel_put(struct timer_wheel *w)
+{
+	pthread_mutex_lock(&w->mtx);
+	if (--w->users == 0) {
+		mevent_delete_close(w->mevp);
+		w->mevp = NULL;
+		w->fd = -1;
 	}
+	pthread_mutex_unlock(&w->mtx);
 }
 
 int32_t
@@ -68,27 +384,19 @@ acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
 		return -1;
 	}
 
-	timer->fd = -1;
-	if ((timer->clockid == CLOCK_REALTIME) ||
-			(timer->clockid == CLOCK_MONOTONIC)) {
-		timer->fd = timerfd_create(timer->clockid,
-					TFD_NONBLOCK | TFD_CLOEXEC);
-	} else {
+	if ((timer->clockid != CLOCK_REALTIME) &&
+			(timer->clockid != CLOCK_MONOTONIC)) {
 		pr_err("acrn_timer clockid is not supported.\n");
-	}
-
-	if (timer->fd <= 0) {
-		pr_err("acrn_timer create failed.\n");
 		return -1;
 	}
 
-	timer->mevp = mevent_add(timer->fd, EVF_READ, timer_handler, timer, NULL, NULL);
-	if (timer->mevp == NULL) {
-		close(timer->fd);
-		pr_err("acrn_timer mevent add failed.\n");
+	timer->wheel = wheel_get();
+	if (timer->wheel == NULL)
 		return -1;
-	}
 
+	timer->queued = false;
+	timer->expires = 0;
+	timer->interval = 0;
 	timer->callback = cb;
 	timer->callback_param = param;
 
@@ -98,50 +406,123 @@ acrn_timer_init(struct acrn_timer *timer, void (*cb)(void *, uint64_t),
 void
 acrn_timer_deinit(struct acrn_timer *timer)
 {
-	if (timer == NULL) {
-		return;
-	}
+	struct timer_wheel *w;
 
-	if (timer->mevp != NULL) {
-		mevent_delete_close(timer->mevp);
-		timer->mevp = NULL;
+	if ((timer == NULL) || (timer->wheel == NULL)) {
+		return;
 	}
 
-	timer->fd = -1;
+	w = timer->wheel;
+	pthread_mutex_lock(&w->mtx);
+	wheel_dequeue(w, timer);
+	timer->expires = 0;
 	timer->callback = NULL;
 	timer->callback_param = NULL;
+	pthread_mutex_unlock(&w->mtx);
+
+	wheel_put(w);
+	timer->wheel = NULL;
 }
 
-int32_t
-acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
+static int32_t
+acrn_timer_set(struct acrn_timer *timer, const struct itimerspec *new_value,
+		bool abs)
 {
-	if (timer == NULL) {
+	struct timer_wheel *w;
+	uint64_t now, value;
+
+	if ((timer == NULL) || (timer->wheel == NULL) || (new_value == NULL) ||
+			(new_value->it_value.tv_nsec >= NS_PER_SEC) ||
+			(new_value->it_interval.tv_nsec >= NS_PER_SEC)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	return timerfd_settime(timer->fd, 0, new_value, NULL);
+	w = timer->wheel;
+	now = clock_now_ns(CLOCK_MONOTONIC);
+	value = ts_to_ns(&new_value->it_value);
+
+	pthread_mutex_lock(&w->mtx);
+	wheel_dequeue(w, timer);
+	timer->expires = 0;
+	timer->interval = 0;
+
+	if (value != 0) {
+		if (!abs)
+			timer->expires = now + value;
+		else if (timer->clockid == CLOCK_MONOTONIC)
+			timer->expires = value;
+		else	/* The wheel runs on CLOCK_MONOTONIC */
+			timer->expires = now + MAX((int64_t)(value -
+				clock_now_ns(timer->clockid)), 0);
+		/* 0 means disarmed */
+		timer->expires = MAX(timer->expires, 1UL);
+
+		timer->interval = ts_to_ns(&new_value->it_interval);
+		timer->tick = howmany(MAX(timer->expires, w->base) - w->base,
+				TW_TICK_NS);
+		wheel_enqueue(w, timer);
+
+		/*
+		 * The dispatching thread re-arms the timerfd after running
+		 * the callbacks, others do it only for an earlier timer.
+		 */
+		if (!(w->dispatching && pthread_equal(w->thread, pthread_self())) &&
+				(MAX(timer->tick, w->clk) < w->armed))
+			wheel_arm(w, MAX(timer->tick, w->clk));
+	}
+	pthread_mutex_unlock(&w->mtx);
+
+	return 0;
+}
+
+int32_t
+acrn_timer_settime(struct acrn_timer *timer, const struct itimerspec *new_value)
+{
+	return acrn_timer_set(timer, new_value, false);
 }
 
 int32_t
 acrn_timer_settime_abs(struct acrn_timer *timer,
 		const struct itimerspec *new_value)
 {
-	if (timer == NULL) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	return timerfd_settime(timer->fd, TFD_TIMER_ABSTIME, new_value, NULL);
+	return acrn_timer_set(timer, new_value, true);
 }
 
 int32_t
 acrn_timer_gettime(struct acrn_timer *timer, struct itimerspec *cur_value)
 {
-	if (timer == NULL) {
+	struct timer_wheel *w;
+	uint64_t now;
+
+	if ((timer == NULL) || (timer->wheel == NULL) || (cur_value == NULL)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	return timerfd_gettime(timer->fd, cur_value);
+	w = timer->wheel;
+	memset(cur_value, 0, sizeof(*cur_value));
+
+	pthread_mutex_lock(&w->mtx);
+	if (timer->expires != 0) {
+		now = clock_now_ns(CLOCK_MONOTONIC);
+		/* expired but not handled yet, report the minimum like timerfd */
+		ns_to_ts((timer->expires > now) ? (timer->expires - now) : 1UL,
+			&cur_value->it_value);
+		ns_to_ts(timer->interval, &cur_value->it_interval);
+	}
+	pthread_mutex_unlock(&w->mtx);
+
+	return 0;
+}
+
+/* Wall time since start, a CLOCK_MONOTONIC time, in ms */
+uint64_t
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
 }
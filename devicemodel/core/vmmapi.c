@@ -292,6 +292,9 @@ vm_destroy(struct vmctx *ctx)
 	close(ctx->fd);
 	free(ctx);
 	devfd = -1;
+
+	/* the guest memory is unpinned by now, give it back to acrn_hugepool */
+	hugetlb_release_pool();
 }
 
 int
@@ -354,6 +357,67 @@ vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	return error;
 }
 
+int
+vm_unmap_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot)
+{
+	struct acrn_vm_memmap memmap;
+	int error;
+	bzero(&memmap, sizeof(struct acrn_vm_memmap));
+	memmap.type = ACRN_MEMMAP_RAM;
+	memmap.vma_base = vma;
+	memmap.len = len;
+	memmap.user_vm_pa = gpa;
+	memmap.attr = prot;
+	error = ioctl(ctx->fd, ACRN_IOCTL_UNSET_MEMSEG, &memmap);
+	if (error) {
+		pr_err("ACRN_IOCTL_UNSET_MEMSEG ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+/*
+ * Unmap the RAM from the guest and unpin it, fails with ENOTTY if HSM can't
+ * unpin the guest memory. The error is left to the caller to report.
+ */
+int
+vm_unpin_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot)
+{
+	struct acrn_vm_memmap memmap;
+
+	bzero(&memmap, sizeof(struct acrn_vm_memmap));
+	memmap.type = ACRN_MEMMAP_RAM;
+	memmap.vma_base = vma;
+	memmap.len = len;
+	memmap.user_vm_pa = gpa;
+	memmap.attr = prot;
+	return ioctl(ctx->fd, ACRN_IOCTL_UNPIN_MEMSEG, &memmap);
+}
+
+/*
+ * Whether HSM can unpin the guest memory. ACRN_IOCTL_UNPIN_MEMSEG isn't in
+ * the upstream HSM driver, so it's only issued with --experimental_unpin,
+ * and probed with an empty range, which only fails with ENOTTY if HSM doesn't
+ * know the ioctl.
+ */
+bool
+vm_can_unpin_memory(struct vmctx *ctx)
+{
+	static int can_unpin = -1;
+
+	if (!experimental_unpin)
+		return false;
+
+	if (can_unpin < 0) {
+		can_unpin = (vm_unpin_memseg_vma(ctx, 0, 0, 0, PROT_ALL) == 0) ||
+			(errno != ENOTTY);
+		if (!can_unpin)
+			pr_err("HSM doesn't support ACRN_IOCTL_UNPIN_MEMSEG\n");
+	}
+	return can_unpin;
+}
+
 int
 vm_setup_memory(struct vmctx *ctx, size_t memsize)
 {
@@ -409,6 +473,7 @@ vm_unsetup_memory(struct vmctx *ctx)
 void *
 vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 {
+	size_t blk, first, last;
 
 	if (ctx->lowmem > 0) {
 		if (gaddr < ctx->lowmem && len <= ctx->lowmem &&
@@ -425,10 +490,52 @@ vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len)
 		}
 	}
 
+	if (ctx->hpmem > 0) {
+		if (gaddr >= ctx->hpmem_gpa_base &&
+		    gaddr < ctx->hpmem_gpa_base + ctx->hpmem &&
+		    len <= ctx->hpmem &&
+		    gaddr + len <= ctx->hpmem_gpa_base + ctx->hpmem &&
+		    len > 0) {
+			/* unplugged blocks aren't backed */
+			first = (gaddr - ctx->hpmem_gpa_base) / ctx->hpmem_block;
+			last = (gaddr + len - 1 - ctx->hpmem_gpa_base) / ctx->hpmem_block;
+			for (blk = first; blk <= last; blk++) {
+				if (!ctx->hpmem_plugged[blk])
+					break;
+			}
+			if (blk > last)
+				return ctx->hpmem_hva + (gaddr - ctx->hpmem_gpa_base);
+		}
+	}
+
 	pr_dbg("%s context memory is not valid!\n", __func__);
 	return NULL;
 }
 
+/*
+ * Allocate guest physical space for device memory, e.g. the virtio-mem
+ * window, from the end of highmem up to the 64-bit PCI hole.
+ *
+ * Returns the guest physical address, or 0 if there's no room left.
+ */
+uint64_t
+vm_alloc_devmem(struct vmctx *ctx, size_t len, size_t align)
+{
+	uint64_t gpa;
+
+	if (ctx->devmem_gpa_top == 0)
+		ctx->devmem_gpa_top = ctx->highmem_gpa_base + ctx->highmem;
+
+	gpa = ALIGN_UP(ctx->devmem_gpa_top, align);
+	if ((len == 0) || (gpa + len > PCI_EMUL_MEMBASE64)) {
+		pr_err("%s: no room for 0x%lx bytes of device memory\n", __func__, len);
+		return 0;
+	}
+
+	ctx->devmem_gpa_top = gpa + len;
+	return gpa;
+}
+
 size_t
 vm_get_lowmem_size(struct vmctx *ctx)
 {
@@ -735,6 +842,41 @@ vm_irqfd(struct vmctx *ctx, struct acrn_irqfd *args)
 	return error;
 }
 
+int
+vm_set_posted_write_buffer(struct vmctx *ctx, uint64_t buf)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_POSTED_WRITE_BUFFER, &buf);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_POSTED_WRITE_BUFFER ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_posted_write_range(struct vmctx *ctx, struct acrn_posted_write_range *range)
+{
+	int error;
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_POSTED_WRITE_RANGE, range);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_POSTED_WRITE_RANGE ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
+int
+vm_set_ioreq_client_polling(struct vmctx *ctx, bool polling)
+{
+	int error;
+	uint64_t enable = polling ? 1UL : 0UL;
+
+	error = ioctl(ctx->fd, ACRN_IOCTL_SET_IOREQ_CLIENT_POLLING, &enable);
+	if (error) {
+		pr_err("ACRN_IOCTL_SET_IOREQ_CLIENT_POLLING ioctl() returned an error: %s\n", errormsg(errno));
+	}
+	return error;
+}
+
 char*
 errormsg(int error)
 {
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Pool of short-lived workers for the start-up jobs split into many pieces,
+ * e.g. loading the images or faulting in the guest memory. Each worker takes
+ * the next piece from the shared context until all of them are done.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "workers.h"
+#include "log.h"
+
+/*
+ * Run worker(arg) on up to nr_threads threads named name and wait for all of
+ * them. If nr_threads is 0 or no thread can be created, the worker is run in
+ * place.
+ * Returns the number of threads which ran the worker, 0 if it ran in place.
+ */
+int
+dm_run_workers(void *(*worker)(void *), void *arg, int nr_threads,
+		const char *name)
+{
+	pthread_t *tids = NULL;
+	int i, n = 0;
+
+	if (nr_threads > 0)
+		tids = calloc(nr_threads, sizeof(pthread_t));
+
+	if (tids != NULL) {
+		for (; n < nr_threads; n++) {
+			if (pthread_create(&tids[n], NULL, worker, arg) != 0)
+				break;
+			pthread_setname_np(tids[n], name);
+		}
+	}
+
+	/* no worker at all, do it in place */
+	if (n == 0) {
+		if (nr_threads > 0)
+			pr_warn("%s: failed to create workers, running in place\n", name);
+		worker(arg);
+	}
+
+	for (i = 0; i < n; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+
+	return n;
+}
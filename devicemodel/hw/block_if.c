@@ -47,6 +47,7 @@
 #include "ahci.h"
 #include "dm_string.h"
 #include "log.h"
+#include "numa.h"
 
 /*
  * Notes:
@@ -385,6 +386,7 @@ blockif_thr(void *arg)
 
 	bc = arg;
 	t = pthread_self();
+	numa_bind_io_thread();
 
 	pthread_mutex_lock(&bc->mtx);
 
@@ -48,6 +48,10 @@
 #include "sw_load.h"
 #include "log.h"
 #include "vdisplay.h"
+#include "numa.h"
+#include "atomic.h"
+#include "exit_stats.h"
+#include "workers.h"
 
 #define CONF1_ADDR_PORT    0x0cf8
 #define CONF1_DATA_PORT    0x0cfc
@@ -63,6 +67,7 @@ struct funcinfo {
 	char	*fi_param;
 	char	*fi_param_saved; /* save for reboot */
 	struct pci_vdev *fi_devi;
+	void	*fi_prep;	/* from vdev_prepare, until pci_emul_init */
 };
 
 struct intxinfo {
@@ -1026,6 +1031,8 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	pdi->lintr.pirq_pin = 0;
 	pdi->lintr.ioapic_irq = 0;
 	pdi->dev_ops = ops;
+	pdi->prep = fi->fi_prep;
+	fi->fi_prep = NULL;
 	snprintf(pdi->name, PI_NAMESZ, "%s-pci-%d", ops->class_name, slot);
 
 	/* Disable legacy interrupts */
@@ -1040,6 +1047,10 @@ pci_emul_init(struct vmctx *ctx, struct pci_vdev_ops *ops, int bus, int slot,
 	else
 		fi->fi_param = NULL;
 	err = (*ops->vdev_init)(ctx, pdi, fi->fi_param);
+	/* vdev_init failed before taking the prepared backend */
+	if (pdi->prep && ops->vdev_unprepare)
+		(*ops->vdev_unprepare)(pdi->prep);
+	pdi->prep = NULL;
 	if (err == 0)
 		fi->fi_devi = pdi;
 	else
@@ -1441,11 +1452,26 @@ pci_emul_fallback_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 	return 0;
 }
 
+static void
+pci_cfgrw_account(int in, int bus, int slot, int func, int coff, uint64_t start)
+{
+	struct businfo *bi;
+	struct pci_vdev *dev = NULL;
+
+	bi = pci_businfo[bus];
+	if (bi != NULL)
+		dev = bi->slotinfo[slot].si_funcs[func].fi_devi;
+
+	exit_stats_account(EXIT_STATS_PCICFG, dev ? dev->name : "none",
+		PCI_BDF(bus, slot, func), coff, !in, start);
+}
+
 static int
 pci_emul_ecfg_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 		      int bytes, uint64_t *val, void *arg1, long arg2)
 {
 	int bus, slot, func, coff, in;
+	uint64_t start;
 
 	coff = addr & 0xfff;
 	func = (addr >> 12) & 0x7;
@@ -1454,13 +1480,126 @@ pci_emul_ecfg_handler(struct vmctx *ctx, int vcpu, int dir, uint64_t addr,
 	in = (dir == MEM_F_READ);
 	if (in)
 		*val = ~0UL;
+	start = exit_stats_begin();
 	pci_cfgrw(ctx, vcpu, in, bus, slot, func, coff, bytes, (uint32_t *)val);
+	if (start)
+		pci_cfgrw_account(in, bus, slot, func, coff, start);
 	return 0;
 }
 
 #define	BUSIO_ROUNDUP		32
 #define	BUSMEM_ROUNDUP		(1024 * 1024)
 
+#define PCI_PREPARE_THREADS	8
+
+struct pci_prepare_job {
+	struct vmctx *ctx;
+	struct pci_vdev_ops *ops;
+	struct funcinfo *fi;
+	int slot;
+	int func;
+};
+
+struct pci_prepare_ctx {
+	struct pci_prepare_job *jobs;
+	int nr_jobs;
+	int next;
+};
+
+static void *
+pci_prepare_worker(void *arg)
+{
+	struct pci_prepare_ctx *pctx = arg;
+	struct pci_prepare_job *job;
+	int i;
+
+	while ((i = atomic_fetch_add(&pctx->next, 1)) < pctx->nr_jobs) {
+		job = &pctx->jobs[i];
+		job->fi->fi_prep = job->ops->vdev_prepare(job->ctx, job->slot,
+				job->func, job->fi->fi_param_saved);
+	}
+
+	return NULL;
+}
+
+/*
+ * Open the backends of the devices with vdev_prepare on a pool of workers,
+ * as it may take long, e.g. for many image files. The devices are still
+ * initialized one after another in slot order afterwards, so that their BARs
+ * and interrupts are the same at every start.
+ */
+static void
+prepare_pci(struct vmctx *ctx)
+{
+	struct pci_prepare_ctx pctx;
+	struct pci_vdev_ops *ops;
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func, n;
+
+	memset(&pctx, 0, sizeof(pctx));
+	pctx.jobs = calloc(MAXSLOTS * MAXFUNCS * MAXBUSES, sizeof(struct pci_prepare_job));
+	if (pctx.jobs == NULL)
+		return;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_name == NULL)
+					continue;
+				ops = pci_emul_finddev(fi->fi_name);
+				if (!ops || !ops->vdev_prepare)
+					continue;
+
+				pctx.jobs[pctx.nr_jobs].ctx = ctx;
+				pctx.jobs[pctx.nr_jobs].ops = ops;
+				pctx.jobs[pctx.nr_jobs].fi = fi;
+				pctx.jobs[pctx.nr_jobs].slot = slot;
+				pctx.jobs[pctx.nr_jobs].func = func;
+				pctx.nr_jobs++;
+			}
+		}
+	}
+
+	n = dm_run_workers(pci_prepare_worker, &pctx,
+			MIN(pctx.nr_jobs, PCI_PREPARE_THREADS), "pci_prepare");
+
+	if (pctx.nr_jobs > 0)
+		pr_info("prepared %d pci devices with %d threads\n", pctx.nr_jobs, n);
+	free(pctx.jobs);
+}
+
+/* release what vdev_prepare opened for the devices not initialized */
+static void
+unprepare_pci(void)
+{
+	struct pci_vdev_ops *ops;
+	struct businfo *bi;
+	struct funcinfo *fi;
+	int bus, slot, func;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				fi = &bi->slotinfo[slot].si_funcs[func];
+				if (fi->fi_prep == NULL)
+					continue;
+				ops = pci_emul_finddev(fi->fi_name);
+				if (ops && ops->vdev_unprepare)
+					ops->vdev_unprepare(fi->fi_prep);
+				fi->fi_prep = NULL;
+			}
+		}
+	}
+}
+
 int
 init_pci(struct vmctx *ctx)
 {
@@ -1478,6 +1617,7 @@ init_pci(struct vmctx *ctx)
 	pci_emul_membase32 = vm_get_lowmem_limit(ctx);
 	pci_emul_membase64 = PCI_EMUL_MEMBASE64;
 
+	prepare_pci(ctx);
 	create_gsi_sharing_groups();
 
 	for (bus = 0; bus < MAXBUSES; bus++) {
@@ -1659,6 +1799,7 @@ init_pci(struct vmctx *ctx)
 	return 0;
 
 pci_emul_init_fail:
+	unprepare_pci();
 	for (i = 0; i < 2; i++) {
 		for (bus = 0; bus < MAXBUSES && success_cnt[i] > 0; bus++) {
 			bi = pci_businfo[bus];
@@ -1810,6 +1951,9 @@ pci_bus_write_dsdt(int bus)
 	dsdt_line("  Device (PCI%01X)", bus);
 	dsdt_line("  {");
 	dsdt_line("    Name (_HID, EisaId (\"PNP0A03\"))");
+	/* the emulated devices belong to the first NUMA node */
+	if (numa_get_nr_nodes() > 0)
+		dsdt_line("    Name (_PXM, 0x00)");
 
 	dsdt_line("    Method (_BBN, 0, NotSerialized)");
 	dsdt_line("    {");
@@ -2241,6 +2385,52 @@ pci_walk_lintr(int bus, pci_lintr_cb cb, void *arg)
 	}
 }
 
+/*
+ * Call cb for every emulated device, stop at the first non-zero return and
+ * return it.
+ */
+int
+pci_walk_vdevs(pci_vdev_cb cb, void *arg)
+{
+	struct businfo *bi;
+	struct pci_vdev *dev;
+	int bus, slot, func, ret;
+
+	for (bus = 0; bus < MAXBUSES; bus++) {
+		bi = pci_businfo[bus];
+		if (bi == NULL)
+			continue;
+		for (slot = 0; slot < MAXSLOTS; slot++) {
+			for (func = 0; func < MAXFUNCS; func++) {
+				dev = bi->slotinfo[slot].si_funcs[func].fi_devi;
+				if (dev == NULL)
+					continue;
+				ret = cb(dev, arg);
+				if (ret != 0)
+					return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * vdev_save/vdev_load for the devices with no state beyond their options and
+ * configuration space, which the guest restores on resume from S3.
+ */
+ssize_t
+pci_save_nostate(struct vmctx *ctx, struct pci_vdev *dev, void *buf, size_t len)
+{
+	return 0;
+}
+
+int
+pci_load_nostate(struct vmctx *ctx, struct pci_vdev *dev, const void *buf, size_t len)
+{
+	return 0;
+}
+
 /*
  * Return 1 if the emulated device in 'slot' is a multi-function device.
  * Return 0 otherwise.
@@ -2550,8 +2740,12 @@ int
 emulate_pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus, int slot,
 		  int func, int reg, int bytes, int *value)
 {
+	uint64_t start = exit_stats_begin();
+
 	pci_cfgrw(ctx, vcpu, in, bus, slot, func, reg,
 			bytes, (uint32_t *)value);
+	if (start)
+		pci_cfgrw_account(in, bus, slot, func, reg, start);
 	return 0;
 }
 
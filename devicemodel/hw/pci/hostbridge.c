@@ -62,5 +62,7 @@ DEFINE_PCI_DEVTYPE(pci_ops_amd_hostbridge);
 struct pci_vdev_ops pci_ops_hostbridge = {
 	.class_name	= "hostbridge",
 	.vdev_init	= pci_hostbridge_init,
+	.vdev_save	= pci_save_nostate,
+	.vdev_load	= pci_load_nostate,
 };
 DEFINE_PCI_DEVTYPE(pci_ops_hostbridge);
@@ -513,7 +513,9 @@ struct pci_vdev_ops pci_ops_lpc = {
 	.vdev_write_dsdt	= pci_lpc_write_dsdt,
 	.vdev_cfgwrite		= pci_lpc_cfgwrite,
 	.vdev_barwrite		= pci_lpc_write,
-	.vdev_barread		= pci_lpc_read
+	.vdev_barread		= pci_lpc_read,
+	.vdev_save		= pci_save_nostate,
+	.vdev_load		= pci_load_nostate
 };
 DEFINE_PCI_DEVTYPE(pci_ops_lpc);
 
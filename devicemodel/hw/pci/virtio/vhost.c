@@ -537,6 +537,12 @@ vhost_dev_init(struct vhost_dev *vdev,
 		goto fail;
 	}
 
+	/* vhost is kicked through ioeventfd, which is bypassed in ioreq polling mode */
+	if (ioreq_poll_time > 0) {
+		WPRINTF("vhost is not supported with ioreq polling\n");
+		goto fail;
+	}
+
 	vhost_kernel_init(vdev, base, fd, vq_idx, busyloop_timeout);
 
 	rc = vhost_kernel_get_features(vdev, &features);
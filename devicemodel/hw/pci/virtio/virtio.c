@@ -1967,6 +1967,30 @@ virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		base->vops->name, baridx);
 }
 
+/*
+ * The guest drivers reset the virtio devices when they are frozen for S3, and
+ * set them up again on resume, so there is no queue state to save. A device
+ * the guest didn't reset is refused.
+ */
+ssize_t
+virtio_pci_save(struct vmctx *ctx, struct pci_vdev *dev, void *buf, size_t len)
+{
+	struct virtio_base *base = dev->arg;
+
+	if (base->status != 0) {
+		pr_err("%s: not reset by the suspended guest, can't be saved\n",
+			base->vops->name);
+		return -1;
+	}
+	return 0;
+}
+
+int
+virtio_pci_load(struct vmctx *ctx, struct pci_vdev *dev, const void *buf, size_t len)
+{
+	return 0;
+}
+
 /**
  * @brief Get the virtio poll parameters
  *
@@ -1997,6 +2021,13 @@ int virtio_register_ioeventfd(struct virtio_base *base, int idx, bool is_registe
 	struct pcibar *bar;
 	int rc = 0;
 
+	/*
+	 * The ioreqs claimed by the DM in polling mode never reach the HSM
+	 * ioeventfd client, the kicks are emulated by the DM instead.
+	 */
+	if (ioreq_poll_time > 0)
+		return 0;
+
 	if (!is_register)
 		ioeventfd.flags = ACRN_IOEVENTFD_FLAG_DEASSIGN;
 
@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio balloon
+ *
+ * The host sets the number of pages it wants back from the guest with the
+ * "balloon" command of the command monitor, the guest driver allocates them
+ * and reports their PFNs on the inflate queue, and reports the pages it takes
+ * back on the deflate queue before using them (VIRTIO_BALLOON_F_MUST_TELL_HOST).
+ *
+ * The guest memory is backed by hugepages, so memory is only given back to
+ * the host for the 2M chunks which are ballooned as a whole: such a chunk is
+ * removed from the EPT, unpinned and punched out of the hugetlbfs file. This
+ * needs HSM to unpin the guest memory with ACRN_IOCTL_UNPIN_MEMSEG, which the
+ * upstream HSM driver doesn't provide yet, so the device is only created with
+ * --experimental_unpin and a HSM supporting it. A discarded chunk is mapped
+ * again as soon as one page of it is deflated. If the host is out of hugepages then,
+ * the deflate request is held and retried, as the guest only uses the pages
+ * after the request is completed.
+ *
+ * The memory statistics of the guest are requested every stats_interval
+ * seconds, if it's given, and logged.
+ *
+ * Usage: -s <slot>,virtio-balloon[,stats_interval=<seconds>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "monitor.h"
+#include "timer.h"
+#include "dm_string.h"
+#include "log.h"
+
+#define VIRTIO_BALLOON_RINGSZ		64
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST	(1 << 0)
+#define VIRTIO_BALLOON_F_STATS_VQ	(1 << 1)
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM	(1 << 2)
+
+#define VIRTIO_BALLOON_S_NAMES		10
+
+#define VIRTIO_BALLOON_PFN_SHIFT	12
+#define BALLOON_CHUNK_SHIFT		21
+#define BALLOON_PAGES_PER_CHUNK		(1U << (BALLOON_CHUNK_SHIFT - VIRTIO_BALLOON_PFN_SHIFT))
+#define BALLOON_MAX_PFNS		256
+#define BALLOON_RETRY_MS		100
+
+enum {
+	VIRTIO_BALLOON_INFLATEQ,
+	VIRTIO_BALLOON_DEFLATEQ,
+	VIRTIO_BALLOON_STATSQ,
+	VIRTIO_BALLOON_MAXQ
+};
+
+struct virtio_balloon_config {
+	uint32_t num_pages;
+	uint32_t actual;
+} __attribute__((packed));
+
+struct virtio_balloon_stat {
+	uint16_t tag;
+	uint64_t val;
+} __attribute__((packed));
+
+static const char *const balloon_stat_names[VIRTIO_BALLOON_S_NAMES] = {
+	"swap_in", "swap_out", "major_faults", "minor_faults", "free_memory",
+	"total_memory", "available_memory", "disk_caches", "hugetlb_allocations",
+	"hugetlb_failures"
+};
+
+/* chunk state, besides the number of ballooned pages in it */
+#define BALLOON_CHUNK_DISCARDED		0x8000
+#define BALLOON_CHUNK_PAGES		0x7fff
+
+struct virtio_balloon {
+	struct virtio_base base;
+	struct virtio_vq_info queues[VIRTIO_BALLOON_MAXQ];
+	pthread_mutex_t mtx;
+	struct virtio_balloon_config cfg;
+	struct vmctx *ctx;
+
+	/* one bit per guest page, and a counter per 2M chunk */
+	size_t nr_pages;
+	size_t low_pages;
+	uint64_t *bitmap;
+	uint16_t *chunks;
+
+	/* the stats buffer held until the next request */
+	bool stats_held;
+	uint16_t stats_idx;
+	uint64_t stats[VIRTIO_BALLOON_S_NAMES];
+	int stats_interval;
+	struct acrn_timer stats_timer;
+
+	/* the deflate request held till its chunks can be mapped again */
+	bool deflate_held;
+	uint16_t deflate_idx;
+	int deflate_n;
+	struct iovec deflate_iov[BALLOON_MAX_PFNS];
+	struct acrn_timer retry_timer;
+};
+
+static int virtio_balloon_debug;
+#define DPRINTF(params) do { if (virtio_balloon_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+/* only one balloon makes sense for a VM */
+static struct virtio_balloon *balloon_dev;
+
+static void virtio_balloon_reset(void *);
+static void virtio_balloon_notify(void *, struct virtio_vq_info *);
+static int virtio_balloon_cfgread(void *, int, int, uint32_t *);
+static int virtio_balloon_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_balloon_ops = {
+	"virtio_balloon",		/* our name */
+	VIRTIO_BALLOON_MAXQ,		/* we support 3 virtqueues */
+	sizeof(struct virtio_balloon_config), /* config reg size */
+	virtio_balloon_reset,		/* reset */
+	virtio_balloon_notify,		/* device-wide qnotify */
+	virtio_balloon_cfgread,		/* read virtio config */
+	virtio_balloon_cfgwrite,	/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+};
+
+/* index of a guest page in the bitmap, -1 if it isn't guest RAM */
+static int64_t
+balloon_page_index(struct virtio_balloon *balloon, uint32_t pfn)
+{
+	struct vmctx *ctx = balloon->ctx;
+	uint64_t gpa = (uint64_t)pfn << VIRTIO_BALLOON_PFN_SHIFT;
+
+	if (gpa < ctx->lowmem)
+		return pfn;
+	if ((gpa >= ctx->highmem_gpa_base) && (gpa < ctx->highmem_gpa_base + ctx->highmem))
+		return balloon->low_pages + ((gpa - ctx->highmem_gpa_base) >> VIRTIO_BALLOON_PFN_SHIFT);
+	return -1;
+}
+
+static vm_paddr_t
+balloon_chunk_gpa(struct virtio_balloon *balloon, size_t chunk)
+{
+	size_t page = chunk * BALLOON_PAGES_PER_CHUNK;
+
+	if (page < balloon->low_pages)
+		return (vm_paddr_t)page << VIRTIO_BALLOON_PFN_SHIFT;
+	return balloon->ctx->highmem_gpa_base +
+		((vm_paddr_t)(page - balloon->low_pages) << VIRTIO_BALLOON_PFN_SHIFT);
+}
+
+static void
+balloon_inflate_page(struct virtio_balloon *balloon, uint32_t pfn)
+{
+	int64_t page = balloon_page_index(balloon, pfn);
+	size_t chunk;
+
+	if (page < 0) {
+		WPRINTF(("%s: pfn 0x%x isn't guest memory\n", __func__, pfn));
+		return;
+	}
+	if (balloon->bitmap[page / 64] & (1UL << (page % 64)))
+		return;
+
+	balloon->bitmap[page / 64] |= 1UL << (page % 64);
+	chunk = page / BALLOON_PAGES_PER_CHUNK;
+	balloon->chunks[chunk]++;
+
+	if ((balloon->chunks[chunk] & BALLOON_CHUNK_PAGES) == BALLOON_PAGES_PER_CHUNK &&
+		vm_discard_memory(balloon->ctx, balloon_chunk_gpa(balloon, chunk),
+			1UL << BALLOON_CHUNK_SHIFT) == 0)
+		balloon->chunks[chunk] |= BALLOON_CHUNK_DISCARDED;
+}
+
+/*
+ * Return -1 if the chunk of the page can't be mapped again, the page is then
+ * kept in the balloon and the chunk discarded.
+ */
+static int
+balloon_deflate_page(struct virtio_balloon *balloon, uint32_t pfn)
+{
+	int64_t page = balloon_page_index(balloon, pfn);
+	size_t chunk;
+
+	if ((page < 0) || !(balloon->bitmap[page / 64] & (1UL << (page % 64))))
+		return 0;
+
+	chunk = page / BALLOON_PAGES_PER_CHUNK;
+	if (balloon->chunks[chunk] & BALLOON_CHUNK_DISCARDED) {
+		if (vm_populate_memory(balloon->ctx, balloon_chunk_gpa(balloon, chunk),
+				1UL << BALLOON_CHUNK_SHIFT) < 0)
+			return -1;
+		balloon->chunks[chunk] &= ~BALLOON_CHUNK_DISCARDED;
+	}
+
+	balloon->bitmap[page / 64] &= ~(1UL << (page % 64));
+	balloon->chunks[chunk]--;
+	return 0;
+}
+
+/* Return false if a page of a deflate request can't be given back yet */
+static bool
+virtio_balloon_proc_chain(struct virtio_balloon *balloon, struct virtio_vq_info *vq,
+	struct iovec *iov, int n)
+{
+	uint32_t *pfns;
+	size_t i, nr;
+	int j;
+
+	for (j = 0; j < n; j++) {
+		pfns = iov[j].iov_base;
+		nr = iov[j].iov_len / sizeof(uint32_t);
+		for (i = 0; i < nr; i++) {
+			if (vq == &balloon->queues[VIRTIO_BALLOON_INFLATEQ])
+				balloon_inflate_page(balloon, pfns[i]);
+			else if (balloon_deflate_page(balloon, pfns[i]) < 0)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+virtio_balloon_arm_retry(struct virtio_balloon *balloon)
+{
+	struct itimerspec ts;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_nsec = BALLOON_RETRY_MS * 1000000L;
+	acrn_timer_settime(&balloon->retry_timer, &ts);
+}
+
+/* inflate and deflate requests are arrays of 32-bit PFNs */
+static void
+virtio_balloon_proc_pfns(struct virtio_balloon *balloon, struct virtio_vq_info *vq)
+{
+	struct iovec iov[BALLOON_MAX_PFNS];
+	uint16_t idx;
+	int n;
+
+	/* the deflate requests are completed in order, after the held one */
+	if ((vq == &balloon->queues[VIRTIO_BALLOON_DEFLATEQ]) && balloon->deflate_held)
+		return;
+
+	while (vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx, iov, BALLOON_MAX_PFNS, NULL);
+		if (n < 0) {
+			WPRINTF(("%s: failed to get the chain\n", __func__));
+			break;
+		}
+
+		if (!virtio_balloon_proc_chain(balloon, vq, iov, n)) {
+			WPRINTF(("%s: out of memory to deflate, retry in %d ms\n",
+				__func__, BALLOON_RETRY_MS));
+			balloon->deflate_held = true;
+			balloon->deflate_idx = idx;
+			balloon->deflate_n = n;
+			memcpy(balloon->deflate_iov, iov, sizeof(struct iovec) * n);
+			virtio_balloon_arm_retry(balloon);
+			break;
+		}
+
+		vq_relchain(vq, idx, 0);
+	}
+
+	vq_endchains(vq, 1);
+}
+
+static void
+virtio_balloon_retry_timer(void *arg, uint64_t nexp)
+{
+	struct virtio_balloon *balloon = arg;
+	struct virtio_vq_info *vq = &balloon->queues[VIRTIO_BALLOON_DEFLATEQ];
+
+	pthread_mutex_lock(&balloon->mtx);
+	if (balloon->deflate_held) {
+		if (virtio_balloon_proc_chain(balloon, vq, balloon->deflate_iov,
+				balloon->deflate_n)) {
+			balloon->deflate_held = false;
+			vq_relchain(vq, balloon->deflate_idx, 0);
+			virtio_balloon_proc_pfns(balloon, vq);
+		} else
+			virtio_balloon_arm_retry(balloon);
+	}
+	pthread_mutex_unlock(&balloon->mtx);
+}
+
+static void
+virtio_balloon_proc_stats(struct virtio_balloon *balloon, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon_stat *stat;
+	struct iovec iov;
+	uint16_t idx;
+	size_t i;
+
+	if (!vq_has_descs(vq))
+		return;
+	if (vq_getchain(vq, &idx, &iov, 1, NULL) < 1) {
+		WPRINTF(("%s: failed to get the chain\n", __func__));
+		return;
+	}
+
+	stat = iov.iov_base;
+	for (i = 0; i < iov.iov_len / sizeof(*stat); i++) {
+		if (stat[i].tag < VIRTIO_BALLOON_S_NAMES)
+			balloon->stats[stat[i].tag] = stat[i].val;
+	}
+
+	/* the guest updates the stats when it gets the buffer back */
+	balloon->stats_idx = idx;
+	balloon->stats_held = true;
+
+	for (i = 0; i < VIRTIO_BALLOON_S_NAMES; i++)
+		pr_info("virtio_balloon: %s %lu\n", balloon_stat_names[i], balloon->stats[i]);
+}
+
+static void
+virtio_balloon_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	pthread_mutex_lock(&balloon->mtx);
+	if (vq == &balloon->queues[VIRTIO_BALLOON_STATSQ])
+		virtio_balloon_proc_stats(balloon, vq);
+	else
+		virtio_balloon_proc_pfns(balloon, vq);
+	pthread_mutex_unlock(&balloon->mtx);
+}
+
+static void
+virtio_balloon_stats_timer(void *arg, uint64_t nexp)
+{
+	struct virtio_balloon *balloon = arg;
+	struct virtio_vq_info *vq = &balloon->queues[VIRTIO_BALLOON_STATSQ];
+
+	pthread_mutex_lock(&balloon->mtx);
+	if (balloon->stats_held) {
+		balloon->stats_held = false;
+		vq_relchain(vq, balloon->stats_idx, 0);
+		vq_endchains(vq, 1);
+	}
+	pthread_mutex_unlock(&balloon->mtx);
+}
+
+static int
+virtio_balloon_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	/* our caller has already verified offset and size */
+	memcpy(retval, (uint8_t *)&balloon->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_balloon_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	if ((offset == offsetof(struct virtio_balloon_config, actual)) && (size == 4)) {
+		balloon->cfg.actual = value;
+		DPRINTF(("virtio_balloon: %u pages in the balloon\n", value));
+		return 0;
+	}
+
+	DPRINTF(("virtio_balloon: write to readonly reg %d\n", offset));
+	return -1;
+}
+
+/* give all the memory back to the guest */
+static void
+virtio_balloon_deflate_all(struct virtio_balloon *balloon)
+{
+	size_t chunk, nr_chunks = balloon->nr_pages / BALLOON_PAGES_PER_CHUNK;
+
+	for (chunk = 0; chunk < nr_chunks; chunk++) {
+		if ((balloon->chunks[chunk] & BALLOON_CHUNK_DISCARDED) &&
+			(vm_populate_memory(balloon->ctx, balloon_chunk_gpa(balloon, chunk),
+				1UL << BALLOON_CHUNK_SHIFT) < 0))
+			WPRINTF(("%s: chunk 0x%lx isn't back!\n", __func__,
+				balloon_chunk_gpa(balloon, chunk)));
+		balloon->chunks[chunk] = 0;
+	}
+	memset(balloon->bitmap, 0, ((balloon->nr_pages + 63) / 64) * sizeof(uint64_t));
+}
+
+static void
+virtio_balloon_reset(void *vdev)
+{
+	struct virtio_balloon *balloon = vdev;
+
+	DPRINTF(("virtio_balloon: device reset requested\n"));
+	pthread_mutex_lock(&balloon->mtx);
+	virtio_balloon_deflate_all(balloon);
+	balloon->cfg.actual = 0;
+	balloon->stats_held = false;
+	balloon->deflate_held = false;
+	virtio_reset_dev(&balloon->base);
+	pthread_mutex_unlock(&balloon->mtx);
+}
+
+/*
+ * Set the guest memory size the balloon should leave the guest, e.g. "2G".
+ */
+int
+vm_monitor_balloon(void *arg, char *size)
+{
+	struct virtio_balloon *balloon = balloon_dev;
+	uint32_t num_pages, actual;
+	size_t target;
+
+	if (balloon == NULL) {
+		WPRINTF(("%s: no virtio-balloon device\n", __func__));
+		return -1;
+	}
+	if (vm_parse_memsize(size, &target) < 0) {
+		WPRINTF(("%s: invalid memory size %s\n", __func__, size));
+		return -1;
+	}
+
+	pthread_mutex_lock(&balloon->mtx);
+	balloon->cfg.num_pages = (target >= (balloon->nr_pages << VIRTIO_BALLOON_PFN_SHIFT)) ? 0 :
+		balloon->nr_pages - (target >> VIRTIO_BALLOON_PFN_SHIFT);
+	num_pages = balloon->cfg.num_pages;
+	actual = balloon->cfg.actual;
+	pthread_mutex_unlock(&balloon->mtx);
+
+	pr_notice("virtio_balloon: target %u pages, %u in the balloon\n",
+		num_pages, actual);
+	virtio_config_changed(&balloon->base);
+	return 0;
+}
+
+static int
+virtio_balloon_parse(struct virtio_balloon *balloon, char *opts)
+{
+	char *cp, *opt, *val;
+
+	if (opts == NULL)
+		return 0;
+
+	cp = opts;
+	while ((opt = strsep(&cp, ",")) != NULL) {
+		val = opt;
+		opt = strsep(&val, "=");
+		if (!strcmp(opt, "stats_interval") && val &&
+			!dm_strtoi(val, NULL, 10, &balloon->stats_interval) &&
+			(balloon->stats_interval >= 0))
+			continue;
+
+		WPRINTF(("virtio_balloon: invalid option %s\n", opt));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+virtio_balloon_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *balloon;
+	struct itimerspec ts;
+	pthread_mutexattr_t attr;
+	size_t nr_chunks;
+	int i;
+
+	if (balloon_dev) {
+		WPRINTF(("virtio_balloon: only one device is supported\n"));
+		return -1;
+	}
+
+	balloon = calloc(1, sizeof(struct virtio_balloon));
+	if (!balloon) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		return -1;
+	}
+
+	if (virtio_balloon_parse(balloon, opts))
+		goto fail;
+
+	if (!vm_can_unpin_memory(ctx)) {
+		WPRINTF(("virtio_balloon: needs --experimental_unpin and HSM support "
+			"of ACRN_IOCTL_UNPIN_MEMSEG\n"));
+		goto fail;
+	}
+
+	balloon->ctx = ctx;
+	balloon->low_pages = ctx->lowmem >> VIRTIO_BALLOON_PFN_SHIFT;
+	balloon->nr_pages = (ctx->lowmem + ctx->highmem) >> VIRTIO_BALLOON_PFN_SHIFT;
+	nr_chunks = (balloon->nr_pages + BALLOON_PAGES_PER_CHUNK - 1) / BALLOON_PAGES_PER_CHUNK;
+	balloon->bitmap = calloc((balloon->nr_pages + 63) / 64, sizeof(uint64_t));
+	balloon->chunks = calloc(nr_chunks, sizeof(uint16_t));
+	if (!balloon->bitmap || !balloon->chunks) {
+		WPRINTF(("virtio_balloon: calloc returns NULL\n"));
+		goto fail;
+	}
+
+	/* init mutex attribute properly to avoid deadlock */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&balloon->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	virtio_linkup(&balloon->base, &virtio_balloon_ops, balloon, dev,
+		balloon->queues, BACKEND_VBSU);
+	balloon->base.mtx = &balloon->mtx;
+	balloon->base.device_caps = VIRTIO_BALLOON_F_MUST_TELL_HOST |
+		VIRTIO_BALLOON_F_STATS_VQ | VIRTIO_BALLOON_F_DEFLATE_ON_OOM;
+	for (i = 0; i < VIRTIO_BALLOON_MAXQ; i++)
+		balloon->queues[i].qsize = VIRTIO_BALLOON_RINGSZ;
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, VIRTIO_DEV_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_OTHER);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_BALLOON);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+
+	if (virtio_interrupt_init(&balloon->base, virtio_uses_msix())) {
+		pthread_mutex_destroy(&balloon->mtx);
+		goto fail;
+	}
+	virtio_set_io_bar(&balloon->base, 0);
+
+	balloon->retry_timer.clockid = CLOCK_MONOTONIC;
+	acrn_timer_init(&balloon->retry_timer, virtio_balloon_retry_timer, balloon);
+
+	if (balloon->stats_interval > 0) {
+		balloon->stats_timer.clockid = CLOCK_MONOTONIC;
+		acrn_timer_init(&balloon->stats_timer, virtio_balloon_stats_timer, balloon);
+		memset(&ts, 0, sizeof(ts));
+		ts.it_value.tv_sec = balloon->stats_interval;
+		ts.it_interval.tv_sec = balloon->stats_interval;
+		acrn_timer_settime(&balloon->stats_timer, &ts);
+	}
+
+	balloon_dev = balloon;
+	return 0;
+
+fail:
+	free(balloon->chunks);
+	free(balloon->bitmap);
+	free(balloon);
+	return -1;
+}
+
+static void
+virtio_balloon_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_balloon *balloon = dev->arg;
+
+	if (balloon == NULL)
+		return;
+
+	if (balloon->stats_interval > 0)
+		acrn_timer_deinit(&balloon->stats_timer);
+	acrn_timer_deinit(&balloon->retry_timer);
+	virtio_balloon_reset(balloon);
+	pthread_mutex_destroy(&balloon->mtx);
+	free(balloon->chunks);
+	free(balloon->bitmap);
+	free(balloon);
+	balloon_dev = NULL;
+	dev->arg = NULL;
+}
+
+struct pci_vdev_ops pci_ops_virtio_balloon = {
+	.class_name	= "virtio-balloon",
+	.vdev_init	= virtio_balloon_init,
+	.vdev_deinit	= virtio_balloon_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_balloon);
@@ -456,6 +456,38 @@ virtio_blk_update_config_space(struct virtio_blk *blk)
 	blk->base.device_caps =
 		virtio_blk_get_caps(blk, !!blk->cfg.writeback);
 }
+/* open the backing file ahead of virtio_blk_init(), the same way as it does */
+static void *
+virtio_blk_prepare(struct vmctx *ctx, int slot, int func, const char *opts)
+{
+	struct blockif_ctxt *bctxt;
+	char bident[16];
+	char *opts_start, *opts_tmp, *opt;
+
+	if ((opts == NULL) || (strstr(opts, "nodisk") != NULL))
+		return NULL;
+
+	if (snprintf(bident, sizeof(bident), "%d:%d", slot, func) >= sizeof(bident))
+		return NULL;
+
+	opts_start = opts_tmp = strdup(opts);
+	if (!opts_start)
+		return NULL;
+	opt = strsep(&opts_tmp, ",");
+	if (strcmp("iothread", opt) != 0)
+		opts_tmp = opts_start;
+	bctxt = blockif_open(opts_tmp, bident);
+	free(opts_start);
+
+	return bctxt;
+}
+
+static void
+virtio_blk_unprepare(void *prep)
+{
+	blockif_close(prep);
+}
+
 static int
 virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 {
@@ -508,7 +540,11 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 		} else {
 			opts_tmp = opts_start;
 		}
-		bctxt = blockif_open(opts_tmp, bident);
+		if (dev->prep)
+			bctxt = dev->prep;
+		else
+			bctxt = blockif_open(opts_tmp, bident);
+		dev->prep = NULL;
 		if (bctxt == NULL) {
 			pr_err("Could not open backing file");
 			free(opts_start);
@@ -521,6 +557,8 @@ virtio_blk_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	blk = calloc(1, sizeof(struct virtio_blk));
 	if (!blk) {
 		WPRINTF(("virtio_blk: calloc returns NULL\n"));
+		if (bctxt)
+			blockif_close(bctxt);
 		return -1;
 	}
 
@@ -812,8 +850,12 @@ end:
 struct pci_vdev_ops pci_ops_virtio_blk = {
 	.class_name	= "virtio-blk",
 	.vdev_init	= virtio_blk_init,
+	.vdev_prepare	= virtio_blk_prepare,
+	.vdev_unprepare	= virtio_blk_unprepare,
 	.vdev_deinit	= virtio_blk_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_pci_save,
+	.vdev_load	= virtio_pci_load
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_blk);
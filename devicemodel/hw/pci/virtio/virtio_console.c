@@ -47,11 +47,22 @@
 #include "pci_core.h"
 #include "virtio.h"
 #include "mevent.h"
+#include "timer.h"
+#include "monitor.h"
 
 #define	VIRTIO_CONSOLE_RINGSZ	64
 #define	VIRTIO_CONSOLE_MAXPORTS	16
 #define	VIRTIO_CONSOLE_MAXQ	(VIRTIO_CONSOLE_MAXPORTS * 2 + 2)
 
+/* the iovecs of the chains moved by one writev or readv */
+#define	VIRTIO_CONSOLE_MAXSEGS	64
+/*
+ * the interval to retry writing to a backend which was full and can't be
+ * polled, doubled at each retry while it stays full
+ */
+#define	VIRTIO_CONSOLE_TX_RETRY_NS	(1000000UL)
+#define	VIRTIO_CONSOLE_TX_RETRY_MAX_NS	(128000000UL)
+
 #define	VIRTIO_CONSOLE_DEVICE_READY	0
 #define	VIRTIO_CONSOLE_DEVICE_ADD	1
 #define	VIRTIO_CONSOLE_DEVICE_REMOVE	2
@@ -81,6 +92,17 @@ struct virtio_console_port;
 struct virtio_console_config;
 typedef void (virtio_console_cb_t)(struct virtio_console_port *, void *,
 				   struct iovec *, int);
+/*
+ * Write the data of a batch of chains to the backend. Return the bytes
+ * taken, 0 if the backend can't take any now, or -1 if the data is dropped.
+ */
+typedef int (virtio_console_write_t)(struct virtio_console_port *, void *,
+				     struct iovec *, int);
+/*
+ * Have the TX queue retried once the backend takes data again. Return -1 if
+ * the backend can't be polled for it.
+ */
+typedef int (virtio_console_wait_t)(struct virtio_console_port *, void *);
 
 enum virtio_console_be_type {
 	VIRTIO_CONSOLE_BE_STDIO = 0,
@@ -104,12 +126,35 @@ struct virtio_console_port {
 	int			txq;
 	void			*arg;
 	virtio_console_cb_t	*cb;
+	virtio_console_write_t	*write;
+	virtio_console_wait_t	*wait_tx;
+
+	/*
+	 * The guest's TX queue is stalled while the backend is full, with
+	 * tx_off bytes of its first chain written. It's retried when the
+	 * backend is writable again, or by tx_timer after tx_retry_ns if the
+	 * backend can't be polled.
+	 */
+	bool			tx_stalled;
+	size_t			tx_off;
+	struct acrn_timer	tx_timer;
+	uint64_t		tx_retry_ns;
+
+	uint64_t		tx_bytes;
+	uint64_t		tx_writes;
+	uint64_t		tx_stalls;
+	uint64_t		tx_drops;	/* bytes */
+	uint64_t		rx_bytes;
+	uint64_t		rx_reads;
+	uint64_t		rx_drops;	/* bytes */
 };
 
 struct virtio_console_backend {
 	struct virtio_console_port	*port;
 	struct mevent			*evp;
 	struct mevent			*conn_evp;
+	/* polls a dup of fd for room while the TX queue is stalled */
+	struct mevent			*tx_evp;
 	int				fd;
 	int				server_fd;
 	bool				open;
@@ -131,6 +176,7 @@ struct virtio_console {
 	struct virtio_console_port	ports[VIRTIO_CONSOLE_MAXPORTS];
 	struct virtio_console_config	*config;
 	int				ref_count;
+	LIST_ENTRY(virtio_console)	link;
 };
 
 struct virtio_console_config {
@@ -185,14 +231,24 @@ static const char *virtio_console_be_table[VIRTIO_CONSOLE_BE_MAX] = {
 static struct termios virtio_console_saved_tio;
 static int virtio_console_saved_flags;
 
+/* the consoles, for their stats */
+static LIST_HEAD(, virtio_console) virtio_consoles = LIST_HEAD_INITIALIZER(virtio_consoles);
+static pthread_mutex_t virtio_consoles_mtx = PTHREAD_MUTEX_INITIALIZER;
+
 static void
 virtio_console_reset(void *vdev)
 {
 	struct virtio_console *console;
+	int i;
 
 	console = vdev;
 
 	DPRINTF(("vtcon: device reset requested!\n"));
+	for (i = 0; i < console->nports; i++) {
+		console->ports[i].tx_stalled = false;
+		console->ports[i].tx_off = 0;
+		console->ports[i].tx_retry_ns = 0;
+	}
 	virtio_reset_dev(&console->base);
 }
 
@@ -241,7 +297,7 @@ virtio_console_port_to_vq(struct virtio_console_port *port, bool tx_queue)
 
 static struct virtio_console_port *
 virtio_console_add_port(struct virtio_console *console, const char *name,
-			virtio_console_cb_t *cb, void *arg, bool is_console)
+			virtio_console_write_t *write, void *arg, bool is_console)
 {
 	struct virtio_console_port *port;
 
@@ -254,7 +310,7 @@ virtio_console_add_port(struct virtio_console *console, const char *name,
 	port->id = console->nports - 1;
 	port->console = console;
 	port->name = name;
-	port->cb = cb;
+	port->write = write;
 	port->arg = arg;
 	port->is_console = is_console;
 
@@ -379,6 +435,170 @@ virtio_console_control_send(struct virtio_console *console,
 	vq_endchains(vq, 1);
 }
 
+/*
+ * Take the available chains, as many as VIRTIO_CONSOLE_MAXSEGS iovecs hold.
+ * A chain longer than that is truncated when it's the first one, or left
+ * for the next batch. Return the number of chains taken.
+ */
+static int
+virtio_console_getchains(struct virtio_vq_info *vq, uint16_t *idx,
+			 int *nseg, struct iovec *iov, int *niov)
+{
+	int n, nchains = 0;
+
+	*niov = 0;
+	while (*niov < VIRTIO_CONSOLE_MAXSEGS && vq_has_descs(vq)) {
+		n = vq_getchain(vq, &idx[nchains], &iov[*niov],
+				VIRTIO_CONSOLE_MAXSEGS - *niov, NULL);
+		if (n < 1) {
+			pr_err("%s: fail to getchain!\n", __func__);
+			break;
+		}
+		if (n > VIRTIO_CONSOLE_MAXSEGS - *niov) {
+			if (nchains > 0) {
+				vq_retchain(vq);
+				break;
+			}
+			n = VIRTIO_CONSOLE_MAXSEGS;
+		}
+		nseg[nchains++] = n;
+		*niov += n;
+	}
+
+	return nchains;
+}
+
+static size_t
+virtio_console_iov_len(struct iovec *iov, int niov)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* retry the stalled TX queue once the backend has room, or after a while */
+static void
+virtio_console_tx_wait(struct virtio_console_port *port)
+{
+	struct itimerspec ts;
+	uint64_t ns;
+
+	if ((port->wait_tx != NULL) && (port->wait_tx(port, port->arg) == 0))
+		return;
+
+	/* back off while the backend stays full */
+	ns = port->tx_retry_ns ? port->tx_retry_ns : VIRTIO_CONSOLE_TX_RETRY_NS;
+	port->tx_retry_ns = MIN(ns * 2, VIRTIO_CONSOLE_TX_RETRY_MAX_NS);
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = ns / NS_PER_SEC;
+	ts.it_value.tv_nsec = ns % NS_PER_SEC;
+	if (acrn_timer_settime(&port->tx_timer, &ts))
+		WPRINTF(("vtcon: failed to set the tx timer\n"));
+}
+
+/*
+ * Write the chains of the guest's TX queue to the backend, a batch per
+ * writev. When the backend is full, the chains not written are left in the
+ * queue and the queue is stalled until there's room in the backend.
+ * Console ports drop the data instead, as the guest spins on the console
+ * writes until they are used.
+ */
+static void
+virtio_console_port_tx(struct virtio_console_port *port,
+		       struct virtio_vq_info *vq)
+{
+	struct iovec iov[VIRTIO_CONSOLE_MAXSEGS], *wiov;
+	uint16_t idx[VIRTIO_CONSOLE_MAXSEGS];
+	int nseg[VIRTIO_CONSOLE_MAXSEGS];
+	size_t clen[VIRTIO_CONSOLE_MAXSEGS];
+	size_t total, skip, done;
+	int nchains, niov, wniov, i, j, ret;
+
+	while (!port->tx_stalled && vq_has_descs(vq)) {
+		nchains = virtio_console_getchains(vq, idx, nseg, iov, &niov);
+		if (nchains == 0)
+			break;
+
+		total = 0;
+		for (i = 0, wiov = iov; i < nchains; wiov += nseg[i++]) {
+			clen[i] = virtio_console_iov_len(wiov, nseg[i]);
+			total += clen[i];
+		}
+
+		/* skip what was written of the first chain before the stall */
+		wiov = iov;
+		wniov = niov;
+		for (skip = port->tx_off; skip > 0 && wniov > 0; ) {
+			if (skip < wiov->iov_len) {
+				wiov->iov_base = (char *)wiov->iov_base + skip;
+				wiov->iov_len -= skip;
+				break;
+			}
+			skip -= wiov->iov_len;
+			wiov++;
+			wniov--;
+		}
+
+		ret = 0;
+		if (total > port->tx_off) {
+			ret = port->write(port, port->arg, wiov, wniov);
+			if (ret == 0 && port->is_console)
+				ret = -1;
+			if (ret > 0) {
+				port->tx_bytes += ret;
+				port->tx_writes++;
+				port->tx_retry_ns = 0;
+			}
+		}
+
+		if (ret < 0) {
+			port->tx_drops += total - port->tx_off;
+			done = total;
+		} else
+			done = port->tx_off + ret;
+
+		for (i = 0; i < nchains && done >= clen[i]; i++) {
+			done -= clen[i];
+			vq_relchain(vq, idx[i], 0);
+		}
+		port->tx_off = 0;
+
+		if (i < nchains) {
+			/* the backend is full, stall on the chains left */
+			port->tx_off = done;
+			for (j = i; j < nchains; j++)
+				vq_retchain(vq);
+
+			port->tx_stalled = true;
+			port->tx_stalls++;
+			virtio_console_tx_wait(port);
+		}
+	}
+	vq_endchains(vq, 1);	/* Generate interrupt if appropriate. */
+}
+
+static void
+virtio_console_tx_retry(void *arg, uint64_t nexp __attribute__((unused)))
+{
+	struct virtio_console_port *port = arg;
+	struct virtio_console *console = port->console;
+
+	if (console == NULL)
+		return;
+
+	pthread_mutex_lock(&console->mtx);
+	if (port->tx_stalled) {
+		port->tx_stalled = false;
+		virtio_console_port_tx(port,
+			virtio_console_port_to_vq(port, false));
+	}
+	pthread_mutex_unlock(&console->mtx);
+}
+
 static void
 virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 {
@@ -391,6 +611,11 @@ virtio_console_notify_tx(void *vdev, struct virtio_vq_info *vq)
 	console = vdev;
 	port = virtio_console_vq_to_port(console, vq);
 
+	if ((port != NULL) && (port->write != NULL)) {
+		virtio_console_port_tx(port, vq);
+		return;
+	}
+
 	while (vq_has_descs(vq)) {
 		if (vq_getchain(vq, &idx, iov, 1, flags) < 1) {
 			pr_err("%s: fail to getchain!\n", __func__);
@@ -432,6 +657,8 @@ virtio_console_reset_backend(struct virtio_console_backend *be)
 
 	if (be->evp)
 		mevent_disable(be->evp);
+	if (be->tx_evp)
+		mevent_disable(be->tx_evp);
 	if (be->fd != STDIN_FILENO)
 		close(be->fd);
 	be->fd = -1;
@@ -459,10 +686,12 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	struct virtio_console_port *port;
 	struct virtio_console_backend *be = arg;
 	struct virtio_vq_info *vq;
-	struct iovec iov;
+	struct iovec iov[VIRTIO_CONSOLE_MAXSEGS], *riov;
+	uint16_t idx[VIRTIO_CONSOLE_MAXSEGS];
+	int nseg[VIRTIO_CONSOLE_MAXSEGS];
 	static char dummybuf[2048];
-	int len, n;
-	uint16_t idx;
+	int len, i, nchains, niov;
+	size_t clen, left, total;
 
 	port = be->port;
 	vq = virtio_console_port_to_vq(port, true);
@@ -471,6 +700,8 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 		len = read(be->fd, dummybuf, sizeof(dummybuf));
 		if (len == 0)
 			goto close;
+		if (len > 0)
+			port->rx_drops += len;
 		return;
 	}
 
@@ -479,18 +710,22 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 		vq_endchains(vq, 1);
 		if (len == 0)
 			goto close;
+		if (len > 0)
+			port->rx_drops += len;
 		return;
 	}
 
+	/* read straight into the guest buffers, a batch of chains at a time */
 	do {
-		n = vq_getchain(vq, &idx, &iov, 1, NULL);
-		if (n < 1){
-			pr_err("%s: fail to getchain!\n", __func__);
+		nchains = virtio_console_getchains(vq, idx, nseg, iov, &niov);
+		if (nchains == 0)
 			break;
-		}
-		len = readv(be->fd, &iov, n);
+
+		total = virtio_console_iov_len(iov, niov);
+		len = readv(be->fd, iov, niov);
 		if (len <= 0) {
-			vq_retchain(vq);
+			for (i = 0; i < nchains; i++)
+				vq_retchain(vq);
 			vq_endchains(vq, 0);
 
 			/* no data available */
@@ -505,9 +740,22 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 			/* any other errors */
 			goto close;
 		}
-
-		vq_relchain(vq, idx, len);
-	} while (vq_has_descs(vq));
+		port->rx_bytes += len;
+		port->rx_reads++;
+
+		/* release the chains filled, and return the ones not used */
+		left = len;
+		for (i = 0, riov = iov; i < nchains && left > 0;
+				riov += nseg[i++]) {
+			clen = virtio_console_iov_len(riov, nseg[i]);
+			if (clen > left)
+				clen = left;
+			vq_relchain(vq, idx[i], clen);
+			left -= clen;
+		}
+		for (; i < nchains; i++)
+			vq_retchain(vq);
+	} while ((size_t)len == total && vq_has_descs(vq));
 
 	vq_endchains(vq, 1);
 	return;
@@ -528,7 +776,7 @@ clear:
 	}
 }
 
-static void
+static int
 virtio_console_backend_write(struct virtio_console_port *port, void *arg,
 			     struct iovec *iov, int niov)
 {
@@ -538,13 +786,14 @@ virtio_console_backend_write(struct virtio_console_port *port, void *arg,
 	be = arg;
 
 	if (be->fd == -1)
-		return;
+		return -1;
 
 	ret = writev(be->fd, iov, niov);
 	if (ret <= 0) {
 		/* Case 1:backend cannot receive more data. For example when pts is
 		 * not connected to any client, its tty buffer will become full.
-		 * In this case we just drop data from guest hvc console.
+		 * In this case the TX queue is stalled until the backend takes
+		 * data again, or data from guest hvc console is dropped.
 		 *
 		 * Case 2: Backend connection not yet setup. For example, when
 		 * virtio-console is used as console port with socket backend, guest
@@ -557,19 +806,73 @@ virtio_console_backend_write(struct virtio_console_port *port, void *arg,
 		 * PS: For Kata, the runtime first launches VM and then proxy which
 		 * acts as a client connects to this socket.
 		 */
-		if (ret == -1 && (errno == EAGAIN || errno == ENOTCONN))
-			return;
+		if (ret == 0 || (ret == -1 && errno == EAGAIN))
+			return 0;
+		if (ret == -1 && errno == ENOTCONN)
+			return -1;
 
 		if (ret == -1 && errno == EBADF) {
 			if (be->be_type == VIRTIO_CONSOLE_BE_SOCKET && (be->socket_type == NULL
 				|| !strcmp(be->socket_type,"server"))) {
 				virtio_console_socket_clear(be);
-				return;
+				return -1;
 			}
 		}
 		virtio_console_reset_backend(be);
 		WPRINTF(("vtcon: be write failed! errno = %d\n", errno));
+		return -1;
 	}
+
+	return ret;
+}
+
+static void
+virtio_console_backend_writable(int fd __attribute__((unused)),
+				enum ev_type t __attribute__((unused)), void *arg)
+{
+	struct virtio_console_backend *be = arg;
+	struct virtio_console_port *port = be->port;
+
+	if ((port == NULL) || (port->console == NULL))
+		return;
+
+	/* level-triggered, so polled again only by the next stall */
+	pthread_mutex_lock(&port->console->mtx);
+	mevent_disable(be->tx_evp);
+	pthread_mutex_unlock(&port->console->mtx);
+
+	virtio_console_tx_retry(port, 0);
+}
+
+/*
+ * Poll the backend for room on a dup of its fd, as fd may be polled for
+ * reading already. Socket backends change fd on reconnection, and regular
+ * files can't be polled, so those are retried by the timer instead.
+ */
+static int
+virtio_console_backend_wait_tx(struct virtio_console_port *port, void *arg)
+{
+	struct virtio_console_backend *be = arg;
+	int fd;
+
+	if ((be->fd < 0) || (be->be_type == VIRTIO_CONSOLE_BE_SOCKET) ||
+		(be->be_type == VIRTIO_CONSOLE_BE_FILE))
+		return -1;
+
+	if (be->tx_evp)
+		return mevent_enable(be->tx_evp);
+
+	fd = dup(be->fd);
+	if (fd < 0)
+		return -1;
+	be->tx_evp = mevent_add(fd, EVF_WRITE, virtio_console_backend_writable,
+			be, NULL, NULL);
+	if (be->tx_evp == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	return 0;
 }
 
 static void
@@ -913,6 +1216,15 @@ virtio_console_add_backend(struct virtio_console *console, char *opt)
 		goto out;
 	}
 
+	be->port->wait_tx = virtio_console_backend_wait_tx;
+	be->port->tx_timer.clockid = CLOCK_MONOTONIC;
+	if (acrn_timer_init(&be->port->tx_timer, virtio_console_tx_retry,
+			be->port) < 0) {
+		WPRINTF(("vtcon: failed to init the tx timer\n"));
+		error = -1;
+		goto out;
+	}
+
 	if (virtio_console_backend_can_read(be_type)) {
 		if (be->be_type == VIRTIO_CONSOLE_BE_SOCKET && (be->socket_type == NULL
 			|| !strcmp(be->socket_type,"server"))) {
@@ -947,6 +1259,7 @@ out:
 	if (error != 0) {
 		if (be) {
 			if (be->port) {
+				acrn_timer_deinit(&be->port->tx_timer);
 				be->port->enabled = false;
 				be->port->arg = NULL;
 			}
@@ -1012,14 +1325,62 @@ virtio_console_close_backend(struct virtio_console_backend *be)
 		be->fd = -1;
 	}
 
+	if (be->tx_evp) {
+		mevent_delete_close(be->tx_evp);
+		be->tx_evp = NULL;
+	}
+
+	pr_info("vtcon: port %s: tx %lu bytes in %lu writes, %lu stalls, "
+		"%lu bytes dropped; rx %lu bytes in %lu reads, %lu bytes "
+		"dropped\n", be->port->name, be->port->tx_bytes,
+		be->port->tx_writes, be->port->tx_stalls, be->port->tx_drops,
+		be->port->rx_bytes, be->port->rx_reads, be->port->rx_drops);
+	acrn_timer_deinit(&be->port->tx_timer);
 	memset(be->port, 0, sizeof(*be->port));
 	free(be);
 }
 
+/* the stats of the console ports, for the command monitor */
+int
+vm_monitor_console_stats(void *arg, struct console_port_stats *stats, int max)
+{
+	struct virtio_console *console;
+	struct virtio_console_port *port;
+	int i, n = 0;
+
+	pthread_mutex_lock(&virtio_consoles_mtx);
+	LIST_FOREACH(console, &virtio_consoles, link) {
+		pthread_mutex_lock(&console->mtx);
+		for (i = 0; (i < console->nports) && (n < max); i++) {
+			port = &console->ports[i];
+			if (!port->enabled || (port->write == NULL))
+				continue;
+			snprintf(stats[n].name, sizeof(stats[n].name), "%s",
+				port->name ? port->name : "");
+			stats[n].tx_bytes = port->tx_bytes;
+			stats[n].tx_writes = port->tx_writes;
+			stats[n].tx_stalls = port->tx_stalls;
+			stats[n].tx_drops = port->tx_drops;
+			stats[n].rx_bytes = port->rx_bytes;
+			stats[n].rx_reads = port->rx_reads;
+			stats[n].rx_drops = port->rx_drops;
+			n++;
+		}
+		pthread_mutex_unlock(&console->mtx);
+	}
+	pthread_mutex_unlock(&virtio_consoles_mtx);
+
+	return n;
+}
+
 static void
 virtio_console_destroy(struct virtio_console *console)
 {
 	if (console) {
+		pthread_mutex_lock(&virtio_consoles_mtx);
+		LIST_REMOVE(console, link);
+		pthread_mutex_unlock(&virtio_consoles_mtx);
+
 		virtio_console_reset(console);
 		if (console->config)
 			free(console->config);
@@ -1178,6 +1539,11 @@ virtio_console_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	console->control_port.rxq = 3;
 	console->control_port.cb = virtio_console_control_tx;
 	console->control_port.enabled = true;
+
+	pthread_mutex_lock(&virtio_consoles_mtx);
+	LIST_INSERT_HEAD(&virtio_consoles, console, link);
+	pthread_mutex_unlock(&virtio_consoles_mtx);
+
 	if (virtio_console_add_backends(console, opts) < 0) {
 		return -1;
 	}
@@ -1209,6 +1575,8 @@ struct pci_vdev_ops pci_ops_virtio_console = {
 	.vdev_init	= virtio_console_init,
 	.vdev_deinit	= virtio_console_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_pci_save,
+	.vdev_load	= virtio_pci_load
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_console);
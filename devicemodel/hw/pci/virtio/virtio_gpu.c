@@ -30,6 +30,7 @@
 #include "console.h"
 #include "vga.h"
 #include "atomic.h"
+#include "monitor.h"
 
 /*
  * Queue definitions.
@@ -44,6 +45,24 @@
 #define VIRTIO_GPU_RINGSZ	64
 #define VIRTIO_GPU_MAXSEGS	256
 
+/*
+ * A transfer of at least VIRTIO_GPU_COPY_MIN_SIZE is copied by the copy
+ * threads together with the ctrl BH, VIRTIO_GPU_COPY_ROWS rows at a time.
+ */
+#define VIRTIO_GPU_COPY_THREADS		3
+#define VIRTIO_GPU_COPY_MIN_SIZE	(512 * 1024)
+#define VIRTIO_GPU_COPY_ROWS		16
+
+/*
+ * The dmabufs of the blob resources are cached after the resources are
+ * unref'ed, so a blob re-created on the same guest memory, like the buffers
+ * of a swapchain, reuses its dmabuf. Once the cached dmabufs are larger than
+ * VIRTIO_GPU_DMABUF_CACHE_SIZE, the least recently used ones are closed.
+ * The ones on guest memory given back to the host, e.g. by virtio-balloon,
+ * are closed right away, as they keep the pages from being freed.
+ */
+#define VIRTIO_GPU_DMABUF_CACHE_SIZE	(128 * MB)
+
 /*
  * Feature bits
  */
@@ -207,6 +226,10 @@ struct virtio_gpu_resource_create_2d {
 struct dma_buf_info {
 	int32_t ref_count;
 	int dmabuf_fd;
+	/* the memfd ranges of the dmabuf, the key in the cache */
+	struct udmabuf_create_list *list;
+	uint64_t size;
+	TAILQ_ENTRY(dma_buf_info) link;
 };
 
 struct virtio_gpu_resource_2d {
@@ -217,6 +240,10 @@ struct virtio_gpu_resource_2d {
 	pixman_image_t *image;
 	struct iovec *iov;
 	uint32_t iovcnt;
+	/* the offset of each iov in the backing, or its address if contiguous */
+	uint64_t *iov_offset;
+	uint64_t backing_size;
+	uint8_t *backing;
 	bool blob;
 	struct dma_buf_info *dma_info;
 	LIST_ENTRY(virtio_gpu_resource_2d) link;
@@ -366,6 +393,35 @@ struct virtio_gpu {
 	int32_t vga_thread_status;
 	uint8_t edid[VIRTIO_GPU_EDID_SIZE];
 	bool is_blob_supported;
+	/* the cached dmabufs, most recently used first */
+	TAILQ_HEAD(virtio_gpu_dmabuf_list, dma_buf_info) dmabuf_cache;
+	/* protects the cache, which the discard notifier also flushes */
+	pthread_mutex_t dmabuf_mtx;
+	uint64_t dmabuf_cache_size;
+	uint64_t dmabuf_hits;
+	uint64_t dmabuf_misses;
+	uint64_t dmabuf_evictions;
+	uint64_t dmabuf_discards;
+	pthread_t copy_tid[VIRTIO_GPU_COPY_THREADS];
+	int copy_threads;
+	pthread_mutex_t copy_mtx;
+	pthread_cond_t copy_cond;
+	pthread_cond_t copy_done;
+	struct virtio_gpu_copy *copy;
+	uint32_t copy_gen;
+	int copy_busy;
+	bool copy_stop;
+};
+
+/* the rows of a transfer_to_host_2d */
+struct virtio_gpu_copy {
+	struct virtio_gpu_resource_2d *r2d;
+	uint8_t *dst;		/* of the first row */
+	uint64_t offset;	/* of the first row in the backing */
+	uint32_t stride;
+	uint32_t row_size;
+	uint32_t height;
+	uint32_t next;		/* the next row to copy */
 };
 
 struct virtio_gpu_command {
@@ -384,6 +440,7 @@ static int virtio_gpu_cfgwrite(void *, int, int, uint32_t);
 static void virtio_gpu_neg_features(void *, uint64_t);
 static void virtio_gpu_set_status(void *, uint64_t);
 static void * virtio_gpu_vga_render(void *param);
+static void virtio_gpu_free_backing(struct virtio_gpu_resource_2d *r2d);
 
 static struct virtio_ops virtio_gpu_ops = {
 	"virtio-gpu",			/* our name */
@@ -397,6 +454,7 @@ static struct virtio_ops virtio_gpu_ops = {
 	virtio_gpu_set_status,		/* called on guest set status */
 };
 static int virtio_gpu_device_cnt = 0;
+static struct virtio_gpu *virtio_gpu_dev;
 
 static inline bool virtio_gpu_blob_supported(struct virtio_gpu *gpu)
 {
@@ -419,10 +477,95 @@ static void virtio_gpu_dmabuf_unref(struct dma_buf_info *info)
 	if (atomic_sub_fetch(&info->ref_count, 1) == 0) {
 		if (info->dmabuf_fd > 0)
 			close(info->dmabuf_fd);
+		free(info->list);
 		free(info);
 	}
 }
 
+/*
+ * drop the least recently used dmabufs until the cache is within size, with
+ * dmabuf_mtx held
+ */
+static void
+virtio_gpu_dmabuf_cache_trim(struct virtio_gpu *gpu, uint64_t size)
+{
+	struct dma_buf_info *info;
+
+	while ((gpu->dmabuf_cache_size > size) && !TAILQ_EMPTY(&gpu->dmabuf_cache)) {
+		info = TAILQ_LAST(&gpu->dmabuf_cache, virtio_gpu_dmabuf_list);
+		TAILQ_REMOVE(&gpu->dmabuf_cache, info, link);
+		gpu->dmabuf_cache_size -= info->size;
+		if (size > 0)
+			gpu->dmabuf_evictions++;
+		virtio_gpu_dmabuf_unref(info);
+	}
+}
+
+static void
+virtio_gpu_dmabuf_cache_flush(struct virtio_gpu *gpu)
+{
+	pthread_mutex_lock(&gpu->dmabuf_mtx);
+	virtio_gpu_dmabuf_cache_trim(gpu, 0);
+	pthread_mutex_unlock(&gpu->dmabuf_mtx);
+}
+
+static bool
+virtio_gpu_dmabuf_overlaps(struct dma_buf_info *info, int fd, uint64_t offset, size_t len)
+{
+	struct udmabuf_create_item *item;
+	uint32_t i;
+
+	for (i = 0; i < info->list->count; i++) {
+		item = &info->list->list[i];
+		if ((item->memfd == fd) && (item->offset < offset + len) &&
+			(offset < item->offset + item->size))
+			return true;
+	}
+
+	return false;
+}
+
+/* close the cached dmabufs on the guest memory being discarded */
+static void
+virtio_gpu_dmabuf_discard(void *arg, int fd, uint64_t offset, size_t len)
+{
+	struct virtio_gpu *gpu = arg;
+	struct dma_buf_info *info, *next;
+
+	pthread_mutex_lock(&gpu->dmabuf_mtx);
+	for (info = TAILQ_FIRST(&gpu->dmabuf_cache); info != NULL; info = next) {
+		next = TAILQ_NEXT(info, link);
+		if (!virtio_gpu_dmabuf_overlaps(info, fd, offset, len))
+			continue;
+
+		TAILQ_REMOVE(&gpu->dmabuf_cache, info, link);
+		gpu->dmabuf_cache_size -= info->size;
+		gpu->dmabuf_discards++;
+		virtio_gpu_dmabuf_unref(info);
+	}
+	pthread_mutex_unlock(&gpu->dmabuf_mtx);
+}
+
+/* the stats of the dmabuf cache, for the command monitor */
+int
+vm_monitor_gpu_stats(void *arg, struct gpu_dmabuf_stats *stats)
+{
+	struct virtio_gpu *gpu = virtio_gpu_dev;
+
+	if (gpu == NULL)
+		return -1;
+
+	pthread_mutex_lock(&gpu->dmabuf_mtx);
+	stats->cache_size = gpu->dmabuf_cache_size;
+	stats->hits = gpu->dmabuf_hits;
+	stats->misses = gpu->dmabuf_misses;
+	stats->evictions = gpu->dmabuf_evictions;
+	stats->discards = gpu->dmabuf_discards;
+	pthread_mutex_unlock(&gpu->dmabuf_mtx);
+
+	return 0;
+}
+
 static void
 virtio_gpu_set_status(void *vdev, uint64_t status)
 {
@@ -454,14 +597,12 @@ virtio_gpu_reset(void *vdev)
 				r2d->blob = false;
 			}
 			LIST_REMOVE(r2d, link);
-			if (r2d->iov) {
-				free(r2d->iov);
-				r2d->iov = NULL;
-			}
+			virtio_gpu_free_backing(r2d);
 			free(r2d);
 		}
 	}
 	LIST_INIT(&gpu->r2d_list);
+	virtio_gpu_dmabuf_cache_flush(gpu);
 	gpu->vga.enable = true;
 	pthread_mutex_lock(&gpu->vga_thread_mtx);
 	if (atomic_load(&gpu->vga_thread_status) == VGA_THREAD_EOL) {
@@ -581,6 +722,211 @@ virtio_gpu_cmd_get_display_info(struct virtio_gpu_command *cmd)
 	memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
 }
 
+static void
+virtio_gpu_free_backing(struct virtio_gpu_resource_2d *r2d)
+{
+	free(r2d->iov);
+	r2d->iov = NULL;
+	free(r2d->iov_offset);
+	r2d->iov_offset = NULL;
+	r2d->iovcnt = 0;
+	r2d->backing = NULL;
+	r2d->backing_size = 0;
+}
+
+/*
+ * Index the backing iovs by their offset in the backing, so the iov of an
+ * offset is found with a binary search. The iovs not mapped are skipped.
+ * If the iovs are contiguous in the DM, the backing is copied from directly.
+ * Without the index, e.g. out of memory, the iovs are walked from the first.
+ */
+static void
+virtio_gpu_index_backing(struct virtio_gpu_resource_2d *r2d)
+{
+	uint64_t offset = 0;
+	uint8_t *end = NULL;
+	bool contiguous = true;
+	int i;
+
+	r2d->iov_offset = malloc(r2d->iovcnt * sizeof(uint64_t));
+	if ((r2d->iov_offset == NULL) && (r2d->iovcnt > 0))
+		pr_warn("%s: no memory to index the backing of resource %d\n",
+			__func__, r2d->resource_id);
+	r2d->backing = NULL;
+	for (i = 0; i < r2d->iovcnt; i++) {
+		if (r2d->iov_offset)
+			r2d->iov_offset[i] = offset;
+		if ((r2d->iov[i].iov_base == NULL) || (r2d->iov[i].iov_len == 0))
+			continue;
+
+		if (r2d->backing == NULL)
+			r2d->backing = r2d->iov[i].iov_base;
+		else if (r2d->iov[i].iov_base != end)
+			contiguous = false;
+		end = (uint8_t *)r2d->iov[i].iov_base + r2d->iov[i].iov_len;
+		offset += r2d->iov[i].iov_len;
+	}
+	r2d->backing_size = offset;
+	if (!contiguous)
+		r2d->backing = NULL;
+}
+
+/* copy size bytes at offset of the backing, as much as the backing holds */
+static void
+virtio_gpu_read_backing(struct virtio_gpu_resource_2d *r2d, uint64_t offset,
+		uint8_t *dst, uint32_t size)
+{
+	uint32_t lo, hi, mid, i, bytes;
+	uint64_t skip;
+
+	if (offset >= r2d->backing_size)
+		return;
+
+	if (r2d->backing) {
+		memcpy(dst, r2d->backing + offset, MIN(size, r2d->backing_size - offset));
+		return;
+	}
+
+	/* the last iov starting at or before offset */
+	lo = 0;
+	hi = r2d->iov_offset ? r2d->iovcnt : 0;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (r2d->iov_offset[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	skip = r2d->iov_offset ? offset - r2d->iov_offset[lo] : offset;
+	for (i = lo; (i < r2d->iovcnt) && (size > 0); i++) {
+		if ((r2d->iov[i].iov_base == NULL) || (r2d->iov[i].iov_len == 0))
+			continue;
+		if (skip >= r2d->iov[i].iov_len) {
+			skip -= r2d->iov[i].iov_len;
+			continue;
+		}
+
+		bytes = MIN(size, r2d->iov[i].iov_len - skip);
+		memcpy(dst, (uint8_t *)r2d->iov[i].iov_base + skip, bytes);
+		dst += bytes;
+		size -= bytes;
+		skip = 0;
+	}
+}
+
+static void
+virtio_gpu_copy_rows(struct virtio_gpu_copy *copy)
+{
+	uint32_t h, first, last;
+
+	for (;;) {
+		first = atomic_fetch_add(&copy->next, VIRTIO_GPU_COPY_ROWS);
+		if (first >= copy->height)
+			break;
+
+		last = MIN(first + VIRTIO_GPU_COPY_ROWS, copy->height);
+		for (h = first; h < last; h++)
+			virtio_gpu_read_backing(copy->r2d,
+				copy->offset + (uint64_t)copy->stride * h,
+				copy->dst + (uint64_t)copy->stride * h,
+				copy->row_size);
+	}
+}
+
+static void *
+virtio_gpu_copy_thread(void *param)
+{
+	struct virtio_gpu *gpu = param;
+	struct virtio_gpu_copy *copy;
+	uint32_t gen = 0;
+
+	pthread_mutex_lock(&gpu->copy_mtx);
+	for (;;) {
+		while (!gpu->copy_stop && (gpu->copy_gen == gen))
+			pthread_cond_wait(&gpu->copy_cond, &gpu->copy_mtx);
+		if (gpu->copy_stop)
+			break;
+
+		gen = gpu->copy_gen;
+		copy = gpu->copy;
+		/* the copy may be over already */
+		if (copy == NULL)
+			continue;
+		gpu->copy_busy++;
+		pthread_mutex_unlock(&gpu->copy_mtx);
+
+		virtio_gpu_copy_rows(copy);
+
+		pthread_mutex_lock(&gpu->copy_mtx);
+		if (--gpu->copy_busy == 0)
+			pthread_cond_signal(&gpu->copy_done);
+	}
+	pthread_mutex_unlock(&gpu->copy_mtx);
+
+	return NULL;
+}
+
+static void
+virtio_gpu_copy(struct virtio_gpu *gpu, struct virtio_gpu_copy *copy)
+{
+	if ((gpu->copy_threads == 0) ||
+		((uint64_t)copy->row_size * copy->height < VIRTIO_GPU_COPY_MIN_SIZE)) {
+		virtio_gpu_copy_rows(copy);
+		return;
+	}
+
+	pthread_mutex_lock(&gpu->copy_mtx);
+	gpu->copy = copy;
+	gpu->copy_gen++;
+	pthread_cond_broadcast(&gpu->copy_cond);
+	pthread_mutex_unlock(&gpu->copy_mtx);
+
+	virtio_gpu_copy_rows(copy);
+
+	pthread_mutex_lock(&gpu->copy_mtx);
+	gpu->copy = NULL;
+	while (gpu->copy_busy > 0)
+		pthread_cond_wait(&gpu->copy_done, &gpu->copy_mtx);
+	pthread_mutex_unlock(&gpu->copy_mtx);
+}
+
+static void
+virtio_gpu_copy_init(struct virtio_gpu *gpu)
+{
+	char tname[MAXCOMLEN + 1];
+	int i;
+
+	pthread_mutex_init(&gpu->copy_mtx, NULL);
+	pthread_cond_init(&gpu->copy_cond, NULL);
+	pthread_cond_init(&gpu->copy_done, NULL);
+	for (i = 0; i < VIRTIO_GPU_COPY_THREADS; i++) {
+		if (pthread_create(&gpu->copy_tid[i], NULL, virtio_gpu_copy_thread, gpu))
+			break;
+		snprintf(tname, sizeof(tname), "vtgpu-copy-%d", i);
+		pthread_setname_np(gpu->copy_tid[i], tname);
+		gpu->copy_threads++;
+	}
+}
+
+static void
+virtio_gpu_copy_deinit(struct virtio_gpu *gpu)
+{
+	int i;
+
+	pthread_mutex_lock(&gpu->copy_mtx);
+	gpu->copy_stop = true;
+	pthread_cond_broadcast(&gpu->copy_cond);
+	pthread_mutex_unlock(&gpu->copy_mtx);
+	for (i = 0; i < gpu->copy_threads; i++)
+		pthread_join(gpu->copy_tid[i], NULL);
+	gpu->copy_threads = 0;
+
+	pthread_cond_destroy(&gpu->copy_done);
+	pthread_cond_destroy(&gpu->copy_cond);
+	pthread_mutex_destroy(&gpu->copy_mtx);
+}
+
 static struct virtio_gpu_resource_2d *
 virtio_gpu_find_resource_2d(struct virtio_gpu *gpu, uint32_t resource_id)
 {
@@ -694,10 +1040,7 @@ virtio_gpu_cmd_resource_unref(struct virtio_gpu_command *cmd)
 			r2d->blob = false;
 		}
 		LIST_REMOVE(r2d, link);
-		if (r2d->iov) {
-			free(r2d->iov);
-			r2d->iov = NULL;
-		}
+		virtio_gpu_free_backing(r2d);
 		free(r2d);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	} else {
@@ -741,6 +1084,7 @@ virtio_gpu_cmd_resource_attach_backing(struct virtio_gpu_command *cmd)
 			r2d->iov[i].iov_len = entries[i].length;
 		}
 		free(entries);
+		virtio_gpu_index_backing(r2d);
 	} else {
 		pr_err("%s: Illegal resource id %d\n", __func__, req.resource_id);
 		resp.type = VIRTIO_GPU_RESP_ERR_INVALID_RESOURCE_ID;
@@ -763,10 +1107,8 @@ virtio_gpu_cmd_resource_detach_backing(struct virtio_gpu_command *cmd)
 	memset(&resp, 0, sizeof(resp));
 
 	r2d = virtio_gpu_find_resource_2d(cmd->gpu, req.resource_id);
-	if (r2d && r2d->iov) {
-		free(r2d->iov);
-		r2d->iov = NULL;
-	}
+	if (r2d)
+		virtio_gpu_free_backing(r2d);
 
 	cmd->iolen = sizeof(resp);
 	resp.type = VIRTIO_GPU_RESP_OK_NODATA;
@@ -833,10 +1175,10 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 	struct virtio_gpu_transfer_to_host_2d req;
 	struct virtio_gpu_resource_2d *r2d;
 	struct virtio_gpu_ctrl_hdr resp;
-	uint32_t src_offset, dst_offset, stride, bpp, h;
+	struct virtio_gpu_copy copy;
+	uint32_t stride, bpp;
 	pixman_format_code_t format;
-	void *img_data, *dst, *src;
-	int i, done, bytes, total;
+	void *img_data;
 	int width, height;
 
 	memcpy(&req, cmd->iov[0].iov_base, sizeof(req));
@@ -874,32 +1216,14 @@ virtio_gpu_cmd_transfer_to_host_2d(struct virtio_gpu_command *cmd)
 		img_data = pixman_image_get_data(r2d->image);
 		width = (req.r.width < r2d->width) ? req.r.width : r2d->width;
 		height = (req.r.height < r2d->height) ? req.r.height : r2d->height;
-		for (h = 0; h < height; h++) {
-			src_offset = req.offset + stride * h;
-			dst_offset = (req.r.y + h) * stride + (req.r.x * bpp);
-			dst = img_data + dst_offset;
-			done = 0;
-			total = width * bpp;
-			for (i = 0; i < r2d->iovcnt; i++) {
-				if ((r2d->iov[i].iov_base == 0) || (r2d->iov[i].iov_len == 0)) {
-					continue;
-				}
-
-				if (src_offset < r2d->iov[i].iov_len) {
-					src = r2d->iov[i].iov_base + src_offset;
-					bytes = ((total - done) < (r2d->iov[i].iov_len - src_offset)) ?
-						 (total - done) : (r2d->iov[i].iov_len - src_offset);
-					memcpy((dst + done), src, bytes);
-					src_offset = 0;
-					done += bytes;
-					if (done >= total) {
-						break;
-					}
-				} else {
-					src_offset -= r2d->iov[i].iov_len;
-				}
-			}
-		}
+		copy.r2d = r2d;
+		copy.dst = (uint8_t *)img_data + req.r.y * stride + req.r.x * bpp;
+		copy.offset = req.offset;
+		copy.stride = stride;
+		copy.row_size = width * bpp;
+		copy.height = height;
+		copy.next = 0;
+		virtio_gpu_copy(cmd->gpu, &copy);
 		pixman_image_unref(r2d->image);
 		resp.type = VIRTIO_GPU_RESP_OK_NODATA;
 	}
@@ -930,6 +1254,7 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 		memcpy(cmd->iov[1].iov_base, &resp, sizeof(resp));
 		return;
 	}
+	memset(&surf, 0, sizeof(surf));
 	if (r2d->blob) {
 		virtio_gpu_dmabuf_ref(r2d->dma_info);
 		surf.dma_info.dmabuf_fd = r2d->dma_info->dmabuf_fd;
@@ -949,6 +1274,10 @@ virtio_gpu_cmd_resource_flush(struct virtio_gpu_command *cmd)
 	surf.stride = pixman_image_get_stride(r2d->image);
 	surf.surf_format = r2d->format;
 	surf.surf_type = SURFACE_PIXMAN;
+	surf.damage.x = req.r.x;
+	surf.damage.y = req.r.y;
+	surf.damage.width = req.r.width;
+	surf.damage.height = req.r.height;
 	vdpy_surface_update(gpu->vdpy_handle, &surf);
 	pixman_image_unref(r2d->image);
 
@@ -983,6 +1312,7 @@ static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
 	struct vm_mem_region ret_region;
 	bool fail_flag;
 	struct dma_buf_info *info;
+	uint64_t size;
 
 	udmabuf = udmabuf_fd();
 	if (udmabuf < 0) {
@@ -990,13 +1320,11 @@ static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
 	}
 
 	fail_flag = false;
-	list = malloc(sizeof(*list) + sizeof(struct udmabuf_create_item) * nr_entries);
-	info = malloc(sizeof(*info));
-	if ((info == NULL) || (list == NULL)) {
-		free(list);
-		free(info);
+	/* zeroed, as the items are compared as a whole in the cache */
+	list = calloc(1, sizeof(*list) + sizeof(struct udmabuf_create_item) * nr_entries);
+	if (list == NULL)
 		return NULL;
-	}
+	size = 0;
 	for (i = 0; i < nr_entries; i++) {
 		if (vm_find_memfd_region(gpu->base.dev->vmctx,
 					entries[i].addr,
@@ -1009,25 +1337,60 @@ static struct dma_buf_info *virtio_gpu_create_udmabuf(struct virtio_gpu *gpu,
 		list->list[i].memfd  = ret_region.fd;
 		list->list[i].offset = ret_region.fd_offset;
 		list->list[i].size   = entries[i].length;
+		size += entries[i].length;
 	}
 	list->count = nr_entries;
 	list->flags = UDMABUF_FLAGS_CLOEXEC;
 	if (fail_flag) {
-		dmabuf_fd = -1;
-	} else {
-		dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE_LIST, list);
+		free(list);
+		return NULL;
 	}
-	if (dmabuf_fd < 0) {
-		free(info);
-		info = NULL;
+
+	pthread_mutex_lock(&gpu->dmabuf_mtx);
+	TAILQ_FOREACH(info, &gpu->dmabuf_cache, link) {
+		if ((info->list->count == list->count) &&
+			!memcmp(info->list->list, list->list,
+				nr_entries * sizeof(struct udmabuf_create_item))) {
+			gpu->dmabuf_hits++;
+			TAILQ_REMOVE(&gpu->dmabuf_cache, info, link);
+			TAILQ_INSERT_HEAD(&gpu->dmabuf_cache, info, link);
+			virtio_gpu_dmabuf_ref(info);
+			pthread_mutex_unlock(&gpu->dmabuf_mtx);
+			free(list);
+			return info;
+		}
+	}
+	gpu->dmabuf_misses++;
+	pthread_mutex_unlock(&gpu->dmabuf_mtx);
+
+	info = calloc(1, sizeof(*info));
+	dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE_LIST, list);
+	if ((info == NULL) || (dmabuf_fd < 0)) {
 		pr_err("%s : Failed to create the dmabuf. %s\n",
 			__func__, strerror(errno));
+		if (dmabuf_fd >= 0)
+			close(dmabuf_fd);
+		free(info);
+		free(list);
+		return NULL;
 	}
-	if (info) {
-		info->dmabuf_fd = dmabuf_fd;
-		atomic_store(&info->ref_count, 1);
+	info->dmabuf_fd = dmabuf_fd;
+	atomic_store(&info->ref_count, 1);
+
+	if (size > VIRTIO_GPU_DMABUF_CACHE_SIZE) {
+		free(list);
+		return info;
 	}
-	free(list);
+
+	/* the cache holds a reference of its own */
+	info->list = list;
+	info->size = size;
+	virtio_gpu_dmabuf_ref(info);
+	pthread_mutex_lock(&gpu->dmabuf_mtx);
+	TAILQ_INSERT_HEAD(&gpu->dmabuf_cache, info, link);
+	gpu->dmabuf_cache_size += size;
+	virtio_gpu_dmabuf_cache_trim(gpu, VIRTIO_GPU_DMABUF_CACHE_SIZE);
+	pthread_mutex_unlock(&gpu->dmabuf_mtx);
 	return info;
 }
 
@@ -1113,6 +1476,7 @@ virtio_gpu_cmd_create_blob(struct virtio_gpu_command *cmd)
 					entries[i].length);
 			r2d->iov[i].iov_len = entries[i].length;
 		}
+		virtio_gpu_index_backing(r2d);
 	}
 
 	free(entries);
@@ -1398,9 +1762,13 @@ virtio_gpu_vga_bh(void *param)
 		gpu->vga.surf.surf_format = PIXMAN_a8r8g8b8;
 		gpu->vga.surf.surf_type = SURFACE_PIXMAN;
 		vdpy_surface_set(gpu->vdpy_handle, &gpu->vga.surf);
+		/* the new surface of the display has to be uploaded whole */
+		vga_vbe_damage_reset(&gpu->vga);
 	}
 
-	vdpy_surface_update(gpu->vdpy_handle, &gpu->vga.surf);
+	/* only the scanlines changed since the last frame are uploaded */
+	if (vga_vbe_damage(&gpu->vga, &gpu->vga.surf))
+		vdpy_surface_update(gpu->vdpy_handle, &gpu->vga.surf);
 }
 
 static void *
@@ -1553,6 +1921,12 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
 
 	LIST_INIT(&gpu->r2d_list);
+	TAILQ_INIT(&gpu->dmabuf_cache);
+	pthread_mutex_init(&gpu->dmabuf_mtx, NULL);
+	if (gpu->is_blob_supported &&
+		(vm_add_discard_notifier(virtio_gpu_dmabuf_discard, gpu) != 0))
+		pr_warn("%s: dmabufs won't be dropped on discarded memory\n", __func__);
+	virtio_gpu_dev = gpu;
 	vdpy_get_display_info(gpu->vdpy_handle, &info);
 
 	/*** PCI Config BARs setup ***/
@@ -1634,6 +2008,7 @@ virtio_gpu_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	gpu->vga.surf.pixel = 0;
 	atomic_store(&gpu->vga_thread_status, VGA_THREAD_RUNNING);
 	pthread_create(&gpu->vga.tid, NULL, virtio_gpu_vga_render, (void*)gpu);
+	virtio_gpu_copy_init(gpu);
 
 	return 0;
 }
@@ -1675,15 +2050,22 @@ virtio_gpu_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				r2d->blob = false;
 			}
 			LIST_REMOVE(r2d, link);
-			if (r2d->iov) {
-				free(r2d->iov);
-				r2d->iov = NULL;
-			}
+			virtio_gpu_free_backing(r2d);
 			free(r2d);
 		}
 	}
+	if (gpu->is_blob_supported)
+		vm_remove_discard_notifier(virtio_gpu_dmabuf_discard, gpu);
+	virtio_gpu_dev = NULL;
+	if (gpu->dmabuf_hits + gpu->dmabuf_misses)
+		pr_info("virtio-gpu dmabuf cache: %lu hits, %lu misses, %lu evictions, %lu discards\n",
+			gpu->dmabuf_hits, gpu->dmabuf_misses, gpu->dmabuf_evictions,
+			gpu->dmabuf_discards);
+	virtio_gpu_dmabuf_cache_flush(gpu);
+	pthread_mutex_destroy(&gpu->dmabuf_mtx);
 
 	vdpy_deinit(gpu->vdpy_handle);
+	virtio_gpu_copy_deinit(gpu);
 
 	if (gpu) {
 		pthread_mutex_destroy(&gpu->mtx);
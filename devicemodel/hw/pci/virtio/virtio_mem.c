@@ -0,0 +1,578 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio-mem
+ *
+ * The device owns a guest physical window above highmem, which the guest
+ * driver adds to its memory in blocks when the host asks it to, with the
+ * "hotplug_mem" command of the command monitor. The window is backed by a
+ * hugetlbfs memfd of its own, mapped without reserving hugepages: a block
+ * is faulted in and mapped into the EPT when it's plugged, and it's removed
+ * from the EPT, unpinned and punched out of the memfd when it's unplugged, so
+ * the guest can't reach unplugged memory (VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE)
+ * and the hugepages go back to the host. The hugepages added to the system
+ * for the plugged blocks are dropped again when they are unplugged.
+ *
+ * HSM pins the guest memory it maps, so the device needs HSM to support
+ * ACRN_IOCTL_UNPIN_MEMSEG, which isn't upstream yet: it's only created with
+ * --experimental_unpin. It isn't supported with --mem_backend memfd, which
+ * has no hugepages to add.
+ *
+ * Usage: -s <slot>,virtio-mem,size=<window size>[,block=<block size>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/memfd.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "monitor.h"
+#include "log.h"
+
+#define VIRTIO_MEM_RINGSZ		64
+/* also the minimum, as sizes are parsed by vm_parse_memsize() */
+#define VIRTIO_MEM_BLOCK		(128 * MB)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+#define VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE	1
+
+/* request types */
+#define VIRTIO_MEM_REQ_PLUG		0
+#define VIRTIO_MEM_REQ_UNPLUG		1
+#define VIRTIO_MEM_REQ_UNPLUG_ALL	2
+#define VIRTIO_MEM_REQ_STATE		3
+
+/* response types */
+#define VIRTIO_MEM_RESP_ACK		0
+#define VIRTIO_MEM_RESP_NACK		1
+#define VIRTIO_MEM_RESP_BUSY		2
+#define VIRTIO_MEM_RESP_ERROR		3
+
+/* states of a block range */
+#define VIRTIO_MEM_STATE_PLUGGED	0
+#define VIRTIO_MEM_STATE_UNPLUGGED	1
+#define VIRTIO_MEM_STATE_MIXED		2
+
+struct virtio_mem_config {
+	uint64_t block_size;
+	uint16_t node_id;
+	uint8_t padding[6];
+	uint64_t addr;
+	uint64_t region_size;
+	uint64_t usable_region_size;
+	uint64_t plugged_size;
+	uint64_t requested_size;
+} __attribute__((packed));
+
+struct virtio_mem_req {
+	uint16_t type;
+	uint16_t padding[3];
+	uint64_t addr;
+	uint16_t nb_blocks;
+	uint16_t padding_[3];
+} __attribute__((packed));
+
+struct virtio_mem_resp {
+	uint16_t type;
+	uint16_t padding[3];
+	uint16_t state;
+} __attribute__((packed));
+
+struct virtio_mem {
+	struct virtio_base base;
+	struct virtio_vq_info vq;
+	pthread_mutex_t mtx;
+	struct virtio_mem_config cfg;
+	struct vmctx *ctx;
+	int fd;
+	size_t nr_blocks;
+};
+
+static int virtio_mem_debug;
+#define DPRINTF(params) do { if (virtio_mem_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+/* the hotplug window is per VM */
+static struct virtio_mem *vmem_dev;
+
+static void virtio_mem_reset(void *);
+static void virtio_mem_notify(void *, struct virtio_vq_info *);
+static int virtio_mem_cfgread(void *, int, int, uint32_t *);
+static int virtio_mem_cfgwrite(void *, int, int, uint32_t);
+
+static struct virtio_ops virtio_mem_ops = {
+	"virtio_mem",			/* our name */
+	1,				/* we support 1 virtqueue */
+	sizeof(struct virtio_mem_config), /* config reg size */
+	virtio_mem_reset,		/* reset */
+	virtio_mem_notify,		/* device-wide qnotify */
+	virtio_mem_cfgread,		/* read virtio config */
+	virtio_mem_cfgwrite,		/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+};
+
+static int
+virtio_mem_plug_block(struct virtio_mem *vmem, size_t blk)
+{
+	struct vmctx *ctx = vmem->ctx;
+	size_t bs = vmem->cfg.block_size;
+	char *hva = ctx->hpmem_hva + blk * bs;
+
+	if (madvise(hva, bs, MADV_POPULATE_WRITE) < 0) {
+		WPRINTF(("%s: failed to populate block %lu: %s\n", __func__,
+			blk, strerror(errno)));
+		return -1;
+	}
+	if (vm_map_memseg_vma(ctx, bs, ctx->hpmem_gpa_base + blk * bs,
+			(uint64_t)hva, PROT_ALL) < 0) {
+		fallocate(vmem->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, blk * bs, bs);
+		return -1;
+	}
+
+	ctx->hpmem_plugged[blk] = 1;
+	vmem->cfg.plugged_size += bs;
+	return 0;
+}
+
+static int
+virtio_mem_unplug_block(struct virtio_mem *vmem, size_t blk)
+{
+	struct vmctx *ctx = vmem->ctx;
+	size_t bs = vmem->cfg.block_size;
+
+	if (vm_unpin_memseg_vma(ctx, bs, ctx->hpmem_gpa_base + blk * bs,
+			(uint64_t)(ctx->hpmem_hva + blk * bs), PROT_ALL) < 0) {
+		WPRINTF(("%s: failed to unmap block %lu: %s\n", __func__,
+			blk, strerror(errno)));
+		return -1;
+	}
+	vm_notify_discard(vmem->fd, blk * bs, bs);
+	if (fallocate(vmem->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			blk * bs, bs) < 0) {
+		WPRINTF(("%s: failed to release block %lu: %s\n", __func__,
+			blk, strerror(errno)));
+	} else if (hugetlb_lock_reserve() == 0) {
+		hugetlb_release_more(bs);
+		hugetlb_unlock_reserve();
+	}
+
+	ctx->hpmem_plugged[blk] = 0;
+	vmem->cfg.plugged_size -= bs;
+	return 0;
+}
+
+/* check the range of a request, get the first block and the plugged ones */
+static int
+virtio_mem_check_range(struct virtio_mem *vmem, uint64_t addr, uint16_t nb,
+		size_t *first, size_t *plugged)
+{
+	size_t bs = vmem->cfg.block_size;
+	size_t blk;
+
+	if ((nb == 0) || (addr % bs) || (addr < vmem->cfg.addr) ||
+		(addr - vmem->cfg.addr) / bs + nb > vmem->nr_blocks)
+		return -1;
+
+	*first = (addr - vmem->cfg.addr) / bs;
+	*plugged = 0;
+	for (blk = *first; blk < *first + nb; blk++)
+		*plugged += vmem->ctx->hpmem_plugged[blk];
+	return 0;
+}
+
+static uint16_t
+virtio_mem_plug(struct virtio_mem *vmem, uint64_t addr, uint16_t nb)
+{
+	size_t bs = vmem->cfg.block_size;
+	size_t first, plugged, blk;
+
+	if (virtio_mem_check_range(vmem, addr, nb, &first, &plugged) || plugged)
+		return VIRTIO_MEM_RESP_ERROR;
+	if (vmem->cfg.plugged_size + nb * bs > vmem->cfg.requested_size)
+		return VIRTIO_MEM_RESP_NACK;
+	if (hugetlb_lock_reserve() < 0)
+		return VIRTIO_MEM_RESP_NACK;
+	if (hugetlb_reserve_more(nb * bs) < 0) {
+		hugetlb_unlock_reserve();
+		return VIRTIO_MEM_RESP_NACK;
+	}
+
+	/* fault the blocks in before another DM can take the hugepages */
+	for (blk = first; blk < first + nb; blk++) {
+		if (virtio_mem_plug_block(vmem, blk) < 0)
+			break;
+	}
+	if (blk < first + nb)
+		hugetlb_release_more((first + nb - blk) * bs);
+	hugetlb_unlock_reserve();
+
+	if (blk < first + nb) {
+		while (blk-- > first)
+			virtio_mem_unplug_block(vmem, blk);
+		return VIRTIO_MEM_RESP_NACK;
+	}
+
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t
+virtio_mem_unplug(struct virtio_mem *vmem, uint64_t addr, uint16_t nb)
+{
+	size_t first, plugged, blk;
+
+	if (virtio_mem_check_range(vmem, addr, nb, &first, &plugged) || (plugged != nb))
+		return VIRTIO_MEM_RESP_ERROR;
+
+	for (blk = first; blk < first + nb; blk++) {
+		if (virtio_mem_unplug_block(vmem, blk) < 0)
+			return VIRTIO_MEM_RESP_ERROR;
+	}
+
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static void
+virtio_mem_unplug_all(struct virtio_mem *vmem)
+{
+	size_t blk;
+
+	for (blk = 0; blk < vmem->nr_blocks; blk++) {
+		if (vmem->ctx->hpmem_plugged[blk])
+			virtio_mem_unplug_block(vmem, blk);
+	}
+}
+
+static uint16_t
+virtio_mem_state(struct virtio_mem *vmem, uint64_t addr, uint16_t nb, uint16_t *state)
+{
+	size_t first, plugged;
+
+	if (virtio_mem_check_range(vmem, addr, nb, &first, &plugged))
+		return VIRTIO_MEM_RESP_ERROR;
+
+	if (plugged == 0)
+		*state = VIRTIO_MEM_STATE_UNPLUGGED;
+	else if (plugged == nb)
+		*state = VIRTIO_MEM_STATE_PLUGGED;
+	else
+		*state = VIRTIO_MEM_STATE_MIXED;
+	return VIRTIO_MEM_RESP_ACK;
+}
+
+static void
+virtio_mem_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_mem *vmem = vdev;
+	struct virtio_mem_resp *resp;
+	struct virtio_mem_req req;
+	struct iovec iov[2];
+	uint16_t idx, state = 0;
+
+	pthread_mutex_lock(&vmem->mtx);
+	while (vq_has_descs(vq)) {
+		if ((vq_getchain(vq, &idx, iov, 2, NULL) != 2) ||
+			(iov[0].iov_len < sizeof(req)) ||
+			(iov[1].iov_len < sizeof(*resp))) {
+			WPRINTF(("%s: invalid request\n", __func__));
+			vq_relchain(vq, idx, 0);
+			continue;
+		}
+
+		memcpy(&req, iov[0].iov_base, sizeof(req));
+		resp = iov[1].iov_base;
+		memset(resp, 0, sizeof(*resp));
+
+		switch (req.type) {
+		case VIRTIO_MEM_REQ_PLUG:
+			resp->type = virtio_mem_plug(vmem, req.addr, req.nb_blocks);
+			break;
+		case VIRTIO_MEM_REQ_UNPLUG:
+			resp->type = virtio_mem_unplug(vmem, req.addr, req.nb_blocks);
+			break;
+		case VIRTIO_MEM_REQ_UNPLUG_ALL:
+			virtio_mem_unplug_all(vmem);
+			resp->type = VIRTIO_MEM_RESP_ACK;
+			break;
+		case VIRTIO_MEM_REQ_STATE:
+			resp->type = virtio_mem_state(vmem, req.addr, req.nb_blocks, &state);
+			resp->state = state;
+			break;
+		default:
+			resp->type = VIRTIO_MEM_RESP_ERROR;
+			break;
+		}
+
+		DPRINTF(("virtio_mem: req %u 0x%lx+%u -> %u, plugged 0x%lx\n", req.type,
+			req.addr, req.nb_blocks, resp->type, vmem->cfg.plugged_size));
+		vq_relchain(vq, idx, sizeof(*resp));
+	}
+	vq_endchains(vq, 1);
+	pthread_mutex_unlock(&vmem->mtx);
+}
+
+static int
+virtio_mem_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_mem *vmem = vdev;
+
+	/* our caller has already verified offset and size */
+	memcpy(retval, (uint8_t *)&vmem->cfg + offset, size);
+	return 0;
+}
+
+static int
+virtio_mem_cfgwrite(void *vdev, int offset, int size, uint32_t value)
+{
+	DPRINTF(("virtio_mem: write to readonly reg %d\n", offset));
+	return -1;
+}
+
+static void
+virtio_mem_reset(void *vdev)
+{
+	struct virtio_mem *vmem = vdev;
+
+	DPRINTF(("virtio_mem: device reset requested\n"));
+	pthread_mutex_lock(&vmem->mtx);
+	virtio_mem_unplug_all(vmem);
+	virtio_reset_dev(&vmem->base);
+	pthread_mutex_unlock(&vmem->mtx);
+}
+
+/*
+ * Ask the guest to plug or unplug memory to have size, e.g. "2G", in the
+ * hotplug window, "0" to unplug all of it.
+ */
+int
+vm_monitor_hotplug_mem(void *arg, char *size)
+{
+	struct virtio_mem *vmem = vmem_dev;
+	size_t requested = 0;
+
+	if (vmem == NULL) {
+		WPRINTF(("%s: no virtio-mem device\n", __func__));
+		return -1;
+	}
+	if (strcmp(size, "0") && (vm_parse_memsize(size, &requested) < 0)) {
+		WPRINTF(("%s: invalid memory size %s\n", __func__, size));
+		return -1;
+	}
+	if ((requested % vmem->cfg.block_size) || (requested > vmem->cfg.region_size)) {
+		WPRINTF(("%s: %s isn't a multiple of the block size 0x%lx within 0x%lx\n",
+			__func__, size, vmem->cfg.block_size, vmem->cfg.region_size));
+		return -1;
+	}
+
+	pthread_mutex_lock(&vmem->mtx);
+	vmem->cfg.requested_size = requested;
+	pthread_mutex_unlock(&vmem->mtx);
+
+	pr_notice("virtio_mem: requested 0x%lx, plugged 0x%lx\n",
+		requested, vmem->cfg.plugged_size);
+	virtio_config_changed(&vmem->base);
+	return 0;
+}
+
+/* plugged memory isn't in the snapshot */
+static ssize_t
+virtio_mem_save(struct vmctx *ctx, struct pci_vdev *dev, void *buf, size_t len)
+{
+	struct virtio_mem *vmem = dev->arg;
+
+	if (vmem->cfg.plugged_size) {
+		WPRINTF(("virtio_mem: can't save plugged memory\n"));
+		return -1;
+	}
+	return virtio_pci_save(ctx, dev, buf, len);
+}
+
+static int
+virtio_mem_parse(struct virtio_mem *vmem, char *opts)
+{
+	char *cp, *opt, *val;
+	size_t size;
+
+	vmem->cfg.block_size = VIRTIO_MEM_BLOCK;
+	cp = opts;
+	while (cp && (opt = strsep(&cp, ",")) != NULL) {
+		val = opt;
+		opt = strsep(&val, "=");
+		if (val == NULL || vm_parse_memsize(val, &size) < 0) {
+			WPRINTF(("virtio_mem: invalid option %s\n", opt));
+			return -1;
+		}
+
+		if (!strcmp(opt, "size"))
+			vmem->cfg.region_size = size;
+		else if (!strcmp(opt, "block"))
+			vmem->cfg.block_size = size;
+		else {
+			WPRINTF(("virtio_mem: invalid option %s\n", opt));
+			return -1;
+		}
+	}
+
+	if ((vmem->cfg.block_size & (vmem->cfg.block_size - 1)) ||
+		(vmem->cfg.region_size == 0) ||
+		(vmem->cfg.region_size % vmem->cfg.block_size)) {
+		WPRINTF(("virtio_mem: size must be a multiple of the block size,"
+			" a power of 2 of at least 128M\n"));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+virtio_mem_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_mem *vmem;
+	pthread_mutexattr_t attr;
+	uint64_t base;
+
+	if (vmem_dev) {
+		WPRINTF(("virtio_mem: only one device is supported\n"));
+		return -1;
+	}
+
+	vmem = calloc(1, sizeof(struct virtio_mem));
+	if (!vmem) {
+		WPRINTF(("virtio_mem: calloc returns NULL\n"));
+		return -1;
+	}
+	vmem->fd = -1;
+	vmem->ctx = ctx;
+
+	if (virtio_mem_parse(vmem, opts))
+		goto fail;
+
+	if (!hugetlb_can_reserve_more()) {
+		WPRINTF(("virtio_mem: not supported with --mem_backend memfd\n"));
+		goto fail;
+	}
+
+	if (!vm_can_unpin_memory(ctx)) {
+		WPRINTF(("virtio_mem: needs --experimental_unpin and HSM support "
+			"of ACRN_IOCTL_UNPIN_MEMSEG\n"));
+		goto fail;
+	}
+
+	/* the window is aligned to the block size */
+	base = vm_alloc_devmem(ctx, vmem->cfg.region_size, vmem->cfg.block_size);
+	if (base == 0)
+		goto fail;
+	vmem->cfg.addr = base;
+	vmem->cfg.usable_region_size = vmem->cfg.region_size;
+	vmem->nr_blocks = vmem->cfg.region_size / vmem->cfg.block_size;
+
+	/* hugepages are allocated when the blocks are plugged */
+	vmem->fd = memfd_create("acrn_virtio_mem", MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+	if ((vmem->fd < 0) || (ftruncate(vmem->fd, vmem->cfg.region_size) < 0)) {
+		WPRINTF(("virtio_mem: failed to create the memfd: %s\n", strerror(errno)));
+		goto fail;
+	}
+	ctx->hpmem_hva = mmap(NULL, vmem->cfg.region_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, vmem->fd, 0);
+	ctx->hpmem_plugged = calloc(vmem->nr_blocks, 1);
+	if ((ctx->hpmem_hva == MAP_FAILED) || !ctx->hpmem_plugged) {
+		WPRINTF(("virtio_mem: failed to map the window\n"));
+		goto fail;
+	}
+	ctx->hpmem_gpa_base = base;
+	ctx->hpmem_block = vmem->cfg.block_size;
+	ctx->hpmem = vmem->cfg.region_size;
+
+	/* init mutex attribute properly to avoid deadlock */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&vmem->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	virtio_linkup(&vmem->base, &virtio_mem_ops, vmem, dev, &vmem->vq, BACKEND_VBSU);
+	vmem->base.mtx = &vmem->mtx;
+	vmem->base.device_caps = (1UL << VIRTIO_F_VERSION_1) |
+		(1UL << VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE);
+	vmem->vq.qsize = VIRTIO_MEM_RINGSZ;
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, 0x1040 + VIRTIO_TYPE_MEM);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_MEMORY);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_MEM);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+	pci_set_cfgdata16(dev, PCIR_REVID, 1);
+
+	if (virtio_interrupt_init(&vmem->base, virtio_uses_msix()) ||
+		virtio_set_modern_bar(&vmem->base, false)) {
+		pthread_mutex_destroy(&vmem->mtx);
+		goto fail;
+	}
+
+	pr_info("virtio_mem: window 0x%lx@0x%lx, block 0x%lx\n",
+		vmem->cfg.region_size, base, vmem->cfg.block_size);
+	vmem_dev = vmem;
+	return 0;
+
+fail:
+	ctx->hpmem = 0;
+	free(ctx->hpmem_plugged);
+	ctx->hpmem_plugged = NULL;
+	if (ctx->hpmem_hva && ctx->hpmem_hva != MAP_FAILED)
+		munmap(ctx->hpmem_hva, vmem->cfg.region_size);
+	ctx->hpmem_hva = NULL;
+	if (vmem->fd >= 0)
+		close(vmem->fd);
+	free(vmem);
+	return -1;
+}
+
+static void
+virtio_mem_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_mem *vmem = dev->arg;
+
+	if (vmem == NULL)
+		return;
+
+	virtio_mem_reset(vmem);
+	ctx->hpmem = 0;
+	munmap(ctx->hpmem_hva, vmem->cfg.region_size);
+	ctx->hpmem_hva = NULL;
+	free(ctx->hpmem_plugged);
+	ctx->hpmem_plugged = NULL;
+	close(vmem->fd);
+	pthread_mutex_destroy(&vmem->mtx);
+	free(vmem);
+	vmem_dev = NULL;
+	dev->arg = NULL;
+}
+
+struct pci_vdev_ops pci_ops_virtio_mem = {
+	.class_name	= "virtio-mem",
+	.vdev_init	= virtio_mem_init,
+	.vdev_deinit	= virtio_mem_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_mem_save,
+	.vdev_load	= virtio_pci_load,
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_mem);
@@ -51,6 +51,7 @@
 #include "virtio.h"
 #include "vhost.h"
 #include "dm_string.h"
+#include "numa.h"
 
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
@@ -590,6 +591,8 @@ virtio_net_tx_thread(void *param)
 	struct virtio_net *net = param;
 	struct virtio_vq_info *vq = &net->queues[VIRTIO_NET_TXQ];
 
+	numa_bind_io_thread();
+
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
@@ -1269,6 +1272,8 @@ struct pci_vdev_ops pci_ops_virtio_net = {
 	.vdev_init	= virtio_net_init,
 	.vdev_deinit	= virtio_net_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_pci_save,
+	.vdev_load	= virtio_pci_load
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_net);
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * virtio-pmem
+ *
+ * A host file is mapped MAP_SHARED and put into the guest physical address
+ * space above highmem, where the guest driver finds it as a persistent
+ * memory range and can use it with DAX. The guest reads and writes the host
+ * page cache directly, so VMs booting the same image share its pages instead
+ * of each caching a copy. A flush request of the guest is an msync() of the
+ * mapping, done in a thread of the device as it may take long.
+ *
+ * There is no read-only mode: HSM pins the guest memory for writing, so the
+ * file has to be opened and mapped writable, and a read-only EPT mapping of
+ * it would still let the Device Model write it.
+ *
+ * Usage: -s <slot>,virtio-pmem,<file>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "dm.h"
+#include "pci_core.h"
+#include "virtio.h"
+#include "vmmapi.h"
+#include "log.h"
+
+#define VIRTIO_PMEM_RINGSZ	64
+/* the range is aligned to the memory section size of the guest */
+#define VIRTIO_PMEM_ALIGN	(128 * MB)
+
+#define VIRTIO_PMEM_REQ_TYPE_FLUSH	0
+
+struct virtio_pmem_config {
+	uint64_t start;
+	uint64_t size;
+} __attribute__((packed));
+
+struct virtio_pmem {
+	struct virtio_base base;
+	struct virtio_vq_info vq;
+	pthread_mutex_t mtx;
+	struct virtio_pmem_config cfg;
+	struct vmctx *ctx;
+	int fd;
+	char *hva;
+	pthread_t tid;
+	pthread_mutex_t flush_mtx;
+	pthread_cond_t flush_cond;
+	int in_progress;
+	bool closing;
+};
+
+static int virtio_pmem_debug;
+#define DPRINTF(params) do { if (virtio_pmem_debug) pr_dbg params; } while (0)
+#define WPRINTF(params) (pr_err params)
+
+static void virtio_pmem_reset(void *);
+static void virtio_pmem_notify(void *, struct virtio_vq_info *);
+static int virtio_pmem_cfgread(void *, int, int, uint32_t *);
+
+static struct virtio_ops virtio_pmem_ops = {
+	"virtio_pmem",			/* our name */
+	1,				/* we support 1 virtqueue */
+	sizeof(struct virtio_pmem_config), /* config reg size */
+	virtio_pmem_reset,		/* reset */
+	virtio_pmem_notify,		/* device-wide qnotify */
+	virtio_pmem_cfgread,		/* read virtio config */
+	NULL,				/* write virtio config */
+	NULL,				/* apply negotiated features */
+	NULL,				/* called on guest set status */
+};
+
+static void *
+virtio_pmem_flush_thread(void *param)
+{
+	struct virtio_pmem *pmem = param;
+	struct virtio_vq_info *vq = &pmem->vq;
+	struct iovec iov[2];
+	uint32_t type, ret;
+	uint16_t idx;
+	int n;
+
+	for (;;) {
+		pthread_mutex_lock(&pmem->flush_mtx);
+		pmem->in_progress = 0;
+		while (!vq_has_descs(vq) && !pmem->closing)
+			pthread_cond_wait(&pmem->flush_cond, &pmem->flush_mtx);
+		if (pmem->closing) {
+			pthread_mutex_unlock(&pmem->flush_mtx);
+			break;
+		}
+		pmem->in_progress = 1;
+		pthread_mutex_unlock(&pmem->flush_mtx);
+
+		do {
+			n = vq_getchain(vq, &idx, iov, 2, NULL);
+			if (n < 0) {
+				WPRINTF(("%s: failed to get the chain\n", __func__));
+				break;
+			}
+			if ((n != 2) || (iov[0].iov_len < sizeof(type)) ||
+				(iov[1].iov_len < sizeof(ret))) {
+				WPRINTF(("%s: invalid request\n", __func__));
+				vq_relchain(vq, idx, 0);
+				continue;
+			}
+
+			memcpy(&type, iov[0].iov_base, sizeof(type));
+			ret = 0;
+			if (type != VIRTIO_PMEM_REQ_TYPE_FLUSH) {
+				ret = 1;
+			} else if (msync(pmem->hva, pmem->cfg.size, MS_SYNC) < 0) {
+				WPRINTF(("%s: msync failed: %s\n", __func__, strerror(errno)));
+				ret = 1;
+			}
+			memcpy(iov[1].iov_base, &ret, sizeof(ret));
+
+			vq_relchain(vq, idx, sizeof(ret));
+		} while (vq_has_descs(vq));
+
+		vq_endchains(vq, 1);
+	}
+
+	return NULL;
+}
+
+static void
+virtio_pmem_notify(void *vdev, struct virtio_vq_info *vq)
+{
+	struct virtio_pmem *pmem = vdev;
+
+	if (!vq_has_descs(vq))
+		return;
+
+	pthread_mutex_lock(&pmem->flush_mtx);
+	if (pmem->in_progress == 0)
+		pthread_cond_signal(&pmem->flush_cond);
+	pthread_mutex_unlock(&pmem->flush_mtx);
+}
+
+static int
+virtio_pmem_cfgread(void *vdev, int offset, int size, uint32_t *retval)
+{
+	struct virtio_pmem *pmem = vdev;
+
+	/* our caller has already verified offset and size */
+	memcpy(retval, (uint8_t *)&pmem->cfg + offset, size);
+	return 0;
+}
+
+static void
+virtio_pmem_reset(void *vdev)
+{
+	struct virtio_pmem *pmem = vdev;
+
+	DPRINTF(("virtio_pmem: device reset requested\n"));
+	virtio_reset_dev(&pmem->base);
+}
+
+static int
+virtio_pmem_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_pmem *pmem;
+	pthread_mutexattr_t attr;
+	char tname[MAXCOMLEN + 1];
+	char *path, *opt;
+	struct stat st;
+
+	path = strsep(&opts, ",");
+	if ((path == NULL) || (*path == '\0')) {
+		WPRINTF(("virtio_pmem: a backing file is needed\n"));
+		return -1;
+	}
+
+	pmem = calloc(1, sizeof(struct virtio_pmem));
+	if (!pmem) {
+		WPRINTF(("virtio_pmem: calloc returns NULL\n"));
+		return -1;
+	}
+	pmem->ctx = ctx;
+	pmem->fd = -1;
+	pmem->hva = MAP_FAILED;
+
+	if ((opt = strsep(&opts, ",")) != NULL) {
+		if (!strcmp(opt, "ro"))
+			WPRINTF(("virtio_pmem: \"ro\" isn't supported, HSM pins the "
+				"guest memory for writing\n"));
+		else
+			WPRINTF(("virtio_pmem: invalid option %s\n", opt));
+		goto fail;
+	}
+
+	pmem->fd = open(path, O_RDWR);
+	if ((pmem->fd < 0) || (fstat(pmem->fd, &st) < 0)) {
+		WPRINTF(("virtio_pmem: failed to open %s: %s\n", path, strerror(errno)));
+		goto fail;
+	}
+	if ((st.st_size == 0) || (st.st_size % (2 * MB))) {
+		WPRINTF(("virtio_pmem: the size of %s isn't a multiple of 2M\n", path));
+		goto fail;
+	}
+	pmem->cfg.size = st.st_size;
+
+	pmem->hva = mmap(NULL, pmem->cfg.size, PROT_READ | PROT_WRITE, MAP_SHARED, pmem->fd, 0);
+	if (pmem->hva == MAP_FAILED) {
+		WPRINTF(("virtio_pmem: failed to map %s: %s\n", path, strerror(errno)));
+		goto fail;
+	}
+
+	pmem->cfg.start = vm_alloc_devmem(ctx, pmem->cfg.size, VIRTIO_PMEM_ALIGN);
+	if ((pmem->cfg.start == 0) ||
+		(vm_map_memseg_vma(ctx, pmem->cfg.size, pmem->cfg.start,
+			(uint64_t)pmem->hva, PROT_ALL) < 0)) {
+		WPRINTF(("virtio_pmem: failed to map %s to the guest\n", path));
+		goto fail;
+	}
+
+	/* init mutex attribute properly to avoid deadlock */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&pmem->mtx, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	virtio_linkup(&pmem->base, &virtio_pmem_ops, pmem, dev, &pmem->vq, BACKEND_VBSU);
+	pmem->base.mtx = &pmem->mtx;
+	pmem->base.device_caps = (1UL << VIRTIO_F_VERSION_1);
+	pmem->vq.qsize = VIRTIO_PMEM_RINGSZ;
+
+	pci_set_cfgdata16(dev, PCIR_DEVICE, 0x1040 + VIRTIO_TYPE_PMEM);
+	pci_set_cfgdata16(dev, PCIR_VENDOR, VIRTIO_VENDOR);
+	pci_set_cfgdata8(dev, PCIR_CLASS, PCIC_STORAGE);
+	pci_set_cfgdata16(dev, PCIR_SUBDEV_0, VIRTIO_TYPE_PMEM);
+	pci_set_cfgdata16(dev, PCIR_SUBVEND_0, VIRTIO_VENDOR);
+	pci_set_cfgdata16(dev, PCIR_REVID, 1);
+
+	if (virtio_interrupt_init(&pmem->base, virtio_uses_msix()) ||
+		virtio_set_modern_bar(&pmem->base, false)) {
+		pthread_mutex_destroy(&pmem->mtx);
+		goto unmap;
+	}
+
+	pmem->in_progress = 0;
+	pthread_mutex_init(&pmem->flush_mtx, NULL);
+	pthread_cond_init(&pmem->flush_cond, NULL);
+	pthread_create(&pmem->tid, NULL, virtio_pmem_flush_thread, pmem);
+	snprintf(tname, sizeof(tname), "vtpmem-%d:%d tx", dev->slot, dev->func);
+	pthread_setname_np(pmem->tid, tname);
+
+	pr_info("virtio_pmem: %s 0x%lx@0x%lx\n", path, pmem->cfg.size,
+		pmem->cfg.start);
+	return 0;
+
+unmap:
+	vm_unmap_memseg_vma(ctx, pmem->cfg.size, pmem->cfg.start,
+		(uint64_t)pmem->hva, PROT_ALL);
+fail:
+	if (pmem->hva != MAP_FAILED)
+		munmap(pmem->hva, pmem->cfg.size);
+	if (pmem->fd >= 0)
+		close(pmem->fd);
+	free(pmem);
+	return -1;
+}
+
+static void
+virtio_pmem_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
+{
+	struct virtio_pmem *pmem = dev->arg;
+	void *jval;
+
+	if (pmem == NULL)
+		return;
+
+	pthread_mutex_lock(&pmem->flush_mtx);
+	pmem->closing = true;
+	pthread_cond_signal(&pmem->flush_cond);
+	pthread_mutex_unlock(&pmem->flush_mtx);
+	pthread_join(pmem->tid, &jval);
+	pthread_cond_destroy(&pmem->flush_cond);
+	pthread_mutex_destroy(&pmem->flush_mtx);
+
+	virtio_pmem_reset(pmem);
+	vm_unmap_memseg_vma(ctx, pmem->cfg.size, pmem->cfg.start, (uint64_t)pmem->hva, PROT_ALL);
+	msync(pmem->hva, pmem->cfg.size, MS_SYNC);
+	munmap(pmem->hva, pmem->cfg.size);
+	close(pmem->fd);
+	pthread_mutex_destroy(&pmem->mtx);
+	free(pmem);
+	dev->arg = NULL;
+}
+
+struct pci_vdev_ops pci_ops_virtio_pmem = {
+	.class_name	= "virtio-pmem",
+	.vdev_init	= virtio_pmem_init,
+	.vdev_deinit	= virtio_pmem_deinit,
+	.vdev_barwrite	= virtio_pci_write,
+	.vdev_barread	= virtio_pci_read,
+};
+DEFINE_PCI_DEVTYPE(pci_ops_virtio_pmem);
@@ -524,6 +524,8 @@ struct pci_vdev_ops pci_ops_virtio_rnd = {
 	.vdev_init	= virtio_rnd_init,
 	.vdev_deinit	= virtio_rnd_deinit,
 	.vdev_barwrite	= virtio_pci_write,
-	.vdev_barread	= virtio_pci_read
+	.vdev_barread	= virtio_pci_read,
+	.vdev_save	= virtio_pci_save,
+	.vdev_load	= virtio_pci_load
 };
 DEFINE_PCI_DEVTYPE(pci_ops_virtio_rnd);
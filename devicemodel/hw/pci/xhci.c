@@ -417,6 +417,7 @@ struct pci_xhci_vdev {
 	int (*excap_write)(struct pci_xhci_vdev *, uint64_t, uint64_t);
 	int		usb2_port_start;
 	int		usb3_port_start;
+	int		xfer_depth;	/* libusb transfers in flight per endpoint */
 
 	pthread_t	vbdp_thread;
 	sem_t		vbdp_sem;
@@ -431,6 +432,15 @@ struct pci_xhci_vdev {
 	struct pci_xhci_native_port native_ports[XHCI_MAX_VIRT_PORTS];
 	struct timespec init_time;
 	uint32_t	quirks;
+
+	/*
+	 * Interrupter moderation: the events inserted within IMODI of the
+	 * last interrupt are signaled together by imod_timer.
+	 */
+	pthread_mutex_t	intr_mtx;
+	struct acrn_timer imod_timer;
+	uint64_t	imod_next;	/* the earliest time of the next interrupt */
+	bool		imod_armed;
 };
 
 /* portregs and devices arrays are set up to start from idx=1 */
@@ -482,6 +492,7 @@ static inline int pci_xhci_is_valid_portnum(int n);
 static int pci_xhci_parse_tablet(struct pci_xhci_vdev *xdev, char *opts);
 static int pci_xhci_parse_log_level(struct pci_xhci_vdev *xdev, char *opts);
 static int pci_xhci_parse_extcap(struct pci_xhci_vdev *xdev, char *opts);
+static int pci_xhci_parse_xfer_depth(struct pci_xhci_vdev *xdev, char *opts);
 static int pci_xhci_convert_speed(int lspeed);
 static void pci_xhci_free_usb_xfer(struct pci_xhci_dev_emu *dev, struct usb_xfer *xfer);
 static void pci_xhci_isoc_handler(void *arg, uint64_t param);
@@ -490,7 +501,8 @@ static void pci_xhci_isoc_handler(void *arg, uint64_t param);
 static struct pci_xhci_option_elem xhci_option_table[] = {
 	{"tablet", pci_xhci_parse_tablet},
 	{"log", pci_xhci_parse_log_level},
-	{"cap", pci_xhci_parse_extcap}
+	{"cap", pci_xhci_parse_extcap},
+	{"depth", pci_xhci_parse_xfer_depth}
 };
 
 static bool
@@ -1203,6 +1215,16 @@ pci_xhci_reset(struct pci_xhci_vdev *xdev)
 	xdev->rtsregs.er_enq_seg = 0;
 	xdev->rtsregs.event_pcs = 1;
 	struct pci_xhci_dev_emu *dev;
+	struct itimerspec ts;
+
+	/* drop the interrupt held back by the moderation, if any */
+	memset(&ts, 0, sizeof(ts));
+	pthread_mutex_lock(&xdev->intr_mtx);
+	if (xdev->imod_armed)
+		acrn_timer_settime(&xdev->imod_timer, &ts);
+	xdev->imod_armed = false;
+	xdev->imod_next = 0;
+	pthread_mutex_unlock(&xdev->intr_mtx);
 
 	for (i = 1; i <= XHCI_MAX_DEVS; i++)
 	{
@@ -1552,14 +1574,18 @@ pci_xhci_trb_next(struct pci_xhci_vdev *xdev,
 	return next;
 }
 
-static void
-pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
+static uint64_t
+pci_xhci_now(void)
 {
+	struct timespec now;
 
-	xdev->rtsregs.intrreg.erdp |= XHCI_ERDP_LO_BUSY;
-	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
-	xdev->opregs.usbsts |= XHCI_STS_EINT;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
 
+static void
+pci_xhci_signal_interrupt(struct pci_xhci_vdev *xdev)
+{
 	/* only trigger interrupt if permitted */
 	if ((xdev->opregs.usbcmd & XHCI_CMD_INTE) &&
 	    (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_ENA)) {
@@ -1570,6 +1596,72 @@ pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
 	}
 }
 
+static void
+pci_xhci_imod_timer(void *arg, uint64_t nexp)
+{
+	struct pci_xhci_vdev *xdev = arg;
+	uint64_t ival;
+
+	/* the same lock as the register accesses, which update iman and usbcmd */
+	pthread_mutex_lock(&xdev->mtx);
+	ival = XHCI_IMOD_IVAL_GET(xdev->rtsregs.intrreg.imod) * 250UL;
+	pthread_mutex_lock(&xdev->intr_mtx);
+	if (!xdev->imod_armed) {
+		/* disarmed by a reset meanwhile */
+		pthread_mutex_unlock(&xdev->intr_mtx);
+		pthread_mutex_unlock(&xdev->mtx);
+		return;
+	}
+	xdev->imod_armed = false;
+	xdev->imod_next = pci_xhci_now() + ival;
+	pthread_mutex_unlock(&xdev->intr_mtx);
+
+	/* the guest may have handled the events in an earlier interrupt */
+	if (xdev->rtsregs.intrreg.iman & XHCI_IMAN_INTR_PEND)
+		pci_xhci_signal_interrupt(xdev);
+	pthread_mutex_unlock(&xdev->mtx);
+}
+
+static void
+pci_xhci_assert_interrupt(struct pci_xhci_vdev *xdev)
+{
+	struct itimerspec ts;
+	uint64_t now, ival;
+
+	xdev->rtsregs.intrreg.erdp |= XHCI_ERDP_LO_BUSY;
+	xdev->rtsregs.intrreg.iman |= XHCI_IMAN_INTR_PEND;
+	xdev->opregs.usbsts |= XHCI_STS_EINT;
+
+	/* IMODI is in 250ns units, 0 means no moderation */
+	ival = XHCI_IMOD_IVAL_GET(xdev->rtsregs.intrreg.imod) * 250UL;
+
+	pthread_mutex_lock(&xdev->intr_mtx);
+	if (xdev->imod_armed) {
+		/* signaled by the timer with the events before it */
+		pthread_mutex_unlock(&xdev->intr_mtx);
+		return;
+	}
+
+	now = pci_xhci_now();
+	if ((ival == 0) || (now >= xdev->imod_next)) {
+		xdev->imod_next = now + ival;
+		pthread_mutex_unlock(&xdev->intr_mtx);
+		pci_xhci_signal_interrupt(xdev);
+		return;
+	}
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_sec = (xdev->imod_next - now) / 1000000000UL;
+	ts.it_value.tv_nsec = (xdev->imod_next - now) % 1000000000UL;
+	if (acrn_timer_settime(&xdev->imod_timer, &ts) == 0) {
+		xdev->imod_armed = true;
+		pthread_mutex_unlock(&xdev->intr_mtx);
+		return;
+	}
+	pthread_mutex_unlock(&xdev->intr_mtx);
+	pci_xhci_signal_interrupt(xdev);
+}
+
 static void
 pci_xhci_deassert_interrupt(struct pci_xhci_vdev *xdev)
 {
@@ -4069,11 +4161,13 @@ static void
 pci_xhci_device_usage(char *opt)
 {
 	static const char *usage_str = "usage:\r\n"
-		" -s <n>,xhci,[bus1-port1,bus2-port2]:[tablet]:[log=x]:[cap=x]\r\n"
+		" -s <n>,xhci,[bus1-port1,bus2-port2]:[tablet]:[log=x]:[cap=x]"
+		":[depth=x]\r\n"
 		" eg: -s 8,xhci,1-2,2-2\r\n"
 		" eg: -s 7,xhci,tablet:log=D\r\n"
 		" eg: -s 7,xhci,1-2,2-2:tablet\r\n"
 		" eg: -s 7,xhci,1-2,2-2:tablet:log=D:cap=apl\r\n"
+		" eg: -s 7,xhci,1-2,2-2:depth=8\r\n"
 		" Note: please follow the board hardware design, assign the "
 		" ports according to the receptacle connection\r\n";
 
@@ -4110,6 +4204,27 @@ errout:
 	return rc;
 }
 
+static int
+pci_xhci_parse_xfer_depth(struct pci_xhci_vdev *xdev, char *opts)
+{
+	char *s;
+	int depth, rc = 0;
+
+	s = strchr(opts, '=');
+	if (!s || dm_strtoi(s + 1, NULL, 10, &depth) ||
+			depth < 1 || depth > USB_DEV_XFER_DEPTH_MAX) {
+		rc = -1;
+		goto errout;
+	}
+
+	xdev->xfer_depth = depth;
+
+errout:
+	if (rc)
+		pr_err("USB: fail to set transfer depth, rc=%d\r\n", rc);
+	return rc;
+}
+
 static int
 pci_xhci_parse_bus_port(struct pci_xhci_vdev *xdev, char *opts)
 {
@@ -4439,9 +4554,13 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	dev->arg = xdev;
 	xdev->dev = dev;
+	/* before pci_xhci_reset(), which takes intr_mtx */
+	pthread_mutex_init(&xdev->mtx, NULL);
+	pthread_mutex_init(&xdev->intr_mtx, NULL);
 
 	xdev->usb2_port_start = (XHCI_MAX_DEVS/2) + 1;
 	xdev->usb3_port_start = 1;
+	xdev->xfer_depth = USB_DEV_XFER_DEPTH;
 
 	xdev->vid = PCI_ACRN_XHCI_VID;
 	xdev->pid = PCI_ACRN_XHCI_PID;
@@ -4464,7 +4583,8 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 				pci_xhci_usb_dev_intr_cb,
 				pci_xhci_usb_dev_lock_ep_cb,
 				pci_xhci_usb_dev_unlock_ep_cb,
-				xdev, usb_get_log_level()) < 0) {
+				xdev, usb_get_log_level(),
+				xdev->xfer_depth) < 0) {
 		error = -3;
 		goto done;
 	}
@@ -4538,8 +4658,6 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 
 	pci_lintr_request(dev);
 
-	pthread_mutex_init(&xdev->mtx, NULL);
-
 	/* create vbdp_thread */
 	xdev->vbdp_polling = true;
 	sem_init(&xdev->vbdp_sem, 0, 0);
@@ -4548,6 +4666,10 @@ pci_xhci_init(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	if (error)
 		goto done;
 
+	/* without the timer, the interrupts are signaled without moderation */
+	if (acrn_timer_init(&xdev->imod_timer, pci_xhci_imod_timer, xdev) < 0)
+		UPRINTF(LWRN, "failed to create the interrupt moderation timer\r\n");
+
 	xhci_in_use = 1;
 done:
 	if (error) {
@@ -4603,6 +4725,8 @@ pci_xhci_deinit(struct vmctx *ctx, struct pci_vdev *dev, char *opts)
 	pthread_join(xdev->vbdp_thread, NULL);
 	sem_close(&xdev->vbdp_sem);
 
+	acrn_timer_deinit(&xdev->imod_timer);
+	pthread_mutex_destroy(&xdev->intr_mtx);
 	pthread_mutex_destroy(&xdev->mtx);
 	free(xdev);
 	xhci_in_use = 0;
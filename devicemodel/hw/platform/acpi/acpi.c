@@ -74,6 +74,7 @@
 #include "vssram.h"
 #include "vmmapi.h"
 #include "mmio_dev.h"
+#include "numa.h"
 
 /*
  * Define the base address of the ACPI tables, and the offsets to
@@ -91,7 +92,9 @@
 #define NHLT_OFFSET		0x400
 #define TPM2_OFFSET		0xC00
 #define RTCT_OFFSET		0xF00
-#define DSDT_OFFSET		0x1100
+#define SRAT_OFFSET		0x1100
+#define SLIT_OFFSET		0x1700
+#define DSDT_OFFSET		0x1800
 
 #define	ASL_TEMPLATE	"dm.XXXXXXX"
 #define ASL_SUFFIX	".aml"
@@ -196,6 +199,13 @@ basl_fwrite_rsdt(FILE *fp, struct vmctx *ctx)
 			    basl_acpi_base + RTCT_OFFSET);
 	}
 
+	if (numa_get_nr_nodes() > 0) {
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : %08X\n", num++,
+			    basl_acpi_base + SRAT_OFFSET);
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : %08X\n", num++,
+			    basl_acpi_base + SLIT_OFFSET);
+	}
+
 	EFFLUSH(fp);
 
 	return 0;
@@ -243,6 +253,13 @@ basl_fwrite_xsdt(FILE *fp, struct vmctx *ctx)
 			    basl_acpi_base + RTCT_OFFSET);
 	}
 
+	if (numa_get_nr_nodes() > 0) {
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : 00000000%08X\n", num++,
+			    basl_acpi_base + SRAT_OFFSET);
+		EFPRINTF(fp, "[0004]\t\tACPI Table Address %u : 00000000%08X\n", num++,
+			    basl_acpi_base + SLIT_OFFSET);
+	}
+
 	EFFLUSH(fp);
 
 	return 0;
@@ -394,6 +411,124 @@ basl_fwrite_madt(FILE *fp, struct vmctx *ctx)
 	return 0;
 }
 
+static int
+basl_fwrite_srat(FILE *fp, struct vmctx *ctx)
+{
+	const struct numa_node *node;
+	uint64_t guest_pcpu_bitmask;
+	int i, n, pcpu_id, lapic_id;
+
+	guest_pcpu_bitmask = vm_get_cpu_affinity_dm();
+
+	EFPRINTF(fp, "/*\n");
+	EFPRINTF(fp, " * dm SRAT template\n");
+	EFPRINTF(fp, " */\n");
+	EFPRINTF(fp, "[0004]\t\tSignature : \"SRAT\"\n");
+	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
+	EFPRINTF(fp, "[0001]\t\tRevision : 03\n");
+	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
+	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
+	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMSRAT  \"\n");
+	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
+
+	/* iasl will fill in the compiler ID/revision fields */
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
+	EFPRINTF(fp, "\n");
+
+	EFPRINTF(fp, "[0004]\t\tTable Revision : 00000001\n");
+	EFPRINTF(fp, "[0008]\t\tReserved : 0000000000000000\n");
+	EFPRINTF(fp, "\n");
+
+	/* A Processor Local APIC Affinity entry for each CPU */
+	for (n = 0; (node = numa_get_node(n)) != NULL; n++) {
+		for (i = 0; i < basl_ncpu; i++) {
+			if ((node->vcpus & (1UL << i)) == 0)
+				continue;
+
+			pcpu_id = pcpuid_from_vcpuid(guest_pcpu_bitmask, i);
+			lapic_id = (pcpu_id < 0) ? -1 : lapicid_from_pcpuid(pcpu_id);
+			if (lapic_id == -1) {
+				pr_err("%s,Err: no local APIC ID for vCPU %d.\n", __func__, i);
+				return -1;
+			}
+
+			EFPRINTF(fp, "[0001]\t\tSubtable Type : 00\n");
+			EFPRINTF(fp, "[0001]\t\tLength : 10\n");
+			EFPRINTF(fp, "[0001]\t\tProximity Domain Low(8) : %02x\n", n);
+			EFPRINTF(fp, "[0001]\t\tApic ID : %02x\n", lapic_id);
+			EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
+			EFPRINTF(fp, "\t\t\tEnabled : 1\n");
+			EFPRINTF(fp, "[0001]\t\tLocal Sapic EID : 00\n");
+			EFPRINTF(fp, "[0003]\t\tProximity Domain High(24) : 000000\n");
+			EFPRINTF(fp, "[0004]\t\tClock Domain : 00000000\n");
+			EFPRINTF(fp, "\n");
+		}
+	}
+
+	/* A Memory Affinity entry for each lowmem/highmem range of the nodes */
+	for (n = 0; (node = numa_get_node(n)) != NULL; n++) {
+		for (i = 0; i < 2; i++) {
+			if (node->len[i] == 0)
+				continue;
+
+			EFPRINTF(fp, "[0001]\t\tSubtable Type : 01\n");
+			EFPRINTF(fp, "[0001]\t\tLength : 28\n");
+			EFPRINTF(fp, "[0004]\t\tProximity Domain : %08x\n", n);
+			EFPRINTF(fp, "[0002]\t\tReserved1 : 0000\n");
+			EFPRINTF(fp, "[0008]\t\tBase Address : %016lx\n", node->gpa[i]);
+			EFPRINTF(fp, "[0008]\t\tAddress Length : %016lx\n", node->len[i]);
+			EFPRINTF(fp, "[0004]\t\tReserved2 : 00000000\n");
+			EFPRINTF(fp, "[0004]\t\tFlags (decoded below) : 00000001\n");
+			EFPRINTF(fp, "\t\t\tEnabled : 1\n");
+			EFPRINTF(fp, "\t\t\tHot Pluggable : 0\n");
+			EFPRINTF(fp, "\t\t\tNon-Volatile : 0\n");
+			EFPRINTF(fp, "[0008]\t\tReserved3 : 0000000000000000\n");
+			EFPRINTF(fp, "\n");
+		}
+	}
+
+	EFFLUSH(fp);
+
+	return 0;
+}
+
+static int
+basl_fwrite_slit(FILE *fp, struct vmctx *ctx)
+{
+	int i, j, nr_nodes;
+
+	nr_nodes = numa_get_nr_nodes();
+
+	EFPRINTF(fp, "/*\n");
+	EFPRINTF(fp, " * dm SLIT template\n");
+	EFPRINTF(fp, " */\n");
+	EFPRINTF(fp, "[0004]\t\tSignature : \"SLIT\"\n");
+	EFPRINTF(fp, "[0004]\t\tTable Length : 00000000\n");
+	EFPRINTF(fp, "[0001]\t\tRevision : 01\n");
+	EFPRINTF(fp, "[0001]\t\tChecksum : 00\n");
+	EFPRINTF(fp, "[0006]\t\tOem ID : \"DM \"\n");
+	EFPRINTF(fp, "[0008]\t\tOem Table ID : \"DMSLIT  \"\n");
+	EFPRINTF(fp, "[0004]\t\tOem Revision : 00000001\n");
+
+	/* iasl will fill in the compiler ID/revision fields */
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler ID : \"xxxx\"\n");
+	EFPRINTF(fp, "[0004]\t\tAsl Compiler Revision : 00000000\n");
+	EFPRINTF(fp, "\n");
+
+	EFPRINTF(fp, "[0008]\t\tLocalities : %016x\n", nr_nodes);
+	for (i = 0; i < nr_nodes; i++) {
+		EFPRINTF(fp, "[%04x]\t\tLocality %3d :", nr_nodes, i);
+		for (j = 0; j < nr_nodes; j++)
+			EFPRINTF(fp, " %02X", numa_distance(i, j));
+		EFPRINTF(fp, "\n");
+	}
+
+	EFFLUSH(fp);
+
+	return 0;
+}
+
 static int
 basl_fwrite_fadt(FILE *fp, struct vmctx *ctx)
 {
@@ -696,7 +831,7 @@ basl_fwrite_nhlt(FILE *fp, struct vmctx *ctx)
 
 	audio_nhlt_len = lseek(fd, 0, SEEK_END);
 	/* check if file size exceeds reserved room */
-	if (audio_nhlt_len > DSDT_OFFSET - NHLT_OFFSET) {
+	if (audio_nhlt_len > SRAT_OFFSET - NHLT_OFFSET) {
 		pr_err("Host NHLT exceeds reserved room!\n");
 		close(fd);
 		return -1;
@@ -1080,6 +1215,8 @@ static struct {
 	{ basl_fwrite_facs, FACS_OFFSET, true  },
 	{ basl_fwrite_nhlt, NHLT_OFFSET, false }, /*valid with audio ptdev*/
 	{ basl_fwrite_tpm2, TPM2_OFFSET, false },
+	{ basl_fwrite_srat, SRAT_OFFSET, false }, /*valid with --numa*/
+	{ basl_fwrite_slit, SLIT_OFFSET, false }, /*valid with --numa*/
 	{ basl_fwrite_dsdt, DSDT_OFFSET, true  }
 };
 
@@ -1236,6 +1373,11 @@ acpi_build(struct vmctx *ctx, int ncpu)
 				basl_ftables[i].valid = true;
 		}
 
+		if (((basl_ftables[i].offset == SRAT_OFFSET) ||
+			(basl_ftables[i].offset == SLIT_OFFSET)) &&
+			(numa_get_nr_nodes() > 0))
+			basl_ftables[i].valid = true;
+
 		if (acpi_table_is_valid(i))
 			err = basl_compile(ctx, basl_ftables[i].wsect,
 					basl_ftables[i].offset);
@@ -337,7 +337,6 @@ vhpet_timer_handler(void *a, uint64_t nexp)
 	struct vhpet_timer_arg *arg;
 	struct timespec now;
 	struct itimerspec tmrts;
-	uint64_t newexp;
 
 	arg = a;
 	vhpet = arg->vhpet;
@@ -385,13 +384,6 @@ vhpet_timer_handler(void *a, uint64_t nexp)
 	timespecadd(&tmrts.it_value, &now);
 	vhpet->timer[n].expts = tmrts.it_value;
 
-	/*
-	 * Catch any remaining expirations that happened after being
-	 * last consumed by the mevent_dispatch thread.
-	 */
-	if (read(vhpet_tmr(vhpet, n)->fd, &newexp, sizeof(newexp)) > 0)
-		nexp += newexp;
-
 	/*
 	 * Periodic timer updates 'compval' upon expiration.
 	 * Try to keep 'compval' as up-to-date as possible.
@@ -432,9 +424,8 @@ vhpet_adjust_compval(struct vhpet *vhpet, int n, const struct timespec *now)
 	 * The 'compval' is rounded up such that it stays "ahead" of
 	 * 'counter'.
 	 *
-	 * There's a slight chance read() in vhpet_timer_handler() had
-	 * already accomplished some of this just prior to calling this
-	 * function.
+	 * There's a slight chance vhpet_timer_handler() had already
+	 * accomplished some of this just prior to calling this function.
 	 */
 	compnext = compval + (delta_ticks / comprate + 1) * comprate;
 
@@ -993,6 +993,59 @@ vrtc_set_time(struct vrtc *vrtc, time_t secs)
 	return error;
 }
 
+/*
+ * RTC state kept in a VM snapshot. The time is saved as the offset to the
+ * host time, so the RTC keeps running while the snapshot isn't used, as it
+ * does in S3.
+ */
+struct vrtc_state {
+	int64_t offset;
+	struct rtcdev rtcdev;
+} __packed;
+
+ssize_t
+vrtc_save_state(struct vmctx *ctx, void *buf, size_t len)
+{
+	struct vrtc *vrtc = ctx->vrtc;
+	struct vrtc_state *state = buf;
+	time_t basetime;
+
+	if (len < sizeof(*state))
+		return -1;
+
+	pthread_mutex_lock(&vrtc->mtx);
+	state->offset = vrtc_curtime(vrtc, &basetime) - basetime;
+	state->rtcdev = vrtc->rtcdev;
+	pthread_mutex_unlock(&vrtc->mtx);
+
+	return sizeof(*state);
+}
+
+int
+vrtc_load_state(struct vmctx *ctx, const void *buf, size_t len)
+{
+	struct vrtc *vrtc = ctx->vrtc;
+	const struct vrtc_state *state = buf;
+	time_t now;
+	int error;
+
+	if (len != sizeof(*state))
+		return -1;
+
+	pthread_mutex_lock(&vrtc->mtx);
+	memcpy(vrtc->rtcdev.nvram, state->rtcdev.nvram, sizeof(vrtc->rtcdev.nvram));
+	memcpy(vrtc->rtcdev.nvram2, state->rtcdev.nvram2, sizeof(vrtc->rtcdev.nvram2));
+	vrtc_set_reg_a(vrtc, state->rtcdev.reg_a);
+	error = vrtc_set_reg_b(vrtc, state->rtcdev.reg_b & ~RTCSB_HALT);
+	if (error == 0) {
+		now = time(NULL);
+		error = vrtc_time_update(vrtc, now + state->offset, now);
+	}
+	pthread_mutex_unlock(&vrtc->mtx);
+
+	return error;
+}
+
 int
 vrtc_init(struct vmctx *ctx)
 {
@@ -9,6 +9,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "acpi.h"
 #include "vmmapi.h"
@@ -28,6 +29,11 @@ static int tpm_debug;
 #define STR_MAX_LEN 1024U
 static char *sock_path = NULL;
 static uint32_t vtpm_crb_mmio_addr = 0U;
+
+/* connection to swtpm set up by prepare_vtpm2() */
+static pthread_t emulator_tid;
+static bool emulator_pending;
+static int emulator_ret;
 struct acpi_dev_pt_ops pt_acpi_dev;
 
 #define TPM2_TABLE_SYSFS_PATH	"/sys/firmware/acpi/tables/TPM2"
@@ -254,6 +260,34 @@ int acrn_parse_vtpm2(char *arg)
 	return 0;
 }
 
+static void *tpm_emulator_thread(void *arg)
+{
+	emulator_ret = init_tpm_emulator(sock_path);
+	return NULL;
+}
+
+/* Connect to swtpm in the background, while the other devices are initialized */
+void prepare_vtpm2(void)
+{
+	if (!sock_path)
+		return;
+
+	if (pthread_create(&emulator_tid, NULL, tpm_emulator_thread, NULL) == 0) {
+		pthread_setname_np(emulator_tid, "tpm_emulator");
+		emulator_pending = true;
+	}
+}
+
+static int wait_tpm_emulator(void)
+{
+	if (!emulator_pending)
+		return init_tpm_emulator(sock_path);
+
+	pthread_join(emulator_tid, NULL);
+	emulator_pending = false;
+	return emulator_ret;
+}
+
 void init_vtpm2(struct vmctx *ctx)
 {
 	if (!sock_path) {
@@ -261,7 +295,7 @@ void init_vtpm2(struct vmctx *ctx)
 		return;
 	}
 
-	if (init_tpm_emulator(sock_path) < 0) {
+	if (wait_tpm_emulator() < 0) {
 		WPRINTF("Failed init tpm emulator!\n");
 		return;
 	}
@@ -278,6 +312,13 @@ void init_vtpm2(struct vmctx *ctx)
 
 void deinit_vtpm2(struct vmctx *ctx)
 {
+	/* init_vtpm2() wasn't reached */
+	if (emulator_pending) {
+		if (wait_tpm_emulator() == 0)
+			deinit_tpm_emulator();
+		return;
+	}
+
 	if (ctx->tpm_dev) {
 		deinit_tpm_crb(ctx);
 
@@ -13,12 +13,19 @@
 #include "usb.h"
 #include "usbdi.h"
 #include "usb_pmapper.h"
+#include "atomic.h"
 
 #undef LOG_TAG
 #define LOG_TAG "USBPM: "
 
+/* the completed requests kept per device, and the largest buffer kept */
+#define USB_DEV_REQ_POOL_SIZE	64
+#define USB_DEV_REQ_POOL_BUF	(1024 * 1024)
+
 static struct usb_dev_sys_ctx_info g_ctx;
 static uint16_t usb_dev_get_ep_maxp(struct usb_dev *udev, int pid, int epnum);
+static inline struct usb_dev_ep *usb_dev_get_ep(struct usb_dev *udev, int pid, int ep);
+static void usb_dev_release_req(struct usb_dev_req *req);
 
 static bool
 usb_get_native_devinfo(struct libusb_device *ldev,
@@ -170,6 +177,7 @@ usb_dev_comp_cb(struct libusb_transfer *trn)
 	struct usb_xfer *xfer;
 	struct usb_block *block;
 	struct usb_native_devinfo *info;
+	struct usb_dev_ep *ep;
 	int do_intr = 0;
 	int i, idx, buf_idx, done;
 	int is_stalled = 0;
@@ -188,6 +196,10 @@ usb_dev_comp_cb(struct libusb_transfer *trn)
 	/* async transfer */
 	xfer = r->xfer;
 
+	ep = usb_dev_get_ep(r->udev, r->in, xfer->epid / 2);
+	if (ep)
+		atomic_sub_fetch(&ep->inflight, 1);
+
 	maxp = usb_dev_get_ep_maxp(r->udev, r->in, xfer->epid / 2);
 	if (trn->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
 		/* got the isoc frame length */
@@ -317,15 +329,55 @@ cancel_out:
 	/* unlock and release memory */
 	g_ctx.unlock_ep_cb(xfer->dev, &xfer->epid);
 
-	if (r && r->buffer)
-		free(r->buffer);
-
 	xfer->reqs[r->blk_head] = NULL;
-	free(r);
+	usb_dev_release_req(r);
+	return;
+
 free_transfer:
 	libusb_free_transfer(trn);
 }
 
+/* take a completed request from the pool, with enough iso packets */
+static struct usb_dev_req *
+usb_dev_get_pooled_req(struct usb_dev *udev, size_t size, size_t count)
+{
+	struct usb_dev_req *req, **prev;
+	uint8_t *buf;
+
+	pthread_mutex_lock(&udev->req_mtx);
+	for (prev = &udev->req_pool; *prev; prev = &(*prev)->next) {
+		if ((*prev)->iso_cnt >= count)
+			break;
+	}
+	req = *prev;
+	if (req) {
+		*prev = req->next;
+		udev->req_pool_cnt--;
+	}
+	pthread_mutex_unlock(&udev->req_mtx);
+
+	if (!req)
+		return NULL;
+
+	if (req->buf_cap < size) {
+		buf = realloc(req->buffer, size);
+		if (!buf) {
+			free(req->buffer);
+			libusb_free_transfer(req->trn);
+			free(req);
+			return NULL;
+		}
+		req->buffer = buf;
+		req->buf_cap = size;
+	}
+	req->trn->num_iso_packets = 0;
+	if (count)
+		memset(req->trn->iso_packet_desc, 0,
+				count * sizeof(struct libusb_iso_packet_descriptor));
+	req->next = NULL;
+	return req;
+}
+
 static struct usb_dev_req *
 usb_dev_alloc_req(struct usb_dev *udev, struct usb_xfer *xfer, int in,
 		size_t size, size_t count)
@@ -336,6 +388,14 @@ usb_dev_alloc_req(struct usb_dev *udev, struct usb_xfer *xfer, int in,
 	if (!udev || !xfer || count < 0)
 		return NULL;
 
+	req = usb_dev_get_pooled_req(udev, size, count);
+	if (req) {
+		req->in = in;
+		req->xfer = xfer;
+		req->seq = seq++;
+		return req;
+	}
+
 	req = calloc(1, sizeof(*req));
 	if (!req)
 		return NULL;
@@ -347,12 +407,14 @@ usb_dev_alloc_req(struct usb_dev *udev, struct usb_xfer *xfer, int in,
 	req->trn = libusb_alloc_transfer(count);
 	if (!req->trn)
 		goto errout;
+	req->iso_cnt = count;
 
 	if (size)
 		req->buffer = malloc(size);
 
 	if (!req->buffer)
 		goto errout;
+	req->buf_cap = size;
 
 	return req;
 
@@ -366,6 +428,46 @@ errout:
 	return NULL;
 }
 
+/* put a completed request back to the pool, or free it if the pool is full */
+static void
+usb_dev_release_req(struct usb_dev_req *req)
+{
+	struct usb_dev *udev = req->udev;
+
+	if (req->buf_cap <= USB_DEV_REQ_POOL_BUF) {
+		pthread_mutex_lock(&udev->req_mtx);
+		if (udev->req_pool_cnt < USB_DEV_REQ_POOL_SIZE) {
+			req->xfer = NULL;
+			req->next = udev->req_pool;
+			udev->req_pool = req;
+			udev->req_pool_cnt++;
+			pthread_mutex_unlock(&udev->req_mtx);
+			return;
+		}
+		pthread_mutex_unlock(&udev->req_mtx);
+	}
+
+	free(req->buffer);
+	libusb_free_transfer(req->trn);
+	free(req);
+}
+
+static void
+usb_dev_free_req_pool(struct usb_dev *udev)
+{
+	struct usb_dev_req *req;
+
+	pthread_mutex_lock(&udev->req_mtx);
+	while ((req = udev->req_pool) != NULL) {
+		udev->req_pool = req->next;
+		free(req->buffer);
+		libusb_free_transfer(req->trn);
+		free(req);
+	}
+	udev->req_pool_cnt = 0;
+	pthread_mutex_unlock(&udev->req_mtx);
+}
+
 static int
 usb_dev_prepare_xfer(struct usb_xfer *xfer, int *head, int *tail)
 {
@@ -746,78 +848,54 @@ usb_dev_reset(void *pdata)
 	return rc;
 }
 
-int
-usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
+/*
+ * Submit the blocks [head, tail) of the xfer as one libusb transfer. The
+ * range ends with a complete TD, so its completion can be handled alone.
+ */
+static int
+usb_dev_submit_req(struct usb_dev *udev, struct usb_xfer *xfer, int dir,
+		uint8_t type, int epctx, int framelen, int head, int tail)
 {
-	struct usb_dev *udev;
 	struct usb_dev_req *r;
+	struct usb_dev_ep *ep;
 	struct usb_native_devinfo *info;
-	int rc = 0, epid;
-	uint8_t type;
-	int i, idx, buf_idx, head, tail, size;
 	struct usb_block *b;
 	static const char * const type_str[] = {"CTRL", "ISO", "BULK", "INT"};
 	static const char * const dir_str[] = {"OUT", "IN"};
-	int framelen = 0, framecnt = 0;
-	uint16_t maxp;
+	int i, idx, buf_idx, rc, epid;
+	int size = 0, framecnt = 0;
 
-	udev = pdata;
 	info = &udev->info;
-	xfer->status = USB_ERR_NORMAL_COMPLETION;
-	size = usb_dev_prepare_xfer(xfer, &head, &tail);
-	if (size <= 0)
-		goto done;
-
-	type = usb_dev_get_ep_type(udev, dir ? TOKEN_IN : TOKEN_OUT, epctx);
-	if (type > USB_ENDPOINT_INT) {
-		xfer->status = USB_ERR_IOERROR;
-		goto done;
-	}
-
 	epid = dir ? (0x80 | epctx) : epctx;
-	if (!(dir == USB_XFER_IN || dir == USB_XFER_OUT)) {
-		xfer->status = USB_ERR_IOERROR;
-		goto done;
-	}
 
-	maxp = usb_dev_get_ep_maxp(udev, dir, epctx);
-	if (type == USB_ENDPOINT_ISOC) {
-		/* need to double check it, there might be some non-spec
-		 * compatible usb devices in the market.
-		 */
-		framelen = USB_EP_MAXP_SZ(maxp) * (1 + USB_EP_MAXP_MT(maxp));
-		UPRINTF(LDBG, "iso maxp %u framelen %d\r\n", maxp, framelen);
-
-		for (idx = head;
-			index_valid(head, tail, xfer->max_blk_cnt, idx);
+	for (idx = head; index_valid(head, tail, xfer->max_blk_cnt, idx);
 			idx = index_inc(idx, xfer->max_blk_cnt)) {
+		b = &xfer->data[idx];
+		if (b->type == USB_DATA_PART || b->type == USB_DATA_FULL)
+			size += b->blen;
 
-			if (xfer->data[idx].blen > framelen)
-				UPRINTF(LFTL, "err framelen %d\r\n", framelen);
+		if (type != USB_ENDPOINT_ISOC)
+			continue;
 
-			if (xfer->data[idx].type == USB_DATA_NONE ||
-					xfer->data[idx].type == USB_DATA_PART)
-				continue;
-			else if (xfer->data[idx].type == USB_DATA_FULL)
-				framecnt++;
-			else
-				UPRINTF(LFTL, "%s:%d error\r\n", __func__, __LINE__);
-		}
-		UPRINTF(LDBG, "iso maxp %u framelen %d, framecnt %d\r\n", maxp,
-				framelen, framecnt);
+		if (b->blen > framelen)
+			UPRINTF(LFTL, "err framelen %d\r\n", framelen);
+
+		if (b->type == USB_DATA_NONE || b->type == USB_DATA_PART)
+			continue;
+		else if (b->type == USB_DATA_FULL)
+			framecnt++;
+		else
+			UPRINTF(LFTL, "%s:%d error\r\n", __func__, __LINE__);
 	}
 
 	r = usb_dev_alloc_req(udev, xfer, dir, size, type ==
 			USB_ENDPOINT_ISOC ? framecnt : 0);
-	if (!r) {
-		xfer->status = USB_ERR_IOERROR;
-		goto done;
-	}
+	if (!r)
+		return USB_ERR_IOERROR;
 
 	r->buf_size = size;
 	r->blk_head = head;
 	r->blk_tail = tail;
-	xfer->reqs[head] = r;
 	UPRINTF(LDBG, "%s: %d-%s: explen %d ep%d-xfr [%d-%d %d] rq-%d "
 			"[%d-%d %d] dir %s type %s\r\n", __func__,
 			info->path.bus, usb_dev_path(&info->path), size, epctx,
@@ -877,19 +955,117 @@ usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
 
 	} else {
 		UPRINTF(LFTL, "%s: wrong endpoint type %d\r\n", __func__, type);
-		if (r->buffer)
-			free(r->buffer);
-		if (r->trn)
-			libusb_free_transfer(r->trn);
-		free(r);
-		xfer->status = USB_ERR_INVAL;
+		usb_dev_release_req(r);
+		return USB_ERR_INVAL;
 	}
 
+	ep = usb_dev_get_ep(udev, dir, epctx);
+	if (ep)
+		atomic_add_fetch(&ep->inflight, 1);
+	xfer->reqs[head] = r;
+
 	rc = libusb_submit_transfer(r->trn);
 	if (rc) {
-		xfer->status = USB_ERR_IOERROR;
 		UPRINTF(LDBG, "libusb_submit_transfer fail: %d\n", rc);
+		xfer->reqs[head] = NULL;
+		if (ep)
+			atomic_sub_fetch(&ep->inflight, 1);
+		usb_dev_release_req(r);
+		return USB_ERR_IOERROR;
+	}
+	return USB_ERR_NORMAL_COMPLETION;
+}
+
+int
+usb_dev_data(void *pdata, struct usb_xfer *xfer, int dir, int epctx)
+{
+	struct usb_dev *udev;
+	struct usb_dev_ep *ep;
+	uint8_t type;
+	int idx, head, tail, size, ntd, slots, per_req, n, first;
+	int framelen = 0;
+	uint16_t maxp;
+
+	udev = pdata;
+	xfer->status = USB_ERR_NORMAL_COMPLETION;
+	size = usb_dev_prepare_xfer(xfer, &head, &tail);
+	if (size <= 0)
+		goto done;
+
+	type = usb_dev_get_ep_type(udev, dir ? TOKEN_IN : TOKEN_OUT, epctx);
+	if (type > USB_ENDPOINT_INT) {
+		xfer->status = USB_ERR_IOERROR;
+		goto done;
 	}
+
+	if (!(dir == USB_XFER_IN || dir == USB_XFER_OUT)) {
+		xfer->status = USB_ERR_IOERROR;
+		goto done;
+	}
+
+	maxp = usb_dev_get_ep_maxp(udev, dir, epctx);
+	if (type == USB_ENDPOINT_ISOC) {
+		/* need to double check it, there might be some non-spec
+		 * compatible usb devices in the market.
+		 */
+		framelen = USB_EP_MAXP_SZ(maxp) * (1 + USB_EP_MAXP_MT(maxp));
+		UPRINTF(LDBG, "iso maxp %u framelen %d\r\n", maxp, framelen);
+	}
+
+	/*
+	 * Keep up to xfer_depth transfers in flight on bulk and isoc
+	 * endpoints by spreading the pending TDs over the free slots, so
+	 * the device is never idle waiting for a completion to be handled.
+	 * Interrupt endpoints poll one request at a time.
+	 */
+	slots = 1;
+	ep = usb_dev_get_ep(udev, dir, epctx);
+	if (ep && (type == USB_ENDPOINT_BULK || type == USB_ENDPOINT_ISOC)) {
+		slots = g_ctx.xfer_depth - atomic_load(&ep->inflight);
+		if (slots < 1)
+			slots = 1;
+	}
+
+	ntd = 0;
+	if (slots > 1) {
+		for (idx = head; index_valid(head, tail, xfer->max_blk_cnt, idx);
+				idx = index_inc(idx, xfer->max_blk_cnt)) {
+			if (xfer->data[idx].type == USB_DATA_FULL)
+				ntd++;
+		}
+	}
+
+	if (ntd <= 1 || slots == 1) {
+		xfer->status = usb_dev_submit_req(udev, xfer, dir, type, epctx,
+				framelen, head, tail);
+		goto done;
+	}
+
+	per_req = (ntd + slots - 1) / slots;
+	first = head;
+	n = 0;
+	for (idx = head; index_valid(head, tail, xfer->max_blk_cnt, idx);
+			idx = index_inc(idx, xfer->max_blk_cnt)) {
+		if (xfer->data[idx].type != USB_DATA_FULL)
+			continue;
+
+		ntd--;
+		if (++n < per_req && ntd > 0)
+			continue;
+
+		/* the trailing partial TD goes with the last request */
+		xfer->status = usb_dev_submit_req(udev, xfer, dir, type, epctx,
+				framelen, first, ntd ? index_inc(idx,
+				xfer->max_blk_cnt) : tail);
+		if (xfer->status != USB_ERR_NORMAL_COMPLETION)
+			break;
+
+		if (ntd == 0)
+			break;
+		first = index_inc(idx, xfer->max_blk_cnt);
+		n = 0;
+	}
+
 done:
 	return xfer->status;
 }
@@ -1097,6 +1273,7 @@ usb_dev_init(void *pdata, char *opt)
 	udev->info    = *di;
 	udev->version = ver;
 	udev->handle  = NULL;
+	pthread_mutex_init(&udev->req_mtx, NULL);
 
 	/* configure physical device through libusb library */
 	if (libusb_open(udev->info.priv_data, &udev->handle)) {
@@ -1151,6 +1328,8 @@ usb_dev_deinit(void *pdata)
 						rc);
 			libusb_close(udev->handle);
 		}
+		usb_dev_free_req_pool(udev);
+		pthread_mutex_destroy(&udev->req_mtx);
 		free(udev);
 	}
 }
@@ -1271,7 +1450,7 @@ int
 usb_dev_sys_init(usb_dev_sys_cb conn_cb, usb_dev_sys_cb disconn_cb,
 		usb_dev_sys_cb notify_cb, usb_dev_sys_cb intr_cb,
 		usb_dev_sys_cb lock_ep_cb, usb_dev_sys_cb unlock_ep_cb,
-		void *hci_data, int log_level)
+		void *hci_data, int log_level, int xfer_depth)
 {
 	libusb_hotplug_event native_conn_evt;
 	libusb_hotplug_event native_disconn_evt;
@@ -1301,6 +1480,9 @@ usb_dev_sys_init(usb_dev_sys_cb conn_cb, usb_dev_sys_cb disconn_cb,
 	g_ctx.intr_cb      = intr_cb;
 	g_ctx.lock_ep_cb   = lock_ep_cb;
 	g_ctx.unlock_ep_cb = unlock_ep_cb;
+	g_ctx.xfer_depth   = xfer_depth;
+	if (g_ctx.xfer_depth < 1 || g_ctx.xfer_depth > USB_DEV_XFER_DEPTH_MAX)
+		g_ctx.xfer_depth = USB_DEV_XFER_DEPTH;
 
 	num_devs = usb_dev_scan_dev(&g_ctx.devlist);
 	UPRINTF(LINF, "found %d devices before Guest OS booted\r\n", num_devs);
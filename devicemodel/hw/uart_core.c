@@ -42,6 +42,7 @@
 
 #include "types.h"
 #include "mevent.h"
+#include "timer.h"
 #include "uart_core.h"
 #include "ns16550.h"
 #include "dm.h"
@@ -57,6 +58,8 @@
 #define	DEFAULT_BAUD	9600
 
 #define	FCR_RX_MASK	0xC0
+#define	FCR_FIFO64	0x20	/* 16750: 64 bytes FIFO, written with DLAB set */
+#define	IIR_FIFO64	0x20	/* 16750: 64 bytes FIFO enabled */
 
 #define	MCR_OUT1	0x04
 #define	MCR_OUT2	0x08
@@ -70,6 +73,19 @@
 #define	DEFAULT_FIFOSZ	(256)
 #define	SOCK_FIFOSZ	(32 * 1024)
 
+/*
+ * The bytes sent by the guest are buffered, and written to the backend once
+ * UART_TX_THRESHOLD of them are pending or UART_TX_FLUSH_NS after the first
+ * one. The rest of the buffer absorbs a backend not keeping up.
+ */
+#define	UART_TXBUF_SZ		(4 * 1024)
+#define	UART_TX_THRESHOLD	(1024)
+#define	UART_TX_FLUSH_NS	(2 * 1000000)
+#define	UART_RX_CHUNK		(256)
+
+/* the TX FIFO emulated in the 'fast' mode */
+#define	FAST_FIFOSZ	(64)
+
 static int uart_debug;
 #define DPRINTF(params) do { if (uart_debug) pr_dbg params; } while (0)
 #define WPRINTF(params) (pr_err params)
@@ -142,6 +158,18 @@ struct uart_vdev {
 
 	bool	thre_int_pending;	/* THRE interrupt pending */
 
+	/*
+	 * In the 'fast' mode, the UART is a 16750 whose THRE interrupt is
+	 * raised once its TX FIFO is full or flushed, not for each byte.
+	 */
+	bool	fast;
+	int	thr_num;		/* bytes in the emulated TX FIFO */
+
+	uint8_t	txbuf[UART_TXBUF_SZ];
+	int	txnum;
+	struct acrn_timer tx_timer;
+	bool	tx_armed;
+
 	void	*arg;
 	int	rxfifo_size;
 	uart_intr_func_t intr_assert;
@@ -149,9 +177,11 @@ struct uart_vdev {
 };
 
 static void uart_drain(int fd, enum ev_type ev, void *arg);
+static void uart_toggle_intr(struct uart_vdev *uart);
 static void uart_deinit(struct uart_vdev *uart);
-static int uart_backend_read(struct uart_backend *be);
-static int uart_backend_write(struct uart_backend *be, unsigned char wb);
+static int uart_backend_read(struct uart_backend *be, uint8_t *buf, int len);
+static int uart_backend_write(struct uart_backend *be, const uint8_t *buf,
+		int len);
 static int uart_reset_backend(struct uart_backend *be);
 static int uart_enable_backend(struct uart_backend *be, bool enable);
 
@@ -206,6 +236,34 @@ rxfifo_putchar(struct uart_vdev *uart, uint8_t ch)
 		return -1;
 }
 
+static int
+rxfifo_space(struct uart_vdev *uart)
+{
+	struct fifo *fifo;
+
+	fifo = &uart->rxfifo;
+	return fifo->size - fifo->num;
+}
+
+/* the caller makes sure there is room for len bytes */
+static void
+rxfifo_putbuf(struct uart_vdev *uart, const uint8_t *buf, int len)
+{
+	struct fifo *fifo;
+	int n;
+
+	fifo = &uart->rxfifo;
+	n = fifo->size - fifo->windex;
+	if (n > len)
+		n = len;
+	memcpy(fifo->buf + fifo->windex, buf, n);
+	memcpy(fifo->buf, buf + n, len - n);
+	fifo->windex = (fifo->windex + len) % fifo->size;
+	fifo->num += len;
+	if (!rxfifo_available(uart))
+		uart_enable_backend(&uart->be, false);
+}
+
 static int
 rxfifo_getchar(struct uart_vdev *uart)
 {
@@ -235,6 +293,78 @@ rxfifo_numchars(struct uart_vdev *uart)
 	return fifo->num;
 }
 
+static void
+uart_tx_arm(struct uart_vdev *uart)
+{
+	struct itimerspec ts;
+
+	if (uart->tx_armed)
+		return;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.it_value.tv_nsec = UART_TX_FLUSH_NS;
+	if (acrn_timer_settime(&uart->tx_timer, &ts) == 0)
+		uart->tx_armed = true;
+}
+
+/* write the buffered bytes out, keeping what the backend can't take now */
+static void
+uart_tx_flush(struct uart_vdev *uart)
+{
+	int rc;
+
+	if (uart->txnum == 0)
+		return;
+
+	rc = uart_backend_write(&uart->be, uart->txbuf, uart->txnum);
+	if (rc < 0 || rc >= uart->txnum) {
+		/* dropped on errors, as no one is listening */
+		uart->txnum = 0;
+	} else if (rc > 0) {
+		memmove(uart->txbuf, uart->txbuf + rc, uart->txnum - rc);
+		uart->txnum -= rc;
+	}
+}
+
+static void
+uart_tx_putchar(struct uart_vdev *uart, uint8_t ch)
+{
+	if (!uart->be.opened)
+		return;
+
+	if (uart->txnum == UART_TXBUF_SZ) {
+		uart_tx_flush(uart);
+		if (uart->txnum == UART_TXBUF_SZ)
+			return;
+	}
+
+	uart->txbuf[uart->txnum++] = ch;
+	if (uart->txnum >= UART_TX_THRESHOLD)
+		uart_tx_flush(uart);
+	if (uart->txnum > 0)
+		uart_tx_arm(uart);
+}
+
+static void
+uart_tx_timer(void *arg, uint64_t nexp)
+{
+	struct uart_vdev *uart = arg;
+
+	pthread_mutex_lock(&uart->mtx);
+	uart->tx_armed = false;
+	uart_tx_flush(uart);
+	if (uart->txnum > 0)
+		uart_tx_arm(uart);
+
+	/* the emulated TX FIFO is drained along with the buffer */
+	if (uart->fast && uart->thr_num > 0) {
+		uart->thr_num = 0;
+		uart->thre_int_pending = true;
+		uart_toggle_intr(uart);
+	}
+	pthread_mutex_unlock(&uart->mtx);
+}
+
 static void
 uart_mevent_teardown(void *param)
 {
@@ -249,6 +379,8 @@ uart_mevent_teardown(void *param)
 	if (!be->opened)
 		return;
 
+	uart_tx_flush(uart);
+
 	switch (be->be_type) {
 	case UART_BE_STDIO:
 		uart_reset_stdio();
@@ -362,6 +494,7 @@ uart_reset(struct uart_vdev *uart)
 
 	/* set the right reset state here */
 	uart->ier = 0;
+	uart->thr_num = 0;
 	uart->thre_int_pending = true;
 	uart_toggle_intr(uart);
 }
@@ -370,7 +503,8 @@ static void
 uart_drain(int fd, enum ev_type ev, void *arg)
 {
 	struct uart_vdev *uart;
-	int ch;
+	uint8_t buf[UART_RX_CHUNK];
+	int n, space;
 
 	uart = arg;
 
@@ -382,11 +516,16 @@ uart_drain(int fd, enum ev_type ev, void *arg)
 	pthread_mutex_lock(&uart->mtx);
 
 	if ((uart->mcr & MCR_LOOPBACK) != 0) {
-		(void) uart_backend_read(&uart->be);
+		(void) uart_backend_read(&uart->be, buf, sizeof(buf));
 	} else {
-		/* only read tty when rxfifo available to make sure no data lost */
-		while (rxfifo_available(uart) && (ch = uart_backend_read(&uart->be)) != -1)
-			rxfifo_putchar(uart, ch);
+		/* only read tty as much as rxfifo can take to make sure no data lost */
+		while ((space = rxfifo_space(uart)) > 0) {
+			n = uart_backend_read(&uart->be, buf,
+				space < sizeof(buf) ? space : sizeof(buf));
+			if (n <= 0)
+				break;
+			rxfifo_putbuf(uart, buf, n);
+		}
 
 		uart_toggle_intr(uart);
 	}
@@ -421,14 +560,28 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 	case REG_DATA:
 		/* THRE INT is cleared after writing data into THR register */
 		uart->thre_int_pending = false;
-		uart_toggle_intr(uart);
+		if (!uart->fast)
+			uart_toggle_intr(uart);
 		if (uart->mcr & MCR_LOOPBACK) {
 			if (rxfifo_putchar(uart, value) != 0)
 				uart->lsr |= LSR_OE;
 		} else {
-			uart_backend_write(&uart->be, value);
+			uart_tx_putchar(uart, value);
 		} /* else drop on floor */
 
+		if (uart->fast) {
+			/*
+			 * The FIFO is sent once it's full, or flushed by
+			 * tx_timer when the guest stops writing.
+			 */
+			if (++uart->thr_num >= FAST_FIFOSZ) {
+				uart->thr_num = 0;
+				uart->thre_int_pending = true;
+			} else
+				uart_tx_arm(uart);
+			break;
+		}
+
 		/* We view the transmission is completed immediately */
 		uart->thre_int_pending = true;
 		break;
@@ -462,8 +615,18 @@ uart_write(struct uart_vdev *uart, int offset, uint8_t value)
 			if ((value & FCR_RCV_RST) != 0)
 				rxfifo_reset(uart, uart->rxfifo_size);
 
-			uart->fcr = value &
-				(FCR_ENABLE | FCR_DMA | FCR_RX_MASK);
+			if ((value & FCR_XMT_RST) != 0 && uart->thr_num > 0) {
+				uart->thr_num = 0;
+				uart->thre_int_pending = true;
+			}
+
+			/* the 64 bytes FIFO bit only changes with DLAB set */
+			if (uart->fast && (uart->lcr & LCR_DLAB) != 0)
+				uart->fcr = value & (FCR_ENABLE | FCR_DMA |
+					FCR_RX_MASK | FCR_FIFO64);
+			else
+				uart->fcr = (uart->fcr & FCR_FIFO64) | (value &
+					(FCR_ENABLE | FCR_DMA | FCR_RX_MASK));
 		}
 		break;
 	case REG_LCR:
@@ -549,6 +712,8 @@ uart_read(struct uart_vdev *uart, int offset)
 		break;
 	case REG_IIR:
 		iir = (uart->fcr & FCR_ENABLE) ? IIR_FIFO_MASK : 0;
+		if (uart->fcr & FCR_FIFO64)
+			iir |= IIR_FIFO64;
 
 		intr_reason = uart_intr_reason(uart);
 
@@ -640,6 +805,13 @@ uart_init(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 
 		pthread_mutex_init(&uart->mtx, NULL);
 
+		uart->tx_timer.clockid = CLOCK_MONOTONIC;
+		if (acrn_timer_init(&uart->tx_timer, uart_tx_timer, uart) < 0) {
+			WPRINTF(("uart: failed to init tx timer\n"));
+			free(uart);
+			return NULL;
+		}
+
 		uart_reset(uart);
 	}
 
@@ -649,8 +821,10 @@ uart_init(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 static void
 uart_deinit(struct uart_vdev *uart)
 {
-	if (uart)
+	if (uart) {
+		acrn_timer_deinit(&uart->tx_timer);
 		free(uart);
+	}
 }
 
 static void
@@ -686,9 +860,8 @@ uart_sock_accept(int fd __attribute__((unused)),
 }
 
 static int
-uart_backend_read(struct uart_backend *be)
+uart_backend_read(struct uart_backend *be, uint8_t *buf, int len)
 {
-	unsigned char rb;
 	int rc = -1;
 
 	if (!be || !be->opened)
@@ -698,10 +871,10 @@ uart_backend_read(struct uart_backend *be)
 	case UART_BE_STDIO:
 	case UART_BE_TTY:
 		/* fd is used to read */
-		rc = read(be->fd, &rb, 1);
+		rc = read(be->fd, buf, len);
 		break;
 	case UART_BE_SOCK:
-		rc = recv(be->fd2, &rb, 1, 0);
+		rc = recv(be->fd2, buf, len, 0);
 		if (rc <= 0 && errno != EAGAIN) {
 			if (be->evp2) {
 				mevent_delete(be->evp2);
@@ -723,11 +896,15 @@ uart_backend_read(struct uart_backend *be)
 	if (rc <= 0)
 		return -1;
 
-	return rb;
+	return rc;
 }
 
+/*
+ * Return the number of bytes written, 0 if the backend can't take any now,
+ * or -1 on errors.
+ */
 static int
-uart_backend_write(struct uart_backend *be, unsigned char wb)
+uart_backend_write(struct uart_backend *be, const uint8_t *buf, int len)
 {
 	int rc = -1;
 
@@ -738,11 +915,11 @@ uart_backend_write(struct uart_backend *be, unsigned char wb)
 	case UART_BE_STDIO:
 	case UART_BE_TTY:
 		/* fd2 is used to write */
-		rc = write(be->fd2, &wb, 1);
+		rc = write(be->fd2, buf, len);
 		break;
 	case UART_BE_SOCK:
-		rc = send(be->fd2, &wb, 1, 0);
-		if (rc != 1)
+		rc = send(be->fd2, buf, len, 0);
+		if (rc < 0 && errno != EAGAIN)
 			WPRINTF(("%s: send error, rc = %d, errno = %d\r\n",
 				__func__, rc, errno));
 		break;
@@ -750,6 +927,9 @@ uart_backend_write(struct uart_backend *be, unsigned char wb)
 		WPRINTF(("not supported backend %d!\n", be->be_type));
 	}
 
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
 	return rc;
 }
 
@@ -967,9 +1147,10 @@ uart_set_backend(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 	struct uart_backend *be = NULL;
 	const char *path = NULL;
 	enum uart_be_type be_type = UART_BE_INVALID;
-	char *vopts, *p;
+	char *vopts, *p, *bopts = NULL;
 	long port = 0;
 	int rxfifo_size = DEFAULT_FIFOSZ;
+	bool fast = false;
 
 	if (opts == NULL) {
 		uart = uart_init(intr_assert, intr_deassert, arg,
@@ -977,6 +1158,16 @@ uart_set_backend(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 		return uart;
 	}
 
+	/* "<backend>,fast" emulates a 16750 with a 64 bytes FIFO */
+	p = strrchr(opts, ',');
+	if (p && strcmp(p + 1, "fast") == 0) {
+		bopts = strndup(opts, p - opts);
+		if (!bopts)
+			goto opts_fail;
+		opts = bopts;
+		fast = true;
+	}
+
 	if (strncmp(opts, "tcp", 3) == 0) {
 		be_type = UART_BE_SOCK;
 		rxfifo_size = SOCK_FIFOSZ;
@@ -1002,6 +1193,7 @@ uart_set_backend(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 	uart = uart_init(intr_assert, intr_deassert, arg, rxfifo_size);
 	if (!uart)
 		goto init_fail;
+	uart->fast = fast;
 
 	be = &uart->be;
 	retval = uart_open_backend(be, path, be_type);
@@ -1016,6 +1208,7 @@ uart_set_backend(uart_intr_func_t intr_assert, uart_intr_func_t intr_deassert,
 		goto config_fail;
 	}
 
+	free(bopts);
 	return uart;
 
 config_fail:
@@ -1034,12 +1227,14 @@ config_fail:
 		mevent_delete(be->evp);
 	else
 		uart_mevent_teardown(uart);
+	free(bopts);
 	return NULL;
 
 open_fail:
 	uart_deinit(uart);
 init_fail:
 opts_fail:
+	free(bopts);
 	return NULL;
 }
 
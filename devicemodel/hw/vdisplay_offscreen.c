@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Offscreen virtual display
+ *
+ * Instead of showing them in a window, the guest surface and the cursor are
+ * composited into a frame in memory, so the display path can run and be
+ * measured on hosts without a GPU or a display. The frames can be dumped as
+ * a sequence of PPM files, or into a ring in shared memory for another
+ * process to read. The frame rate, the bytes composited per frame and the
+ * latency from the submission of an update, e.g. the flush of the guest, to
+ * its frame are logged every few seconds, and reported by display_stats of
+ * the command monitor.
+ *
+ * It's run by the display thread of vdisplay_sdl.c, which calls it instead
+ * of SDL when the virtio-gpu option "offscreen" is given.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "log.h"
+#include "vdisplay.h"
+
+#define OFFSCREEN_STATS_INTERVAL_NS	(5 * 1000000000UL)
+#define OFFSCREEN_SHM_SLOTS		4
+#define OFFSCREEN_SHM_MAGIC		0x4e524341	/* "ACRN" */
+
+/*
+ * The shared memory ring: this header, then OFFSCREEN_SHM_SLOTS frames of
+ * x8r8g8b8 pixels. frames is stored last, the newest frame is in the slot
+ * (frames - 1) % slots.
+ */
+struct offscreen_shm_header {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t slots;
+	uint32_t padding;
+	uint64_t frames;
+};
+
+static struct offscreen {
+	/* the guest surface, mapped from a dmabuf for a blob resource */
+	pixman_image_t *src;
+	void *dmabuf_map;
+	size_t dmabuf_size;
+
+	pixman_image_t *frame;
+	int width;
+	int height;
+
+	pixman_image_t *cursor;
+	struct cursor cur;
+	/* where the cursor is in the frame */
+	int cur_x;
+	int cur_y;
+	int cur_w;
+	int cur_h;
+	bool cursor_changed;
+	/* when the first cursor change not composed yet was submitted */
+	uint64_t cursor_submit_ns;
+
+	/* a directory for PPM files, or "shm:<name>" */
+	const char *dump;
+	uint64_t seq;
+	uint8_t *ppm;
+	int shm_fd;
+	struct offscreen_shm_header *shm;
+	size_t shm_size;
+
+	struct timespec stats_start;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t latency_ns;
+	uint64_t max_latency_ns;
+
+	/* for display_stats: all frames, and the last stats interval */
+	uint64_t total_frames;
+	uint64_t fps_x100;
+	uint64_t bytes_per_frame;
+	uint64_t avg_latency_us;
+	uint64_t max_latency_us;
+} ofs = {
+	.shm_fd = -1,
+};
+
+static uint64_t
+offscreen_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static bool
+offscreen_clip(int *x, int *y, int *w, int *h)
+{
+	if (*x < 0) {
+		*w += *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*h += *y;
+		*y = 0;
+	}
+	if (*x + *w > ofs.width)
+		*w = ofs.width - *x;
+	if (*y + *h > ofs.height)
+		*h = ofs.height - *y;
+
+	return (*w > 0) && (*h > 0);
+}
+
+static void
+offscreen_dump_ppm(void)
+{
+	char path[PATH_MAX];
+	uint32_t *row;
+	uint8_t *p;
+	int fd, x, y, len;
+
+	if (ofs.ppm == NULL) {
+		ofs.ppm = malloc(32 + ofs.width * ofs.height * 3);
+		if (ofs.ppm == NULL)
+			return;
+	}
+
+	len = snprintf((char *)ofs.ppm, 32, "P6\n%d %d\n255\n", ofs.width, ofs.height);
+	p = ofs.ppm + len;
+	for (y = 0; y < ofs.height; y++) {
+		row = (uint32_t *)((uint8_t *)pixman_image_get_data(ofs.frame) +
+				y * pixman_image_get_stride(ofs.frame));
+		for (x = 0; x < ofs.width; x++) {
+			*p++ = row[x] >> 16;
+			*p++ = row[x] >> 8;
+			*p++ = row[x];
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/frame-%08lu.ppm", ofs.dump, ofs.seq);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_err("%s: failed to create %s: %s\n", __func__, path, strerror(errno));
+		return;
+	}
+	if (write(fd, ofs.ppm, p - ofs.ppm) != p - ofs.ppm)
+		pr_err("%s: failed to write %s\n", __func__, path);
+	close(fd);
+}
+
+static int
+offscreen_map_shm(void)
+{
+	char path[PATH_MAX];
+	int stride = pixman_image_get_stride(ofs.frame);
+
+	snprintf(path, sizeof(path), "/dev/shm/%s", ofs.dump + 4);
+	if (ofs.shm_fd < 0) {
+		ofs.shm_fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (ofs.shm_fd < 0) {
+			pr_err("%s: failed to create %s: %s\n", __func__, path, strerror(errno));
+			return -1;
+		}
+	}
+
+	ofs.shm_size = sizeof(struct offscreen_shm_header) +
+			(size_t)OFFSCREEN_SHM_SLOTS * stride * ofs.height;
+	if (ftruncate(ofs.shm_fd, ofs.shm_size) < 0) {
+		pr_err("%s: failed to resize %s: %s\n", __func__, path, strerror(errno));
+		return -1;
+	}
+	ofs.shm = mmap(NULL, ofs.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, ofs.shm_fd, 0);
+	if (ofs.shm == MAP_FAILED) {
+		ofs.shm = NULL;
+		pr_err("%s: failed to map %s: %s\n", __func__, path, strerror(errno));
+		return -1;
+	}
+
+	ofs.shm->magic = OFFSCREEN_SHM_MAGIC;
+	ofs.shm->width = ofs.width;
+	ofs.shm->height = ofs.height;
+	ofs.shm->stride = stride;
+	ofs.shm->slots = OFFSCREEN_SHM_SLOTS;
+	__atomic_store_n(&ofs.shm->frames, 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void
+offscreen_dump_shm(void)
+{
+	size_t size = (size_t)pixman_image_get_stride(ofs.frame) * ofs.height;
+	uint8_t *slot;
+
+	if ((ofs.shm == NULL) && (offscreen_map_shm() < 0))
+		return;
+
+	slot = (uint8_t *)(ofs.shm + 1) + (ofs.seq % OFFSCREEN_SHM_SLOTS) * size;
+	memcpy(slot, pixman_image_get_data(ofs.frame), size);
+	__atomic_store_n(&ofs.shm->frames, ofs.seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Composite the damaged area and the cursor into the frame, submit_ns is
+ * when the update was submitted to the display thread.
+ */
+static void
+offscreen_compose(int x, int y, int w, int h, uint64_t submit_ns)
+{
+	uint64_t bytes = 0, latency;
+	int cx, cy, cw, ch;
+
+	if ((ofs.frame == NULL) || (ofs.src == NULL))
+		return;
+
+	if (offscreen_clip(&x, &y, &w, &h)) {
+		pixman_image_composite32(PIXMAN_OP_SRC, ofs.src, NULL, ofs.frame,
+				x, y, 0, 0, x, y, w, h);
+		bytes += (uint64_t)w * h * 4;
+	}
+
+	if (ofs.cursor && (ofs.cursor_changed || (bytes > 0))) {
+		/* restore what the cursor covered, and put it on top */
+		cx = ofs.cur_x;
+		cy = ofs.cur_y;
+		cw = ofs.cur_w;
+		ch = ofs.cur_h;
+		if (offscreen_clip(&cx, &cy, &cw, &ch)) {
+			pixman_image_composite32(PIXMAN_OP_SRC, ofs.src, NULL, ofs.frame,
+					cx, cy, 0, 0, cx, cy, cw, ch);
+			bytes += (uint64_t)cw * ch * 4;
+		}
+
+		ofs.cur_x = (int)ofs.cur.x - (int)ofs.cur.hot_x;
+		ofs.cur_y = (int)ofs.cur.y - (int)ofs.cur.hot_y;
+		ofs.cur_w = ofs.cur.width;
+		ofs.cur_h = ofs.cur.height;
+		cx = ofs.cur_x;
+		cy = ofs.cur_y;
+		cw = ofs.cur_w;
+		ch = ofs.cur_h;
+		if (offscreen_clip(&cx, &cy, &cw, &ch)) {
+			pixman_image_composite32(PIXMAN_OP_OVER, ofs.cursor, NULL, ofs.frame,
+					cx - ofs.cur_x, cy - ofs.cur_y, 0, 0, cx, cy, cw, ch);
+			bytes += (uint64_t)cw * ch * 4;
+		}
+	}
+	if (ofs.cursor_changed && (ofs.cursor_submit_ns < submit_ns))
+		submit_ns = ofs.cursor_submit_ns;
+	ofs.cursor_changed = false;
+
+	if (bytes == 0)
+		return;
+
+	if (ofs.dump) {
+		if (!strncmp(ofs.dump, "shm:", 4))
+			offscreen_dump_shm();
+		else
+			offscreen_dump_ppm();
+	}
+	ofs.seq++;
+
+	latency = offscreen_now() - submit_ns;
+	__atomic_store_n(&ofs.total_frames, ofs.total_frames + 1, __ATOMIC_RELAXED);
+	ofs.frames++;
+	ofs.bytes += bytes;
+	ofs.latency_ns += latency;
+	if (latency > ofs.max_latency_ns)
+		ofs.max_latency_ns = latency;
+}
+
+static void
+offscreen_report(uint64_t now)
+{
+	uint64_t elapsed;
+
+	elapsed = now - (ofs.stats_start.tv_sec * 1000000000UL + ofs.stats_start.tv_nsec);
+	if (elapsed == 0)
+		return;
+
+	__atomic_store_n(&ofs.fps_x100, ofs.frames * 100000000000UL / elapsed,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&ofs.bytes_per_frame, ofs.frames ? ofs.bytes / ofs.frames : 0,
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&ofs.avg_latency_us,
+			ofs.frames ? ofs.latency_ns / ofs.frames / 1000 : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&ofs.max_latency_us, ofs.max_latency_ns / 1000, __ATOMIC_RELAXED);
+
+	if (ofs.frames > 0)
+		pr_info("offscreen display: %lu.%02lu fps, %lu bytes/frame, "
+			"update latency avg %lu us max %lu us\n",
+			ofs.fps_x100 / 100, ofs.fps_x100 % 100,
+			ofs.bytes_per_frame, ofs.avg_latency_us, ofs.max_latency_us);
+
+	ofs.frames = 0;
+	ofs.bytes = 0;
+	ofs.latency_ns = 0;
+	ofs.max_latency_ns = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ofs.stats_start);
+}
+
+static void
+offscreen_release_src(void)
+{
+	if (ofs.src) {
+		pixman_image_unref(ofs.src);
+		ofs.src = NULL;
+	}
+	if (ofs.dmabuf_map) {
+		munmap(ofs.dmabuf_map, ofs.dmabuf_size);
+		ofs.dmabuf_map = NULL;
+	}
+}
+
+static void
+offscreen_release_frame(void)
+{
+	if (ofs.frame) {
+		pixman_image_unref(ofs.frame);
+		ofs.frame = NULL;
+	}
+	free(ofs.ppm);
+	ofs.ppm = NULL;
+	if (ofs.shm) {
+		munmap(ofs.shm, ofs.shm_size);
+		ofs.shm = NULL;
+	}
+	ofs.width = 0;
+	ofs.height = 0;
+}
+
+static pixman_format_code_t
+offscreen_dmabuf_format(uint32_t fourcc)
+{
+	switch (fourcc) {
+	case DRM_FORMAT_XRGB8888:
+		return PIXMAN_x8r8g8b8;
+	case DRM_FORMAT_ARGB8888:
+		return PIXMAN_a8r8g8b8;
+	case DRM_FORMAT_XBGR8888:
+		return PIXMAN_x8b8g8r8;
+	case DRM_FORMAT_ABGR8888:
+		return PIXMAN_a8b8g8r8;
+	default:
+		return 0;
+	}
+}
+
+void
+vdpy_offscreen_surface_set(struct surface *surf, uint64_t submit_ns)
+{
+	pixman_format_code_t format;
+
+	offscreen_release_src();
+	if (surf == NULL) {
+		offscreen_release_frame();
+		return;
+	}
+
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		ofs.src = pixman_image_create_bits(surf->surf_format,
+				surf->width, surf->height, surf->pixel, surf->stride);
+	} else if (surf->surf_type == SURFACE_DMABUF) {
+		/* the dmabufs of virtio-gpu are udmabufs, which can be mapped */
+		format = offscreen_dmabuf_format(surf->dma_info.surf_fourcc);
+		ofs.dmabuf_size = (size_t)surf->stride * surf->height;
+		ofs.dmabuf_map = mmap(NULL, ofs.dmabuf_size, PROT_READ, MAP_SHARED,
+				surf->dma_info.dmabuf_fd, 0);
+		if (ofs.dmabuf_map == MAP_FAILED) {
+			ofs.dmabuf_map = NULL;
+			pr_err("%s: failed to map the dmabuf: %s\n", __func__, strerror(errno));
+		} else if (format == 0) {
+			pr_err("%s: unsupported format %x\n", __func__, surf->dma_info.surf_fourcc);
+		} else {
+			ofs.src = pixman_image_create_bits(format, surf->width, surf->height,
+					ofs.dmabuf_map, surf->stride);
+		}
+	}
+	if (ofs.src == NULL) {
+		pr_err("%s: failed to create the surface image\n", __func__);
+		return;
+	}
+
+	if ((ofs.width != surf->width) || (ofs.height != surf->height)) {
+		offscreen_release_frame();
+		ofs.frame = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+				surf->width, surf->height, NULL, 0);
+		if (ofs.frame == NULL) {
+			pr_err("%s: failed to create the frame\n", __func__);
+			return;
+		}
+		ofs.width = surf->width;
+		ofs.height = surf->height;
+	}
+
+	offscreen_compose(0, 0, ofs.width, ofs.height, submit_ns);
+}
+
+void
+vdpy_offscreen_surface_update(struct surface *surf, uint64_t submit_ns)
+{
+	/* a flush of another resource of the same size */
+	if ((surf->surf_type == SURFACE_PIXMAN) &&
+		(ofs.src == NULL || (pixman_image_get_data(ofs.src) != surf->pixel))) {
+		offscreen_release_src();
+		ofs.src = pixman_image_create_bits(surf->surf_format,
+				MIN(surf->width, ofs.width), MIN(surf->height, ofs.height),
+				surf->pixel, surf->stride);
+	}
+
+	if ((surf->surf_type == SURFACE_PIXMAN) &&
+		(surf->damage.width > 0) && (surf->damage.height > 0))
+		offscreen_compose(surf->damage.x, surf->damage.y,
+				surf->damage.width, surf->damage.height, submit_ns);
+	else
+		offscreen_compose(0, 0, ofs.width, ofs.height, submit_ns);
+}
+
+static void
+offscreen_cursor_changed(uint64_t submit_ns)
+{
+	if (!ofs.cursor_changed || (submit_ns < ofs.cursor_submit_ns))
+		ofs.cursor_submit_ns = submit_ns;
+	ofs.cursor_changed = true;
+}
+
+void
+vdpy_offscreen_cursor_define(struct cursor *cur, uint64_t submit_ns)
+{
+	uint32_t y;
+
+	if (ofs.cursor) {
+		pixman_image_unref(ofs.cursor);
+		ofs.cursor = NULL;
+	}
+
+	ofs.cursor = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+			cur->width, cur->height, NULL, 0);
+	if (ofs.cursor == NULL) {
+		pr_err("%s: failed to create the cursor image\n", __func__);
+		return;
+	}
+	for (y = 0; y < cur->height; y++)
+		memcpy((uint8_t *)pixman_image_get_data(ofs.cursor) +
+				y * pixman_image_get_stride(ofs.cursor),
+			(uint8_t *)cur->data + y * cur->width * 4, cur->width * 4);
+
+	ofs.cur = *cur;
+	ofs.cur.data = NULL;
+	offscreen_cursor_changed(submit_ns);
+}
+
+void
+vdpy_offscreen_cursor_move(uint32_t x, uint32_t y, uint64_t submit_ns)
+{
+	ofs.cur.x = x;
+	ofs.cur.y = y;
+	offscreen_cursor_changed(submit_ns);
+}
+
+/* called by the ui timer, to draw the cursor moves and to log the stats */
+void
+vdpy_offscreen_refresh(void)
+{
+	uint64_t now = offscreen_now();
+
+	if (ofs.cursor_changed)
+		offscreen_compose(0, 0, 0, 0, ofs.cursor_submit_ns);
+
+	if (now - (ofs.stats_start.tv_sec * 1000000000UL + ofs.stats_start.tv_nsec) >=
+			OFFSCREEN_STATS_INTERVAL_NS)
+		offscreen_report(now);
+}
+
+/* the stats for display_stats, read by another thread */
+void
+vdpy_offscreen_get_stats(struct vdpy_stats *stats)
+{
+	stats->presented = __atomic_load_n(&ofs.total_frames, __ATOMIC_RELAXED);
+	stats->fps_x100 = __atomic_load_n(&ofs.fps_x100, __ATOMIC_RELAXED);
+	stats->bytes_per_frame = __atomic_load_n(&ofs.bytes_per_frame, __ATOMIC_RELAXED);
+	stats->avg_latency_us = __atomic_load_n(&ofs.avg_latency_us, __ATOMIC_RELAXED);
+	stats->max_latency_us = __atomic_load_n(&ofs.max_latency_us, __ATOMIC_RELAXED);
+}
+
+int
+vdpy_offscreen_init(const char *dump)
+{
+	ofs.dump = dump;
+	ofs.seq = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ofs.stats_start);
+
+	pr_info("offscreen display is created%s%s\n",
+		dump ? ", dumping frames to " : "", dump ? dump : "");
+	return 0;
+}
+
+void
+vdpy_offscreen_deinit(void)
+{
+	offscreen_report(offscreen_now());
+	offscreen_release_src();
+	offscreen_release_frame();
+	if (ofs.cursor) {
+		pixman_image_unref(ofs.cursor);
+		ofs.cursor = NULL;
+	}
+	if (ofs.shm_fd >= 0) {
+		close(ofs.shm_fd);
+		ofs.shm_fd = -1;
+	}
+	ofs.dump = NULL;
+}
@@ -31,6 +31,16 @@
 #define VDPY_DEFAULT_HEIGHT 768
 #define VDPY_MIN_WIDTH 640
 #define VDPY_MIN_HEIGHT 480
+/* the refresh rate used when the one of the screen is unknown */
+#define VDPY_DEFAULT_REFRESH 60
+/* delay of the next try when the ui timer can't queue the refresh */
+#define VDPY_UI_RETRY_NS 1000000UL
+/*
+ * The window events aren't handled, so the window is presented again at
+ * this interval while the guest doesn't update it, to repaint it once it's
+ * uncovered, restored or resized.
+ */
+#define VDPY_IDLE_PRESENT_NS 250000000UL
 #define transto_10bits(color) (uint16_t)(color * 1024 + 0.5)
 
 static unsigned char default_raw_argb[VDPY_DEFAULT_WIDTH * VDPY_DEFAULT_HEIGHT * 4];
@@ -41,6 +51,7 @@ struct state {
 	bool is_wayland;
 	bool is_x11;
 	bool is_fullscreen;
+	bool is_offscreen;
 	uint64_t updates;
 	int n_connect;
 };
@@ -66,11 +77,24 @@ static struct display {
 	struct surface surf;
 	struct cursor cur;
 	SDL_Texture *cursor_tex;
-	/* Add one UI_timer(33ms) to render the buffers from guest_vm */
+	/* Add one UI_timer to render the buffers from guest_vm. It's armed
+	 * for the next refresh of the screen when an update has to wait for
+	 * it (ui_timer_armed), and for the idle present otherwise.
+	 */
 	struct acrn_timer ui_timer;
 	struct vdpy_display_bh ui_timer_bh;
+	bool ui_timer_armed;
 	/* Record the update_time that is activated from guest_vm */
 	struct timespec last_time;
+	/* the refresh interval of the screen */
+	uint64_t frame_ns;
+	/* a surface or cursor update is not presented yet */
+	bool dirty;
+	/* frames presented, and updates presented by a later frame */
+	uint64_t presented;
+	uint64_t coalesced;
+	/* the area of dpy_texture not uploaded since it was created */
+	SDL_Rect damage;
 	// protect the request_list
 	pthread_mutex_t vdisplay_mutex;
 	// receive the signal that request is submitted
@@ -82,12 +106,17 @@ static struct display {
 	EGLDisplay eglDisplay;
 	struct egl_display_ops gl_ops;
 	EGLImage cur_egl_img;
+	/* where the offscreen display dumps the frames */
+	char *dump;
+	/* when the bh being run was submitted */
+	uint64_t bh_submit_ns;
 } vdpy = {
 	.s.is_ui_realized = false,
 	.s.is_active = false,
 	.s.is_wayland = false,
 	.s.is_x11 = false,
 	.s.is_fullscreen = false,
+	.s.is_offscreen = false,
 	.s.updates = 0,
 	.s.n_connect = 0
 };
@@ -549,6 +578,39 @@ vdpy_get_display_info(int handle, struct display_info *info)
 	}
 }
 
+/*
+ * The frames presented by the SDL display and the updates presented by a
+ * later frame, or the stats of the offscreen display. Returns -1 if there's
+ * no display.
+ */
+int
+vdpy_get_stats(struct vdpy_stats *stats)
+{
+	if (!vdpy.s.is_active)
+		return -1;
+
+	memset(stats, 0, sizeof(*stats));
+	if (vdpy.s.is_offscreen) {
+		stats->offscreen = true;
+		vdpy_offscreen_get_stats(stats);
+		return 0;
+	}
+
+	/* updated by the display thread only, read without the lock */
+	stats->presented = atomic_load(&vdpy.presented);
+	stats->coalesced = atomic_load(&vdpy.coalesced);
+	return 0;
+}
+
+static uint64_t
+vdpy_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
 static void
 sdl_gl_display_init(void)
 {
@@ -598,6 +660,11 @@ vdpy_surface_set(int handle, struct surface *surf)
 		return;
 	}
 
+	if (vdpy.s.is_offscreen) {
+		vdpy_offscreen_surface_set(surf, vdpy.bh_submit_ns);
+		return;
+	}
+
 	if (surf == NULL ) {
 		vdpy.surf.width = 0;
 		vdpy.surf.height = 0;
@@ -610,6 +677,7 @@ vdpy_surface_set(int handle, struct surface *surf)
 			pr_err("failed to create pixman_image\n");
 			return;
 		}
+
 		vdpy.guest_width = VDPY_MIN_WIDTH;
 		vdpy.guest_height = VDPY_MIN_HEIGHT;
 	} else if (surf->surf_type == SURFACE_PIXMAN) {
@@ -673,6 +741,16 @@ vdpy_surface_set(int handle, struct surface *surf)
 		pr_err("Failed to create SDL_texture for surface.\n");
 	}
 
+	/* all of a new texture needs to be uploaded by the next update */
+	vdpy.damage.x = 0;
+	vdpy.damage.y = 0;
+	vdpy.damage.w = 0;
+	vdpy.damage.h = 0;
+	if (surf && (surf->surf_type == SURFACE_PIXMAN)) {
+		vdpy.damage.w = vdpy.guest_width;
+		vdpy.damage.h = vdpy.guest_height;
+	}
+
 	/* For the surf_switch, it will be updated in surface_update */
 	if (!surf) {
 		SDL_UpdateTexture(vdpy.dpy_texture, NULL,
@@ -737,6 +815,7 @@ vdpy_surface_set(int handle, struct surface *surf)
 	}
 	/* Replace the cur_img with the created_img */
 	vdpy.dpy_img = src_img;
+	vdpy.dirty = true;
 }
 
 void
@@ -748,11 +827,136 @@ vdpy_cursor_position_transformation(struct display *vdpy, SDL_Rect *rect)
 	rect->h = (vdpy->cur.height * vdpy->height) / vdpy->guest_height;
 }
 
-void
-vdpy_surface_update(int handle, struct surface *surf)
+static void
+vdpy_damage_add(struct display *vdpy, struct surface *surf)
+{
+	SDL_Rect rect;
+
+	rect.x = 0;
+	rect.y = 0;
+	rect.w = vdpy->guest_width;
+	rect.h = vdpy->guest_height;
+	if ((surf->damage.width > 0) && (surf->damage.height > 0) &&
+		(surf->damage.x < rect.w) && (surf->damage.y < rect.h)) {
+		rect.x = surf->damage.x;
+		rect.y = surf->damage.y;
+		rect.w = MIN(surf->damage.width, vdpy->guest_width - rect.x);
+		rect.h = MIN(surf->damage.height, vdpy->guest_height - rect.y);
+	}
+
+	if ((vdpy->damage.w == 0) || (vdpy->damage.h == 0))
+		vdpy->damage = rect;
+	else
+		SDL_UnionRect(&vdpy->damage, &rect, &vdpy->damage);
+}
+
+/*
+ * Upload the damaged area only, the rest of the texture is up to date. It's
+ * done right away, as the pixels of surf may be freed once the update returns.
+ */
+static void
+vdpy_damage_upload(struct display *vdpy, struct surface *surf)
+{
+	SDL_Rect *rect = &vdpy->damage;
+
+	if ((rect->w == 0) || (rect->h == 0))
+		return;
+
+	if (surf->pixel)
+		SDL_UpdateTexture(vdpy->dpy_texture, rect,
+			(uint8_t *)surf->pixel + rect->y * surf->stride + rect->x * 4,
+			surf->stride);
+	rect->w = 0;
+	rect->h = 0;
+}
+
+static void
+vdpy_present(struct display *vdpy)
 {
 	SDL_Rect cursor_rect;
 
+	SDL_RenderClear(vdpy->dpy_renderer);
+	SDL_RenderCopy(vdpy->dpy_renderer, vdpy->dpy_texture, NULL, NULL);
+
+	/* This should be handled after rendering the surface_texture.
+	 * Otherwise it will be hidden
+	 */
+	if (vdpy->cursor_tex) {
+		vdpy_cursor_position_transformation(vdpy, &cursor_rect);
+		SDL_RenderCopy(vdpy->dpy_renderer, vdpy->cursor_tex,
+				NULL, &cursor_rect);
+	}
+
+	SDL_RenderPresent(vdpy->dpy_renderer);
+
+	/* update the rendering time */
+	clock_gettime(CLOCK_MONOTONIC, &vdpy->last_time);
+	vdpy->dirty = false;
+	vdpy->presented++;
+}
+
+static int
+vdpy_timer_settime(struct display *vdpy, uint64_t ns)
+{
+	struct itimerspec ui_timer_spec;
+
+	memset(&ui_timer_spec, 0, sizeof(ui_timer_spec));
+	ui_timer_spec.it_value.tv_sec = ns / NS_PER_SEC;
+	ui_timer_spec.it_value.tv_nsec = ns % NS_PER_SEC;
+	return acrn_timer_settime(&vdpy->ui_timer, &ui_timer_spec);
+}
+
+static void
+vdpy_ui_timer_arm(struct display *vdpy, uint64_t ns)
+{
+	if (vdpy_timer_settime(vdpy, ns) == 0)
+		vdpy->ui_timer_armed = true;
+}
+
+/* arm the ui timer for the idle present, unless a refresh is pending */
+static void
+vdpy_idle_timer_arm(struct display *vdpy)
+{
+	if (!vdpy->ui_timer_armed)
+		vdpy_timer_settime(vdpy, VDPY_IDLE_PRESENT_NS);
+}
+
+/* the time since the last present */
+static uint64_t
+vdpy_elapsed_ns(struct display *vdpy)
+{
+	struct timespec cur_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &cur_time);
+	return (cur_time.tv_sec - vdpy->last_time.tv_sec) * 1000000000 +
+			cur_time.tv_nsec - vdpy->last_time.tv_nsec;
+}
+
+/*
+ * No more than one frame is presented per refresh of the screen. The updates
+ * within it are presented together when the ui timer fires.
+ */
+static void
+vdpy_schedule_present(struct display *vdpy)
+{
+	uint64_t elapsed_time;
+
+	vdpy->dirty = true;
+
+	elapsed_time = vdpy_elapsed_ns(vdpy);
+	if (elapsed_time >= vdpy->frame_ns) {
+		vdpy_present(vdpy);
+		return;
+	}
+
+	vdpy->coalesced++;
+	if (!vdpy->ui_timer_armed)
+		vdpy_ui_timer_arm(vdpy, vdpy->frame_ns - elapsed_time);
+}
+
+void
+vdpy_surface_update(int handle, struct surface *surf)
+{
 	if (handle != vdpy.s.n_connect) {
 		return;
 	}
@@ -768,27 +972,16 @@ vdpy_surface_update(int handle, struct surface *surf)
 	        return;
 	}
 
-	if (surf->surf_type == SURFACE_PIXMAN)
-		SDL_UpdateTexture(vdpy.dpy_texture, NULL,
-			  surf->pixel,
-			  surf->stride);
-
-	SDL_RenderClear(vdpy.dpy_renderer);
-	SDL_RenderCopy(vdpy.dpy_renderer, vdpy.dpy_texture, NULL, NULL);
-
-	/* This should be handled after rendering the surface_texture.
-	 * Otherwise it will be hidden
-	 */
-	if (vdpy.cursor_tex) {
-		vdpy_cursor_position_transformation(&vdpy, &cursor_rect);
-		SDL_RenderCopy(vdpy.dpy_renderer, vdpy.cursor_tex,
-				NULL, &cursor_rect);
+	if (vdpy.s.is_offscreen) {
+		vdpy_offscreen_surface_update(surf, vdpy.bh_submit_ns);
+		return;
 	}
 
-	SDL_RenderPresent(vdpy.dpy_renderer);
-
-	/* update the rendering time */
-	clock_gettime(CLOCK_MONOTONIC, &vdpy.last_time);
+	if (surf->surf_type == SURFACE_PIXMAN) {
+		vdpy_damage_add(&vdpy, surf);
+		vdpy_damage_upload(&vdpy, surf);
+	}
+	vdpy_schedule_present(&vdpy);
 }
 
 void
@@ -807,6 +1000,11 @@ vdpy_cursor_define(int handle, struct cursor *cur)
 	if (cur->data == NULL)
 		return;
 
+	if (vdpy.s.is_offscreen) {
+		vdpy_offscreen_cursor_define(cur, vdpy.bh_submit_ns);
+		return;
+	}
+
 	if (vdpy.cursor_tex)
 		SDL_DestroyTexture(vdpy.cursor_tex);
 
@@ -823,6 +1021,7 @@ vdpy_cursor_define(int handle, struct cursor *cur)
 	SDL_SetTextureBlendMode(vdpy.cursor_tex, SDL_BLENDMODE_BLEND);
 	vdpy.cur = *cur;
 	SDL_UpdateTexture(vdpy.cursor_tex, NULL, cur->data, cur->width * 4);
+	vdpy_schedule_present(&vdpy);
 }
 
 void
@@ -832,49 +1031,39 @@ vdpy_cursor_move(int handle, uint32_t x, uint32_t y)
 		return;
 	}
 
+	if (vdpy.s.is_offscreen) {
+		vdpy_offscreen_cursor_move(x, y, vdpy.bh_submit_ns);
+		return;
+	}
+
 	/* Only move the position of the cursor. The cursor_texture
 	 * will be handled in surface_update
 	 */
 	vdpy.cur.x = x;
 	vdpy.cur.y = y;
+	vdpy_schedule_present(&vdpy);
 }
 
 static void
 vdpy_sdl_ui_refresh(void *data)
 {
 	struct display *ui_vdpy;
-	struct timespec cur_time;
-	uint64_t elapsed_time;
-	SDL_Rect cursor_rect;
 
 	ui_vdpy = (struct display *)data;
 
-	/* Skip it if no surface needs to be rendered */
-	if (ui_vdpy->dpy_texture == NULL)
-		return;
-
-	clock_gettime(CLOCK_MONOTONIC, &cur_time);
-
-	elapsed_time = (cur_time.tv_sec - ui_vdpy->last_time.tv_sec) * 1000000000 +
-			cur_time.tv_nsec - ui_vdpy->last_time.tv_nsec;
-
-	/* the time interval is less than 10ms. Skip it */
-	if (elapsed_time < 10000000)
+	if (ui_vdpy->s.is_offscreen) {
+		vdpy_offscreen_refresh();
 		return;
+	}
 
-	SDL_RenderClear(ui_vdpy->dpy_renderer);
-	SDL_RenderCopy(ui_vdpy->dpy_renderer, ui_vdpy->dpy_texture, NULL, NULL);
+	ui_vdpy->ui_timer_armed = false;
 
-	/* This should be handled after rendering the surface_texture.
-	 * Otherwise it will be hidden
-	 */
-	if (ui_vdpy->cursor_tex) {
-		vdpy_cursor_position_transformation(ui_vdpy, &cursor_rect);
-		SDL_RenderCopy(ui_vdpy->dpy_renderer, ui_vdpy->cursor_tex,
-				NULL, &cursor_rect);
-	}
+	/* present the updates, or the same frame again if it's idle */
+	if ((ui_vdpy->dpy_texture != NULL) && (ui_vdpy->dirty ||
+			(vdpy_elapsed_ns(ui_vdpy) >= VDPY_IDLE_PRESENT_NS)))
+		vdpy_present(ui_vdpy);
 
-	SDL_RenderPresent(ui_vdpy->dpy_renderer);
+	vdpy_idle_timer_arm(ui_vdpy);
 }
 
 static void
@@ -888,14 +1077,19 @@ vdpy_sdl_ui_timer(void *data, uint64_t nexp)
 	/* Don't submit the display_request if another func already
 	 * acquires the mutex.
 	 * This is to optimize the mevent thread otherwise it needs
-	 * to wait for some time.
+	 * to wait for some time. The one-shot timer of the SDL display
+	 * is tried again shortly, so that the pending update is presented.
 	 */
-	if (pthread_mutex_trylock(&ui_vdpy->vdisplay_mutex))
+	if (pthread_mutex_trylock(&ui_vdpy->vdisplay_mutex)) {
+		if (!ui_vdpy->s.is_offscreen)
+			vdpy_ui_timer_arm(ui_vdpy, VDPY_UI_RETRY_NS);
 		return;
+	}
 
 	bh_task = &ui_vdpy->ui_timer_bh;
 	if ((bh_task->bh_flag & ACRN_BH_PENDING) == 0) {
 		bh_task->bh_flag |= ACRN_BH_PENDING;
+		bh_task->submit_ns = vdpy_now_ns();
 		TAILQ_INSERT_TAIL(&ui_vdpy->request_list, bh_task, link);
 	}
 	pthread_cond_signal(&ui_vdpy->vdisplay_signal);
@@ -908,6 +1102,7 @@ vdpy_sdl_display_thread(void *data)
 	uint32_t win_flags;
 	struct vdpy_display_bh *bh;
 	struct itimerspec ui_timer_spec;
+	SDL_DisplayMode mode;
 
 	if (vdpy.width && vdpy.height) {
 		/* clip the region between (640x480) and (1920x1080) */
@@ -929,15 +1124,22 @@ vdpy_sdl_display_thread(void *data)
 		vdpy.height = VDPY_DEFAULT_HEIGHT;
 	}
 
+	vdpy.dpy_win = NULL;
+	vdpy.dpy_renderer = NULL;
+	vdpy.dpy_img = NULL;
+	if (vdpy.s.is_offscreen) {
+		if (vdpy_offscreen_init(vdpy.dump))
+			return NULL;
+		vdpy.frame_ns = 33000000;
+		goto display_init;
+	}
+
 	win_flags = SDL_WINDOW_OPENGL |
 		    SDL_WINDOW_ALWAYS_ON_TOP |
 		    SDL_WINDOW_SHOWN;
 	if (vdpy.s.is_fullscreen) {
 		win_flags |= SDL_WINDOW_FULLSCREEN;
 	}
-	vdpy.dpy_win = NULL;
-	vdpy.dpy_renderer = NULL;
-	vdpy.dpy_img = NULL;
 	vdpy.dpy_win = SDL_CreateWindow("ACRN_DM",
 					vdpy.org_x, vdpy.org_y,
 					vdpy.width, vdpy.height,
@@ -946,12 +1148,22 @@ vdpy_sdl_display_thread(void *data)
 		pr_err("Failed to Create SDL_Window\n");
 		goto sdl_fail;
 	}
+	/* not synced to vblank, SDL_RenderPresent() would block the virtio-gpu
+	 * commands run by this thread. The frames are paced by the ui timer.
+	 */
 	vdpy.dpy_renderer = SDL_CreateRenderer(vdpy.dpy_win, -1, 0);
 	if (vdpy.dpy_renderer == NULL) {
 		pr_err("Failed to Create GL_Renderer \n");
 		goto sdl_fail;
 	}
+	if ((SDL_GetWindowDisplayMode(vdpy.dpy_win, &mode) == 0) &&
+			(mode.refresh_rate >= 24))
+		vdpy.frame_ns = 1000000000UL / mode.refresh_rate;
+	else
+		vdpy.frame_ns = 1000000000UL / VDPY_DEFAULT_REFRESH;
 	sdl_gl_display_init();
+
+display_init:
 	pthread_mutex_init(&vdpy.vdisplay_mutex, NULL);
 	pthread_cond_init(&vdpy.vdisplay_signal, NULL);
 	TAILQ_INIT(&vdpy.request_list);
@@ -962,15 +1174,23 @@ vdpy_sdl_display_thread(void *data)
 	clock_gettime(CLOCK_MONOTONIC, &vdpy.last_time);
 	vdpy.ui_timer.clockid = CLOCK_MONOTONIC;
 	acrn_timer_init(&vdpy.ui_timer, vdpy_sdl_ui_timer, &vdpy);
-	ui_timer_spec.it_interval.tv_sec = 0;
-	ui_timer_spec.it_interval.tv_nsec = 33000000;
-	/* Wait for 5s to start the timer */
-	ui_timer_spec.it_value.tv_sec = 5;
-	ui_timer_spec.it_value.tv_nsec = 0;
-	/* Start one periodic timer to refresh UI based on 30fps */
-	acrn_timer_settime(&vdpy.ui_timer, &ui_timer_spec);
-
-	pr_info("SDL display thread is created\n");
+	vdpy.ui_timer_armed = false;
+	if (vdpy.s.is_offscreen) {
+		ui_timer_spec.it_interval.tv_sec = 0;
+		ui_timer_spec.it_interval.tv_nsec = vdpy.frame_ns;
+		/* Wait for 5s to start the timer */
+		ui_timer_spec.it_value.tv_sec = 5;
+		ui_timer_spec.it_value.tv_nsec = 0;
+		/* the offscreen display composes the cursor and reports its
+		 * stats at a steady rate
+		 */
+		acrn_timer_settime(&vdpy.ui_timer, &ui_timer_spec);
+	} else {
+		vdpy_idle_timer_arm(&vdpy);
+	}
+
+	if (!vdpy.s.is_offscreen)
+		pr_info("SDL display thread is created\n");
 	/* Begin to process the display_cmd after initialization */
 	do {
 		if (!vdpy.s.is_active) {
@@ -989,6 +1209,7 @@ vdpy_sdl_display_thread(void *data)
 
 			TAILQ_REMOVE(&vdpy.request_list, bh, link);
 
+			vdpy.bh_submit_ns = bh->submit_ns;
 			bh->task_cb(bh->data);
 
 			if (atomic_load(&bh->bh_flag) & ACRN_BH_FREE) {
@@ -1004,9 +1225,16 @@ vdpy_sdl_display_thread(void *data)
 	} while (1);
 
 	acrn_timer_deinit(&vdpy.ui_timer);
+	if (!vdpy.s.is_offscreen)
+		pr_info("display: %lu frames presented, %lu updates coalesced\n",
+			vdpy.presented, vdpy.coalesced);
 	/* SDL display_thread will exit because of DM request */
 	pthread_mutex_destroy(&vdpy.vdisplay_mutex);
 	pthread_cond_destroy(&vdpy.vdisplay_signal);
+	if (vdpy.s.is_offscreen) {
+		vdpy_offscreen_deinit();
+		return NULL;
+	}
 	if (vdpy.dpy_img) {
 		pixman_image_unref(vdpy.dpy_img);
 		vdpy.dpy_img = NULL;
@@ -1059,6 +1287,7 @@ bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh_task)
 
 	if ((bh_task->bh_flag & ACRN_BH_PENDING) == 0) {
 		bh_task->bh_flag |= ACRN_BH_PENDING;
+		bh_task->submit_ns = vdpy_now_ns();
 		TAILQ_INSERT_TAIL(&vdpy.request_list, bh_task, link);
 		bh_ok = true;
 	}
@@ -1134,6 +1363,10 @@ gfx_ui_init()
 	SDL_SysWMinfo info;
 	SDL_Rect disp_rect;
 
+	/* no window system is needed to display offscreen */
+	if (vdpy.s.is_offscreen)
+		return 0;
+
 	setenv("SDL_VIDEO_X11_FORCE_EGL", "1", 1);
 	setenv("SDL_OPENGL_ES_DRIVER", "1", 1);
 	setenv("SDL_RENDER_DRIVER", "opengles2", 1);
@@ -1179,6 +1412,9 @@ gfx_ui_init()
 void
 gfx_ui_deinit()
 {
+	free(vdpy.dump);
+	vdpy.dump = NULL;
+
 	if (!vdpy.s.is_ui_realized) {
 		return;
 	}
@@ -1217,6 +1453,16 @@ int vdpy_parse_cmd_option(const char *opts)
 		pr_info("virtual display: windowed.\n");
 	}
 
+	if (opts && strcasestr(opts, "offscreen")) {
+		vdpy.s.is_offscreen = true;
+		str = strcasestr(opts, "dump=");
+		if (str) {
+			str += strlen("dump=");
+			vdpy.dump = strndup(str, strcspn(str, ","));
+		}
+		pr_info("virtual display: offscreen.\n");
+	}
+
 	vdpy.info.xoff = 0;
 	vdpy.info.yoff = 0;
 	vdpy.info.width = vdpy.width;
@@ -21,6 +21,7 @@
 #include "vga.h"
 #include "gc.h"
 #include "log.h"
+#include "posted_write.h"
 
 #define	KB	(1024UL)
 #define	MB	(1024 * 1024UL)
@@ -1276,6 +1277,10 @@ vga_init(struct gfx_ctx *gc, int io_only)
 	error = register_mem_fallback(&vd->mr);
 	assert(error == 0);
 
+	/* VGA memory reads are still blocking, they flush the posted writes first */
+	if (posted_write_add_range(ACRN_IOREQ_TYPE_MMIO, vd->mr.base, vd->mr.size) == 0)
+		pr_info("VGA memory writes are posted\n");
+
 	vd->vga_ram = malloc(256 * KB);
 	memset(vd->vga_ram, 0, 256 * KB);
 
@@ -1427,6 +1432,102 @@ vga_vbe_read(struct vmctx *ctx, int vcpu, struct vga *vga,
 	return (value);
 }
 
+static uint64_t
+vga_line_hash(const uint8_t *line, int len)
+{
+	const uint64_t *p = (const uint64_t *)line;
+	uint64_t h0, h1, h2, h3;
+	uint32_t tail;
+	int i, n;
+
+	/* four lanes, so the multiplies of consecutive words overlap */
+	h0 = 0x9e3779b97f4a7c15UL;
+	h1 = h0 + 1;
+	h2 = h0 + 2;
+	h3 = h0 + 3;
+	n = len / 8;
+	for (i = 0; i + 4 <= n; i += 4) {
+		h0 = (h0 ^ p[i + 0]) * 0xff51afd7ed558ccdUL;
+		h1 = (h1 ^ p[i + 1]) * 0xff51afd7ed558ccdUL;
+		h2 = (h2 ^ p[i + 2]) * 0xff51afd7ed558ccdUL;
+		h3 = (h3 ^ p[i + 3]) * 0xff51afd7ed558ccdUL;
+		h0 ^= h0 >> 29;
+		h1 ^= h1 >> 29;
+		h2 ^= h2 >> 29;
+		h3 ^= h3 >> 29;
+	}
+	for (; i < n; i++)
+		h0 = ((h0 ^ p[i]) * 0xff51afd7ed558ccdUL) ^ (h0 >> 29);
+	if (len % 8) {
+		tail = 0;
+		memcpy(&tail, line + n * 8, len % 8 > 4 ? 4 : len % 8);
+		h1 = (h1 ^ tail) * 0xff51afd7ed558ccdUL;
+	}
+
+	return h0 ^ (h1 * 3) ^ (h2 * 5) ^ (h3 * 7);
+}
+
+/*
+ * The VBE framebuffer is guest memory mapped to the BAR, the guest writes
+ * it without any exit. Find what it changed by comparing the hash of each
+ * scanline with the one of the last frame, and set the damage of surf to
+ * the band of the changed lines. Return false if no line changed.
+ */
+bool
+vga_vbe_damage(struct vga *vga, struct surface *surf)
+{
+	uint8_t *fb = (uint8_t *)surf->pixel;
+	uint64_t h;
+	int y, first, last;
+	bool all = false;
+
+	if ((fb == NULL) || (surf->width <= 0) || (surf->height <= 0))
+		return false;
+
+	if ((vga->line_hash == NULL) || (vga->line_hash_width != surf->width) ||
+			(vga->line_hash_height != surf->height)) {
+		free(vga->line_hash);
+		vga->line_hash = calloc(surf->height, sizeof(uint64_t));
+		vga->line_hash_width = surf->width;
+		vga->line_hash_height = surf->height;
+		all = true;
+	}
+
+	first = -1;
+	last = -1;
+	for (y = 0; y < surf->height; y++) {
+		h = vga_line_hash(fb + y * surf->stride, surf->width * 4);
+		if (vga->line_hash && (vga->line_hash[y] == h) && !all)
+			continue;
+		if (vga->line_hash)
+			vga->line_hash[y] = h;
+		if (first < 0)
+			first = y;
+		last = y;
+	}
+
+	if (first < 0)
+		return false;
+
+	surf->damage.x = 0;
+	surf->damage.y = first;
+	surf->damage.width = surf->width;
+	surf->damage.height = last - first + 1;
+	return true;
+}
+
+/*
+ * Forget the hashes of the last frame, so that the next vga_vbe_damage()
+ * damages the whole surface. Called when the display is given the surface
+ * again, as it doesn't have the lines the hashes stand for any more.
+ */
+void
+vga_vbe_damage_reset(struct vga *vga)
+{
+	free(vga->line_hash);
+	vga->line_hash = NULL;
+}
+
 void vga_deinit(struct vga *vga)
 {
 	struct vga_vdev *vd;
@@ -1447,11 +1548,15 @@ void vga_deinit(struct vga *vga)
 		//assert(error == 0);
 	}
 
+	posted_write_del_range(ACRN_IOREQ_TYPE_MMIO, vd->mr.base, vd->mr.size);
 	unregister_mem_fallback(&vd->mr);
 
 	free(vd->vga_ram);
 	vd->vga_ram = NULL;
 
+	free(vga->line_hash);
+	vga->line_hash = NULL;
+
 	free(vd);
 	vga->dev = NULL;
 }
@@ -112,6 +112,8 @@ void	dsdt_unindent(int levels);
 void	sci_init(struct vmctx *ctx);
 void	pm_write_dsdt(struct vmctx *ctx, int ncpu);
 void	pm_backto_wakeup(struct vmctx *ctx);
+ssize_t	pm_save_state(void *buf, size_t len);
+int	pm_load_state(const void *buf, size_t len);
 void	inject_power_button_event(struct vmctx *ctx);
 void	power_button_init(struct vmctx *ctx);
 void	power_button_deinit(struct vmctx *ctx);
@@ -51,6 +51,10 @@ extern bool pt_tpm2;
 extern bool ssram;
 extern bool vtpm2;
 extern bool is_winvm;
+extern uint32_t ioreq_poll_time;
+extern uint32_t mem_prefault_threads;
+extern bool use_hugepool;
+extern bool experimental_unpin;
 
 /**
  * @brief Convert guest physical address to host virtual address
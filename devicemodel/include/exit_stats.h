@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _EXIT_STATS_H_
+#define _EXIT_STATS_H_
+
+#include <stdbool.h>
+#include <time.h>
+#include "types.h"
+
+enum exit_stats_type {
+	EXIT_STATS_MMIO = 0,
+	EXIT_STATS_PIO,
+	EXIT_STATS_PCICFG,
+	EXIT_STATS_TYPES
+};
+
+/* bucket i counts the accesses served in [2^(i-1), 2^i) ns, the last one the rest */
+#define EXIT_STATS_HIST_BUCKETS	24
+/*
+ * registers tracked per region, and reported as the hottest ones. Once all the
+ * slots are taken, a new register replaces the one with the fewest hits.
+ */
+#define EXIT_STATS_REG_SLOTS	32
+#define EXIT_STATS_TOP_REGS	8
+#define EXIT_STATS_NAME_LEN	32
+
+struct exit_stats_reg {
+	uint64_t offset;
+	uint64_t reads;
+	uint64_t writes;
+	/* reads and writes plus the hits of the registers it replaced */
+	uint64_t hits;
+};
+
+/*
+ * The accesses to one emulated region: a MMIO range or an I/O port range,
+ * identified by its base, or the config space of a PCI function, identified
+ * by its BDF.
+ */
+struct exit_stats_entry {
+	enum exit_stats_type type;
+	uint64_t base;
+	char name[EXIT_STATS_NAME_LEN];
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_ns;
+	uint64_t write_ns;
+	uint64_t hist[EXIT_STATS_HIST_BUCKETS];
+	int nregs;
+	struct exit_stats_reg regs[EXIT_STATS_REG_SLOTS];
+};
+
+extern bool exit_stats_enabled;
+
+static inline uint64_t
+exit_stats_begin(void)
+{
+	struct timespec now;
+
+	if (!exit_stats_enabled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+void exit_stats_account(enum exit_stats_type type, const char *name,
+		uint64_t base, uint64_t offset, bool write, uint64_t start);
+void exit_stats_enable(bool enable);
+void exit_stats_reset(void);
+int exit_stats_collect(struct exit_stats_entry **entries);
+const char *exit_stats_type_str(enum exit_stats_type type);
+
+#endif
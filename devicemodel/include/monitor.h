@@ -15,6 +15,8 @@
 #ifndef MONITOR_H
 #define MONITOR_H
 
+#include <stdint.h>
+
 int monitor_init(struct vmctx *ctx);
 void monitor_close(void);
 
@@ -26,6 +28,7 @@ struct monitor_vm_ops {
 	int (*unpause) (void *arg);
 	int (*query) (void *arg);
 	int (*rescan)(void *arg, char *devargs);
+	int (*snapshot)(void *arg, char *path);
 };
 
 int monitor_register_vm_ops(struct monitor_vm_ops *ops, void *arg,
@@ -36,4 +39,29 @@ unsigned get_wakeup_reason(void);
 int set_wakeup_timer(time_t t);
 int acrn_parse_intr_monitor(const char *opt);
 int vm_monitor_blkrescan(void *arg, char *devargs);
+int vm_monitor_balloon(void *arg, char *size);
+int vm_monitor_hotplug_mem(void *arg, char *size);
+
+/* the dmabuf cache of virtio-gpu */
+struct gpu_dmabuf_stats {
+	uint64_t cache_size;	/* bytes of guest memory of the cached dmabufs */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;	/* closed to keep the cache within its size */
+	uint64_t discards;	/* closed as their guest memory was discarded */
+};
+int vm_monitor_gpu_stats(void *arg, struct gpu_dmabuf_stats *stats);
+
+/* the traffic of a virtio-console port */
+struct console_port_stats {
+	char name[32];
+	uint64_t tx_bytes;
+	uint64_t tx_writes;
+	uint64_t tx_stalls;	/* times the backend was full */
+	uint64_t tx_drops;	/* bytes */
+	uint64_t rx_bytes;
+	uint64_t rx_reads;
+	uint64_t rx_drops;	/* bytes */
+};
+int vm_monitor_console_stats(void *arg, struct console_port_stats *stats, int max);
 #endif
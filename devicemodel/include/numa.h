@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <stdbool.h>
+#include <sched.h>
+#include "types.h"
+
+struct vmctx;
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED		1
+#define MPOL_BIND		2
+#define MPOL_F_ADDR		(1 << 1)
+#define MPOL_MF_STRICT		(1 << 0)
+#endif
+
+#define NUMA_MAX_NODES		8
+/* max number of host nodes in the memory policy masks */
+#define NUMA_MAX_HOST_NODES	64
+
+/*
+ * A guest NUMA node, as given by --numa:
+ * - vcpus: bitmap of the vCPU IDs on the node
+ * - mem: guest memory size of the node
+ * - host: the host node the memory and the DM threads serving the node are
+ *   bound to, -1 if it's not bound
+ * - gpa/len: the guest physical ranges of the node memory, as the memory is
+ *   split into lowmem and highmem, one node may own up to two ranges
+ */
+struct numa_node {
+	uint64_t vcpus;
+	size_t mem;
+	int host;
+	vm_paddr_t gpa[2];
+	size_t len[2];
+};
+
+int acrn_parse_numa(char *arg);
+int numa_setup(struct vmctx *ctx, size_t memsize, int ncpus);
+int numa_get_nr_nodes(void);
+bool numa_is_bound(void);
+const struct numa_node *numa_get_node(int node);
+int numa_distance(int from, int to);
+int numa_node_cpus(int host_node, cpu_set_t *cpus);
+int numa_bind_memory(char *hva, vm_paddr_t gpa, size_t len, size_t pg_size);
+void numa_bind_io_thread(void);
+
+#endif /* _NUMA_H_ */
@@ -65,6 +65,18 @@ struct pci_vdev_ops {
 	int	(*vdev_init)(struct vmctx *, struct pci_vdev *,
 			     char *opts);
 
+	/*
+	 * optional, open the backend of the instance ahead of vdev_init, e.g.
+	 * an image file. It's called in parallel with the other devices, so it
+	 * must not touch the PCI or VM resources. vdev_init gets the result in
+	 * pci_vdev->prep, and does the work itself if it's NULL. vdev_init
+	 * takes the result by clearing pci_vdev->prep, whatever is left there
+	 * after vdev_init, e.g. on its error paths, is passed to vdev_unprepare.
+	 */
+	void	*(*vdev_prepare)(struct vmctx *ctx, int slot, int func,
+			const char *opts);
+	void	(*vdev_unprepare)(void *prep);
+
 	/* instance deinit */
 	void	(*vdev_deinit)(struct vmctx *, struct pci_vdev *,
 			char *opts);
@@ -90,6 +102,12 @@ struct pci_vdev_ops {
 	uint64_t  (*vdev_barread)(struct vmctx *ctx, int vcpu,
 				struct pci_vdev *pi, int baridx,
 				uint64_t offset, int size);
+
+	/* snapshot save/restore of the device state, return the size saved */
+	ssize_t	(*vdev_save)(struct vmctx *ctx, struct pci_vdev *dev,
+			void *buf, size_t len);
+	int	(*vdev_load)(struct vmctx *ctx, struct pci_vdev *dev,
+			const void *buf, size_t len);
 };
 
 /*
@@ -174,6 +192,7 @@ struct pci_vdev {
 	} msix;
 
 	void	*arg;		/* devemu-private data */
+	void	*prep;		/* from vdev_prepare, owned by vdev_init */
 
 	uint8_t	cfgdata[PCI_REGMAX + 1];
 	struct pcibar bar[PCI_BARMAX + 1];
@@ -303,6 +322,7 @@ uint32_t get_gpu_rsvmem_size(void);
 
 typedef void (*pci_lintr_cb)(int b, int s, int pin, int pirq_pin,
 			     int ioapic_irq, void *arg);
+typedef int (*pci_vdev_cb)(struct pci_vdev *dev, void *arg);
 
 int	init_pci(struct vmctx *ctx);
 void	deinit_pci(struct vmctx *ctx);
@@ -378,6 +398,9 @@ int	pci_emul_msix_twrite(struct pci_vdev *pi, uint64_t offset, int size,
 uint64_t pci_emul_msix_tread(struct pci_vdev *pi, uint64_t offset, int size);
 int	pci_count_lintr(int bus);
 void	pci_walk_lintr(int bus, pci_lintr_cb cb, void *arg);
+int	pci_walk_vdevs(pci_vdev_cb cb, void *arg);
+ssize_t	pci_save_nostate(struct vmctx *ctx, struct pci_vdev *dev, void *buf, size_t len);
+int	pci_load_nostate(struct vmctx *ctx, struct pci_vdev *dev, const void *buf, size_t len);
 void	pci_write_dsdt(void);
 int	pci_bus_configured(int bus);
 int	emulate_pci_cfgrw(struct vmctx *ctx, int vcpu, int in, int bus,
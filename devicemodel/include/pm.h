@@ -26,5 +26,6 @@ int wait_for_resume(struct vmctx *ctx);
 int vm_resume(struct vmctx *ctx);
 int vm_monitor_resume(void *arg);
 int vm_monitor_query(void *arg);
+int vm_monitor_snapshot(void *arg, char *path);
 
 #endif
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _POSTED_WRITE_H_
+#define _POSTED_WRITE_H_
+
+#include <stdbool.h>
+#include "types.h"
+
+struct vmctx;
+struct acrn_io_request;
+
+extern bool posted_write;
+
+int posted_write_init(struct vmctx *ctx);
+void posted_write_deinit(struct vmctx *ctx);
+int posted_write_add_range(uint32_t type, uint64_t base, uint64_t len);
+int posted_write_del_range(uint32_t type, uint64_t base, uint64_t len);
+int posted_write_drain(void);
+void posted_write_hold(void);
+void posted_write_release(void);
+void posted_write_wake(struct acrn_io_request *io_req);
+
+#endif
@@ -101,12 +101,30 @@
 	_IO(ACRN_IOCTL_TYPE, 0x34)
 #define ACRN_IOCTL_CLEAR_VM_IOREQ	\
 	_IO(ACRN_IOCTL_TYPE, 0x35)
+/*
+ * Not implemented by the upstream HSM driver yet. The DM probes them and
+ * falls back to the blocking I/O requests when they fail.
+ */
+#define ACRN_IOCTL_SET_POSTED_WRITE_BUFFER	\
+	_IOW(ACRN_IOCTL_TYPE, 0x36, __u64)
+#define ACRN_IOCTL_SET_POSTED_WRITE_RANGE	\
+	_IOW(ACRN_IOCTL_TYPE, 0x37, struct acrn_posted_write_range)
+#define ACRN_IOCTL_SET_IOREQ_CLIENT_POLLING	\
+	_IOW(ACRN_IOCTL_TYPE, 0x38, __u64)
 
 /* Guest memory management */
 #define ACRN_IOCTL_SET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x41, struct acrn_vm_memmap)
 #define ACRN_IOCTL_UNSET_MEMSEG		\
 	_IOW(ACRN_IOCTL_TYPE, 0x42, struct acrn_vm_memmap)
+/*
+ * Like ACRN_IOCTL_UNSET_MEMSEG for RAM, and also drops the pins HSM took on
+ * the pages when they were mapped, so that they can be freed. EXPERIMENTAL:
+ * not implemented by the upstream HSM driver yet and the number isn't
+ * reserved there, the DM only issues it with --experimental_unpin.
+ */
+#define ACRN_IOCTL_UNPIN_MEMSEG		\
+	_IOW(ACRN_IOCTL_TYPE, 0x43, struct acrn_vm_memmap)
 
 /* PCI assignment*/
 #define ACRN_IOCTL_SET_PTDEV_INTR	\
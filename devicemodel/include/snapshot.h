@@ -0,0 +1,24 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct vmctx;
+
+/* max size of the state of one device or platform component */
+#define SNAPSHOT_STATE_MAX	(64 * 1024)
+
+int acrn_parse_restore(char *arg);
+bool snapshot_restoring(void);
+int vm_snapshot(struct vmctx *ctx, const char *path);
+int vm_restore(struct vmctx *ctx);
+
+#endif
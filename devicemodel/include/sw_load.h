@@ -54,6 +54,14 @@ struct e820_entry {
 	uint32_t type;
 } __attribute__((packed));
 
+/* a range of an image file to read into guest memory */
+struct image_load {
+	int fd;
+	off_t offset;
+	size_t size;
+	char *dst;
+};
+
 extern const struct e820_entry e820_default_entries[NUM_E820_ENTRIES];
 extern int with_bootargs;
 
@@ -71,6 +79,7 @@ char *get_bootargs(void);
 void vsbl_set_bdf(int bnum, int snum, int fnum);
 
 int check_image(char *path, size_t size_limit, size_t *size);
+int load_images(struct image_load *images, int n);
 uint32_t acrn_create_e820_table(struct vmctx *ctx, struct e820_entry *e820);
 int add_e820_entry(struct e820_entry *e820, int len, uint64_t start,
 	uint64_t size, uint32_t type);
@@ -7,14 +7,24 @@
 #define _TIMER_H_
 
 #include <time.h>  // for struct itimerspec
+#include <stdbool.h>
 #include <sys/param.h>
+#include <sys/queue.h>
+
+struct timer_wheel;
 
 struct acrn_timer {
-	int32_t fd;
 	int32_t clockid;
-	struct mevent *mevp;
 	void (*callback)(void *, uint64_t);
 	void *callback_param;
+
+	/* Managed by timer.c */
+	struct timer_wheel *wheel;
+	LIST_ENTRY(acrn_timer) entry;
+	bool queued;		/* on a wheel slot or the expired list */
+	uint64_t expires;	/* CLOCK_MONOTONIC ns, 0 if disarmed */
+	uint64_t interval;	/* ns, 0 for one-shot */
+	uint64_t tick;		/* wheel tick of expires */
 };
 
 int32_t
@@ -28,6 +38,8 @@ acrn_timer_settime_abs(struct acrn_timer *timer,
 		const struct itimerspec *new_value);
 int32_t
 acrn_timer_gettime(struct acrn_timer *timer, struct itimerspec *cur_value);
+uint64_t
+elapsed_ms(const struct timespec *start);
 
 #define NS_PER_SEC	(1000000000ULL)
 
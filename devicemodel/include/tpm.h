@@ -57,6 +57,9 @@ enum {
 #define TPM_CRB_DATA_BUFFER_SIZE ((TPM_CRB_MMIO_SIZE) - (TPM_CRB_REG_SIZE))
 
 /* APIs by tpm.c */
+/* Connect to the TPM emulator ahead of init_vtpm2 */
+void prepare_vtpm2(void);
+
 /* Initialize Virtual TPM2 */
 void init_vtpm2(struct vmctx *ctx);
 
@@ -7,6 +7,7 @@
 
 #ifndef _USB_DEVICE_H
 #define _USB_DEVICE_H
+#include <pthread.h>
 #include <libusb-1.0/libusb.h>
 #include "usb_core.h"
 
@@ -24,6 +25,10 @@
 #define USB_EP_MAXP_SZ(m) ((m) & 0x7ff)
 #define USB_EP_MAXP_MT(m) (((m) >> 11) & 0x3)
 
+/* the libusb transfers kept in flight per endpoint by default, and at most */
+#define USB_DEV_XFER_DEPTH	4
+#define USB_DEV_XFER_DEPTH_MAX	32
+
 enum {
 	USB_INFO_VERSION,
 	USB_INFO_SPEED,
@@ -37,6 +42,7 @@ struct usb_dev_ep {
 	uint8_t pid;
 	uint8_t type;
 	uint16_t maxp;
+	int inflight;	/* libusb transfers submitted and not completed */
 };
 
 struct usb_dev {
@@ -57,6 +63,11 @@ struct usb_dev {
 
 	/* libusb data */
 	libusb_device_handle *handle;
+
+	/* the requests completed, kept with their transfer and buffer */
+	pthread_mutex_t req_mtx;
+	struct usb_dev_req *req_pool;
+	int req_pool_cnt;
 };
 
 /*
@@ -74,12 +85,15 @@ struct usb_dev_req {
 	 */
 	uint8_t	*buffer;
 	int     buf_size;
+	int     buf_cap;	/* the allocated size of buffer */
 	int     blk_head;
 	int     blk_tail;
 
 	struct usb_xfer *xfer;
 	struct libusb_transfer *trn;
+	int     iso_cnt;	/* the iso packets allocated in trn */
 	struct usb_block *setup_blk;
+	struct usb_dev_req *next;	/* in the pool of udev */
 };
 
 /* callback type used by code from HCD layer */
@@ -110,6 +124,9 @@ struct usb_dev_sys_ctx_info {
 
 	libusb_device **devlist;
 
+	/* the libusb transfers kept in flight per bulk or isoc endpoint */
+	int xfer_depth;
+
 	/*
 	 * private data from HCD layer
 	 */
@@ -121,7 +138,7 @@ int usb_dev_sys_init(usb_dev_sys_cb conn_cb, usb_dev_sys_cb disconn_cb,
 		usb_dev_sys_cb notify_cb, usb_dev_sys_cb intr_cb,
 		usb_dev_sys_cb lock_ep_cb,
 		usb_dev_sys_cb unlock_ep_cb,
-		void *hci_data, int log_level);
+		void *hci_data, int log_level, int xfer_depth);
 void usb_dev_sys_deinit(void);
 void *usb_dev_init(void *pdata, char *opt);
 void usb_dev_deinit(void *pdata);
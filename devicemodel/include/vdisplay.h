@@ -27,6 +27,8 @@ struct vdpy_display_bh {
 	bh_task_func task_cb;
 	void *data;
 	uint32_t bh_flag;
+	/* CLOCK_MONOTONIC ns when it was submitted, set by the display */
+	uint64_t submit_ns;
 };
 
 struct edid_info {
@@ -64,6 +66,13 @@ struct surface {
 	uint32_t bpp;
 	uint32_t stride;
 	void *pixel;
+	/* the area changed by the update, the whole surface if it's empty */
+	struct {
+		uint32_t x;
+		uint32_t y;
+		uint32_t width;
+		uint32_t height;
+	} damage;
 	struct  {
 		int dmabuf_fd;
 		uint32_t surf_fourcc;
@@ -93,7 +102,31 @@ bool vdpy_submit_bh(int handle, struct vdpy_display_bh *bh);
 void vdpy_get_edid(int handle, uint8_t *edid, size_t size);
 void vdpy_cursor_define(int handle, struct cursor *cur);
 void vdpy_cursor_move(int handle, uint32_t x, uint32_t y);
+struct vdpy_stats {
+	/* frames presented */
+	uint64_t presented;
+	/* SDL: updates presented by a later frame */
+	uint64_t coalesced;
+	/* offscreen: over the last stats interval */
+	bool offscreen;
+	uint64_t fps_x100;
+	uint64_t bytes_per_frame;
+	uint64_t avg_latency_us;
+	uint64_t max_latency_us;
+};
+
+int vdpy_get_stats(struct vdpy_stats *stats);
 int vdpy_deinit(int handle);
 void gfx_ui_deinit();
 
+/* the offscreen display, run by the display thread instead of SDL */
+int vdpy_offscreen_init(const char *dump);
+void vdpy_offscreen_deinit(void);
+void vdpy_offscreen_surface_set(struct surface *surf, uint64_t submit_ns);
+void vdpy_offscreen_surface_update(struct surface *surf, uint64_t submit_ns);
+void vdpy_offscreen_cursor_define(struct cursor *cur, uint64_t submit_ns);
+void vdpy_offscreen_cursor_move(uint32_t x, uint32_t y, uint64_t submit_ns);
+void vdpy_offscreen_refresh(void);
+void vdpy_offscreen_get_stats(struct vdpy_stats *stats);
+
 #endif /* _VDISPLAY_H_ */
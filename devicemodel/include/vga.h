@@ -182,6 +182,10 @@ struct vga {
 		uint16_t  y_offset;
 		uint16_t  video_memory_64k;
 	} __attribute__((packed)) vberegs;
+	/* the hash of each scanline of the last frame, to find the damage */
+	uint64_t *line_hash;
+	int line_hash_width;
+	int line_hash_height;
 };
 
 void *vga_init(struct gfx_ctx *gc, int io_only);
@@ -198,6 +202,8 @@ void vga_vbe_write(struct vmctx *ctx, int vcpu, struct vga *vga,
 		uint64_t offset, int size, uint64_t value);
 uint64_t vga_vbe_read(struct vmctx *ctx, int vcpu, struct vga *vga,
 		uint64_t offset, int size);
+bool vga_vbe_damage(struct vga *vga, struct surface *surf);
+void vga_vbe_damage_reset(struct vga *vga);
 
 void vga_deinit(struct vga *vga);
 #endif /* _VGA_H_ */
@@ -194,6 +194,8 @@ enum {
 #define	VIRTIO_TYPE_SCSI	8
 #define	VIRTIO_TYPE_9P		9
 #define	VIRTIO_TYPE_INPUT	18
+#define	VIRTIO_TYPE_MEM		24
+#define	VIRTIO_TYPE_PMEM	27
 
 /*
  * ACRN virtio device types
@@ -219,6 +221,7 @@ enum {
 #define	VIRTIO_VENDOR		0x1AF4
 #define	VIRTIO_DEV_NET		0x1000
 #define	VIRTIO_DEV_BLOCK	0x1001
+#define	VIRTIO_DEV_BALLOON	0x1002
 #define	VIRTIO_DEV_CONSOLE	0x1003
 #define	VIRTIO_DEV_RANDOM	0x1005
 #define	VIRTIO_DEV_GPU		0x1050
@@ -741,6 +744,30 @@ uint64_t virtio_pci_read(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 void virtio_pci_write(struct vmctx *ctx, int vcpu, struct pci_vdev *dev,
 		      int baridx, uint64_t offset, int size, uint64_t value);
 
+/**
+ * @brief Save the state of a virtio device for a VM snapshot.
+ *
+ * Only valid for a device the suspended guest has reset, which has no state
+ * beyond its options.
+ *
+ * @param ctx Pointer to struct vmctx representing VM context.
+ * @param dev Pointer to struct pci_vdev which emulates a PCI device.
+ * @param buf Buffer for the state.
+ * @param len Size of the buffer.
+ *
+ * @return size of the state saved, -1 if the device can't be saved.
+ */
+ssize_t virtio_pci_save(struct vmctx *ctx, struct pci_vdev *dev,
+			void *buf, size_t len);
+
+/**
+ * @brief Load the state of a virtio device saved by virtio_pci_save().
+ *
+ * @return 0 on success and non-zero on fail.
+ */
+int virtio_pci_load(struct vmctx *ctx, struct pci_vdev *dev,
+		    const void *buf, size_t len);
+
 /**
  * @brief Set modern BAR (usually 4) to map PCI config registers.
  *
@@ -58,6 +58,19 @@ struct vmctx {
 	char    *baseaddr;
 	char    *name;
 
+	/*
+	 * virtio-mem hotplug window, mapped at hpmem_hva, with
+	 * one byte per block set when the block is plugged
+	 */
+	uint64_t hpmem_gpa_base;
+	size_t  hpmem;
+	char    *hpmem_hva;
+	size_t  hpmem_block;
+	uint8_t *hpmem_plugged;
+
+	/* top of the device memory handed out by vm_alloc_devmem() */
+	uint64_t devmem_gpa_top;
+
 	/* fields to track virtual devices */
 	void *atkbdc_base;
 	void *vrtc;
@@ -92,9 +105,23 @@ struct vm_mem_region {
 	uint64_t fd_offset;
 	int fd;
 };
+
+/* from the smaps of the guest memory */
+struct vm_mem_stats {
+	uint64_t rss_kb;
+	uint64_t thp_kb;
+};
+int	vm_get_mem_stats(struct vmctx *ctx, struct vm_mem_stats *stats);
 bool	vm_find_memfd_region(struct vmctx *ctx, vm_paddr_t gpa,
 			     struct vm_mem_region *ret_region);
 bool    vm_allow_dmabuf(struct vmctx *ctx);
+int	vm_discard_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
+/* called with the memfd range about to be discarded */
+typedef void (*vm_discard_notifier_t)(void *arg, int fd, uint64_t offset, size_t len);
+int	vm_add_discard_notifier(vm_discard_notifier_t fn, void *arg);
+void	vm_remove_discard_notifier(vm_discard_notifier_t fn, void *arg);
+void	vm_notify_discard(int fd, uint64_t offset, size_t len);
+int	vm_populate_memory(struct vmctx *ctx, vm_paddr_t gpa, size_t len);
 /*
  * Create a device memory segment identified by 'segid'.
  *
@@ -118,13 +145,27 @@ void	vm_destroy(struct vmctx *ctx);
 int	vm_parse_memsize(const char *optarg, size_t *memsize);
 int	vm_map_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
 	uint64_t vma, int prot);
+int	vm_unmap_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot);
+int	vm_unpin_memseg_vma(struct vmctx *ctx, size_t len, vm_paddr_t gpa,
+	uint64_t vma, int prot);
+bool	vm_can_unpin_memory(struct vmctx *ctx);
 int	vm_setup_memory(struct vmctx *ctx, size_t len);
 void	vm_unsetup_memory(struct vmctx *ctx);
 bool	init_hugetlb(void);
 void	uninit_hugetlb(void);
+int	acrn_parse_mem_backend(char *arg);
+bool	vm_is_memfd_backend(void);
 int	hugetlb_setup_memory(struct vmctx *ctx);
+int	hugetlb_lock_reserve(void);
+void	hugetlb_unlock_reserve(void);
+bool	hugetlb_can_reserve_more(void);
+int	hugetlb_reserve_more(size_t len);
+void	hugetlb_release_more(size_t len);
 void	hugetlb_unsetup_memory(struct vmctx *ctx);
+void	hugetlb_release_pool(void);
 void	*vm_map_gpa(struct vmctx *ctx, vm_paddr_t gaddr, size_t len);
+uint64_t vm_alloc_devmem(struct vmctx *ctx, size_t len, size_t align);
 uint32_t vm_get_lowmem_limit(struct vmctx *ctx);
 size_t	vm_get_lowmem_size(struct vmctx *ctx);
 size_t	vm_get_highmem_size(struct vmctx *ctx);
@@ -158,6 +199,9 @@ void	vm_reset_watchdog(struct vmctx *ctx);
 
 int	vm_ioeventfd(struct vmctx *ctx, struct acrn_ioeventfd *args);
 int	vm_irqfd(struct vmctx *ctx, struct acrn_irqfd *args);
+int	vm_set_posted_write_buffer(struct vmctx *ctx, uint64_t buf);
+int	vm_set_posted_write_range(struct vmctx *ctx, struct acrn_posted_write_range *range);
+int	vm_set_ioreq_client_polling(struct vmctx *ctx, bool polling);
 
 /*
  * Return a string describing the meaning of the `error' code.
@@ -0,0 +1,14 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+int dm_run_workers(void *(*worker)(void *), void *arg, int nr_threads,
+		const char *name);
+
+#endif /* _WORKERS_H_ */
@@ -17,9 +17,11 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "dm.h"
 #include "log.h"
+#include "atomic.h"
 
 #define DISK_PREFIX  "disk_log: "
 
@@ -40,6 +42,9 @@ static uint16_t cur_file_index;
 static uint8_t disk_log_level = LOG_DEBUG;
 static bool disk_log_enabled = false;
 
+static uint8_t async_log_level = LOG_DEBUG;
+static bool async_log_enabled = false;
+
 #define DISK_LOG_MAX_LEN    (MAX_ONE_LOG_SIZE + 32)
 #define INDEX_AFTER(a, b) ((short int)b - (short int)a < 0)
 
@@ -125,68 +130,48 @@ static int init_disk_logger(bool enable, uint8_t log_level)
 	return 1;
 }
 
-static void deinit_disk_logger(void)
+/* shared by the disk loggers, the file is written by either of them */
+static pthread_mutex_t disk_mtx = PTHREAD_MUTEX_INITIALIZER;
+static bool disk_closed;
+
+static int format_log_time(char *buf, int size, time_t tt, struct timespec *times)
 {
-	if (disk_fd > 0) {
-		disk_log_enabled = false;
+	struct tm lt;
 
-		fsync(disk_fd);
-		close(disk_fd);
-		disk_fd = -1;
-	}
+	localtime_r(&tt, &lt);
+	return snprintf(buf, size, "[%4d-%02d-%02d %02d:%02d:%02d][%5lu.%06lu] ",
+		lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday, lt.tm_hour, lt.tm_min, lt.tm_sec,
+		times->tv_sec, times->tv_nsec / 1000);
 }
 
-static void write_to_disk(const char *fmt, va_list args)
+/* write buf to the current log file, and move to a new file when it's full */
+static int write_disk_log(const char *buf, int len)
 {
-	char buffer[DISK_LOG_MAX_LEN];
-	char *file_name = buffer;
-	char *buf;
-	int len;
+	char file_name[FILE_NAME_LENGTH];
 	int write_cnt;
-	struct timespec times = {0, 0};
-	struct tm *lt;
-	time_t tt;
-
 
-	if ((disk_fd < 0) && disk_log_enabled) {
+	pthread_mutex_lock(&disk_mtx);
+	if ((disk_fd < 0) && !disk_closed) {
 		/**
 		 * usually this probe just be called once in DM whole life; but we need use vmname in
 		 * probe_disk_log_file, it can't be called in init_disk_logger for vmname not inited then,
 		 * so call it here.
 		 */
-		if (probe_disk_log_file() < 0) {
-			disk_log_enabled = false;
-			return;
-		}
+		if (probe_disk_log_file() < 0)
+			disk_closed = true;
 	}
-
-	len = vasprintf(&buf, fmt, args);
-	if (len < 0)
-		return;
-
-	time(&tt);
-	lt = localtime(&tt);
-	clock_gettime(CLOCK_MONOTONIC, &times);
-
-	len = snprintf(buffer, DISK_LOG_MAX_LEN, "[%4d-%02d-%02d %02d:%02d:%02d][%5lu.%06lu] ",
-		lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday, lt->tm_hour, lt->tm_min, lt->tm_sec,
-		times.tv_sec, times.tv_nsec / 1000);
-	if (len < 0 || len >= DISK_LOG_MAX_LEN) {
-		free(buf);
-		return;
+	if (disk_fd < 0) {
+		pthread_mutex_unlock(&disk_mtx);
+		return -1;
 	}
-	len = strnlen(buffer, DISK_LOG_MAX_LEN);
 
-	strncpy(buffer + len, buf, DISK_LOG_MAX_LEN - len);
-	buffer[DISK_LOG_MAX_LEN - 1] = '\0';
-	free(buf);
-
-	write_cnt = write(disk_fd, buffer, strnlen(buffer, DISK_LOG_MAX_LEN));
+	write_cnt = write(disk_fd, buf, len);
 	if (write_cnt < 0) {
 		printf(DISK_PREFIX"write disk failed");
 		close(disk_fd);
 		disk_fd = -1;
-		return;
+		pthread_mutex_unlock(&disk_mtx);
+		return -1;
 	}
 
 	cur_log_size += write_cnt;
@@ -206,10 +191,61 @@ static void write_to_disk(const char *fmt, va_list args)
 		disk_fd = open(file_name, O_RDWR | O_CREAT, 0644);
 		if (disk_fd < 0) {
 			printf(DISK_PREFIX" open %s failed! Error: %s\n", file_name, strerror(errno));
-			return;
 		}
 		cur_log_size = 0;
 	}
+	pthread_mutex_unlock(&disk_mtx);
+	return 0;
+}
+
+static void close_disk_log(void)
+{
+	pthread_mutex_lock(&disk_mtx);
+	if (disk_fd > 0) {
+		fsync(disk_fd);
+		close(disk_fd);
+		disk_fd = -1;
+	}
+	disk_closed = true;
+	pthread_mutex_unlock(&disk_mtx);
+}
+
+static void deinit_disk_logger(void)
+{
+	if (disk_log_enabled) {
+		disk_log_enabled = false;
+		if (!async_log_enabled)
+			close_disk_log();
+	}
+}
+
+static void write_to_disk(const char *fmt, va_list args)
+{
+	char buffer[DISK_LOG_MAX_LEN];
+	char *buf;
+	int len;
+	struct timespec times = {0, 0};
+	time_t tt;
+
+	len = vasprintf(&buf, fmt, args);
+	if (len < 0)
+		return;
+
+	time(&tt);
+	clock_gettime(CLOCK_MONOTONIC, &times);
+
+	len = format_log_time(buffer, DISK_LOG_MAX_LEN, tt, &times);
+	if (len < 0 || len >= DISK_LOG_MAX_LEN) {
+		free(buf);
+		return;
+	}
+	len = strnlen(buffer, DISK_LOG_MAX_LEN);
+
+	strncpy(buffer + len, buf, DISK_LOG_MAX_LEN - len);
+	buffer[DISK_LOG_MAX_LEN - 1] = '\0';
+	free(buf);
+
+	write_disk_log(buffer, strnlen(buffer, DISK_LOG_MAX_LEN));
 }
 
 static struct logger_ops logger_disk = {
@@ -222,3 +258,271 @@ static struct logger_ops logger_disk = {
 };
 
 DEFINE_LOGGER_DEVICE(logger_disk);
+
+/*
+ * disk_async logger
+ *
+ * It writes the same files as the disk logger, without blocking the threads
+ * logging. Each thread formats its messages into fixed-size records of its
+ * own ring, and a writer thread adds the time stamps and writes the records
+ * of all rings in batches. A thread finding its ring full drops the message
+ * and counts it, and the writer logs the count.
+ *
+ * The writer sleeps on async_cond once the rings are empty. It sets
+ * async_sleeping before checking them a last time, and a thread logging
+ * checks it after publishing its record, so one of them always sees the
+ * other: either the writer finds the record, or the thread wakes it up.
+ * Threads only take async_wake_mtx while the writer sleeps.
+ */
+#define ASYNC_RING_SIZE		256U	/* records per thread, a power of 2 */
+#define ASYNC_BATCH_SIZE	(64 * 1024)
+
+struct async_log_rec {
+	time_t tt;
+	struct timespec times;
+	char msg[MAX_ONE_LOG_SIZE];
+};
+
+struct async_log_ring {
+	struct async_log_ring *next;
+	bool owned;
+	uint32_t head;			/* moved by the thread logging */
+	uint64_t dropped;
+	uint32_t tail __aligned(64);	/* moved by the writer */
+	uint64_t dropped_logged;
+	struct async_log_rec recs[ASYNC_RING_SIZE];
+};
+
+/* the rings are reused by new threads once their thread is gone, never freed */
+static struct async_log_ring *async_rings;
+static pthread_mutex_t async_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t async_once = PTHREAD_ONCE_INIT;
+static pthread_key_t async_key;
+static __thread struct async_log_ring *async_ring;
+static pthread_t async_tid;
+static bool async_started;
+static bool async_stop;
+static bool async_sleeping;
+static pthread_mutex_t async_wake_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+
+static bool is_async_log_enabled(void)
+{
+	return async_log_enabled;
+}
+
+static uint8_t get_async_log_level(void)
+{
+	return async_log_level;
+}
+
+static int flush_async_log(char *batch, int len)
+{
+	if ((len > 0) && (write_disk_log(batch, len) < 0))
+		return -1;
+	return 0;
+}
+
+/* write the records of all rings, return the number of records written */
+static int drain_async_log(char *batch)
+{
+	struct async_log_ring *ring;
+	struct async_log_rec *rec;
+	uint32_t head, tail;
+	uint64_t dropped;
+	int len = 0, count = 0;
+
+	for (ring = atomic_load(&async_rings); ring; ring = ring->next) {
+		dropped = atomic_load(&ring->dropped);
+		if (dropped != ring->dropped_logged) {
+			len += snprintf(batch + len, ASYNC_BATCH_SIZE - len,
+				DISK_PREFIX"%lu messages dropped\n",
+				dropped - ring->dropped_logged);
+			ring->dropped_logged = dropped;
+		}
+
+		head = atomic_load(&ring->head);
+		for (tail = ring->tail; tail != head; tail++) {
+			if (len > ASYNC_BATCH_SIZE - 2 * DISK_LOG_MAX_LEN) {
+				flush_async_log(batch, len);
+				len = 0;
+			}
+
+			rec = &ring->recs[tail & (ASYNC_RING_SIZE - 1)];
+			len += format_log_time(batch + len, DISK_LOG_MAX_LEN, rec->tt, &rec->times);
+			len += strnlen(strncpy(batch + len, rec->msg, MAX_ONE_LOG_SIZE),
+					MAX_ONE_LOG_SIZE);
+			count++;
+		}
+		atomic_store(&ring->tail, tail);
+	}
+
+	flush_async_log(batch, len);
+	return count;
+}
+
+static bool async_log_pending(void)
+{
+	struct async_log_ring *ring;
+
+	for (ring = atomic_load(&async_rings); ring; ring = ring->next) {
+		if ((atomic_load(&ring->head) != ring->tail) ||
+			(atomic_load(&ring->dropped) != ring->dropped_logged))
+			return true;
+	}
+	return false;
+}
+
+static void wake_async_log(void)
+{
+	pthread_mutex_lock(&async_wake_mtx);
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_wake_mtx);
+}
+
+static void *async_log_writer(void *arg)
+{
+	char *batch;
+
+	batch = malloc(ASYNC_BATCH_SIZE);
+	if (batch == NULL) {
+		printf(DISK_PREFIX"failed to allocate the batch buffer\n");
+		async_log_enabled = false;
+		return NULL;
+	}
+
+	for (;;) {
+		if (atomic_load(&async_stop)) {
+			drain_async_log(batch);
+			break;
+		}
+		if (drain_async_log(batch) > 0)
+			continue;
+
+		pthread_mutex_lock(&async_wake_mtx);
+		atomic_store(&async_sleeping, true);
+		if (!async_log_pending() && !atomic_load(&async_stop))
+			pthread_cond_wait(&async_cond, &async_wake_mtx);
+		atomic_store(&async_sleeping, false);
+		pthread_mutex_unlock(&async_wake_mtx);
+	}
+
+	free(batch);
+	return NULL;
+}
+
+static void release_async_ring(void *arg)
+{
+	struct async_log_ring *ring = arg;
+
+	pthread_mutex_lock(&async_mtx);
+	ring->owned = false;
+	pthread_mutex_unlock(&async_mtx);
+}
+
+static void start_async_log(void)
+{
+	pthread_key_create(&async_key, release_async_ring);
+
+	if (pthread_create(&async_tid, NULL, async_log_writer, NULL) != 0) {
+		printf(DISK_PREFIX"failed to create the writer thread\n");
+		async_log_enabled = false;
+		return;
+	}
+	pthread_setname_np(async_tid, "log_writer");
+	async_started = true;
+}
+
+static struct async_log_ring *get_async_ring(void)
+{
+	struct async_log_ring *ring;
+
+	if (async_ring)
+		return async_ring;
+
+	pthread_once(&async_once, start_async_log);
+	if (!async_started)
+		return NULL;
+
+	pthread_mutex_lock(&async_mtx);
+	for (ring = async_rings; ring; ring = ring->next) {
+		if (!ring->owned)
+			break;
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(*ring));
+		if (ring == NULL) {
+			pthread_mutex_unlock(&async_mtx);
+			return NULL;
+		}
+		ring->next = async_rings;
+		atomic_store(&async_rings, ring);
+	}
+	ring->owned = true;
+	pthread_mutex_unlock(&async_mtx);
+
+	pthread_setspecific(async_key, ring);
+	async_ring = ring;
+	return ring;
+}
+
+static int init_async_logger(bool enable, uint8_t log_level)
+{
+	async_log_enabled = enable;
+	async_log_level = log_level;
+
+	return 1;
+}
+
+static void deinit_async_logger(void)
+{
+	void *jval;
+
+	if (async_log_enabled) {
+		async_log_enabled = false;
+		if (async_started) {
+			atomic_store(&async_stop, true);
+			wake_async_log();
+			pthread_join(async_tid, &jval);
+		}
+		if (!disk_log_enabled)
+			close_disk_log();
+	}
+}
+
+static void write_to_disk_async(const char *fmt, va_list args)
+{
+	struct async_log_ring *ring;
+	struct async_log_rec *rec;
+	uint32_t head;
+
+	ring = get_async_ring();
+	if (ring == NULL)
+		return;
+
+	head = ring->head;
+	if (head - atomic_load(&ring->tail) >= ASYNC_RING_SIZE) {
+		atomic_store(&ring->dropped, ring->dropped + 1);
+		return;
+	}
+
+	rec = &ring->recs[head & (ASYNC_RING_SIZE - 1)];
+	time(&rec->tt);
+	clock_gettime(CLOCK_MONOTONIC, &rec->times);
+	vsnprintf(rec->msg, MAX_ONE_LOG_SIZE, fmt, args);
+	atomic_store(&ring->head, head + 1);
+
+	if (atomic_load(&async_sleeping))
+		wake_async_log();
+}
+
+static struct logger_ops logger_disk_async = {
+	.name = "disk_async",
+	.is_enabled = is_async_log_enabled,
+	.get_log_level = get_async_log_level,
+	.init = init_async_logger,
+	.deinit = deinit_async_logger,
+	.output = write_to_disk_async,
+};
+
+DEFINE_LOGGER_DEVICE(logger_disk_async);
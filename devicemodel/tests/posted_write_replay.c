@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+/*
+ * Posted write replay test
+ *
+ * Runs the DM side of the posted write ring against a producer thread which
+ * queues the writes the way acrn_insert_request() does in the hypervisor, and
+ * checks that every write is emulated once and in order, including across
+ * posted_write_hold()/posted_write_release() and the ring wrap-around, and
+ * while the ring is left idle and the writes are delivered as blocking
+ * requests. Also checks that posted writes fall back to blocking requests
+ * when HSM doesn't support them.
+ *
+ * No hypervisor or HSM is needed: build and run it with "make test".
+ */
+
+#include <stdarg.h>
+#include <assert.h>
+
+#include "../core/posted_write.c"
+
+#define TEST_WRITES	(ACRN_POSTED_WRITE_SLOT_MAX * 200U)
+#define TEST_PIO_PORT	0x3c0U
+#define TEST_MMIO_BASE	0xa0000UL
+
+static struct acrn_posted_write_ring *test_ring;
+static uint64_t test_next;
+static uint64_t test_blocking;
+static bool test_hsm_support = true;
+
+void
+output_log(uint8_t level, const char *fmt, ...)
+{
+	va_list args;
+
+	if (level > LOG_WARNING)
+		return;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static void
+test_check(uint32_t type, uint64_t address, uint32_t size, uint64_t value)
+{
+	/* even writes are port I/O, odd ones MMIO, see test_producer */
+	if (value != test_next) {
+		fprintf(stderr, "posted write %lu emulated, %lu expected\n", value, test_next);
+		exit(1);
+	}
+	if ((type != ((value & 1UL) ? ACRN_IOREQ_TYPE_MMIO : ACRN_IOREQ_TYPE_PORTIO)) ||
+	    (address != ((value & 1UL) ? TEST_MMIO_BASE + (value % 4096UL) : TEST_PIO_PORT)) ||
+	    (size != ((value & 1UL) ? 8U : 4U))) {
+		fprintf(stderr, "posted write %lu is corrupted\n", value);
+		exit(1);
+	}
+	test_next++;
+}
+
+int
+emulate_inout(struct vmctx *ctx, int *pvcpu, struct acrn_pio_request *req)
+{
+	assert(req->direction == ACRN_IOREQ_DIR_WRITE);
+	/* port I/O values are 32-bit, the test keeps them below 4G */
+	test_check(ACRN_IOREQ_TYPE_PORTIO, req->address, (uint32_t)req->size, req->value);
+	return 0;
+}
+
+int
+emulate_mem(struct vmctx *ctx, struct acrn_mmio_request *mmio_req)
+{
+	assert(mmio_req->direction == ACRN_IOREQ_DIR_WRITE);
+	test_check(ACRN_IOREQ_TYPE_MMIO, mmio_req->address, (uint32_t)mmio_req->size, mmio_req->value);
+	return 0;
+}
+
+int
+vm_set_posted_write_buffer(struct vmctx *ctx, uint64_t buf)
+{
+	if (!test_hsm_support) {
+		errno = ENOTTY;
+		return -1;
+	}
+
+	test_ring = &((struct acrn_posted_write_buffer *)buf)->ring;
+	return 0;
+}
+
+int
+vm_set_posted_write_range(struct vmctx *ctx, struct acrn_posted_write_range *range)
+{
+	return test_hsm_support ? 0 : -1;
+}
+
+/* A write delivered as a blocking request, handled as vm_handle_ioreqs() does */
+static void
+test_blocking_write(uint64_t value)
+{
+	struct acrn_io_request req;
+
+	memset(&req, 0, sizeof(req));
+	if (value & 1UL) {
+		req.type = ACRN_IOREQ_TYPE_MMIO;
+		req.reqs.mmio_request.direction = ACRN_IOREQ_DIR_WRITE;
+		req.reqs.mmio_request.address = TEST_MMIO_BASE + (value % 4096UL);
+		req.reqs.mmio_request.size = 8UL;
+		req.reqs.mmio_request.value = value;
+	} else {
+		req.type = ACRN_IOREQ_TYPE_PORTIO;
+		req.reqs.pio_request.direction = ACRN_IOREQ_DIR_WRITE;
+		req.reqs.pio_request.address = TEST_PIO_PORT;
+		req.reqs.pio_request.size = 4UL;
+		req.reqs.pio_request.value = (uint32_t)value;
+	}
+
+	posted_write_hold();
+	posted_write_wake(&req);
+	if (value & 1UL)
+		emulate_mem(NULL, &req.reqs.mmio_request);
+	else
+		emulate_inout(NULL, NULL, &req.reqs.pio_request);
+	posted_write_release();
+	test_blocking++;
+}
+
+/* The hypervisor side of the ring, see acrn_post_write_request() */
+static void *
+test_producer(void *arg)
+{
+	struct acrn_posted_write *pw;
+	uint32_t head, next;
+	uint64_t value;
+
+	for (value = 0UL; value < TEST_WRITES; value++) {
+		/* long enough for the ring to be left idle */
+		if (value == TEST_WRITES / 2)
+			usleep(50 * 1000);
+
+		head = atomic_load(&test_ring->head);
+		if (!(head & ACRN_POSTED_WRITE_HEAD_IDLE)) {
+			next = (head + 1U) % ACRN_POSTED_WRITE_SLOT_MAX;
+			/* ring full, the hypervisor would fall back to a blocking request */
+			while (next == atomic_load(&test_ring->tail))
+				__builtin_ia32_pause();
+
+			pw = &test_ring->slot[head];
+			pw->type = (value & 1UL) ? ACRN_IOREQ_TYPE_MMIO : ACRN_IOREQ_TYPE_PORTIO;
+			pw->size = (value & 1UL) ? 8U : 4U;
+			pw->address = (value & 1UL) ? TEST_MMIO_BASE + (value % 4096UL) : TEST_PIO_PORT;
+			pw->value = value;
+			if (atomic_cmpxchg(&test_ring->head, &head, next))
+				continue;
+		}
+
+		/* the ring is idle, the write is delivered as a blocking request */
+		test_blocking_write(value);
+	}
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	struct vmctx *ctx = (struct vmctx *)&test_next;
+	pthread_t tid;
+	int i;
+
+	if ((posted_write_init(ctx) != 0) ||
+	    (posted_write_add_range(ACRN_IOREQ_TYPE_MMIO, TEST_MMIO_BASE, 4096UL) != 0)) {
+		fprintf(stderr, "failed to set up posted writes\n");
+		return 1;
+	}
+
+	pthread_create(&tid, NULL, test_producer, NULL);
+
+	/* the vm_loop thread, emulating blocking requests between the posted writes */
+	for (i = 0; atomic_load(&test_next) < TEST_WRITES; i++) {
+		posted_write_hold();
+		if ((i % 16) == 0)
+			posted_write_drain_locked();
+		posted_write_release();
+		if ((i % 64) == 0)
+			posted_write_drain();
+	}
+	pthread_join(tid, NULL);
+
+	posted_write_deinit(ctx);
+	if ((test_next != TEST_WRITES) ||
+	    (test_ring->tail != (test_ring->head & ~ACRN_POSTED_WRITE_HEAD_IDLE))) {
+		fprintf(stderr, "%lu of %u posted writes emulated\n", test_next, TEST_WRITES);
+		return 1;
+	}
+	/* the ring was left idle during the pause, and polled again after it */
+	if ((test_blocking == 0UL) || (test_blocking > TEST_WRITES / 4)) {
+		fprintf(stderr, "%lu posted writes delivered as blocking requests\n", test_blocking);
+		return 1;
+	}
+
+	/* without HSM support, the writes are emulated as blocking requests */
+	test_hsm_support = false;
+	if ((posted_write_init(ctx) == 0) ||
+	    (posted_write_add_range(ACRN_IOREQ_TYPE_MMIO, TEST_MMIO_BASE, 4096UL) == 0) ||
+	    (posted_write_drain() != 0)) {
+		fprintf(stderr, "posted writes are not disabled without HSM support\n");
+		return 1;
+	}
+
+	printf("posted write replay: %u writes OK, %lu blocking\n", TEST_WRITES, test_blocking);
+	return 0;
+}
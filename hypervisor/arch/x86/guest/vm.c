@@ -701,6 +701,7 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 		spinlock_init(&vm->vlapic_mode_lock);
 		spinlock_init(&vm->ept_lock);
 		spinlock_init(&vm->emul_mmio_lock);
+		spinlock_init(&vm->posted_write_lock);
 		spinlock_init(&vm->arch_vm.iwkey_backup_lock);
 
 		vm->arch_vm.vlapic_mode = VM_VLAPIC_XAPIC;
@@ -758,6 +759,8 @@ int32_t create_vm(uint16_t vm_id, uint64_t pcpu_bitmap, struct acrn_vm_config *v
 			/* Populate return VM handle */
 			*rtn_vm = vm;
 			vm->sw.io_shared_page = NULL;
+			vm->sw.posted_write_page = NULL;
+			vm->sw.is_client_polling_ioreq = false;
 			if ((vm_config->load_order == POST_LAUNCHED_VM)
 				&& ((vm_config->guest_flags & GUEST_FLAG_IO_COMPLETION_POLLING) != 0U)) {
 				/* enable IO completion polling mode per its guest flags in vm_config. */
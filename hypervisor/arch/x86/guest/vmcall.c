@@ -60,6 +60,12 @@ static const struct hc_dispatch hc_dispatch_table[] = {
 		.handler = hcall_set_ioreq_buffer},
 	[HC_IDX(HC_NOTIFY_REQUEST_FINISH)] = {
 		.handler = hcall_notify_ioreq_finish},
+	[HC_IDX(HC_SET_POSTED_WRITE_BUFFER)] = {
+		.handler = hcall_set_posted_write_buffer},
+	[HC_IDX(HC_SET_POSTED_WRITE_RANGE)] = {
+		.handler = hcall_set_posted_write_range},
+	[HC_IDX(HC_SET_IOREQ_CLIENT_POLLING)] = {
+		.handler = hcall_set_ioreq_client_polling},
 	[HC_IDX(HC_VM_SET_MEMORY_REGIONS)] = {
 		.handler = hcall_set_vm_memory_regions},
 	[HC_IDX(HC_VM_WRITE_PROTECT_PAGE)] = {
@@ -557,6 +557,114 @@ int32_t hcall_notify_ioreq_finish(__unused struct acrn_vcpu *vcpu, struct acrn_v
 	return ret;
 }
 
+/**
+ * @brief set posted write shared buffer
+ *
+ * Set the posted write ring buffer for a VM.
+ * The function will return -1 if the target VM does not exist.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to buffer address
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_posted_write_buffer(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_posted_write_ring *ring;
+	uint64_t hpa;
+	int32_t ret = -1;
+
+	if (is_created_vm(target_vm)) {
+		uint64_t pwbuf;
+
+		if ((copy_from_gpa(vm, &pwbuf, param2, sizeof(pwbuf)) == 0)
+				&& mem_aligned_check(pwbuf, PAGE_SIZE)) {
+			dev_dbg(DBG_LEVEL_HYCALL, "[%d] SET POSTED WRITE BUFFER=0x%p",
+					target_vm->vm_id, pwbuf);
+
+			hpa = gpa2hpa(vm, pwbuf);
+			if (hpa == INVALID_HPA) {
+				pr_err("%s,vm[%hu] gpa 0x%lx,GPA is unmapping.",
+					__func__, vm->vm_id, pwbuf);
+				target_vm->sw.posted_write_page = NULL;
+			} else {
+				ring = &((struct acrn_posted_write_buffer *)hpa2hva(hpa))->ring;
+				stac();
+				ring->head = 0U;
+				ring->tail = 0U;
+				clac();
+				target_vm->sw.posted_write_page = hpa2hva(hpa);
+				ret = 0;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief assign or deassign a posted write range
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_posted_write_range
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_posted_write_range(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_posted_write_range range;
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(target_vm) && !is_poweroff_vm(target_vm)) {
+		if (copy_from_gpa(vm, &range, param2, sizeof(range)) == 0) {
+			ret = set_posted_write_range(target_vm, &range);
+		}
+	} else {
+		pr_err("%s, vm[%d] is not a postlaunched VM, or is powered off\n", __func__, target_vm->vm_id);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief set whether the DM is polling the I/O request slots
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param2 non-zero to start polling, 0 to stop polling
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_ioreq_client_polling(__unused struct acrn_vcpu *vcpu, struct acrn_vm *target_vm,
+		__unused uint64_t param1, uint64_t param2)
+{
+	int32_t ret = -EINVAL;
+
+	if (is_postlaunched_vm(target_vm) && !is_poweroff_vm(target_vm)) {
+		target_vm->sw.is_client_polling_ioreq = (param2 != 0UL);
+		/*
+		 * Make the new state visible before the DM scans the request
+		 * slots, it pairs with the barrier in acrn_insert_request.
+		 */
+		cpu_memory_barrier();
+		ret = 0;
+	} else {
+		pr_err("%s, vm[%d] is not a postlaunched VM, or is powered off\n", __func__, target_vm->vm_id);
+	}
+
+	return ret;
+}
+
 /**
  *@pre is_service_vm(vm)
  *@pre gpa2hpa(vm, region->service_vm_gpa) != INVALID_HPA
@@ -5,8 +5,10 @@
 
 #include <asm/guest/vm.h>
 #include <asm/irq.h>
+#include <asm/lib/atomic.h>
 #include <errno.h>
 #include <logmsg.h>
+#include <pci.h>
 
 #define DBG_LEVEL_IOREQ	6U
 
@@ -69,9 +71,166 @@ static inline bool has_complete_ioreq(const struct acrn_vcpu *vcpu)
 	return (get_io_req_state(vcpu->vm, vcpu->vcpu_id) == ACRN_IOREQ_STATE_COMPLETE);
 }
 
+/**
+ * @brief Whether \p io_req accesses the PCI configuration ports
+ *
+ * HSM owns the 0xcf8 latch and converts the 0xcfc accesses into PCI config
+ * requests, so these requests always go through HSM, even while the DM is
+ * polling the request slots.
+ */
+static bool is_pci_cfg_pio(const struct io_request *io_req)
+{
+	const struct acrn_pio_request *pio_req = &io_req->reqs.pio_request;
+
+	return ((io_req->io_type == ACRN_IOREQ_TYPE_PORTIO) &&
+		((pio_req->address == PCI_CONFIG_ADDR) ||
+		 ((pio_req->address >= PCI_CONFIG_DATA) && (pio_req->address < (PCI_CONFIG_DATA + 4UL)))));
+}
+
+/**
+ * @pre vm != NULL && io_req != NULL
+ * @pre vm->posted_write_lock is held
+ */
+static bool is_posted_write_range(const struct acrn_vm *vm, const struct io_request *io_req)
+{
+	/* here for both IO & MMIO, the direction, address, size definition is same */
+	const struct acrn_pio_request *pio_req = &io_req->reqs.pio_request;
+	const struct acrn_posted_write_range *range;
+	bool ret = false;
+	uint16_t i;
+
+	if (((io_req->io_type == ACRN_IOREQ_TYPE_PORTIO) || (io_req->io_type == ACRN_IOREQ_TYPE_MMIO))
+			&& (pio_req->direction == ACRN_IOREQ_DIR_WRITE)) {
+		for (i = 0U; i < ACRN_POSTED_WRITE_RANGE_MAX; i++) {
+			range = &vm->posted_write_range[i];
+			if ((range->len != 0UL) && (range->type == io_req->io_type)
+					&& (pio_req->address >= range->base)
+					&& ((pio_req->address + pio_req->size) <= (range->base + range->len))) {
+				ret = true;
+				break;
+			}
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Queue a write \p io_req in the posted write ring of the VM
+ *
+ * @param vcpu The virtual CPU that triggers the access
+ * @param io_req The I/O request holding the details of the access
+ *
+ * @pre vcpu != NULL && io_req != NULL
+ *
+ * @return true if \p io_req is queued and \p vcpu needn't wait for its
+ *	   completion, false if it shall be delivered as a blocking request.
+ */
+static bool acrn_post_write_request(struct acrn_vcpu *vcpu, const struct io_request *io_req)
+{
+	struct acrn_vm *vm = vcpu->vm;
+	struct acrn_posted_write_ring *ring;
+	struct acrn_posted_write *slot;
+	uint32_t head, next;
+	bool posted = false;
+
+	if (vm->sw.posted_write_page != NULL) {
+		spinlock_obtain(&vm->posted_write_lock);
+		if (is_posted_write_range(vm, io_req)) {
+			ring = &((struct acrn_posted_write_buffer *)vm->sw.posted_write_page)->ring;
+
+			stac();
+			head = ring->head;
+			next = (head + 1U) % ACRN_POSTED_WRITE_SLOT_MAX;
+			/*
+			 * Fall back to a blocking request if the ring is full, or
+			 * idle as the DM doesn't poll it (head has the idle flag)
+			 */
+			if ((head < ACRN_POSTED_WRITE_SLOT_MAX) && (next != ring->tail)) {
+				slot = &ring->slot[head];
+				slot->type = io_req->io_type;
+				if (io_req->io_type == ACRN_IOREQ_TYPE_PORTIO) {
+					slot->size = (uint32_t)io_req->reqs.pio_request.size;
+					slot->address = io_req->reqs.pio_request.address;
+					slot->value = (uint64_t)io_req->reqs.pio_request.value;
+				} else {
+					slot->size = (uint32_t)io_req->reqs.mmio_request.size;
+					slot->address = io_req->reqs.mmio_request.address;
+					slot->value = io_req->reqs.mmio_request.value;
+				}
+
+				/*
+				 * The locked cmpxchg orders the filling of the slot
+				 * before the head, and fails if the DM set the idle
+				 * flag meanwhile.
+				 */
+				posted = (atomic_cmpxchg32(&ring->head, head, next) == head);
+			}
+			clac();
+		}
+		spinlock_release(&vm->posted_write_lock);
+	}
+
+	return posted;
+}
+
+/**
+ * @brief Assign or deassign a posted write range of \p vm
+ *
+ * @param vm The VM whose posted write ranges to be changed
+ * @param range The range to be assigned or deassigned
+ *
+ * @pre vm != NULL && range != NULL
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL \p range is invalid or no matched range to deassign.
+ * @retval -EBUSY No free range to assign.
+ */
+int32_t set_posted_write_range(struct acrn_vm *vm, const struct acrn_posted_write_range *range)
+{
+	struct acrn_posted_write_range *entry;
+	int32_t ret = -EINVAL;
+	uint16_t i;
+
+	if (((range->type == ACRN_IOREQ_TYPE_PORTIO) || (range->type == ACRN_IOREQ_TYPE_MMIO))
+			&& (range->len != 0UL) && ((range->base + range->len) > range->base)) {
+		spinlock_obtain(&vm->posted_write_lock);
+		if ((range->flags & ACRN_POSTED_WRITE_FLAG_DEASSIGN) != 0U) {
+			for (i = 0U; i < ACRN_POSTED_WRITE_RANGE_MAX; i++) {
+				entry = &vm->posted_write_range[i];
+				if ((entry->type == range->type) && (entry->base == range->base)
+						&& (entry->len == range->len)) {
+					(void)memset(entry, 0U, sizeof(*entry));
+					ret = 0;
+					break;
+				}
+			}
+		} else {
+			ret = -EBUSY;
+			for (i = 0U; i < ACRN_POSTED_WRITE_RANGE_MAX; i++) {
+				entry = &vm->posted_write_range[i];
+				if (entry->len == 0UL) {
+					entry->type = range->type;
+					entry->flags = 0U;
+					entry->base = range->base;
+					entry->len = range->len;
+					ret = 0;
+					break;
+				}
+			}
+		}
+		spinlock_release(&vm->posted_write_lock);
+	}
+
+	return ret;
+}
+
 /**
  * @brief Deliver \p io_req to Service VM and suspend \p vcpu till its completion
  *
+ * A write to a posted write range is queued in the posted write ring instead
+ * and \p vcpu is not suspended, unless the ring is full.
+ *
  * @param vcpu The virtual CPU that triggers the MMIO access
  * @param io_req The I/O request holding the details of the MMIO access
  *
@@ -85,7 +244,9 @@ int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_
 	int32_t ret = 0;
 	uint16_t cur;
 
-	if ((vcpu->vm->sw.io_shared_page != NULL)
+	if (acrn_post_write_request(vcpu, io_req)) {
+		/* the DM emulates the write asynchronously, nothing to wait for */
+	} else if ((vcpu->vm->sw.io_shared_page != NULL)
 		 && (get_io_req_state(vcpu->vm, vcpu->vcpu_id) == ACRN_IOREQ_STATE_FREE)) {
 
 		req_buf = (struct acrn_io_request_buffer *)(vcpu->vm->sw.io_shared_page);
@@ -113,8 +274,20 @@ int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_
 		 */
 		set_io_req_state(vcpu->vm, vcpu->vcpu_id, ACRN_IOREQ_STATE_PENDING);
 
-		/* signal HSM */
-		arch_fire_hsm_interrupt();
+		/*
+		 * The pending state must be visible before checking whether the DM
+		 * is polling, otherwise a DM which just stopped polling could miss
+		 * the request and wait for an upcall that never comes.
+		 */
+		cpu_memory_barrier();
+
+		/*
+		 * signal HSM, unless the DM is polling the request slots and
+		 * claims the request itself
+		 */
+		if (!vcpu->vm->sw.is_client_polling_ioreq || is_pci_cfg_pio(io_req)) {
+			arch_fire_hsm_interrupt();
+		}
 
 		/* Polling completion of the request in polling mode */
 		if (is_polling) {
@@ -730,4 +903,8 @@ void deinit_emul_io(struct acrn_vm *vm)
 {
 	(void)memset(vm->emul_mmio, 0U, sizeof(vm->emul_mmio));
 	(void)memset(vm->emul_pio, 0U, sizeof(vm->emul_pio));
+
+	vm->sw.posted_write_page = NULL;
+	(void)memset(vm->posted_write_range, 0U, sizeof(vm->posted_write_range));
+	vm->sw.is_client_polling_ioreq = false;
 }
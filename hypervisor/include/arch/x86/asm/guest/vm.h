@@ -71,6 +71,10 @@ struct vm_sw_info {
 	void *io_shared_page;
 	/* If enable IO completion polling mode */
 	bool is_polling_ioreq;
+	/* HVA to posted write ring page */
+	void *posted_write_page;
+	/* If the DM polls the IO request slots, no upcall is needed */
+	volatile bool is_client_polling_ioreq;
 };
 
 struct vm_pm_info {
@@ -158,6 +162,9 @@ struct acrn_vm {
 
 	struct vm_io_handler_desc emul_pio[EMUL_PIO_IDX_MAX];
 
+	spinlock_t posted_write_lock;	/* Used to protect posted write ranges and ring producer for a VM */
+	struct acrn_posted_write_range posted_write_range[ACRN_POSTED_WRITE_RANGE_MAX];
+
 	char name[MAX_VM_NAME_LEN];
 	struct secure_world_control sworld_control;
 
@@ -217,6 +217,56 @@ int32_t hcall_set_ioreq_buffer(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm
  */
 int32_t hcall_notify_ioreq_finish(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
 
+/**
+ * @brief set posted write shared buffer
+ *
+ * Set the posted write ring buffer for a VM.
+ * The function will return -1 if the target VM does not exist.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to buffer address
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_posted_write_buffer(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief assign or deassign a posted write range
+ *
+ * Guest writes to an assigned range are queued in the posted write ring
+ * and the vCPU is resumed without waiting for the DM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 guest physical address. This gpa points to data structure of
+ *              acrn_posted_write_range
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_posted_write_range(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
+/**
+ * @brief set whether the DM is polling the I/O request slots
+ *
+ * While the DM polls the I/O request slots of a VM, no upcall is injected to
+ * the Service VM for the new I/O requests of that VM, except for the accesses
+ * to the PCI configuration ports, which are always dispatched by HSM.
+ *
+ * @param vcpu Pointer to vCPU that initiates the hypercall
+ * @param target_vm Pointer to target VM data structure
+ * @param param1 not used
+ * @param param2 non-zero to start polling, 0 to stop polling
+ *
+ * @pre is_service_vm(vcpu->vm)
+ * @return 0 on success, non-zero on error.
+ */
+int32_t hcall_set_ioreq_client_polling(struct acrn_vcpu *vcpu, struct acrn_vm *target_vm, uint64_t param1, uint64_t param2);
+
 /**
  * @brief setup ept memory mapping for multi regions
  *
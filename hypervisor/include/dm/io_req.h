@@ -181,6 +181,20 @@ struct mem_io_node {
  */
 int32_t acrn_insert_request(struct acrn_vcpu *vcpu, const struct io_request *io_req);
 
+/**
+ * @brief Assign or deassign a posted write range of \p vm
+ *
+ * @param vm The VM whose posted write ranges to be changed
+ * @param range The range to be assigned or deassigned
+ *
+ * @pre vm != NULL && range != NULL
+ *
+ * @retval 0 on success.
+ * @retval -EINVAL \p range is invalid or no matched range to deassign.
+ * @retval -EBUSY No free range to assign.
+ */
+int32_t set_posted_write_range(struct acrn_vm *vm, const struct acrn_posted_write_range *range);
+
 /**
  * @brief Reset all IO requests status of the VM
  *
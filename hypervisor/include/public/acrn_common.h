@@ -342,6 +342,129 @@ struct acrn_io_request_buffer {
 	};
 };
 
+/*
+ * Posted write
+ */
+
+#define ACRN_POSTED_WRITE_SLOT_MAX	127U
+#define ACRN_POSTED_WRITE_RANGE_MAX	8U
+
+#define ACRN_POSTED_WRITE_FLAG_DEASSIGN	(1U << 0U)
+
+/* Set in the head of an empty ring by the DM when it stops polling the ring */
+#define ACRN_POSTED_WRITE_HEAD_IDLE	(1U << 31U)
+
+/**
+ * @brief A guest write access queued by the hypervisor without blocking the vCPU
+ */
+struct acrn_posted_write {
+	/**
+	 * @brief Type of the access, ACRN_IOREQ_TYPE_PORTIO or ACRN_IOREQ_TYPE_MMIO
+	 */
+	uint32_t type;
+
+	/**
+	 * @brief Width of the access in byte
+	 */
+	uint32_t size;
+
+	/**
+	 * @brief Port or guest physical address of the access
+	 */
+	uint64_t address;
+
+	/**
+	 * @brief The value written by the guest
+	 */
+	uint64_t value;
+
+	/**
+	 * @brief Reserved
+	 */
+	uint64_t reserved;
+};
+
+/**
+ * @brief Ring of posted writes shared between the hypervisor and the DM
+ *
+ * The hypervisor is the only producer: it fills the slot at \p head and then
+ * advances \p head. The DM is the only consumer: it emulates the slot at
+ * \p tail and then advances \p tail. The ring is empty when head == tail and
+ * full when (head + 1) % ACRN_POSTED_WRITE_SLOT_MAX == tail. A write that
+ * finds the ring full is delivered as a normal (blocking) I/O request.
+ *
+ * The hypervisor does not order posted writes against blocking I/O requests,
+ * so the DM shall drain the ring before it handles any blocking I/O request
+ * of the same VM.
+ *
+ * Instead of polling an empty ring, the DM may set ACRN_POSTED_WRITE_HEAD_IDLE
+ * in \p head with a compare-and-exchange against \p tail. The hypervisor then
+ * delivers the writes as blocking requests, which wake the DM, until the DM
+ * clears the flag. The hypervisor moves \p head with a compare-and-exchange
+ * too, so a write is either queued before the flag is set or not at all.
+ */
+struct acrn_posted_write_ring {
+	/**
+	 * @brief Next slot to be filled, only moved by the hypervisor
+	 *
+	 * The DM only sets and clears ACRN_POSTED_WRITE_HEAD_IDLE in it.
+	 *
+	 * Byte offset: 0.
+	 */
+	uint32_t head;
+
+	/**
+	 * @brief Next slot to be consumed, only written by the DM
+	 *
+	 * Byte offset: 4.
+	 */
+	uint32_t tail;
+
+	/**
+	 * @brief Reserved
+	 *
+	 * Byte offset: 8.
+	 */
+	uint32_t reserved[6];
+
+	/**
+	 * @brief The posted writes
+	 *
+	 * Byte offset: 32.
+	 */
+	struct acrn_posted_write slot[ACRN_POSTED_WRITE_SLOT_MAX];
+};
+
+struct acrn_posted_write_buffer {
+	union {
+		struct acrn_posted_write_ring	ring;
+		int8_t				reserved[4096];
+	};
+};
+
+/**
+ * @brief Info to assign or deassign a posted write range for a VM
+ *
+ * Guest writes that fall entirely in an assigned range are queued in the
+ * posted write ring instead of blocking the vCPU. Reads from the range are
+ * still delivered as normal I/O requests.
+ *
+ * the parameter for HC_SET_POSTED_WRITE_RANGE hypercall
+ */
+struct acrn_posted_write_range {
+	/** ACRN_IOREQ_TYPE_PORTIO or ACRN_IOREQ_TYPE_MMIO */
+	uint32_t type;
+
+	/** ACRN_POSTED_WRITE_FLAG_DEASSIGN to remove the range */
+	uint32_t flags;
+
+	/** start of the range, port or guest physical address */
+	uint64_t base;
+
+	/** length of the range in byte */
+	uint64_t len;
+};
+
 /**
  * @brief Info to create a VM, the parameter for HC_CREATE_VM hypercall
  */
@@ -50,6 +50,9 @@
 #define HC_ID_IOREQ_BASE            0x30UL
 #define HC_SET_IOREQ_BUFFER         BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x00UL)
 #define HC_NOTIFY_REQUEST_FINISH    BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x01UL)
+#define HC_SET_POSTED_WRITE_BUFFER  BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x02UL)
+#define HC_SET_POSTED_WRITE_RANGE   BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x03UL)
+#define HC_SET_IOREQ_CLIENT_POLLING BASE_HC_ID(HC_ID, HC_ID_IOREQ_BASE + 0x04UL)
 
 /* Guest memory management */
 #define HC_ID_MEM_BASE              0x40UL
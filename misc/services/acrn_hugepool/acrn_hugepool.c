@@ -0,0 +1,617 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * acrn_hugepool keeps hugetlb memory reserved for User VMs across VM
+ * restarts.
+ *
+ * The pool is made of units, each of them a set of hugetlb memfds (one per
+ * hugepage size) that are allocated, faulted in and cleared at startup. A
+ * device model leases a whole unit at launch and maps the memfds as guest
+ * memory. When the lease ends, the unit is cleared again by a background
+ * thread and put back to the pool. So relaunching a VM neither has to find
+ * free hugepages in a fragmented system nor wait for them to be zeroed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/memfd.h>
+
+#include "hugepool.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE	23
+#endif
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open		434
+#endif
+
+#define MAX_UNITS		16
+#define LEASE_WAIT_SECONDS	30
+
+#define pool_log(fmt, args...)	fprintf(stderr, "acrn_hugepool: " fmt, ##args)
+
+struct pool_level {
+	const char *name;
+	uint64_t pg_size;
+	unsigned int memfd_flag;
+	const char *nr_path;
+	const char *free_path;
+};
+
+static const struct pool_level levels[HUGEPOOL_LV_MAX] = {
+	{
+		.name = "2M",
+		.pg_size = 2UL << 20,
+		.memfd_flag = MFD_HUGE_2MB,
+		.nr_path = "/sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages",
+		.free_path = "/sys/kernel/mm/hugepages/hugepages-2048kB/free_hugepages",
+	},
+	{
+		.name = "1G",
+		.pg_size = 1UL << 30,
+		.memfd_flag = MFD_HUGE_1GB,
+		.nr_path = "/sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages",
+		.free_path = "/sys/kernel/mm/hugepages/hugepages-1048576kB/free_hugepages",
+	},
+};
+
+enum unit_state {
+	UNIT_FREE,
+	UNIT_LEASED,
+	UNIT_DIRTY,
+};
+
+struct pool_unit {
+	uint64_t size[HUGEPOOL_LV_MAX];
+	int fd[HUGEPOOL_LV_MAX];
+	char *hva[HUGEPOOL_LV_MAX];
+	enum unit_state state;
+	char owner[HUGEPOOL_NAME_LEN];
+};
+
+static struct pool_unit units[MAX_UNITS];
+static int nr_units;
+
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a unit is returned to the pool, or becomes free */
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+		"Usage: %s -u <2M size>:<1G size> [-u ...]\n"
+		"       -u: add a unit of <2M size> bytes backed by 2M pages\n"
+		"           and <1G size> bytes backed by 1G pages to the pool,\n"
+		"           the sizes take K/M/G suffixes, e.g. -u 512M:4G\n"
+		"       -h: show this help\n", progname);
+}
+
+static int parse_size(const char *s, char **end, uint64_t *size)
+{
+	uint64_t val;
+
+	errno = 0;
+	val = strtoull(s, end, 0);
+	if (errno || *end == s)
+		return -1;
+
+	switch (**end) {
+	case 'G': case 'g':
+		val <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		val <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		val <<= 10;
+		(*end)++;
+		break;
+	default:
+		break;
+	}
+
+	*size = val;
+	return 0;
+}
+
+static int parse_unit(const char *arg)
+{
+	struct pool_unit *unit;
+	char *end;
+	int level;
+
+	if (nr_units >= MAX_UNITS) {
+		pool_log("at most %d units are supported\n", MAX_UNITS);
+		return -1;
+	}
+
+	unit = &units[nr_units];
+	for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+		if (parse_size(arg, &end, &unit->size[level]) < 0)
+			return -1;
+		if (unit->size[level] % levels[level].pg_size) {
+			pool_log("%s size of unit %d isn't %s aligned\n",
+				levels[level].name, nr_units, levels[level].name);
+			return -1;
+		}
+		if (level < HUGEPOOL_LV_MAX - 1) {
+			if (*end != ':')
+				return -1;
+			arg = end + 1;
+		}
+	}
+	if (*end != '\0')
+		return -1;
+
+	nr_units++;
+	return 0;
+}
+
+static int read_sys_value(const char *path, uint64_t *val)
+{
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	*val = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+static int write_sys_value(const char *path, uint64_t val)
+{
+	char buf[32];
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "%lu", val);
+	len = (write(fd, buf, len) == len) ? 0 : -1;
+	close(fd);
+	return len;
+}
+
+/*
+ * Make sure there are enough free hugepages of each size for all units,
+ * raising nr_hugepages if needed. This only happens once at startup, before
+ * memory gets fragmented by the Service VM workloads.
+ */
+static int reserve_hugepages(void)
+{
+	uint64_t need, nr, nr_free;
+	int level, i;
+
+	for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+		need = 0;
+		for (i = 0; i < nr_units; i++)
+			need += units[i].size[level] / levels[level].pg_size;
+		if (need == 0)
+			continue;
+
+		if (read_sys_value(levels[level].free_path, &nr_free) < 0 ||
+			read_sys_value(levels[level].nr_path, &nr) < 0) {
+			pool_log("no %s hugepage support\n", levels[level].name);
+			return -1;
+		}
+		if (nr_free >= need)
+			continue;
+
+		if (write_sys_value(levels[level].nr_path, nr + need - nr_free) < 0 ||
+			read_sys_value(levels[level].free_path, &nr_free) < 0 ||
+			nr_free < need) {
+			pool_log("failed to reserve %lu %s hugepages\n",
+				need, levels[level].name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int prefault(char *hva, uint64_t size, uint64_t pg_size)
+{
+	uint64_t off;
+
+	if (madvise(hva, size, MADV_POPULATE_WRITE) == 0)
+		return 0;
+	if (errno != EINVAL)
+		return -1;
+
+	/* kernel without MADV_POPULATE_WRITE, touch every page instead */
+	for (off = 0; off < size; off += pg_size)
+		*(volatile char *)(hva + off) = 0;
+	return 0;
+}
+
+static int setup_unit(struct pool_unit *unit, int idx)
+{
+	char name[32];
+	int level, fd;
+
+	for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+		unit->fd[level] = -1;
+		unit->hva[level] = NULL;
+	}
+
+	for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+		if (unit->size[level] == 0)
+			continue;
+
+		snprintf(name, sizeof(name), "acrn_hugepool_%d_%s", idx, levels[level].name);
+		fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB |
+				levels[level].memfd_flag);
+		if (fd < 0) {
+			pool_log("memfd_create %s failed: %s\n", name, strerror(errno));
+			return -1;
+		}
+		unit->fd[level] = fd;
+
+		/*
+		 * Seal the size so that the DM can't shrink the pool memory,
+		 * this is also what udmabuf requires on the guest memory.
+		 */
+		if (ftruncate(fd, unit->size[level]) < 0 ||
+			fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL | F_SEAL_GROW | F_SEAL_SHRINK) < 0) {
+			pool_log("failed to size %s: %s\n", name, strerror(errno));
+			return -1;
+		}
+
+		unit->hva[level] = mmap(NULL, unit->size[level], PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+		if (unit->hva[level] == MAP_FAILED) {
+			unit->hva[level] = NULL;
+			pool_log("failed to map %s: %s\n", name, strerror(errno));
+			return -1;
+		}
+
+		if (prefault(unit->hva[level], unit->size[level], levels[level].pg_size) < 0) {
+			pool_log("failed to fault in %s: %s\n", name, strerror(errno));
+			return -1;
+		}
+	}
+
+	unit->state = UNIT_FREE;
+	return 0;
+}
+
+/*
+ * Find the smallest unit that fits the request. A dirty unit is only picked
+ * if no free unit fits, the caller waits for it to be cleared then.
+ */
+static struct pool_unit *find_unit(const uint64_t *size)
+{
+	struct pool_unit *unit, *best = NULL;
+	uint64_t total, best_total = UINT64_MAX;
+	int level, i;
+
+	for (i = 0; i < nr_units; i++) {
+		unit = &units[i];
+		if (unit->state == UNIT_LEASED)
+			continue;
+
+		total = 0;
+		for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+			if (unit->size[level] < size[level])
+				break;
+			total += unit->size[level];
+		}
+		if (level < HUGEPOOL_LV_MAX)
+			continue;
+
+		if (best == NULL ||
+			(best->state == UNIT_DIRTY && unit->state == UNIT_FREE) ||
+			(best->state == unit->state && total < best_total)) {
+			best = unit;
+			best_total = total;
+		}
+	}
+
+	return best;
+}
+
+static struct pool_unit *lease_unit(const struct hugepool_msg *req)
+{
+	struct pool_unit *unit;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += LEASE_WAIT_SECONDS;
+
+	pthread_mutex_lock(&pool_mtx);
+	while ((unit = find_unit(req->size)) != NULL && unit->state == UNIT_DIRTY) {
+		if (pthread_cond_timedwait(&pool_cond, &pool_mtx, &deadline) == ETIMEDOUT) {
+			unit = NULL;
+			break;
+		}
+	}
+	if (unit) {
+		unit->state = UNIT_LEASED;
+		memcpy(unit->owner, req->name, sizeof(unit->owner));
+		unit->owner[sizeof(unit->owner) - 1] = '\0';
+	}
+	pthread_mutex_unlock(&pool_mtx);
+
+	return unit;
+}
+
+static void return_unit(struct pool_unit *unit)
+{
+	pthread_mutex_lock(&pool_mtx);
+	unit->state = UNIT_DIRTY;
+	pthread_cond_broadcast(&pool_cond);
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+/* Clear the returned units so that no guest data leaks into the next lease */
+static void *cleaner_thread(void *arg)
+{
+	struct pool_unit *unit;
+	int level, i;
+
+	pthread_mutex_lock(&pool_mtx);
+	while (1) {
+		for (i = 0; i < nr_units; i++) {
+			if (units[i].state == UNIT_DIRTY)
+				break;
+		}
+		if (i == nr_units) {
+			pthread_cond_wait(&pool_cond, &pool_mtx);
+			continue;
+		}
+
+		/*
+		 * A dirty unit can't be leased, so it's safe to clear it
+		 * without holding the lock.
+		 */
+		unit = &units[i];
+		pthread_mutex_unlock(&pool_mtx);
+		for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+			if (unit->hva[level])
+				memset(unit->hva[level], 0, unit->size[level]);
+		}
+		pthread_mutex_lock(&pool_mtx);
+
+		pool_log("unit %d returned by %s is ready\n", i, unit->owner);
+		unit->state = UNIT_FREE;
+		pthread_cond_broadcast(&pool_cond);
+	}
+
+	return NULL;
+}
+
+static int send_reply(int sock, struct hugepool_msg *msg, struct pool_unit *unit)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * HUGEPOOL_LV_MAX)];
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fds[HUGEPOOL_LV_MAX];
+	int level, nr_fds = 0;
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (unit) {
+		for (level = 0; level < HUGEPOOL_LV_MAX; level++) {
+			msg->size[level] = unit->size[level];
+			if (unit->fd[level] >= 0)
+				fds[nr_fds++] = unit->fd[level];
+		}
+	}
+
+	if (nr_fds) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+	}
+
+	return (sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof(*msg)) ? 0 : -1;
+}
+
+/*
+ * Wait for the process on the other end of sock to exit. The DM closes its
+ * HSM file on exit, which destroys the VM and unpins its memory, so the
+ * memory can be reused after that.
+ */
+static void wait_peer_exit(int sock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	struct pollfd pfd;
+	int pidfd;
+
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.pid <= 0)
+		return;
+
+	pidfd = syscall(SYS_pidfd_open, cred.pid, 0);
+	if (pidfd >= 0) {
+		pfd.fd = pidfd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+			;
+		close(pidfd);
+		return;
+	}
+
+	/* kernel without pidfd, wait for the pid to go away */
+	while (kill(cred.pid, 0) == 0 || errno != ESRCH)
+		sleep(1);
+}
+
+static void *client_thread(void *arg)
+{
+	struct pool_unit *unit = NULL;
+	struct hugepool_msg msg;
+	int sock = (int)(intptr_t)arg;
+	ssize_t len;
+
+	while ((len = recv(sock, &msg, sizeof(msg), 0)) == sizeof(msg)) {
+		if (msg.magic != HUGEPOOL_MSG_MAGIC)
+			break;
+		msg.name[HUGEPOOL_NAME_LEN - 1] = '\0';
+
+		if (msg.type == HUGEPOOL_RELEASE) {
+			if (unit) {
+				return_unit(unit);
+				unit = NULL;
+			}
+			msg.result = 0;
+			send_reply(sock, &msg, NULL);
+		} else if (msg.type == HUGEPOOL_LEASE && unit == NULL) {
+			unit = lease_unit(&msg);
+			if (unit)
+				pool_log("unit %ld leased to %s\n", unit - units, unit->owner);
+			else
+				pool_log("no unit fits %s\n", msg.name);
+			msg.result = unit ? 0 : -EBUSY;
+			if (send_reply(sock, &msg, unit) < 0)
+				break;
+		} else {
+			msg.result = -EINVAL;
+			send_reply(sock, &msg, NULL);
+		}
+	}
+
+	/*
+	 * The connection is gone without a release, e.g. the DM crashed or
+	 * was killed. The VM may still exist until the DM process is gone,
+	 * keep the unit leased till then.
+	 */
+	if (unit) {
+		pool_log("%s left without releasing unit %ld, waiting for it to exit\n",
+			unit->owner, unit - units);
+		wait_peer_exit(sock);
+		return_unit(unit);
+	}
+	close(sock);
+	return NULL;
+}
+
+static int create_server(void)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	mkdir("/run/acrn", 0755);
+	unlink(HUGEPOOL_SOCK_PATH);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HUGEPOOL_SOCK_PATH, sizeof(addr.sun_path) - 1);
+
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		chmod(HUGEPOOL_SOCK_PATH, 0600) < 0 ||
+		listen(sock, MAX_UNITS) < 0) {
+		pool_log("failed to create %s: %s\n", HUGEPOOL_SOCK_PATH, strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int opt, sock, conn, i;
+
+	while ((opt = getopt(argc, argv, "u:h")) != -1) {
+		switch (opt) {
+		case 'u':
+			if (parse_unit(optarg) < 0) {
+				pool_log("invalid unit '%s'\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : 1;
+		}
+	}
+
+	if (nr_units == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (reserve_hugepages() < 0)
+		return 1;
+
+	for (i = 0; i < nr_units; i++) {
+		if (setup_unit(&units[i], i) < 0)
+			return 1;
+		pool_log("unit %d: %lu MB of 2M pages, %lu MB of 1G pages\n", i,
+			units[i].size[HUGEPOOL_LV_2M] >> 20,
+			units[i].size[HUGEPOOL_LV_1G] >> 20);
+	}
+
+	sock = create_server();
+	if (sock < 0)
+		return 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, cleaner_thread, NULL) != 0) {
+		pool_log("failed to create the cleaner thread\n");
+		return 1;
+	}
+
+	while (1) {
+		conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (conn < 0) {
+			if (errno == EINTR)
+				continue;
+			pool_log("accept failed: %s\n", strerror(errno));
+			break;
+		}
+		if (pthread_create(&tid, &attr, client_thread, (void *)(intptr_t)conn) != 0) {
+			pool_log("failed to create a client thread\n");
+			close(conn);
+		}
+	}
+
+	close(sock);
+	return 1;
+}
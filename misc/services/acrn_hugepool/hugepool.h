@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2022 Intel Corporation.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Protocol between acrn_hugepool and the device model.
+ *
+ * The DM connects to HUGEPOOL_SOCK_PATH and sends a HUGEPOOL_LEASE request
+ * with the memory it needs of each hugepage size. The reply carries one
+ * hugetlb memfd for each size with a non-zero granted size, in the order of
+ * the levels, as SCM_RIGHTS ancillary data. The memory is already faulted in
+ * and cleared, and the memfds are sealed against resizing.
+ *
+ * The DM sends HUGEPOOL_RELEASE once the VM is destroyed, so that the memory
+ * is no longer mapped to the guest nor pinned by HSM, and the reply returns
+ * the memory to the pool. If the connection is closed without a release, the
+ * memory is only returned after the DM process has exited, since the VM
+ * teardown completes when the process releases its HSM file.
+ */
+
+#ifndef _HUGEPOOL_H_
+#define _HUGEPOOL_H_
+
+#include <stdint.h>
+
+#define HUGEPOOL_SOCK_PATH	"/run/acrn/hugepool.sock"
+#define HUGEPOOL_MSG_MAGIC	0x6c6f6f7065677568UL	/* "hugepool" */
+
+/* Level 0 for 2M pages, level 1 for 1G pages, the same as the DM hugetlb levels */
+#define HUGEPOOL_LV_2M		0
+#define HUGEPOOL_LV_1G		1
+#define HUGEPOOL_LV_MAX		2
+
+#define HUGEPOOL_NAME_LEN	16
+
+enum hugepool_msg_type {
+	HUGEPOOL_LEASE = 1,
+	HUGEPOOL_RELEASE,
+};
+
+struct hugepool_msg {
+	uint64_t magic;
+	uint32_t type;
+	int32_t result;		/* 0 or -errno, in the reply */
+	char name[HUGEPOOL_NAME_LEN];	/* VM name, for logging */
+	uint64_t size[HUGEPOOL_LV_MAX];	/* bytes requested, or granted in the reply */
+};
+
+#endif
@@ -313,8 +313,9 @@ int shell_cmd(const char *cmd, char *outbuf, int len)
 	return ret;
 }
 
-static int send_msg(const char *vmname, struct mngr_msg *req,
-		    struct mngr_msg *ack)
+/* timeout in seconds to wait for the ack, zero to wait until it's received */
+static int send_msg_timeout(const char *vmname, struct mngr_msg *req,
+		    struct mngr_msg *ack, unsigned timeout)
 {
 	int fd, ret;
 
@@ -329,7 +330,7 @@ static int send_msg(const char *vmname, struct mngr_msg *req,
 		return -1;
 	}
 
-	ret = mngr_send_msg(fd, req, ack, 1);
+	ret = mngr_send_msg(fd, req, ack, timeout);
 	if (ret < 0) {
 		printf("Unable to send msg to vm %s socket. It may have been shutdown\n", vmname);
 		mngr_close(fd);
@@ -341,6 +342,12 @@ static int send_msg(const char *vmname, struct mngr_msg *req,
 	return 0;
 }
 
+static int send_msg(const char *vmname, struct mngr_msg *req,
+		    struct mngr_msg *ack)
+{
+	return send_msg_timeout(vmname, req, ack, 1);
+}
+
 int list_vm()
 {
 	struct vmmngr_struct *s;
@@ -428,3 +435,27 @@ int blkrescan_vm(const char *vmname, char *devargs)
 
 	return ack.data.err;
 }
+
+int snapshot_vm(const char *vmname, const char *path)
+{
+	struct mngr_msg req;
+	struct mngr_msg ack;
+	int ret;
+
+	req.magic = MNGR_MSG_MAGIC;
+	req.msgid = DM_SNAPSHOT;
+	req.timestamp = time(NULL);
+	strncpy(req.data.devargs, path, PARAM_LEN - 1);
+	req.data.devargs[PARAM_LEN - 1] = '\0';
+
+	/* saving the guest memory takes far longer than other requests */
+	ret = send_msg_timeout(vmname, &req, &ack, 0);
+	if (ret)
+		return ret;
+
+	if (ack.data.err) {
+		printf("Unable to save vm. errno(%d)\n", ack.data.err);
+	}
+
+	return ack.data.err;
+}
@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "acrn_mngr.h"
 #include "acrnctl.h"
 #include "ioc.h"
@@ -34,6 +35,7 @@
 #define ADD_DESC       "Add one virtual machine with SCRIPTS and OPTIONS"
 #define RESET_DESC     "Stop and then start virtual machine VM_NAME"
 #define BLKRESCAN_DESC  "Rescan virtio-blk device attached to a virtual machine"
+#define SNAPSHOT_DESC  "Save suspended virtual machine VM_NAME to a file, restore with acrn-dm --restore"
 
 #define VM_NAME (1)
 #define CMD_ARGS (2)
@@ -427,6 +429,41 @@ static int acrnctl_do_blkrescan(int argc, char *argv[])
 	return 0;
 }
 
+static int acrnctl_do_snapshot(int argc, char *argv[])
+{
+	struct vmmngr_struct *s;
+	char path[PATH_MAX];
+
+	s = vmmngr_find(argv[VM_NAME]);
+	if (!s) {
+		printf("can't find %s\n", argv[VM_NAME]);
+		return -1;
+	}
+	if (s->state != VM_SUSPENDED) {
+		printf("%s is in %s state but should be in %s state for snapshot\n",
+			argv[VM_NAME], state_str[s->state], state_str[VM_SUSPENDED]);
+		return -1;
+	}
+
+	/* the DM runs in another working directory */
+	if (argv[CMD_ARGS][0] == '/')
+		snprintf(path, sizeof(path), "%s", argv[CMD_ARGS]);
+	else if (!getcwd(path, sizeof(path)) ||
+		(strlen(path) + strlen(argv[CMD_ARGS]) + 2 > sizeof(path))) {
+		printf("invalid snapshot path %s\n", argv[CMD_ARGS]);
+		return -1;
+	} else {
+		strcat(path, "/");
+		strcat(path, argv[CMD_ARGS]);
+	}
+	if (strlen(path) >= PARAM_LEN) {
+		printf("snapshot path %s is too long\n", path);
+		return -1;
+	}
+
+	return snapshot_vm(argv[VM_NAME], path);
+}
+
 static int acrnctl_do_stop(int argc, char *argv[])
 {
 	struct vmmngr_struct *s;
@@ -641,6 +678,18 @@ static int valid_blkrescan_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 	return 0;
 }
 
+static int valid_snapshot_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
+{
+	char df_opt[] = "VM_NAME path";
+
+	if (argc != 3 || !strcmp(argv[1], "help")) {
+		printf("acrnctl %s %s\n", cmd->cmd, df_opt);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int valid_add_args(struct acrnctl_cmd *cmd, int argc, char *argv[])
 {
 	char df_opt[32] = "launch_scripts options";
@@ -683,6 +732,7 @@ struct acrnctl_cmd acmds[] = {
 	ACMD("add", acrnctl_do_add, ADD_DESC, valid_add_args),
 	ACMD("reset", acrnctl_do_reset, RESET_DESC, df_valid_args),
 	ACMD("blkrescan", acrnctl_do_blkrescan, BLKRESCAN_DESC, valid_blkrescan_args),
+	ACMD("snapshot", acrnctl_do_snapshot, SNAPSHOT_DESC, valid_snapshot_args),
 };
 
 #define NCMD	(sizeof(acmds)/sizeof(struct acrnctl_cmd))
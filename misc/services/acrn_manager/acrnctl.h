@@ -58,5 +58,6 @@ int pause_vm(const char *vmname);
 int continue_vm(const char *vmname);
 int resume_vm(const char *vmname, unsigned reason);
 int blkrescan_vm(const char *vmname, char *devargs);
+int snapshot_vm(const char *vmname, const char *path);
 
 #endif				/* _ACRNCTL_H_ */